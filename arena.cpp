@@ -0,0 +1,125 @@
+#include "arena.h"
+#include <stdlib.h>
+#include <pthread.h>
+
+struct ArenaSlab {
+  struct ArenaSlab* next;
+  size_t size;
+  size_t used;
+  uint8_t data[];
+};
+
+/* A thread's released slabs, handed to the shared pool when the thread exits */
+struct SpareSlabs {
+  struct ArenaSlab* slabs;
+  size_t numSlabs;
+  ~SpareSlabs();
+};
+
+//released slabs waiting to be reused. Each thread keeps its own and
+//trades them with the shared pool ARENA_SPARE_BATCH at a time, so an
+//arena allocated from on one thread can be released on another
+//without the slabs piling up where they aren't needed.
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static struct ArenaSlab* sharedSlabs = NULL;
+static size_t numSharedSlabs = 0;
+static thread_local struct SpareSlabs spares = {NULL,0};
+
+static struct ArenaSlab* getSlab(size_t size);
+
+/* Moves count of the calling thread's spares to the shared pool */
+static void shareSlabs(size_t count){
+  pthread_mutex_lock(&poolLock);
+  while(count > 0 && spares.slabs != NULL){
+    struct ArenaSlab* slab = spares.slabs;
+    spares.slabs = slab->next;
+    spares.numSlabs--;
+    if(numSharedSlabs < ARENA_MAX_SPARE_SLABS){
+      slab->next = sharedSlabs;
+      sharedSlabs = slab;
+      numSharedSlabs++;
+    }else{
+      free(slab);
+    }
+    count--;
+  }
+  pthread_mutex_unlock(&poolLock);
+}
+
+/* Refills the calling thread's spares from the shared pool */
+static void takeSharedSlabs(){
+  pthread_mutex_lock(&poolLock);
+  for(int i = 0; i < ARENA_SPARE_BATCH && sharedSlabs != NULL; i++){
+    struct ArenaSlab* slab = sharedSlabs;
+    sharedSlabs = slab->next;
+    numSharedSlabs--;
+    slab->next = spares.slabs;
+    spares.slabs = slab;
+    spares.numSlabs++;
+  }
+  pthread_mutex_unlock(&poolLock);
+}
+
+SpareSlabs::~SpareSlabs(){
+  shareSlabs(numSlabs);
+}
+
+void arenaInit(Arena* arena){
+  arena->current = NULL;
+  arena->oldest = NULL;
+  arena->numSlabs = 0;
+}
+
+void* arenaAlloc(Arena* arena, size_t size){
+  //keep every allocation aligned for whatever is stored in it
+  size = (size + sizeof(void*) - 1) & ~(sizeof(void*) - 1);
+  struct ArenaSlab* slab = arena->current;
+  if(slab == NULL || slab->size - slab->used < size){
+    slab = getSlab(size);
+    if(slab == NULL) return NULL;
+    slab->next = arena->current;
+    arena->current = slab;
+    if(arena->oldest == NULL) arena->oldest = slab;
+    arena->numSlabs++;
+  }
+  void* result = slab->data + slab->used;
+  slab->used += size;
+  return result;
+}
+
+/*
+ * The arena's slabs are spliced onto the thread's spares whole, so
+ * releasing costs the same however much was allocated. Only once the
+ * spares have grown past twice a batch are the excess handed on to
+ * the shared pool, and freed if that is full.
+ */
+void arenaRelease(Arena* arena){
+  if(arena->current != NULL){
+    arena->oldest->next = spares.slabs;
+    spares.slabs = arena->current;
+    spares.numSlabs += arena->numSlabs;
+    if(spares.numSlabs > 2 * ARENA_SPARE_BATCH) shareSlabs(spares.numSlabs - ARENA_SPARE_BATCH);
+  }
+  arenaInit(arena);
+}
+
+/*
+ * Hands out a spare slab if one is big enough, otherwise a new one.
+ * Allocations bigger than a slab get a slab of their own.
+ */
+static struct ArenaSlab* getSlab(size_t size){
+  struct ArenaSlab* slab;
+  if(size <= ARENA_SLAB_BYTES && spares.slabs == NULL) takeSharedSlabs();
+  if(size <= ARENA_SLAB_BYTES && spares.slabs != NULL){
+    slab = spares.slabs;
+    spares.slabs = slab->next;
+    spares.numSlabs--;
+  }else{
+    size_t slabSize = size > ARENA_SLAB_BYTES ? size : ARENA_SLAB_BYTES;
+    slab = (struct ArenaSlab*) malloc(sizeof(struct ArenaSlab) + slabSize);
+    if(slab == NULL) return NULL;
+    slab->size = slabSize;
+  }
+  slab->used = 0;
+  return slab;
+}
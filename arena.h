@@ -0,0 +1,46 @@
+#ifndef _arena_h
+#define _arena_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Size of the chunks arenas carve allocations out of
+#define ARENA_SLAB_BYTES (64 * 1024)
+//Slabs moved between a thread's spares and the shared pool at once
+#define ARENA_SPARE_BATCH 16
+//Most released slabs the shared pool keeps around for reuse, the rest are freed
+#define ARENA_MAX_SPARE_SLABS 256
+
+struct ArenaSlab;
+
+/*
+ * A bump allocator. Allocations are carved out of slabs one after
+ * another and can't be freed individually. Instead the whole arena
+ * is released at once, which hands its slabs to a shared pool that
+ * later arenas draw from, so steady state needs no malloc at all.
+ */
+struct Arena {
+  struct ArenaSlab* current;
+  struct ArenaSlab* oldest;
+  size_t numSlabs;
+};
+typedef struct Arena Arena;
+
+void arenaInit(Arena* arena);
+
+/*
+ * Returns size bytes of arena memory, or NULL if
+ * no more memory could be had from the system.
+ */
+void* arenaAlloc(Arena* arena, size_t size);
+
+/*
+ * Releases everything allocated from the arena, handing its slabs
+ * to the calling thread's spares, which overflow into the shared
+ * pool. Any thread may release an arena, not only the one that
+ * allocated from it. The arena is left empty and ready to be used
+ * again.
+ */
+void arenaRelease(Arena* arena);
+
+#endif
@@ -0,0 +1,358 @@
+#include "client.h"
+#include "replfs_net.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <vector>
+#include <algorithm>
+
+#define DEFAULT_PORT 44020
+#define DEFAULT_SERVERS 3
+#define DEFAULT_SECONDS 10
+#define DEFAULT_WRITES 16
+#define MAX_BENCH_SERVERS 32
+//writes wrap around within this much of each file
+#define MAX_FILE_BYTES (16 * 1024 * 1024)
+//WriteBlock takes writes of any size; this just keeps one write within a file
+#define MAX_BENCH_WRITE (4 * 1024 * 1024)
+//how long the servers get to apply the last commits before they are checked
+#define VERIFY_WAIT_MSEC 10000
+#define VERIFY_POLL_MSEC 100
+//time for the servers to join the group before the roll call
+#define SERVER_START_MSEC 200
+
+/*
+ * Measures commit throughput and latency against servers on this
+ * machine. The servers are started on loopback multicast, each with
+ * its own mount directory under -dir, and stopped afterwards. Every
+ * thread drives its share of the files, writing -writes blocks of
+ * -size bytes and committing them, until -commits commits have been
+ * made or -seconds have passed. -drop is the loss rate given to the
+ * client and every server.
+ *
+ * The result is printed as one line of key=value pairs, latencies in
+ * usecs, so runs can be compared by script.
+ *
+ * With -verify, every thread also keeps what its files should hold
+ * once its commits are applied, and afterwards each server's copy of
+ * every file is read back and compared with it, so that a build which
+ * is fast because it gets the data wrong fails instead. Keeping the
+ * copies costs the threads some time of their own.
+ *
+ * usage: replFsBench [-servers n] [-port p] [-drop pct] [-size bytes]
+ *                    [-writes n] [-files n] [-threads n] [-commits n]
+ *                    [-seconds s] [-quorum n] [-compress] [-verify]
+ *                    [-server path] [-dir path]
+ */
+
+struct BenchConfig {
+  int numServers;
+  unsigned short port;
+  int dropPercent;
+  int writeSize;
+  int writesPerCommit;
+  int numFiles;
+  int numThreads;
+  long maxCommits;
+  int seconds;
+  int quorum;
+  bool compress;
+  bool verify;
+  const char* serverPath;
+  const char* dir;
+};
+
+/* What one thread did, and how long each of its commits took */
+struct BenchThread {
+  pthread_t thread;
+  int index;
+  std::vector<int> fds;
+  //with -verify, what each of fds should hold
+  std::vector<std::vector<char> > contents;
+  long commits;
+  long failures;
+  uint64_t bytes;
+  std::vector<uint64_t> latencies;
+};
+
+static BenchConfig config;
+static uint64_t deadline;
+
+static void usage(){
+  printf("usage: replFsBench [-servers n] [-port p] [-drop pct] [-size bytes]\n"
+         "                   [-writes n] [-files n] [-threads n] [-commits n]\n"
+         "                   [-seconds s] [-quorum n] [-compress] [-verify]\n"
+         "                   [-server path] [-dir path]\n");
+}
+
+static int removeEntry(const char* path, const struct stat* info, int flag, struct FTW* ftw){
+  return remove(path);
+}
+
+/* Starts a server on a fresh mount directory, returning its pid or -1 */
+static pid_t startServer(int index){
+  char mount[PATH_MAX];
+  snprintf(mount,sizeof(mount),"%s/server%d",config.dir,index);
+  nftw(mount,removeEntry,16,FTW_DEPTH | FTW_PHYS);
+  char port[16];
+  char drop[16];
+  snprintf(port,sizeof(port),"%u",config.port);
+  snprintf(drop,sizeof(drop),"%d",config.dropPercent);
+  pid_t pid = fork();
+  if(pid == 0){
+    //the bench's output is the result line alone
+    if(freopen("/dev/null","w",stdout) == NULL) _exit(-1);
+    execl(config.serverPath,config.serverPath,"-port",port,"-mount",mount,
+          "-drop",drop,(char*) NULL);
+    perror("exec");
+    _exit(-1);
+  }
+  return pid;
+}
+
+/* Lays a commit's writes, made one after another from offset on, over what a file holds */
+static void applyWrites(std::vector<char>* contents, int offset, const std::vector<char>& writes){
+  for(size_t done = 0; done < writes.size(); done += config.writeSize){
+    if(offset + config.writeSize > MAX_FILE_BYTES) offset = 0;
+    if(contents->size() < (size_t) offset + config.writeSize) contents->resize(offset + config.writeSize);
+    memcpy(&(*contents)[offset],&writes[done],config.writeSize);
+    offset += config.writeSize;
+  }
+}
+
+/* Writes and commits to the thread's files in turn until done */
+static void* runThread(void* arg){
+  BenchThread* self = (BenchThread*) arg;
+  std::vector<char> buffer(config.writeSize);
+  for(int i = 0; i < config.writeSize; i++) buffer[i] = 'a' + (i + self->index) % 26;
+  std::vector<int> offsets(self->fds.size(),0);
+  //with -verify, the writes of the commit being made, back to back
+  std::vector<char> writes;
+  size_t next = 0;
+  while(monotonicUsec() < deadline &&
+        (config.maxCommits == 0 || self->commits + self->failures < config.maxCommits)){
+    size_t current = next;
+    int fd = self->fds[current];
+    int& offset = offsets[current];
+    int startOffset = offset;
+    next = (next + 1) % self->fds.size();
+    uint64_t start = monotonicUsec();
+    bool failed = false;
+    writes.clear();
+    for(int i = 0; i < config.writesPerCommit && !failed; i++){
+      if(offset + config.writeSize > MAX_FILE_BYTES) offset = 0;
+      buffer[i % config.writeSize] ^= 1;
+      failed = WriteBlock(fd,&buffer[0],offset,config.writeSize) != config.writeSize;
+      if(config.verify) writes.insert(writes.end(),buffer.begin(),buffer.end());
+      offset += config.writeSize;
+    }
+    if(!failed) failed = Commit(fd) != 0;
+    if(failed){
+      self->failures++;
+      Abort(fd);
+      //nothing of the commit was applied, so the next starts where it did
+      offset = startOffset;
+      continue;
+    }
+    if(config.verify) applyWrites(&self->contents[current],startOffset,writes);
+    self->latencies.push_back(monotonicUsec() - start);
+    self->commits++;
+    self->bytes += (uint64_t) config.writeSize * config.writesPerCommit;
+  }
+  return NULL;
+}
+
+/* Returns the first offset at which the file at path differs from contents, or -1 if it doesn't */
+static long compareFile(const char* path, const std::vector<char>& contents, std::vector<char>* copy){
+  FILE* in = fopen(path,"r");
+  if(in == NULL) return 0;
+  //a byte more, to tell if the file is longer
+  copy->resize(contents.size() + 1);
+  size_t length = fread(&(*copy)[0],1,copy->size(),in);
+  fclose(in);
+  size_t common = length < contents.size() ? length : contents.size();
+  for(size_t i = 0; i < common; i++){
+    if((*copy)[i] != contents[i]) return i;
+  }
+  return length == contents.size() ? -1 : (long) common;
+}
+
+/*
+ * Reads back every server's copy of each file and compares it with
+ * what it should hold. The servers apply commits after acking them,
+ * and stragglers catch up in the background, so a copy that differs
+ * is read again until VERIFY_WAIT_MSEC have passed. Returns false,
+ * having printed where, if any copy still differs.
+ */
+static bool verifyFiles(const std::vector<BenchThread>& threads){
+  uint64_t waitUntil = monotonicUsec() + VERIFY_WAIT_MSEC * USEC_PER_MSEC;
+  std::vector<char> copy;
+  for(int i = 0; i < config.numFiles; i++){
+    const std::vector<char>& contents = threads[i % config.numThreads].contents[i / config.numThreads];
+    for(int j = 0; j < config.numServers; j++){
+      char path[PATH_MAX];
+      snprintf(path,sizeof(path),"%s/server%d/bench%d",config.dir,j,i);
+      long mismatch;
+      while((mismatch = compareFile(path,contents,&copy)) >= 0 && monotonicUsec() < waitUntil){
+        usleep(VERIFY_POLL_MSEC * USEC_PER_MSEC);
+      }
+      if(mismatch >= 0){
+        printf("bench error=verify file=bench%d server=%d offset=%ld\n",i,j,mismatch);
+        return false;
+      }
+    }
+  }
+  return true;
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double fraction){
+  if(sorted.size() == 0) return 0;
+  size_t index = (size_t) (fraction * sorted.size());
+  if(index >= sorted.size()) index = sorted.size() - 1;
+  return sorted[index];
+}
+
+static bool parseArgs(const int argc, const char* argv[]){
+  config.numServers = DEFAULT_SERVERS;
+  config.port = DEFAULT_PORT;
+  config.dropPercent = 0;
+  config.writeSize = MAX_WRITE_SIZE;
+  config.writesPerCommit = DEFAULT_WRITES;
+  config.numFiles = 1;
+  config.numThreads = 1;
+  config.maxCommits = 0;
+  config.seconds = DEFAULT_SECONDS;
+  config.quorum = REPLFS_QUORUM_ALL;
+  config.compress = false;
+  config.verify = false;
+  config.serverPath = "./replFsServer";
+  config.dir = "/tmp/replfs_bench";
+  for(int i = 1; i < argc; i++){
+    bool hasValue = i + 1 < argc;
+    if(strcmp(argv[i],"-compress") == 0){
+      config.compress = true;
+    }else if(strcmp(argv[i],"-verify") == 0){
+      config.verify = true;
+    }else if(!hasValue){
+      return false;
+    }else if(strcmp(argv[i],"-servers") == 0){
+      config.numServers = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-port") == 0){
+      config.port = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-drop") == 0){
+      config.dropPercent = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-size") == 0){
+      config.writeSize = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-writes") == 0){
+      config.writesPerCommit = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-files") == 0){
+      config.numFiles = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-threads") == 0){
+      config.numThreads = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-commits") == 0){
+      config.maxCommits = atol(argv[++i]);
+    }else if(strcmp(argv[i],"-seconds") == 0){
+      config.seconds = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-quorum") == 0){
+      config.quorum = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-server") == 0){
+      config.serverPath = argv[++i];
+    }else if(strcmp(argv[i],"-dir") == 0){
+      config.dir = argv[++i];
+    }else{
+      return false;
+    }
+  }
+  if(config.numServers < 1 || config.numServers > MAX_BENCH_SERVERS) return false;
+  if(config.writeSize < 1 || config.writeSize > MAX_BENCH_WRITE) return false;
+  if(config.writesPerCommit < 1) return false;
+  if(config.numThreads < 1) return false;
+  //every thread needs a file of its own
+  if(config.numFiles < config.numThreads) config.numFiles = config.numThreads;
+  return config.seconds > 0;
+}
+
+int main(const int argc, const char* argv[]){
+  if(!parseArgs(argc,argv)){
+    usage();
+    return -1;
+  }
+  if(mkdir(config.dir,0777) != 0 && errno != EEXIST){
+    perror("mkdir");
+    return -1;
+  }
+  std::vector<pid_t> servers;
+  for(int i = 0; i < config.numServers; i++){
+    pid_t pid = startServer(i);
+    if(pid > 0) servers.push_back(pid);
+  }
+  usleep(SERVER_START_MSEC * USEC_PER_MSEC);
+  int status = -1;
+  if(InitReplFs(config.port,config.dropPercent,config.numServers) != 0){
+    printf("bench error=init servers=%d\n",config.numServers);
+  }else{
+    SetCommitQuorum(config.quorum);
+    SetCompression(config.compress);
+    std::vector<BenchThread> threads(config.numThreads);
+    bool opened = true;
+    for(int i = 0; i < config.numFiles && opened; i++){
+      char name[32];
+      snprintf(name,sizeof(name),"bench%d",i);
+      int fd = OpenFile(name);
+      opened = fd >= 0;
+      threads[i % config.numThreads].fds.push_back(fd);
+      threads[i % config.numThreads].contents.push_back(std::vector<char>());
+    }
+    if(!opened){
+      printf("bench error=open servers=%d\n",config.numServers);
+    }else{
+      uint64_t start = monotonicUsec();
+      deadline = start + (uint64_t) config.seconds * USEC_PER_SEC;
+      for(int i = 0; i < config.numThreads; i++){
+        threads[i].index = i;
+        threads[i].commits = 0;
+        threads[i].failures = 0;
+        threads[i].bytes = 0;
+        pthread_create(&threads[i].thread,NULL,runThread,&threads[i]);
+      }
+      long commits = 0;
+      long failures = 0;
+      uint64_t bytes = 0;
+      std::vector<uint64_t> latencies;
+      for(int i = 0; i < config.numThreads; i++){
+        pthread_join(threads[i].thread,NULL);
+        commits += threads[i].commits;
+        failures += threads[i].failures;
+        bytes += threads[i].bytes;
+        latencies.insert(latencies.end(),threads[i].latencies.begin(),threads[i].latencies.end());
+      }
+      double seconds = (monotonicUsec() - start) / (double) USEC_PER_SEC;
+      std::sort(latencies.begin(),latencies.end());
+      printf("bench servers=%d threads=%d files=%d size=%d writes=%d drop=%d quorum=%d "
+             "compress=%d commits=%ld failures=%ld seconds=%.3f commits_per_sec=%.1f "
+             "mb_per_sec=%.3f p50_usec=%lu p99_usec=%lu p999_usec=%lu max_usec=%lu\n",
+             config.numServers,config.numThreads,config.numFiles,config.writeSize,
+             config.writesPerCommit,config.dropPercent,config.quorum,config.compress,
+             commits,failures,seconds,commits / seconds,bytes / seconds / (1024 * 1024),
+             (unsigned long) percentile(latencies,0.5),(unsigned long) percentile(latencies,0.99),
+             (unsigned long) percentile(latencies,0.999),
+             (unsigned long) (latencies.size() ? latencies.back() : 0));
+      for(int i = 0; i < config.numFiles; i++){
+        CloseFile(threads[i % config.numThreads].fds[i / config.numThreads]);
+      }
+      status = failures == 0 ? 0 : -1;
+      if(config.verify && !verifyFiles(threads)) status = -1;
+    }
+  }
+  for(size_t i = 0; i < servers.size(); i++) kill(servers[i],SIGTERM);
+  for(size_t i = 0; i < servers.size(); i++) waitpid(servers[i],NULL,0);
+  return status;
+}
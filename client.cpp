@@ -1,6 +1,12 @@
 #include "client.h"
 #include "replfs_net.h"
 #include "packets.h"
+#include "staging.h"
+#include "extents.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "metrics.h"
+#include "trace.h"
 #include <time.h>
 #include <sys/time.h>
 #include <stdlib.h>
@@ -9,124 +15,403 @@
 #include <set>
 #include <map>
 #include <vector>
+#include <algorithm>
 #include <limits.h>
-
-#define WORD_SIZE_BYTES ((int) sizeof(unsigned int))
-#define WORD_SIZE_BITS (WORD_SIZE_BYTES * CHAR_BIT)
+#include <stdint.h>
+#include <string.h>
+#include <pthread.h>
+#include <utility>
 
 #define DEFAULT_PORT 44016
 
 #define ERR_RETURN -1
 #define OK_RETURN 0
 
-#define USEC_PER_SEC 1000000
-
 #define MAX_ROLLCALL_ROUNDS 3
-#define MAX_TIMEOUTS_PER_ROLLCALL 3
+#define ROLLCALL_ROUND_MSEC 600
+
+#define MAX_OPEN_MSEC 2000
+#define MAX_COMMIT_LATENCY_MSEC 2000
+#define MAX_COMMIT_MSEC 2000
+#define MAX_ABORT_MSEC 2000
+#define MAX_READ_MSEC 2000
+
+//most blocks each file keeps cached
+#define MAX_CACHED_BLOCKS 4096
+//most block reads a ReadBlock has outstanding at once
+#define READ_WINDOW 32
+#define NO_BLOCK UINT32_MAX
+
+//byte offsets on the wire are 32 bits
+#define MAX_FILESIZE_BYTES 0xffffffffLL
 
-#define MAX_TIMEOUTS_PER_OPEN 10
-#define MAX_COMMIT_LATENCY_SEC 2
-#define MAX_TIMEOUTS_PER_COMMIT 10
-#define MAX_TIMEOUTS_PER_ABORT 10
+//the phases an in-flight commit moves through
+#define COMMIT_PHASE_READY 1  //waiting for every server to be ready
+#define COMMIT_PHASE_QUEUED 2 //everyone is ready, waiting on an earlier commit
+#define COMMIT_PHASE_ACK 3    //Commit sent, waiting for acks
+#define COMMIT_PHASE_CATCHUP 4 //done as far as the caller knows, stragglers still to ack
 
-#define MAX_FILESIZE_BYTES (1024 *1024)
+//how long stragglers are helped to catch up with a commit before
+//they are left behind, and how many commits may be waiting on them
+#define MAX_CATCHUP_MSEC 10000
+#define MAX_CATCHUP_COMMITS 256
+
+//a member that has been quiet for MEMBER_PROBE_MSEC is probed, and one
+//quiet for MEMBER_TIMEOUT_MSEC is taken to have left
+#define MEMBER_PROBE_MSEC 500
+#define MEMBER_TIMEOUT_MSEC 5000
+
+/*
+ * Retransmission state for a packet we want acknowledged.
+ * The timeout starts from the current round trip estimate
+ * and doubles with every resend.
+ */
+struct Retransmit {
+  TimerId timer;
+  uint64_t sentAt;
+  //0 if there is no overall time limit
+  uint64_t deadline;
+  uint64_t rto;
+  bool resent;
+  bool sampled;
+};
+
+struct PendingCommit {
+  uint32_t fileId;
+  uint32_t commitNum;
+  uint32_t finalWriteNum;
+  //commitChecksum of its writes, which every ready server has to match
+  uint32_t checksum;
+  bool closeFlag;
+  int phase;
+  struct Retransmit retransmit;
+  std::set<uint32_t> remainingServers;
+  std::map<uint32_t,uint64_t> serverTimes;
+  //when the COMMIT_REQUEST and the COMMIT first went out
+  uint64_t startedAt;
+  uint64_t committedAt;
+  StagedCommit* staged;
+  //the writes laid over each other by offset, for reads made before it is applied
+  ExtentMap extents;
+  CommitCallback callback;
+};
+
+/* A READ_BLOCK_SIZE aligned block of a file's committed data */
+struct CachedBlock {
+  //less than READ_BLOCK_SIZE if the file ends in this block
+  uint32_t length;
+  uint8_t data[READ_BLOCK_SIZE];
+};
+
+/* A block read waiting for its reply, which is matched by requestId */
+struct PendingRead {
+  ReadRequestPacket request;
+  struct Retransmit retransmit;
+  bool timerFired;
+  bool done;
+  uint8_t status;
+  struct CachedBlock block;
+};
 
 struct OpenFile {
   uint32_t fileId;
   uint32_t commitNum;
-  uint8_t writeNum;
+  uint32_t writeNum;
+  //set when a commit fails, cleared by Abort
+  bool failed;
+  uint32_t failedCommitNum;
+  std::map<uint32_t,struct PendingCommit*> pendingCommits;
+  //signalled whenever one of the file's commits completes or fails
+  pthread_cond_t changed;
+  int numWaiting;
+  //a closed file is freed by the last thread waiting on it
+  bool closed;
+  //committed blocks read so far, by offset / READ_BLOCK_SIZE
+  std::map<uint32_t,struct CachedBlock*> cache;
+  //the cached block the file ends in, or NO_BLOCK
+  uint32_t endBlock;
+  //what is staged for the next commit, laid over each other by offset
+  ExtentMap stagedExtents;
+  //the members that opened the file and haven't left since. Only they
+  //take part in its commits; servers that join later copy it from them
+  std::set<uint32_t> servers;
+};
+
+/* The commit number an OpenFile or roll call ack is filed under */
+#define NO_COMMIT 0
+typedef std::pair<uint32_t,uint32_t> OperationKey;
+
+/*
+ * An application thread waiting on the servers' acks for an
+ * OpenFile, an Abort or a roll call, filed by fileId and commitNum.
+ * The network thread records who acked and tells the waiter when
+ * its retransmission timer fires.
+ */
+struct Waiter {
+  uint8_t ackType;
+  OperationKey key;
+  std::set<uint32_t> ackedServers;
+  //whose acks are wanted, NULL for a roll call
+  std::set<uint32_t>* servers;
+  struct Retransmit retransmit;
+  bool timerFired;
+  pthread_cond_t wakeup;
+};
+
+/*
+ * Writes gathered to be compressed together, data back to back.
+ * They go out as one COMPRESSED_BATCH if they shrink enough to fit.
+ */
+struct CompressingBatch {
+  uint32_t fileId;
+  uint32_t commitNum;
+  int numWrites;
+  BatchedWrite writes[UINT8_MAX];
+  size_t dataSize;
+  uint8_t data[MAX_BATCH_DATA];
+};
+
+/*
+ * Everything one client has. A process using the library through
+ * InitReplFs is one client, processClient. On the simulated network
+ * a process can run any number of them, the calls acting as the one
+ * last made current.
+ *
+ * Everything here is guarded by lock. Application threads hold it
+ * while they call into the library, and the network thread while it
+ * handles events; waiting for the servers releases it.
+ */
+struct ClientNode {
+  pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+  //false if the network thread couldn't be started, in which
+  //case waiting threads handle events themselves
+  bool networkRunning;
+  //the client's node on the simulated network, or -1
+  int simNode = -1;
+
+  //the members, which servers join and leave as the client runs
+  std::set<uint32_t> serverIds;
+  //bumped whenever a server joins or leaves, 0 until the roll call is done
+  uint32_t membershipEpoch;
+  //when each member was last heard from, in usecs
+  std::map<uint32_t,uint64_t> lastHeard;
+  TimerId membershipTimer;
+  uint32_t nextFileId = 1;
+  std::set<uint32_t> openFileIds;
+  std::map <uint32_t,struct OpenFile*> openFiles;
+  std::map<uint32_t,StagedCommit*> stagedWrites;
+  std::map<TimerId,struct PendingCommit*> commitTimers;
+  //how many servers each phase of a commit waits for, 0 for all of them
+  int commitQuorum = REPLFS_QUORUM_ALL;
+  //commits the caller has been told about that some servers haven't acked
+  std::map<OperationKey,struct PendingCommit*> catchingUp;
+  //servers that fell too far behind to be helped; nothing waits for them
+  std::set<uint32_t> laggingServers;
+  std::map<OperationKey,struct Waiter*> waiters;
+  std::map<TimerId,struct Waiter*> waiterTimers;
+  uint32_t nextRequestId = 1;
+  std::map<uint32_t,struct PendingRead*> pendingReads;
+  std::map<TimerId,struct PendingRead*> readTimers;
+  //smoothed time each server takes to reply, in usecs
+  std::map<uint32_t,uint64_t> serverLatency;
+
+  //writes waiting to go out together in one datagram
+  WriteBatchPacket outgoingBatch;
+  size_t outgoingBatchSize;
+
+  //the features each server announced when it answered the roll call or joined
+  std::map<uint32_t,uint32_t> serverFeatures;
+  //compression is asked for with SetCompression, and only used
+  //while every member can take compressed batches
+  bool compressionWanted;
+  bool compressing;
+  struct CompressingBatch compressingBatch;
+  CompressedBatchPacket compressedBatch;
+  //how far the last batch compressed, in thousandths, to guess how much the next will hold
+  size_t compressedPermille = 1000;
 };
 
-static std::set<uint32_t> serverIds;
-static std::set<uint32_t> openFileIds;
-static std::map <uint32_t,struct OpenFile*> openFiles;
-static std::map<uint32_t,std::vector<WriteBlockPacket*> >stagedWrites;
+static struct ClientNode processClient;
+static thread_local struct ClientNode* client = &processClient;
+//the clients on the simulated network, numbered as InitSimReplFs returned them
+static std::vector<struct ClientNode*> simClients;
 
 static int RollCall(size_t expectedNumServers);
+static void startRetransmit(struct Retransmit* retransmit, uint64_t maxMsec);
+static bool nextRetransmit(struct Retransmit* retransmit);
+static void ackReceived(struct Retransmit* retransmit);
+static void restartRetransmit(struct Retransmit* retransmit);
+static void stopRetransmit(struct Retransmit* retransmit);
+static void batchWrite(uint32_t fileId, uint32_t commitNum, const StagedWrite* write);
+static StagedCommit* newStagedCommit();
+static void freeStagedCommit(StagedCommit* staged);
+static void flushBatch();
+static void flushPlainBatch();
+static void updateCompression();
+static bool pumpEvents(bool block);
+static void handleEvent(ReplfsEvent* event);
+static void* networkThread(void* arg);
+static void addWaiter(struct Waiter* waiter, uint8_t ackType, uint32_t fileId, uint32_t commitNum);
+static void removeWaiter(struct Waiter* waiter);
+static void waitForProgress(pthread_cond_t* wakeup);
+static bool waitOnFile(struct OpenFile* file);
+static bool sendUntilAcked(void* request, uint8_t type, uint8_t ackType, uint32_t fileId,
+                           uint32_t commitNum, std::set<uint32_t>* servers, uint64_t maxMsec);
+static void serverReplied(uint32_t serverId, struct Retransmit* retransmit);
+static void invalidateCache(struct OpenFile* file, const StagedCommit* staged);
+static void dropCachedBlocks(struct OpenFile* file, uint32_t first, uint32_t last);
+static void wakeReader(struct PendingRead* read);
+static void handleReadReply(ReadReplyPacket* reply);
+static void sendMembership();
 
 int InitReplFs(unsigned short portNum, int packetLoss, int numServers){
+  pthread_mutex_lock(&client->lock);
   srand(time(NULL));
   LOG("Initializing network connection...\n");
   netInit(portNum,packetLoss);
   LOG("Network initialized.\n");
-  return RollCall(numServers);
+  pthread_t thread;
+  if(pthread_create(&thread,NULL,networkThread,NULL) == 0){
+    pthread_detach(thread);
+    client->networkRunning = true;
+  }else{
+    LOG("Unable to start the network thread, callers will handle events\n");
+  }
+  int result = RollCall(numServers);
+  pthread_mutex_unlock(&client->lock);
+  return result;
+}
+
+/*
+ * Simulated clients start no network thread. Each waits for the
+ * servers by running the simulation until it has had a turn, and on
+ * its turns handles whatever it has waiting, so nothing on the one
+ * thread a simulation runs on needs locking.
+ */
+static void stepClient(void* context){
+  client = (struct ClientNode*) context;
+  corkSends();
+  while(pumpEvents(false));
+  uncorkSends();
+}
+
+int InitSimReplFs(unsigned short portNum, int numServers){
+  struct ClientNode* node = new struct ClientNode();
+  node->simNode = netAddNode(portNum);
+  netSetHandler(node->simNode,stepClient,node);
+  simClients.push_back(node);
+  client = node;
+  if(RollCall(numServers) != OK_RETURN) return ERR_RETURN;
+  return simClients.size() - 1;
+}
+
+void UseSimClient(int number){
+  client = simClients[number];
+  netUseNode(client->simNode);
+}
+
+/*
+ * Handles events as they arrive for as long as the process runs.
+ * Events that come in together are handled under one hold of the
+ * lock, and whatever they send goes out together.
+ */
+static void* networkThread(void* arg){
+  static ReplfsEvent events[RECEIVE_BATCH];
+  static ReplfsPacket packets[RECEIVE_BATCH];
+  for(int i = 0; i < RECEIVE_BATCH; i++) events[i].packet = &packets[i];
+  while(true){
+    int numEvents = nextEvents(events,RECEIVE_BATCH);
+    pthread_mutex_lock(&client->lock);
+    corkSends();
+    for(int i = 0; i < numEvents; i++) handleEvent(&events[i]);
+    uncorkSends();
+    pthread_mutex_unlock(&client->lock);
+  }
+  return NULL;
 }
 
 static int RollCall(size_t expectedNumServers){
   LOG("Sending RollCall\n");
-  for(int roundNum=0; roundNum < MAX_ROLLCALL_ROUNDS && serverIds.size() != expectedNumServers; roundNum++){
-    serverIds.clear();
+  struct Waiter waiter;
+  addWaiter(&waiter,ROLL_CALL_ACK,0,NO_COMMIT);
+  //rounds last a fixed time, and acks to a broadcast aren't round trip samples
+  waiter.retransmit.sampled = true;
+  for(int roundNum=0; roundNum < MAX_ROLLCALL_ROUNDS && client->serverIds.size() != expectedNumServers; roundNum++){
+    waiter.ackedServers.clear();
     if(sendPacket(NULL,ROLL_CALL) < 0){
       LOG("Error sending packet...\n");
     }
     LOG("RollCall sent, round %d.\n",roundNum+1);
-    int timeoutNum = 0;
-    ReplfsEvent event;
-    ReplfsPacket packet;
-    event.packet = &packet;
-    while(timeoutNum < MAX_TIMEOUTS_PER_ROLLCALL && serverIds.size() != expectedNumServers){
-      nextEvent(&event);
-      if(event.type == HEARTBEAT_EVENT){
-        timeoutNum++;
-      }else if(packet.type == ROLL_CALL_ACK){
-        RollCallAckPacket* p = (RollCallAckPacket*) &(packet.body);
-        serverIds.insert(p->proposedId);
-        LOG("Saw new server with ID %u\n",p->proposedId);
-      }
+    waiter.retransmit.sentAt = monotonicUsec();
+    waiter.retransmit.timer = setTimer(ROLLCALL_ROUND_MSEC * USEC_PER_MSEC);
+    client->waiterTimers[waiter.retransmit.timer] = &waiter;
+    waiter.timerFired = false;
+    while(!waiter.timerFired && waiter.ackedServers.size() != expectedNumServers){
+      waitForProgress(&waiter.wakeup);
     }
+    client->waiterTimers.erase(waiter.retransmit.timer);
+    cancelTimer(waiter.retransmit.timer);
+    client->serverIds = waiter.ackedServers;
   }
-  if(serverIds.size() == expectedNumServers){
+  removeWaiter(&waiter);
+  if(client->serverIds.size() == expectedNumServers){
     LOG("Expected number of servers accounted for. Initialization complete.\n");
+    client->membershipEpoch = 1;
+    setEpoch(client->membershipEpoch);
+    uint64_t now = monotonicUsec();
+    std::set<uint32_t>::iterator it;
+    for(it = client->serverIds.begin(); it != client->serverIds.end(); ++it) client->lastHeard[*it] = now;
+    sendMembership();
+    updateCompression();
+    client->membershipTimer = setTimer(MEMBER_PROBE_MSEC * USEC_PER_MSEC);
     return OK_RETURN;
   }else{
-    LOG("Saw %zu servers, expected %zu. Initialization failed.\n",serverIds.size(),expectedNumServers);
+    LOG("Saw %zu servers, expected %zu. Initialization failed.\n",client->serverIds.size(),expectedNumServers);
     return ERR_RETURN;
   }
 }
 
+static int openFile(char* name);
+static int writeBlock(int fd, char* buffer, int byteOffset, int blockSize);
+static int pollCommits(int fd);
+static int performClose(int fd);
+static int readBlock(int fd, char* buffer, int byteOffset, int blockSize);
+
 int OpenFile(char *name){
-  static uint32_t nextFileId = 1;
+  pthread_mutex_lock(&client->lock);
+  int result = openFile(name);
+  pthread_mutex_unlock(&client->lock);
+  return result;
+}
+
+static int openFile(char* name){
   //create and send the first OpenFile packet
   OpenFilePacket packet;
-  packet.fileId = nextFileId;
-  nextFileId++;
+  packet.fileId = client->nextFileId;
+  client->nextFileId++;
   strncpy((char*) packet.fileName,name,MAX_FILENAME_SIZE);
   LOG("Created new fileId \'%u\' for file %s\n",packet.fileId,name);
-  sendPacket(&packet,OPEN_FILE);
-  //wait for acknowledgements
-  int timeoutNum = 0;
-  ReplfsEvent event;
-  ReplfsPacket incoming;
-  event.packet = &incoming;
-  std::set<uint32_t> remainingServers = serverIds;
-  while(timeoutNum < MAX_TIMEOUTS_PER_OPEN && remainingServers.size() >0){
-    nextEvent(&event);
-    if(event.type == HEARTBEAT_EVENT){
-      timeoutNum++;
-      LOG("Resending OpenFile packet for file %u\n",packet.fileId);
-      sendPacket(&packet,OPEN_FILE);
-    }else if(event.type == PACKET_EVENT && incoming.type == OPEN_FILE_ACK){
-      OpenFileAckPacket* openFileAck = (OpenFileAckPacket*) &incoming.body;
-      if(openFileAck->fileId == packet.fileId){
-        remainingServers.erase(openFileAck->serverId);
-        LOG("Received OpenFileAck from server %u. %zu servers remaining\n",
-            openFileAck->serverId,remainingServers.size());
-      }
-    }
-  }
+  std::set<uint32_t> members = client->serverIds;
   //if all the servers acknowledged...
-  if(remainingServers.size() == 0){
+  if(sendUntilAcked(&packet,OPEN_FILE,OPEN_FILE_ACK,packet.fileId,NO_COMMIT,&members,MAX_OPEN_MSEC)){
     LOG("All servers acknowledged OpenFile.\n");
     LOG("Creating housekeeping data...\n");
     //insert the id into the list of ids
-    openFileIds.insert(packet.fileId);
+    client->openFileIds.insert(packet.fileId);
     //create the file struct and add it to the map
     struct OpenFile* file = new struct OpenFile;
     file->fileId = packet.fileId;
     file->commitNum = 1;
     file->writeNum = 0;
-    openFiles[packet.fileId] = file;
-    stagedWrites[packet.fileId] = std::vector<WriteBlockPacket*>();
+    file->failed = false;
+    file->failedCommitNum = 0;
+    pthread_cond_init(&file->changed,NULL);
+    file->numWaiting = 0;
+    file->closed = false;
+    file->endBlock = NO_BLOCK;
+    file->servers = members;
+    client->openFiles[packet.fileId] = file;
+    client->stagedWrites[packet.fileId] = newStagedCommit();
     return packet.fileId;
   }else{
     LOG("Some servers did not acknowledge OpenFile. File could not be opened.\n");
@@ -134,240 +419,1387 @@ int OpenFile(char *name){
   }
 }
 
+/*
+ * Writes bigger than MAX_WRITE_SIZE are split into pieces, each
+ * staged as a write of its own with the next write number. Servers
+ * apply writes in write number order, so the pieces land exactly as
+ * a single write would.
+ */
 int WriteBlock(int fd, char *buffer, int byteOffset, int blockSize){
-  if(openFileIds.count(fd) == 0 ||
-     blockSize > MAX_WRITE_SIZE ||
-     byteOffset + blockSize > MAX_FILESIZE_BYTES){
+  pthread_mutex_lock(&client->lock);
+  int result = writeBlock(fd,buffer,byteOffset,blockSize);
+  pthread_mutex_unlock(&client->lock);
+  return result;
+}
+
+static int writeBlock(int fd, char* buffer, int byteOffset, int blockSize){
+  if(client->openFileIds.count(fd) == 0 ||
+     byteOffset < 0 || blockSize < 0 ||
+     (long long) byteOffset + blockSize > MAX_FILESIZE_BYTES){
     return ERR_RETURN;
   }
   if(buffer == NULL) return OK_RETURN;
-  WriteBlockPacket* outgoing = (WriteBlockPacket*) malloc(sizeof(WriteBlockPacket));
-  if(outgoing == NULL){
-    LOG("Error mallocing enough size for a write block packet. Crashing...\n");
+  struct OpenFile* file = client->openFiles[fd];
+  if(file->failed) return ERR_RETURN;
+  if(!client->networkRunning && file->pendingCommits.size() > 0) pumpEvents(false);
+  //an empty write still counts as one
+  uint32_t numPieces = blockSize == 0 ? 1 : (blockSize + MAX_WRITE_SIZE - 1) / MAX_WRITE_SIZE;
+  if(file->writeNum + numPieces > MAX_WRITES_PER_COMMIT){
+    LOG("Exceeded max writes for file %u commit %u\n",fd,file->commitNum);
     return ERR_RETURN;
   }
-  outgoing->fileId = fd;
-  struct OpenFile* file = openFiles[fd];
-  outgoing->commitNum = file->commitNum;
-  if(file->writeNum >= 127){
-    LOG("Exceeded max writes for file %u commit %u\n",fd,file->commitNum);
+  StagedCommit* staged = client->stagedWrites[fd];
+  //the whole write is copied in at once, so running out of memory can't
+  //leave some of its pieces staged and sent without the rest
+  uint8_t* data = (uint8_t*) arenaAlloc(&staged->arena,blockSize);
+  if(data == NULL){
+    LOG("Error allocating space for a staged write\n");
     return ERR_RETURN;
-  }else{
+  }
+  memcpy(data,buffer,blockSize);
+  int written = 0;
+  corkSends();
+  do{
+    StagedWrite write;
+    write.blockSize = blockSize - written < MAX_WRITE_SIZE ? blockSize - written : MAX_WRITE_SIZE;
+    write.data = data + written;
     file->writeNum++;
-    LOG("Incremented writenum for file %u commit %u to %u\n",fd,file->commitNum,file->writeNum);
-  }
-  outgoing->writeNum = file->writeNum;
-  outgoing->byteOffset = byteOffset;
-  outgoing->blockSize = blockSize;
-  memcpy(outgoing->data,buffer,blockSize);
-  sendPacket(outgoing,WRITE_BLOCK);
-  stagedWrites[fd].push_back(outgoing);
-  LOG("Sent WriteBlock packet\n");
+    write.writeNum = file->writeNum;
+    write.byteOffset = byteOffset + written;
+    write.crc = crc32c(0,write.data,write.blockSize);
+    staged->writes.push_back(write);
+    extentInsert(&file->stagedExtents,write.byteOffset,write.blockSize,write.data);
+    batchWrite(fd,file->commitNum,&write);
+    trace(TRACE_WRITE,fd,file->commitNum,write.writeNum);
+    written += write.blockSize;
+  }while(written < blockSize);
+  uncorkSends();
   return blockSize;
 }
 
-void initializeServerTimes(std::map<uint32_t,struct timeval>& serverTimes);
-bool serversAlive(std::map<uint32_t,struct timeval>& serverTimes);
-int finishCommit(uint32_t fd, uint32_t commitNum,bool closeFlag);
-void resendWrites(uint32_t fileId, uint32_t commitNum, uint8_t reqWrites[16]);
+/*
+ * Adds a write to the outgoing batch. The batch is sent first
+ * if the write belongs to a different commit or wouldn't fit.
+ */
+static void addPlainWrite(uint32_t fileId, uint32_t commitNum, const BatchedWrite* header,
+                          const uint8_t* data){
+  size_t writeSize = sizeof(BatchedWrite) + header->blockSize;
+  if(client->outgoingBatch.numWrites > 0 &&
+     (client->outgoingBatch.fileId != fileId ||
+      client->outgoingBatch.commitNum != commitNum ||
+      client->outgoingBatch.numWrites == UINT8_MAX ||
+      client->outgoingBatchSize + writeSize > sizeof(client->outgoingBatch.writes))){
+    flushPlainBatch();
+  }
+  client->outgoingBatch.fileId = fileId;
+  client->outgoingBatch.commitNum = commitNum;
+  memcpy(client->outgoingBatch.writes + client->outgoingBatchSize,header,sizeof(BatchedWrite));
+  memcpy(client->outgoingBatch.writes + client->outgoingBatchSize + sizeof(BatchedWrite),data,header->blockSize);
+  client->outgoingBatchSize += writeSize;
+  client->outgoingBatch.numWrites++;
+}
+
+/*
+ * Sends the writes gathered for compression. They go out compressed
+ * if that shrinks them and fits in a datagram, and otherwise join the
+ * plain batch. Either way the result tells how much the next batch
+ * can gather.
+ */
+static void flushCompressed(){
+  struct CompressingBatch& pending = client->compressingBatch;
+  if(pending.numWrites == 0) return;
+  CompressedBatchPacket& packet = client->compressedBatch;
+  size_t headersSize = pending.numWrites * sizeof(BatchedWrite);
+  size_t capacity = sizeof(packet.writes) - headersSize;
+  if(capacity >= pending.dataSize) capacity = pending.dataSize > 0 ? pending.dataSize - 1 : 0;
+  size_t length = lzCompress(pending.data,pending.dataSize,packet.writes + headersSize,capacity);
+  if(length > 0){
+    client->compressedPermille = length * 1000 / pending.dataSize;
+    packet.fileId = pending.fileId;
+    packet.commitNum = pending.commitNum;
+    packet.numWrites = pending.numWrites;
+    packet.dataLength = length;
+    memcpy(packet.writes,pending.writes,headersSize);
+    LOG("Sending %u writes for file %u compressed from %zu to %zu bytes\n",
+        packet.numWrites,packet.fileId,pending.dataSize,length);
+    sendPacket(&packet,COMPRESSED_BATCH);
+  }else{
+    //didn't shrink, or shrank less than guessed
+    if(client->compressedPermille < 1000) client->compressedPermille = (client->compressedPermille + 1000) / 2;
+    size_t offset = 0;
+    for(int i = 0; i < pending.numWrites; i++){
+      addPlainWrite(pending.fileId,pending.commitNum,&pending.writes[i],pending.data + offset);
+      offset += pending.writes[i].blockSize;
+    }
+  }
+  pending.numWrites = 0;
+  pending.dataSize = 0;
+}
+
+/*
+ * Gathers a write to be compressed, first sending what is gathered
+ * if the write belongs to a different commit, or if adding it would
+ * likely compress to more than a datagram holds.
+ */
+static void compressWrite(uint32_t fileId, uint32_t commitNum, const BatchedWrite* header,
+                          const uint8_t* data){
+  struct CompressingBatch& pending = client->compressingBatch;
+  if(pending.numWrites > 0){
+    size_t dataSize = pending.dataSize + header->blockSize;
+    //a little slack, since the next batch compresses differently
+    size_t guess = dataSize * client->compressedPermille / 1000 + dataSize / 16;
+    if(pending.fileId != fileId || pending.commitNum != commitNum ||
+       pending.numWrites == UINT8_MAX || dataSize > MAX_BATCH_DATA ||
+       (pending.numWrites + 1) * sizeof(BatchedWrite) + guess > sizeof(client->compressedBatch.writes)){
+      flushCompressed();
+    }
+  }
+  pending.fileId = fileId;
+  pending.commitNum = commitNum;
+  pending.writes[pending.numWrites++] = *header;
+  memcpy(pending.data + pending.dataSize,data,header->blockSize);
+  pending.dataSize += header->blockSize;
+}
+
+/* Queues a write to be sent, compressed if compression is on */
+static void batchWrite(uint32_t fileId, uint32_t commitNum, const StagedWrite* write){
+  BatchedWrite header;
+  header.writeNum = write->writeNum;
+  header.byteOffset = write->byteOffset;
+  header.blockSize = write->blockSize;
+  header.crc = write->crc;
+  if(client->compressing){
+    compressWrite(fileId,commitNum,&header,write->data);
+  }else{
+    addPlainWrite(fileId,commitNum,&header,write->data);
+  }
+}
+
+static StagedCommit* newStagedCommit(){
+  StagedCommit* staged = new StagedCommit;
+  arenaInit(&staged->arena);
+  return staged;
+}
+
+static void freeStagedCommit(StagedCommit* staged){
+  arenaRelease(&staged->arena);
+  delete staged;
+}
+
+/* Sends whatever writes are waiting in the outgoing batches */
+static void flushBatch(){
+  flushCompressed();
+  flushPlainBatch();
+}
+
+static void flushPlainBatch(){
+  if(client->outgoingBatch.numWrites == 0) return;
+  LOG("Sending batch of %u writes for file %u\n",client->outgoingBatch.numWrites,client->outgoingBatch.fileId);
+  sendPacket(&client->outgoingBatch,WRITE_BATCH);
+  client->outgoingBatch.numWrites = 0;
+  client->outgoingBatchSize = 0;
+}
+
+void initializeServerTimes(std::map<uint32_t,uint64_t>& serverTimes, const std::set<uint32_t>& servers);
+size_t deadServers(std::map<uint32_t,uint64_t>& serverTimes);
+void resendWrites(struct PendingCommit* commit, WriteResendRequestPacket* request);
+int startCommit(int fd, bool closeFlag, CommitCallback callback);
+int waitCommits(int fd);
 int performCommit(int fd,bool closeFlag);
 
 int Commit(int fd){
-  return performCommit(fd,false);
+  pthread_mutex_lock(&client->lock);
+  int result = performCommit(fd,false);
+  pthread_mutex_unlock(&client->lock);
+  return result;
+}
+
+int CommitAsync(int fd, CommitCallback callback){
+  pthread_mutex_lock(&client->lock);
+  int result = startCommit(fd,false,callback);
+  pthread_mutex_unlock(&client->lock);
+  return result;
+}
+
+int PollCommits(int fd){
+  pthread_mutex_lock(&client->lock);
+  int result = pollCommits(fd);
+  pthread_mutex_unlock(&client->lock);
+  return result;
+}
+
+static int pollCommits(int fd){
+  if(client->openFileIds.count(fd) == 0) return ERR_RETURN;
+  if(!client->networkRunning){
+    while(pumpEvents(false) && client->openFileIds.count(fd) != 0);
+  }
+  if(client->openFileIds.count(fd) == 0) return 0;
+  if(client->openFiles[fd]->failed) return ERR_RETURN;
+  return client->openFiles[fd]->pendingCommits.size();
+}
+
+int WaitCommits(int fd){
+  pthread_mutex_lock(&client->lock);
+  int result = client->openFileIds.count(fd) == 0 ? ERR_RETURN : waitCommits(fd);
+  pthread_mutex_unlock(&client->lock);
+  return result;
 }
 
 int performCommit(int fd,bool closeFlag){
-  if(openFileIds.count(fd) == 0) return ERR_RETURN;
+  if(startCommit(fd,closeFlag,NULL) == ERR_RETURN) return ERR_RETURN;
+  return waitCommits(fd);
+}
+
+/*
+ * Blocks until every commit in flight for fd has completed.
+ * Returns an error if any of them failed. A file closed by
+ * its final commit counts as success.
+ */
+int waitCommits(int fd){
+  if(client->openFileIds.count(fd) == 0) return OK_RETURN;
+  struct OpenFile* file = client->openFiles[fd];
+  while(file->pendingCommits.size() > 0){
+    if(!waitOnFile(file)) return OK_RETURN;
+  }
+  return file->failed ? ERR_RETURN : OK_RETURN;
+}
+
+/*
+ * Hands the writes staged for fd over to a new in-flight commit
+ * and sends out the commit request. The file moves on to the next
+ * commit number straight away so the caller can keep writing.
+ * Returns the number of the commit that was started.
+ */
+int startCommit(int fd, bool closeFlag, CommitCallback callback){
+  if(client->openFileIds.count(fd) == 0) return ERR_RETURN;
+  struct OpenFile* file = client->openFiles[fd];
+  while(!file->failed && file->pendingCommits.size() >= MAX_COMMITS_IN_FLIGHT){
+    if(!waitOnFile(file)) return ERR_RETURN;
+  }
+  if(file->failed) return ERR_RETURN;
+  flushBatch();
   LOG("Sending out a commit request for file %u\n",fd);
+  struct PendingCommit* commit = new struct PendingCommit;
+  commit->fileId = fd;
+  commit->commitNum = file->commitNum;
+  commit->finalWriteNum = file->writeNum;
+  commit->closeFlag = closeFlag;
+  commit->phase = COMMIT_PHASE_READY;
+  commit->remainingServers = file->servers;
+  commit->startedAt = monotonicUsec();
+  commit->committedAt = 0;
+  commit->staged = client->stagedWrites[fd];
+  commit->checksum = commitChecksum(commit->staged,commit->finalWriteNum);
+  client->stagedWrites[fd] = newStagedCommit();
+  commit->extents.swap(file->stagedExtents);
+  commit->callback = callback;
+  initializeServerTimes(commit->serverTimes,file->servers);
+  file->pendingCommits[commit->commitNum] = commit;
+  file->commitNum++;
+  file->writeNum = 0;
   CommitRequestPacket commitRequest;
   commitRequest.fileId = fd;
-  commitRequest.commitNum = openFiles[fd]->commitNum;
-  commitRequest.finalWriteNum = openFiles[fd]->writeNum;
-  //listen for responses
-  ReplfsEvent event;
-  ReplfsPacket incoming;
-  event.packet = &incoming;
-  //holds the last time we've seen the servers
-  std::map<uint32_t,struct timeval> serverTimes;
-  //holds a list of servers that have yet to ack
-  std::set<uint32_t> remainingServers = serverIds;
-  initializeServerTimes(serverTimes);
+  commitRequest.commitNum = commit->commitNum;
+  commitRequest.finalWriteNum = commit->finalWriteNum;
+  commitRequest.checksum = commit->checksum;
   sendPacket(&commitRequest,COMMIT_REQUEST);
-  LOG("Waiting for %zu servers to come to readiness...\n",remainingServers.size());
-  while(serversAlive(serverTimes) && remainingServers.size() > 0){
-    //resend the commit request
-    nextEvent(&event);
-    if(event.type == HEARTBEAT_EVENT){
-      sendPacket(&commitRequest,COMMIT_REQUEST);
-    }if(event.type == PACKET_EVENT && incoming.type == READY_TO_COMMIT){
-      ReadyToCommitPacket* rtcPacket = (ReadyToCommitPacket*) incoming.body;
-      if(rtcPacket->fileId == commitRequest.fileId && rtcPacket->commitNum == commitRequest.commitNum){
-        //if the server is ready to commit, we remove them from 
-        //the time tracking data structures
-        LOG("Server %u ready to commit. %zu remaining...\n",
-            rtcPacket->serverId,remainingServers.size());
-        remainingServers.erase(rtcPacket->serverId);
-        serverTimes.erase(rtcPacket->serverId);
-      }
-    }else if(event.type == PACKET_EVENT && incoming.type == WRITE_RESEND_REQUEST){
-      WriteResendRequestPacket* request = (WriteResendRequestPacket*) incoming.body;
-      //update the last seen time
-      struct timeval curTime;
-      gettimeofday(&curTime,NULL);
-      serverTimes[request->serverId] = curTime;
-      //resend the requested writes
-      resendWrites(request->fileId,request->commitNum,request->requestedWrites);
-    }
-  }
-  if(remainingServers.size() == 0){
-    LOG("Commit phase 1 completed. Finishing commit...\n");
-    return finishCommit(fd,commitRequest.commitNum,closeFlag);
-  }else{
-    LOG("Commit failed in phase 1.\n");
-    return ERR_RETURN;
+  trace(TRACE_COMMIT_REQUESTED,fd,commit->commitNum,commit->finalWriteNum);
+  //phase 1 has no overall limit, it lasts as long as the servers are alive
+  startRetransmit(&commit->retransmit,0);
+  client->commitTimers[commit->retransmit.timer] = commit;
+  LOG("Waiting for %zu servers to come to readiness...\n",commit->remainingServers.size());
+  return commit->commitNum;
+}
+
+static void startRetransmit(struct Retransmit* retransmit, uint64_t maxMsec){
+  retransmit->sentAt = monotonicUsec();
+  retransmit->deadline = maxMsec ? retransmit->sentAt + maxMsec * USEC_PER_MSEC : 0;
+  retransmit->rto = retransmitTimeout();
+  retransmit->resent = false;
+  retransmit->sampled = false;
+  retransmit->timer = setTimer(retransmit->rto);
+}
+
+/*
+ * Called when the retransmission timer fires. Returns false if the
+ * time limit has passed, otherwise backs off and re-arms the timer
+ * so the caller can resend.
+ */
+static bool nextRetransmit(struct Retransmit* retransmit){
+  uint64_t now = monotonicUsec();
+  if(retransmit->deadline != 0 && now >= retransmit->deadline) return false;
+  retransmit->rto *= 2;
+  if(retransmit->rto > MAX_RTO_USEC) retransmit->rto = MAX_RTO_USEC;
+  uint64_t delay = retransmit->rto;
+  if(retransmit->deadline != 0 && now + delay > retransmit->deadline){
+    delay = retransmit->deadline - now;
   }
+  retransmit->resent = true;
+  retransmit->timer = setTimer(delay);
+  return true;
+}
+
+/*
+ * Takes a round trip sample from the first ack. Acks that might
+ * be for a resend are ambiguous, so those are skipped (Karn).
+ */
+static void ackReceived(struct Retransmit* retransmit){
+  if(retransmit->sampled || retransmit->resent) return;
+  rttSample(monotonicUsec() - retransmit->sentAt);
+  retransmit->sampled = true;
+}
+
+static void stopRetransmit(struct Retransmit* retransmit){
+  cancelTimer(retransmit->timer);
 }
 
-void initializeServerTimes(std::map<uint32_t,struct timeval>& serverTimes){
-  struct timeval curTime;
-  gettimeofday(&curTime,NULL);
-  std::set<uint32_t>::iterator serverIdIt;
-  for(serverIdIt = serverIds.begin();serverIdIt != serverIds.end(); ++ serverIdIt){
+/*
+ * Drops any backoff and re-arms the timer from the current
+ * estimate, for when the other side is clearly making progress.
+ */
+static void restartRetransmit(struct Retransmit* retransmit){
+  cancelTimer(retransmit->timer);
+  retransmit->rto = retransmitTimeout();
+  retransmit->resent = true;
+  retransmit->timer = setTimer(retransmit->rto);
+}
+
+void initializeServerTimes(std::map<uint32_t,uint64_t>& serverTimes, const std::set<uint32_t>& servers){
+  uint64_t curTime = monotonicUsec();
+  std::set<uint32_t>::const_iterator serverIdIt;
+  for(serverIdIt = servers.begin();serverIdIt != servers.end(); ++ serverIdIt){
     serverTimes[*serverIdIt] = curTime;
   }
 }
 
-bool serversAlive(std::map<uint32_t,struct timeval>& serverTimes){
-  struct timeval curTime;
-  struct timeval serverTime;
-  gettimeofday(&curTime,NULL);
-  std::map<uint32_t,struct timeval>::iterator serverIt;
+/* Counts the servers that haven't been heard from for too long */
+size_t deadServers(std::map<uint32_t,uint64_t>& serverTimes){
+  uint64_t curTime = monotonicUsec();
+  size_t numDead = 0;
+  std::map<uint32_t,uint64_t>::iterator serverIt;
   for(serverIt = serverTimes.begin();serverIt != serverTimes.end(); ++serverIt){
-    serverTime = (*serverIt).second;
-    long usecs = (curTime.tv_sec - serverTime.tv_sec) * USEC_PER_SEC;
-    usecs += (curTime.tv_usec - serverTime.tv_usec);
-    if(usecs >= MAX_COMMIT_LATENCY_SEC * USEC_PER_SEC){
+    if(curTime - (*serverIt).second >= MAX_COMMIT_LATENCY_MSEC * USEC_PER_MSEC){
       LOG("Server %u died during commit phase 1.\n",(*serverIt).first);
-      return false;
+      numDead++;
     }
   }
-  return true;
+  return numDead;
+}
+
+/*
+ * The number of numServers servers each phase of a commit has to
+ * hear from. Nothing can be committed without at least one.
+ */
+static size_t quorumSize(size_t numServers){
+  size_t quorum = numServers;
+  if(client->commitQuorum == REPLFS_QUORUM_MAJORITY){
+    quorum = numServers / 2 + 1;
+  }else if(client->commitQuorum > 0 && (size_t) client->commitQuorum < numServers){
+    quorum = client->commitQuorum;
+  }
+  return quorum > 0 ? quorum : 1;
+}
+
+/* True once all but the quorum's worth of the file's servers have answered */
+static bool quorumReached(struct OpenFile* file, struct PendingCommit* commit){
+  return file->servers.size() - commit->remainingServers.size() >= quorumSize(file->servers.size());
+}
+
+int SetCommitQuorum(int quorum){
+  if(quorum < REPLFS_QUORUM_MAJORITY) return ERR_RETURN;
+  pthread_mutex_lock(&client->lock);
+  client->commitQuorum = quorum;
+  pthread_mutex_unlock(&client->lock);
+  return OK_RETURN;
+}
+
+/*
+ * Compression is used while it is wanted and every member announced
+ * it can take compressed batches. Whatever was gathered the old way
+ * is sent before switching.
+ */
+static void updateCompression(){
+  bool supported = client->serverIds.size() > 0;
+  std::set<uint32_t>::iterator it;
+  for(it = client->serverIds.begin(); it != client->serverIds.end(); ++it){
+    std::map<uint32_t,uint32_t>::iterator features = client->serverFeatures.find(*it);
+    if(features == client->serverFeatures.end() || !(features->second & FEATURE_COMPRESSED_BATCH)){
+      supported = false;
+    }
+  }
+  bool wasCompressing = client->compressing;
+  client->compressing = client->compressionWanted && supported;
+  if(client->compressing != wasCompressing){
+    flushBatch();
+    LOG("Compression %s\n",client->compressing ? "on" : "off");
+  }
+}
+
+int SetCompression(int enabled){
+  pthread_mutex_lock(&client->lock);
+  client->compressionWanted = enabled != 0;
+  updateCompression();
+  pthread_mutex_unlock(&client->lock);
+  return OK_RETURN;
+}
+
+int GetStats(char* buffer, int size){
+  if(size < 0) return ERR_RETURN;
+  //counted per thread, so there is nothing of the client's to lock
+  MetricSnapshot* snapshot = new MetricSnapshot;
+  metricsSnapshot(snapshot);
+  int length = metricsFormat(snapshot,buffer,size);
+  delete snapshot;
+  return length;
+}
+
+int DumpTrace(const char* path){
+  if(path == NULL) return ERR_RETURN;
+  return traceDump(path,0) == 0 ? OK_RETURN : ERR_RETURN;
 }
 
-void cleanupAfterCommit(uint32_t fileId, uint32_t commitNum);
+int GetNumServers(){
+  pthread_mutex_lock(&client->lock);
+  int numServers = client->serverIds.size();
+  pthread_mutex_unlock(&client->lock);
+  return numServers;
+}
+
+static void deleteFile(struct OpenFile* file){
+  pthread_cond_destroy(&file->changed);
+  delete file;
+}
 
+/* Forgets fd, leaving the file itself to any threads waiting on it */
 void closeFile(int fd){
   LOG("Closing file %u\n.",fd);
-  openFileIds.erase(fd);
-  delete openFiles[fd];
-  openFiles.erase(fd);
-  stagedWrites.erase(fd);
-}
-
-int finishCommit(uint32_t fd, uint32_t commitNum, bool closeFlag){
-  LOG("Sending commit packet\n");
-  CommitPacket commit;
-  commit.fileId = fd;
-  commit.commitNum = commitNum;
-  commit.closeFlag = closeFlag;
-  sendPacket(&commit,COMMIT);
+  struct OpenFile* file = client->openFiles[fd];
+  client->openFileIds.erase(fd);
+  client->openFiles.erase(fd);
+  freeStagedCommit(client->stagedWrites[fd]);
+  client->stagedWrites.erase(fd);
+  dropCachedBlocks(file,0,NO_BLOCK);
+  file->closed = true;
+  if(file->numWaiting == 0){
+    deleteFile(file);
+  }else{
+    pthread_cond_broadcast(&file->changed);
+  }
+}
+
+/*
+ * Waits for the network thread to report progress on file. Returns
+ * false if the file was closed meanwhile, after which it is gone.
+ */
+static bool waitOnFile(struct OpenFile* file){
+  file->numWaiting++;
+  waitForProgress(&file->changed);
+  file->numWaiting--;
+  if(!file->closed) return true;
+  if(file->numWaiting == 0) deleteFile(file);
+  return false;
+}
+
+/*
+ * Gives up the client's lock until wakeup is signalled. Without a
+ * network thread the caller handles the next event itself instead,
+ * and on the simulated network it runs the other nodes until this
+ * client has had its turn.
+ */
+static void waitForProgress(pthread_cond_t* wakeup){
+  if(client->networkRunning){
+    pthread_cond_wait(wakeup,&client->lock);
+  }else if(client->simNode >= 0){
+    struct ClientNode* self = client;
+    int node;
+    do{
+      node = netStep();
+      client = self;
+      netUseNode(self->simNode);
+      if(node < 0){
+        fprintf(stderr,"ReplFS: simulated client is waiting with nothing to wait for\n");
+        exit(-1);
+      }
+    }while(node != self->simNode);
+  }else{
+    pumpEvents(true);
+  }
+}
+
+static void addWaiter(struct Waiter* waiter, uint8_t ackType, uint32_t fileId, uint32_t commitNum){
+  waiter->ackType = ackType;
+  waiter->key = OperationKey(fileId,commitNum);
+  waiter->timerFired = false;
+  waiter->servers = NULL;
+  memset(&waiter->retransmit,0,sizeof(waiter->retransmit));
+  pthread_cond_init(&waiter->wakeup,NULL);
+  client->waiters[waiter->key] = waiter;
+}
+
+static void removeWaiter(struct Waiter* waiter){
+  client->waiterTimers.erase(waiter->retransmit.timer);
+  stopRetransmit(&waiter->retransmit);
+  client->waiters.erase(waiter->key);
+  pthread_cond_destroy(&waiter->wakeup);
+}
+
+/* Files an ack with whoever is waiting for it, if anyone still is */
+static void ackWaiter(uint8_t ackType, uint32_t fileId, uint32_t commitNum, uint32_t serverId){
+  std::map<OperationKey,struct Waiter*>::iterator it = client->waiters.find(OperationKey(fileId,commitNum));
+  if(it == client->waiters.end() || it->second->ackType != ackType) return;
+  struct Waiter* waiter = it->second;
+  ackReceived(&waiter->retransmit);
+  serverReplied(serverId,&waiter->retransmit);
+  waiter->ackedServers.insert(serverId);
+  client->laggingServers.erase(serverId);
+  LOG("Received ack of type 0x%x from server %u for file %u\n",ackType,serverId,fileId);
+  pthread_cond_signal(&waiter->wakeup);
+}
+
+/*
+ * Whether enough of servers have acked a request: a quorum of them,
+ * and every one that hasn't been left behind by an earlier commit.
+ */
+static bool requestAcked(const std::set<uint32_t>& servers, const std::set<uint32_t>& ackedServers){
+  size_t numAcked = 0;
+  std::set<uint32_t>::const_iterator it;
+  for(it = servers.begin(); it != servers.end(); ++it){
+    if(ackedServers.count(*it) != 0){
+      numAcked++;
+    }else if(client->laggingServers.count(*it) == 0){
+      return false;
+    }
+  }
+  return numAcked >= quorumSize(servers.size());
+}
+
+/*
+ * Sends request and waits for servers to ack it, resending whenever
+ * the retransmission timer fires. Servers that leave meanwhile are
+ * taken out of servers. Returns false if too few had acked once
+ * maxMsec had passed.
+ */
+static bool sendUntilAcked(void* request, uint8_t type, uint8_t ackType, uint32_t fileId,
+                           uint32_t commitNum, std::set<uint32_t>* servers, uint64_t maxMsec){
+  struct Waiter waiter;
+  addWaiter(&waiter,ackType,fileId,commitNum);
+  waiter.servers = servers;
+  sendPacket(request,type);
+  startRetransmit(&waiter.retransmit,maxMsec);
+  client->waiterTimers[waiter.retransmit.timer] = &waiter;
+  bool timedOut = false;
+  while(!timedOut && !requestAcked(*servers,waiter.ackedServers)){
+    waitForProgress(&waiter.wakeup);
+    if(waiter.timerFired){
+      waiter.timerFired = false;
+      timedOut = !nextRetransmit(&waiter.retransmit);
+      if(!timedOut){
+        LOG("Resending packet of type 0x%x for file %u\n",type,fileId);
+        sendPacket(request,type);
+        client->waiterTimers[waiter.retransmit.timer] = &waiter;
+      }
+    }
+  }
+  removeWaiter(&waiter);
+  return !timedOut;
+}
+
+static struct PendingCommit* findCommit(uint32_t fileId, uint32_t commitNum){
+  std::map<OperationKey,struct PendingCommit*>::iterator straggling = client->catchingUp.find(OperationKey(fileId,commitNum));
+  if(straggling != client->catchingUp.end()) return straggling->second;
+  if(client->openFileIds.count(fileId) == 0) return NULL;
+  std::map<uint32_t,struct PendingCommit*>& pending = client->openFiles[fileId]->pendingCommits;
+  std::map<uint32_t,struct PendingCommit*>::iterator it = pending.find(commitNum);
+  return it == pending.end() ? NULL : it->second;
+}
+
+/* Phase 1 is over; the commit waits its turn for the final COMMIT */
+static void commitReady(struct PendingCommit* commit){
+  client->commitTimers.erase(commit->retransmit.timer);
+  stopRetransmit(&commit->retransmit);
+  commit->phase = COMMIT_PHASE_QUEUED;
+  metricRecord(HISTOGRAM_COMMIT_PREPARE,monotonicUsec() - commit->startedAt);
+  trace(TRACE_COMMIT_READY,commit->fileId,commit->commitNum,0);
+}
+
+static void sendCommit(struct PendingCommit* commit){
+  CommitPacket packet;
+  packet.fileId = commit->fileId;
+  packet.commitNum = commit->commitNum;
+  packet.finalWriteNum = commit->finalWriteNum;
+  packet.checksum = commit->checksum;
+  packet.closeFlag = commit->closeFlag;
+  sendPacket(&packet,COMMIT);
+}
+
+/*
+ * Sends the final Commit for the oldest commit in flight once every
+ * server is ready for it. Servers apply commits in order, so later
+ * commits stay queued until the ones before them are acknowledged.
+ */
+static void advanceCommits(struct OpenFile* file){
+  if(file->pendingCommits.size() == 0) return;
+  struct PendingCommit* commit = file->pendingCommits.begin()->second;
+  if(commit->phase != COMMIT_PHASE_QUEUED) return;
+  LOG("Commit phase 1 completed. Finishing commit %u...\n",commit->commitNum);
+  commit->phase = COMMIT_PHASE_ACK;
+  commit->remainingServers = file->servers;
+  commit->committedAt = monotonicUsec();
+  sendCommit(commit);
+  trace(TRACE_COMMIT_SENT,commit->fileId,commit->commitNum,0);
+  startRetransmit(&commit->retransmit,MAX_COMMIT_MSEC);
+  client->commitTimers[commit->retransmit.timer] = commit;
   LOG("Waiting for commit acks\n");
-  int timeoutNum = 0;
+}
+
+static void freePendingCommit(struct PendingCommit* commit){
+  client->commitTimers.erase(commit->retransmit.timer);
+  stopRetransmit(&commit->retransmit);
+  freeStagedCommit(commit->staged);
+  delete commit;
+}
+
+static void finishCatchUp(struct PendingCommit* commit){
+  client->catchingUp.erase(OperationKey(commit->fileId,commit->commitNum));
+  std::map<uint32_t,struct OpenFile*>::iterator file = client->openFiles.find(commit->fileId);
+  if(file != client->openFiles.end()) pthread_cond_broadcast(&file->second->changed);
+  freePendingCommit(commit);
+}
+
+/*
+ * Leaves the servers still catching up with a commit behind. They
+ * won't be waited for again until they ack something newer.
+ */
+static void abandonCatchUp(struct PendingCommit* commit){
+  LOG("Leaving %zu servers behind at commit %u of file %u\n",
+      commit->remainingServers.size(),commit->commitNum,commit->fileId);
+  client->laggingServers.insert(commit->remainingServers.begin(),commit->remainingServers.end());
+  finishCatchUp(commit);
+}
+
+/*
+ * Keeps a commit the quorum has applied around for the servers that
+ * haven't, resending it in the background so they can ask for the
+ * writes they missed. Servers already left behind aren't waited for.
+ */
+static void startCatchUp(struct PendingCommit* commit){
+  std::set<uint32_t>::iterator lagging;
+  for(lagging = client->laggingServers.begin(); lagging != client->laggingServers.end(); ++lagging){
+    commit->remainingServers.erase(*lagging);
+  }
+  if(commit->remainingServers.size() == 0){
+    freePendingCommit(commit);
+    return;
+  }
+  if(client->catchingUp.size() >= MAX_CATCHUP_COMMITS) abandonCatchUp(client->catchingUp.begin()->second);
+  client->commitTimers.erase(commit->retransmit.timer);
+  stopRetransmit(&commit->retransmit);
+  commit->phase = COMMIT_PHASE_CATCHUP;
+  commit->callback = NULL;
+  commit->extents.clear();
+  client->catchingUp[OperationKey(commit->fileId,commit->commitNum)] = commit;
+  startRetransmit(&commit->retransmit,MAX_CATCHUP_MSEC);
+  client->commitTimers[commit->retransmit.timer] = commit;
+}
+
+static void completeCommit(struct OpenFile* file, struct PendingCommit* commit){
+  LOG("Commit successful! File:%u commit:%u\n",commit->fileId,commit->commitNum);
+  uint64_t now = monotonicUsec();
+  metricRecord(HISTOGRAM_COMMIT_APPLY,now - commit->committedAt);
+  metricRecord(HISTOGRAM_COMMIT,now - commit->startedAt);
+  metricAdd(METRIC_COMMITS,1);
+  trace(TRACE_COMMIT_DONE,commit->fileId,commit->commitNum,0);
+  file->pendingCommits.erase(commit->commitNum);
+  invalidateCache(file,commit->staged);
+  if(commit->callback) commit->callback(commit->fileId,commit->commitNum,OK_RETURN);
+  uint32_t fileId = commit->fileId;
+  bool closeFlag = commit->closeFlag;
+  startCatchUp(commit);
+  if(closeFlag){
+    closeFile(fileId);
+  }else{
+    advanceCommits(file);
+    pthread_cond_broadcast(&file->changed);
+  }
+}
+
+/*
+ * Fails the given commit and every commit started after it, since
+ * the servers can't apply a commit until its predecessors are done.
+ */
+static void failCommits(struct OpenFile* file, uint32_t commitNum){
+  LOG("Commit %u for file %u failed.\n",commitNum,file->fileId);
+  if(!file->failed || commitNum < file->failedCommitNum){
+    file->failedCommitNum = commitNum;
+  }
+  file->failed = true;
+  std::map<uint32_t,struct PendingCommit*>::iterator it = file->pendingCommits.lower_bound(commitNum);
+  while(it != file->pendingCommits.end()){
+    struct PendingCommit* commit = it->second;
+    file->pendingCommits.erase(it++);
+    metricAdd(METRIC_COMMITS_FAILED,1);
+    trace(TRACE_COMMIT_FAILED,commit->fileId,commit->commitNum,0);
+    if(commit->callback) commit->callback(commit->fileId,commit->commitNum,ERR_RETURN);
+    freePendingCommit(commit);
+  }
+  //some servers may have applied what failed, so nothing cached can be trusted
+  dropCachedBlocks(file,0,NO_BLOCK);
+  pthread_cond_broadcast(&file->changed);
+}
+
+/*
+ * Resends whatever an in-flight commit is waiting on. Phase 1 fails
+ * once too many servers have gone quiet for a quorum to be ready.
+ */
+static void handleCommitTimeout(struct PendingCommit* commit){
+  client->commitTimers.erase(commit->retransmit.timer);
+  if(commit->phase == COMMIT_PHASE_CATCHUP){
+    if(!nextRetransmit(&commit->retransmit)){
+      abandonCatchUp(commit);
+      return;
+    }
+    client->commitTimers[commit->retransmit.timer] = commit;
+    sendCommit(commit);
+    return;
+  }
+  struct OpenFile* file = client->openFiles[commit->fileId];
+  if(commit->phase == COMMIT_PHASE_READY){
+    size_t numServers = file->servers.size();
+    if(numServers - deadServers(commit->serverTimes) < quorumSize(numServers)){
+      LOG("Commit failed in phase 1.\n");
+      failCommits(file,commit->commitNum);
+      return;
+    }
+    nextRetransmit(&commit->retransmit);
+    client->commitTimers[commit->retransmit.timer] = commit;
+    CommitRequestPacket commitRequest;
+    commitRequest.fileId = commit->fileId;
+    commitRequest.commitNum = commit->commitNum;
+    commitRequest.finalWriteNum = commit->finalWriteNum;
+    commitRequest.checksum = commit->checksum;
+    sendPacket(&commitRequest,COMMIT_REQUEST);
+  }else if(commit->phase == COMMIT_PHASE_ACK){
+    if(!nextRetransmit(&commit->retransmit)){
+      LOG("Some servers did not ack commit. Commit failed.\n");
+      failCommits(file,commit->commitNum);
+      return;
+    }
+    client->commitTimers[commit->retransmit.timer] = commit;
+    LOG("Resending Commit packet for file %u\n",commit->fileId);
+    sendCommit(commit);
+  }
+}
+
+/* Tells the servers who the members are as of the current epoch */
+static void sendMembership(){
+  MembershipPacket packet;
+  packet.numMembers = 0;
+  std::set<uint32_t>::iterator it;
+  for(it = client->serverIds.begin(); it != client->serverIds.end(); ++it){
+    packet.memberIds[packet.numMembers++] = *it;
+  }
+  sendPacket(&packet,MEMBERSHIP);
+}
+
+/*
+ * Acks and replies from servers all start with the sender's id, and
+ * any of them shows that a member is still alive.
+ */
+static void heardFrom(ReplfsPacket* packet){
+  switch(packet->type){
+    case ROLL_CALL_ACK:
+    case OPEN_FILE_ACK:
+    case READY_TO_COMMIT:
+    case WRITE_RESEND_REQUEST:
+    case COMMIT_ACK:
+    case ABORT_ACK:
+    case READ_REPLY:
+    case JOIN:
+      break;
+    default:
+      return;
+  }
+  uint32_t serverId;
+  memcpy(&serverId,packet->body,sizeof(serverId));
+  std::map<uint32_t,uint64_t>::iterator it = client->lastHeard.find(serverId);
+  if(it != client->lastHeard.end()) it->second = monotonicUsec();
+}
+
+/*
+ * Lets a server in. It takes part in files opened from now on, and
+ * copies the ones already open from the other servers by itself
+ * once their acks for a later commit show it is behind.
+ */
+static void admitServer(uint32_t serverId, uint32_t features){
+  if(client->serverIds.size() >= MAX_MEMBERS){
+    LOG("Already %zu members, not letting server %u in\n",client->serverIds.size(),serverId);
+    return;
+  }
+  client->serverIds.insert(serverId);
+  client->serverFeatures[serverId] = features;
+  client->lastHeard[serverId] = monotonicUsec();
+  setEpoch(++client->membershipEpoch);
+  LOG("Server %u joined, membership epoch %u\n",serverId,client->membershipEpoch);
+  sendMembership();
+  updateCompression();
+}
+
+/*
+ * Moves a file's commits on once the servers they were waiting
+ * for have gone. Only the oldest commit can be completed.
+ */
+static void recheckCommits(struct OpenFile* file){
+  std::map<uint32_t,struct PendingCommit*>::iterator it;
+  for(it = file->pendingCommits.begin(); it != file->pendingCommits.end(); ++it){
+    struct PendingCommit* commit = it->second;
+    if(commit->phase == COMMIT_PHASE_READY && quorumReached(file,commit)) commitReady(commit);
+  }
+  advanceCommits(file);
+  if(file->pendingCommits.size() == 0) return;
+  struct PendingCommit* oldest = file->pendingCommits.begin()->second;
+  if(oldest->phase == COMMIT_PHASE_ACK && quorumReached(file,oldest)){
+    completeCommit(file,oldest);
+  }
+}
+
+/*
+ * Forgets a server that left or went quiet for too long. Nothing
+ * waits for it from now on, so whatever was only waiting on it
+ * goes ahead.
+ */
+static void removeServer(uint32_t serverId){
+  client->serverIds.erase(serverId);
+  client->lastHeard.erase(serverId);
+  client->laggingServers.erase(serverId);
+  client->serverLatency.erase(serverId);
+  client->serverFeatures.erase(serverId);
+  setEpoch(++client->membershipEpoch);
+  LOG("Server %u left, membership epoch %u\n",serverId,client->membershipEpoch);
+  std::map<OperationKey,struct Waiter*>::iterator waiter;
+  for(waiter = client->waiters.begin(); waiter != client->waiters.end(); ++waiter){
+    if(waiter->second->servers) waiter->second->servers->erase(serverId);
+    pthread_cond_signal(&waiter->second->wakeup);
+  }
+  std::map<OperationKey,struct PendingCommit*>::iterator straggling = client->catchingUp.begin();
+  while(straggling != client->catchingUp.end()){
+    struct PendingCommit* commit = (straggling++)->second;
+    commit->remainingServers.erase(serverId);
+    if(commit->remainingServers.size() == 0) finishCatchUp(commit);
+  }
+  //completing a commit may close its file
+  std::vector<uint32_t> fileIds(client->openFileIds.begin(),client->openFileIds.end());
+  for(size_t i = 0; i < fileIds.size(); i++){
+    if(client->openFileIds.count(fileIds[i]) == 0) continue;
+    struct OpenFile* file = client->openFiles[fileIds[i]];
+    file->servers.erase(serverId);
+    std::map<uint32_t,struct PendingCommit*>::iterator it;
+    for(it = file->pendingCommits.begin(); it != file->pendingCommits.end(); ++it){
+      it->second->remainingServers.erase(serverId);
+      it->second->serverTimes.erase(serverId);
+    }
+    recheckCommits(file);
+  }
+  sendMembership();
+  updateCompression();
+}
+
+/*
+ * Runs every MEMBER_PROBE_MSEC. Any packet from a server shows it is
+ * alive, so members are only probed once one of them has gone quiet,
+ * and one that stays quiet is taken to have left.
+ */
+static void checkMembers(){
+  uint64_t now = monotonicUsec();
+  std::vector<uint32_t> quiet;
+  bool probe = false;
+  std::map<uint32_t,uint64_t>::iterator it;
+  for(it = client->lastHeard.begin(); it != client->lastHeard.end(); ++it){
+    if(now - it->second >= MEMBER_TIMEOUT_MSEC * USEC_PER_MSEC){
+      quiet.push_back(it->first);
+    }else if(now - it->second >= MEMBER_PROBE_MSEC * USEC_PER_MSEC){
+      probe = true;
+    }
+  }
+  for(size_t i = 0; i < quiet.size(); i++){
+    LOG("Server %u has gone quiet\n",quiet[i]);
+    removeServer(quiet[i]);
+  }
+  if(probe && quiet.size() == 0) sendMembership();
+  client->membershipTimer = setTimer(MEMBER_PROBE_MSEC * USEC_PER_MSEC);
+}
+
+/*
+ * Handles one event in the calling thread, for when there is no
+ * network thread. Returns false if block is false and nothing was
+ * waiting.
+ */
+static bool pumpEvents(bool block){
   ReplfsEvent event;
   ReplfsPacket incoming;
   event.packet = &incoming;
-  std::set<uint32_t> remainingServers = serverIds;
-  while(timeoutNum < MAX_TIMEOUTS_PER_COMMIT && remainingServers.size() >0){
+  if(block){
     nextEvent(&event);
-    if(event.type == HEARTBEAT_EVENT){
-      timeoutNum++;
-      LOG("Resending Commit packet for file %u\n",commit.fileId);
-      sendPacket(&commit,COMMIT);
-    }else if(event.type == PACKET_EVENT && incoming.type == COMMIT_ACK){
-      CommitAckPacket* commitAck = (CommitAckPacket*) &incoming.body;
-      if(commitAck->fileId == commit.fileId && commitAck->commitNum == commit.commitNum){
-        remainingServers.erase(commitAck->serverId);
-        LOG("Received CommitAck from server %u\n",commitAck->serverId);
-      }
-    }
-  }
-  if(remainingServers.size() == 0){
-    LOG("Commit successful!\n");
-    cleanupAfterCommit(fd,commitNum);
-    if(closeFlag) closeFile(fd);
-    return OK_RETURN;
-  }else{
-    LOG("Some servers did not ack commit. Commit failed.\n");
-    return ERR_RETURN;
+  }else if(!pollEvent(&event)){
+    return false;
   }
+  handleEvent(&event);
+  return true;
 }
 
-void cleanupAfterCommit(uint32_t fileId, uint32_t commitNum){
-  LOG("Cleaning up after commit. File:%u commit:%u\n",fileId,commitNum);
-  std::vector<WriteBlockPacket*>::iterator it;
-  for(it = stagedWrites[fileId].begin(); it != stagedWrites[fileId].end(); it++){
-    free(*it);
+/*
+ * Drives the in-flight commits and waiting threads forward by one
+ * event, handing each ack to whatever it is for by fileId and
+ * commitNum.
+ */
+static void handleEvent(ReplfsEvent* event){
+  ReplfsPacket& incoming = *event->packet;
+  if(event->type == PACKET_EVENT) heardFrom(&incoming);
+  if(event->type == TIMER_EVENT){
+    if(event->timer == client->membershipTimer) checkMembers();
+    std::map<TimerId,struct PendingCommit*>::iterator it = client->commitTimers.find(event->timer);
+    if(it != client->commitTimers.end()) handleCommitTimeout(it->second);
+    std::map<TimerId,struct Waiter*>::iterator waiter = client->waiterTimers.find(event->timer);
+    if(waiter != client->waiterTimers.end()){
+      waiter->second->timerFired = true;
+      pthread_cond_signal(&waiter->second->wakeup);
+      client->waiterTimers.erase(waiter);
+    }
+    std::map<TimerId,struct PendingRead*>::iterator read = client->readTimers.find(event->timer);
+    if(read != client->readTimers.end()){
+      read->second->timerFired = true;
+      wakeReader(read->second);
+      client->readTimers.erase(read);
+    }
+  }else if(incoming.type == READ_REPLY){
+    handleReadReply((ReadReplyPacket*) incoming.body);
+  }else if(incoming.type == JOIN && client->membershipEpoch != 0){
+    MemberPacket* join = (MemberPacket*) incoming.body;
+    if(client->serverIds.count(join->serverId) == 0){
+      admitServer(join->serverId,join->features);
+    }else if(incoming.epoch != client->membershipEpoch){
+      //a member that missed the latest list
+      sendMembership();
+    }
+  }else if(incoming.type == LEAVE && client->membershipEpoch != 0){
+    MemberPacket* leave = (MemberPacket*) incoming.body;
+    if(client->serverIds.count(leave->serverId) != 0) removeServer(leave->serverId);
+  }else if(incoming.type == ROLL_CALL_ACK){
+    RollCallAckPacket* rollCallAck = (RollCallAckPacket*) incoming.body;
+    client->serverFeatures[rollCallAck->proposedId] = rollCallAck->features;
+    ackWaiter(ROLL_CALL_ACK,0,NO_COMMIT,rollCallAck->proposedId);
+  }else if(incoming.type == OPEN_FILE_ACK){
+    OpenFileAckPacket* openFileAck = (OpenFileAckPacket*) incoming.body;
+    ackWaiter(OPEN_FILE_ACK,openFileAck->fileId,NO_COMMIT,openFileAck->serverId);
+  }else if(incoming.type == ABORT_ACK){
+    AbortAckPacket* abortAck = (AbortAckPacket*) incoming.body;
+    ackWaiter(ABORT_ACK,abortAck->fileId,abortAck->commitNum,abortAck->serverId);
+  }else if(incoming.type == READY_TO_COMMIT){
+    ReadyToCommitPacket* rtcPacket = (ReadyToCommitPacket*) incoming.body;
+    struct PendingCommit* commit = findCommit(rtcPacket->fileId,rtcPacket->commitNum);
+    if(commit != NULL && rtcPacket->checksum != commit->checksum){
+      //the server checks before it claims to be ready, so it has diverged somehow
+      LOG("Server %u staged commit %u of file %u differently, not counting it as ready\n",
+          rtcPacket->serverId,rtcPacket->commitNum,rtcPacket->fileId);
+    }else if(commit != NULL && commit->phase == COMMIT_PHASE_READY){
+      //if the server is ready to commit, we remove them from
+      //the time tracking data structures
+      commit->remainingServers.erase(rtcPacket->serverId);
+      commit->serverTimes.erase(rtcPacket->serverId);
+      trace(TRACE_SERVER_READY,commit->fileId,commit->commitNum,rtcPacket->serverId);
+      if(quorumReached(client->openFiles[commit->fileId],commit)){
+        commitReady(commit);
+        advanceCommits(client->openFiles[commit->fileId]);
+      }
+    }
+  }else if(incoming.type == WRITE_RESEND_REQUEST){
+    WriteResendRequestPacket* request = (WriteResendRequestPacket*) incoming.body;
+    struct PendingCommit* commit = findCommit(request->fileId,request->commitNum);
+    if(commit != NULL && commit->phase == COMMIT_PHASE_READY){
+      //update the last seen time
+      commit->serverTimes[request->serverId] = monotonicUsec();
+      client->commitTimers.erase(commit->retransmit.timer);
+      restartRetransmit(&commit->retransmit);
+      client->commitTimers[commit->retransmit.timer] = commit;
+    }
+    //servers left out of the quorum ask for writes in later phases too
+    if(commit != NULL) resendWrites(commit,request);
+  }else if(incoming.type == COMMIT_ACK){
+    CommitAckPacket* commitAck = (CommitAckPacket*) incoming.body;
+    struct PendingCommit* commit = findCommit(commitAck->fileId,commitAck->commitNum);
+    if(commit != NULL && commit->phase == COMMIT_PHASE_ACK){
+      ackReceived(&commit->retransmit);
+      serverReplied(commitAck->serverId,&commit->retransmit);
+      commit->remainingServers.erase(commitAck->serverId);
+      client->laggingServers.erase(commitAck->serverId);
+      trace(TRACE_SERVER_ACKED,commit->fileId,commit->commitNum,commitAck->serverId);
+      if(quorumReached(client->openFiles[commit->fileId],commit)){
+        completeCommit(client->openFiles[commit->fileId],commit);
+      }
+    }else if(commit != NULL && commit->phase == COMMIT_PHASE_CATCHUP){
+      commit->remainingServers.erase(commitAck->serverId);
+      client->laggingServers.erase(commitAck->serverId);
+      if(commit->remainingServers.size() == 0) finishCatchUp(commit);
+    }
   }
-  stagedWrites[fileId].clear();
-  openFiles[fileId]->commitNum++;
-  openFiles[fileId]->writeNum = 0;
 }
 
-void resendWrites(uint32_t fileId, uint32_t commitNum, uint8_t reqWrites[16]){
-  std::vector<WriteBlockPacket*>::iterator it;
-  for(it = stagedWrites[fileId].begin(); it!= stagedWrites[fileId].end(); ++it){
-    WriteBlockPacket* write = (*it);
-    void* address = ((unsigned int*) reqWrites) + (write->writeNum / WORD_SIZE_BITS);
-    if(*(unsigned int*)address & (1 << (write->writeNum % WORD_SIZE_BITS))){
-      LOG("Resending write %u for file %u commit %u\n",
-          write->writeNum,fileId,commitNum);
-      sendPacket(write,WRITE_BLOCK);
+/*
+ * A commit's writes are numbered from 1 in the order they were
+ * made, so each requested write is found by its position.
+ */
+void resendWrites(struct PendingCommit* commit, WriteResendRequestPacket* request){
+  //the resent batches go out together
+  corkSends();
+  for(int i = 0; i < request->numRanges; i++){
+    WriteRange* range = &request->ranges[i];
+    LOG("Resending writes %u-%u for file %u commit %u\n",range->first,
+        range->first + range->count - 1,commit->fileId,commit->commitNum);
+    for(uint32_t writeNum = range->first; writeNum - range->first < range->count; writeNum++){
+      if(writeNum == 0 || writeNum > commit->staged->writes.size()) break;
+      batchWrite(commit->fileId,commit->commitNum,&commit->staged->writes[writeNum - 1]);
+      metricAdd(METRIC_WRITES_RESENT,1);
+      trace(TRACE_WRITE_RESENT,commit->fileId,commit->commitNum,writeNum);
     }
   }
+  flushBatch();
+  uncorkSends();
 }
 
 int performAbort(int fd, bool closeFlag);
 
 int Abort(int fd){
-  return performAbort(fd,false);
+  pthread_mutex_lock(&client->lock);
+  int result = performAbort(fd,false);
+  pthread_mutex_unlock(&client->lock);
+  return result;
 }
 
+/*
+ * Throws away everything staged for fd. Commits already in flight
+ * are allowed to finish first; if one of them failed, the abort
+ * starts from the failed commit so the servers drop it and every
+ * commit staged after it.
+ */
 int performAbort(int fd, bool closeFlag){
-  if(openFileIds.count(fd) == 0) return ERR_RETURN;
-  cleanupAfterCommit(fd,openFiles[fd]->commitNum);
+  if(client->openFileIds.count(fd) == 0) return ERR_RETURN;
+  waitCommits(fd);
+  if(client->openFileIds.count(fd) == 0) return ERR_RETURN;
+  struct OpenFile* file = client->openFiles[fd];
+  //stragglers must have applied every earlier commit before dropping the rest
+  std::map<OperationKey,struct PendingCommit*>::iterator straggling =
+    client->catchingUp.lower_bound(OperationKey(fd,0));
+  while(straggling != client->catchingUp.end() && straggling->first.first == (uint32_t) fd){
+    if(!waitOnFile(file)) return ERR_RETURN;
+    straggling = client->catchingUp.lower_bound(OperationKey(fd,0));
+  }
   AbortPacket abort;
   abort.fileId = fd;
-  abort.commitNum = openFiles[fd]->commitNum-1;
+  abort.commitNum = file->failed ? file->failedCommitNum : file->commitNum;
   abort.closeFlag = closeFlag;
-  sendPacket(&abort,ABORT);
-  //wait for acknowledgements
-  int timeoutNum = 0;
-  ReplfsEvent event;
-  ReplfsPacket incoming;
-  event.packet = &incoming;
-  std::set<uint32_t> remainingServers = serverIds;
-  while(timeoutNum < MAX_TIMEOUTS_PER_ABORT && remainingServers.size() >0){
-    nextEvent(&event);
-    if(event.type == HEARTBEAT_EVENT){
-      timeoutNum++;
-      LOG("Resending Abort packet for file %u\n",abort.fileId);
-      sendPacket(&abort,ABORT);
-    }else if(event.type == PACKET_EVENT && incoming.type == ABORT_ACK){
-      AbortAckPacket* abortAck = (AbortAckPacket*) incoming.body;
-      if(abortAck->fileId == abort.fileId && abortAck->commitNum == abort.commitNum){
-        remainingServers.erase(abortAck->serverId);
-        LOG("Received Abort Ack from server %u. %zu remaining.\n",
-            abortAck->serverId,remainingServers.size());
-      }
-    }
+  arenaRelease(&client->stagedWrites[fd]->arena);
+  client->stagedWrites[fd]->writes.clear();
+  file->stagedExtents.clear();
+  if(client->outgoingBatch.fileId == (uint32_t) fd){
+    client->outgoingBatch.numWrites = 0;
+    client->outgoingBatchSize = 0;
+  }
+  if(client->compressingBatch.fileId == (uint32_t) fd){
+    client->compressingBatch.numWrites = 0;
+    client->compressingBatch.dataSize = 0;
   }
+  file->commitNum = abort.commitNum + 1;
+  file->writeNum = 0;
+  file->failed = false;
+  //a copy, since the file may be closed while we wait
+  std::set<uint32_t> servers = file->servers;
+  sendUntilAcked(&abort,ABORT,ABORT_ACK,abort.fileId,abort.commitNum,&servers,MAX_ABORT_MSEC);
+  //another thread may have closed it while we waited
+  if(closeFlag && client->openFileIds.count(fd) != 0) closeFile(fd);
   return OK_RETURN;
 }
 
 int CloseFile(int fd){
-  if(stagedWrites[fd].size() != 0){
+  pthread_mutex_lock(&client->lock);
+  int result = performClose(fd);
+  pthread_mutex_unlock(&client->lock);
+  return result;
+}
+
+static int performClose(int fd){
+  if(client->openFileIds.count(fd) == 0) return ERR_RETURN;
+  waitCommits(fd);
+  if(client->openFileIds.count(fd) == 0) return ERR_RETURN;
+  if(!client->openFiles[fd]->failed && client->stagedWrites[fd]->writes.size() != 0){
     return performCommit(fd,true);
   }else{
     return performAbort(fd,true);
   }
 }
+
+int ReadBlock(int fd, char *buffer, int byteOffset, int blockSize){
+  pthread_mutex_lock(&client->lock);
+  int result = readBlock(fd,buffer,byteOffset,blockSize);
+  pthread_mutex_unlock(&client->lock);
+  return result;
+}
+
+/* Every commit before this one has been applied by a quorum of servers, or aborted */
+static uint32_t appliedCommitNum(struct OpenFile* file){
+  if(file->pendingCommits.size() == 0) return file->commitNum;
+  return file->pendingCommits.begin()->first;
+}
+
+/* Folds in how long a server took to answer, unless it was asked more than once */
+static void serverReplied(uint32_t serverId, struct Retransmit* retransmit){
+  if(retransmit->resent) return;
+  uint64_t sample = monotonicUsec() - retransmit->sentAt;
+  std::map<uint32_t,uint64_t>::iterator it = client->serverLatency.find(serverId);
+  if(it == client->serverLatency.end()){
+    client->serverLatency[serverId] = sample;
+  }else{
+    it->second = (7 * it->second + sample) / 8;
+  }
+}
+
+/*
+ * The file's server that has been answering fastest, for requests
+ * only one needs to see. There may be none left, in which case the
+ * request goes unanswered.
+ */
+static uint32_t fastestServer(struct OpenFile* file){
+  if(file->servers.size() == 0) return 0;
+  uint32_t fastest = *file->servers.begin();
+  uint64_t fastestLatency = UINT64_MAX;
+  std::set<uint32_t>::iterator it;
+  for(it = file->servers.begin(); it != file->servers.end(); ++it){
+    if(client->laggingServers.count(*it) != 0) continue;
+    std::map<uint32_t,uint64_t>::iterator latency = client->serverLatency.find(*it);
+    uint64_t estimate = latency == client->serverLatency.end() ? 0 : latency->second;
+    if(estimate < fastestLatency){
+      fastest = *it;
+      fastestLatency = estimate;
+    }
+  }
+  return fastest;
+}
+
+/* Forgets the cached blocks from first to last, inclusive */
+static void dropCachedBlocks(struct OpenFile* file, uint32_t first, uint32_t last){
+  std::map<uint32_t,struct CachedBlock*>::iterator it = file->cache.lower_bound(first);
+  while(it != file->cache.end() && it->first <= last){
+    if(it->first == file->endBlock) file->endBlock = NO_BLOCK;
+    delete it->second;
+    file->cache.erase(it++);
+  }
+}
+
+/*
+ * Drops the blocks a newly applied commit wrote to, and the block
+ * the file ended in if the commit made it any longer.
+ */
+static void invalidateCache(struct OpenFile* file, const StagedCommit* staged){
+  if(file->cache.size() == 0) return;
+  std::vector<StagedWrite>::const_iterator it;
+  for(it = staged->writes.begin(); it != staged->writes.end(); ++it){
+    if(it->blockSize == 0) continue;
+    uint64_t end = (uint64_t) it->byteOffset + it->blockSize;
+    dropCachedBlocks(file,it->byteOffset / READ_BLOCK_SIZE,(end - 1) / READ_BLOCK_SIZE);
+    if(file->endBlock != NO_BLOCK &&
+       end > (uint64_t) file->endBlock * READ_BLOCK_SIZE + file->cache[file->endBlock]->length){
+      dropCachedBlocks(file,file->endBlock,file->endBlock);
+    }
+  }
+}
+
+/*
+ * Keeps a block read from a server. When the cache is full the
+ * block at the lowest offset makes way.
+ */
+static void cacheBlock(struct OpenFile* file, uint32_t index, const struct CachedBlock* block){
+  dropCachedBlocks(file,index,index);
+  if(file->cache.size() >= MAX_CACHED_BLOCKS) dropCachedBlocks(file,0,file->cache.begin()->first);
+  if(block->length < READ_BLOCK_SIZE){
+    //the file can only end in one place
+    if(file->endBlock != NO_BLOCK) dropCachedBlocks(file,file->endBlock,file->endBlock);
+    file->endBlock = index;
+  }
+  struct CachedBlock* cached = new struct CachedBlock;
+  memcpy(cached,block,sizeof(*cached));
+  file->cache[index] = cached;
+}
+
+static void wakeReader(struct PendingRead* read){
+  std::map<uint32_t,struct OpenFile*>::iterator file = client->openFiles.find(read->request.fileId);
+  if(file != client->openFiles.end()) pthread_cond_broadcast(&file->second->changed);
+}
+
+/*
+ * Hands a block to the read waiting for it. The block is cached
+ * if it holds every commit the client has seen applied, since any
+ * commit applied from then on will clear it again.
+ */
+static void handleReadReply(ReadReplyPacket* reply){
+  std::map<uint32_t,struct PendingRead*>::iterator it = client->pendingReads.find(reply->requestId);
+  if(it == client->pendingReads.end()) return;
+  struct PendingRead* read = it->second;
+  if(read->done || reply->fileId != read->request.fileId || reply->serverId != read->request.serverId){
+    return;
+  }
+  serverReplied(reply->serverId,&read->retransmit);
+  read->done = true;
+  read->status = reply->status;
+  read->block.length = reply->length;
+  memcpy(read->block.data,reply->data,reply->length);
+  std::map<uint32_t,struct OpenFile*>::iterator file = client->openFiles.find(reply->fileId);
+  if(file != client->openFiles.end() && reply->status == READ_OK &&
+     reply->commitNum >= appliedCommitNum(file->second)){
+    cacheBlock(file->second,reply->byteOffset / READ_BLOCK_SIZE,&read->block);
+  }
+  wakeReader(read);
+}
+
+static void sendRead(struct OpenFile* file, struct PendingRead* read){
+  read->request.serverId = fastestServer(file);
+  sendPacket(&read->request,READ_REQUEST);
+}
+
+static void finishRead(struct PendingRead* read){
+  client->readTimers.erase(read->retransmit.timer);
+  stopRetransmit(&read->retransmit);
+  client->pendingReads.erase(read->request.requestId);
+}
+
+/*
+ * Fills in reads with each of count blocks from first on, asking
+ * for those that aren't cached and waiting for them all. A server
+ * that doesn't answer in time is made to look slower, so the resend
+ * goes to the next fastest. Returns false if any read failed.
+ */
+static bool fetchBlocks(struct OpenFile* file, uint32_t first, uint32_t count, struct PendingRead* reads){
+  uint32_t numWaiting = 0;
+  corkSends();
+  for(uint32_t i = 0; i < count; i++){
+    struct PendingRead* read = &reads[i];
+    std::map<uint32_t,struct CachedBlock*>::iterator cached = file->cache.find(first + i);
+    read->done = cached != file->cache.end();
+    read->status = READ_OK;
+    read->request.requestId = 0;
+    if(read->done){
+      //copied, since the cache may change while we wait for the rest
+      memcpy(&read->block,cached->second,sizeof(read->block));
+      continue;
+    }
+    read->request.fileId = file->fileId;
+    read->request.requestId = client->nextRequestId++;
+    read->request.commitNum = appliedCommitNum(file);
+    read->request.byteOffset = (first + i) * READ_BLOCK_SIZE;
+    read->request.length = READ_BLOCK_SIZE;
+    read->timerFired = false;
+    client->pendingReads[read->request.requestId] = read;
+    sendRead(file,read);
+    startRetransmit(&read->retransmit,MAX_READ_MSEC);
+    client->readTimers[read->retransmit.timer] = read;
+    numWaiting++;
+  }
+  uncorkSends();
+  bool failed = false;
+  bool closed = false;
+  while(numWaiting > 0 && !failed){
+    if(!waitOnFile(file)){
+      closed = true;
+      break;
+    }
+    numWaiting = 0;
+    for(uint32_t i = 0; i < count && !failed; i++){
+      struct PendingRead* read = &reads[i];
+      if(read->done){
+        failed = read->status != READ_OK;
+        continue;
+      }
+      numWaiting++;
+      if(!read->timerFired) continue;
+      read->timerFired = false;
+      client->serverLatency[read->request.serverId] += read->retransmit.rto;
+      if(!nextRetransmit(&read->retransmit)){
+        LOG("No server answered read of file %u at %u\n",file->fileId,read->request.byteOffset);
+        failed = true;
+        break;
+      }
+      client->readTimers[read->retransmit.timer] = read;
+      sendRead(file,read);
+    }
+  }
+  for(uint32_t i = 0; i < count; i++){
+    if(reads[i].request.requestId != 0) finishRead(&reads[i]);
+  }
+  return !failed && !closed;
+}
+
+/*
+ * Reads committed data into buffer, returning how many bytes there
+ * were. Reads go to one server rather than all of them, a block at
+ * a time, and blocks read once are served from the cache until a
+ * commit writes over them.
+ */
+static int readCommitted(struct OpenFile* file, char* buffer, int byteOffset, int blockSize){
+  uint32_t first = byteOffset / READ_BLOCK_SIZE;
+  uint32_t last = ((uint64_t) byteOffset + blockSize - 1) / READ_BLOCK_SIZE;
+  uint64_t end = (uint64_t) byteOffset + blockSize;
+  int numRead = 0;
+  struct PendingRead reads[READ_WINDOW];
+  for(uint32_t window = first; window <= last; window += READ_WINDOW){
+    uint32_t count = last - window + 1 < READ_WINDOW ? last - window + 1 : READ_WINDOW;
+    if(!fetchBlocks(file,window,count,reads)) return ERR_RETURN;
+    for(uint32_t i = 0; i < count; i++){
+      const struct CachedBlock* block = &reads[i].block;
+      uint64_t blockStart = (uint64_t) (window + i) * READ_BLOCK_SIZE;
+      uint64_t from = blockStart > (uint64_t) byteOffset ? blockStart : byteOffset;
+      uint64_t to = blockStart + block->length < end ? blockStart + block->length : end;
+      if(to > from){
+        memcpy(buffer + (from - byteOffset),block->data + (from - blockStart),to - from);
+        numRead += to - from;
+      }
+      if(block->length < READ_BLOCK_SIZE) return numRead;
+    }
+  }
+  return numRead;
+}
+
+/*
+ * The caller's own writes are seen as soon as they are made: the
+ * commits still in flight are laid over the committed data, oldest
+ * first, then whatever is staged. Servers may already have applied
+ * some of those commits, but laying them down again in order gives
+ * the same bytes. Writes past the end of the file make it longer,
+ * with any gap reading as zeros.
+ */
+static int readBlock(int fd, char* buffer, int byteOffset, int blockSize){
+  if(client->openFileIds.count(fd) == 0 || byteOffset < 0 || blockSize < 0 ||
+     (buffer == NULL && blockSize > 0)){
+    return ERR_RETURN;
+  }
+  struct OpenFile* file = client->openFiles[fd];
+  if(file->failed || file->servers.size() == 0) return ERR_RETURN;
+  if(blockSize == 0) return 0;
+  int numRead;
+  uint32_t applied;
+  do{
+    applied = appliedCommitNum(file);
+    numRead = readCommitted(file,buffer,byteOffset,blockSize);
+    if(numRead == ERR_RETURN || file->failed) return ERR_RETURN;
+    //a commit that completed meanwhile is no longer laid over what was
+    //read, and the servers it was read from may not have had it yet
+  }while(appliedCommitNum(file) != applied);
+  if(file->pendingCommits.size() == 0 && file->stagedExtents.size() == 0) return numRead;
+  memset(buffer + numRead,0,blockSize - numRead);
+  uint64_t end = (uint64_t) byteOffset + numRead;
+  std::map<uint32_t,struct PendingCommit*>::iterator it;
+  for(it = file->pendingCommits.begin(); it != file->pendingCommits.end(); ++it){
+    extentsRead(&it->second->extents,byteOffset,blockSize,(uint8_t*) buffer);
+    end = std::max(end,extentsEnd(&it->second->extents));
+  }
+  extentsRead(&file->stagedExtents,byteOffset,blockSize,(uint8_t*) buffer);
+  end = std::max(end,extentsEnd(&file->stagedExtents));
+  end = std::min(end,(uint64_t) byteOffset + blockSize);
+  return end > (uint64_t) byteOffset ? end - byteOffset : 0;
+}
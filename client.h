@@ -4,16 +4,114 @@
 extern "C" {
 #endif
 
+/*
+ * InitReplFs starts a network thread that handles every packet and
+ * timer for the library, so any number of application threads may
+ * call into it at once, for instance each driving its own file. A
+ * thread waiting on the servers blocks only itself.
+ */
 extern int InitReplFs(unsigned short portNum, int packetLoss, int numServers);
 
+/*
+ * For running clients on the simulated network (see netSimulate in
+ * replfs_net.h), any number to a process and all on one thread, in
+ * place of InitReplFs. InitSimReplFs adds a client as a node on
+ * portNum, does its roll call and returns the client's number, or
+ * -1. There is no network thread: a call that waits for the servers
+ * runs the simulation with netStep until the client has had its
+ * turn. Calls act as the client last added or made current with
+ * UseSimClient.
+ */
+extern int InitSimReplFs(unsigned short portNum, int numServers);
+extern void UseSimClient(int client);
+
+/*
+ * InitReplFs's roll call has to find exactly numServers servers, but
+ * the membership changes as the client runs. A server started later
+ * joins by itself and takes part in the files opened from then on,
+ * copying the ones already open from the others. A server that stops,
+ * or goes quiet for a few seconds, is dropped and no longer waited
+ * for. GetNumServers returns how many servers are members right now.
+ */
+extern int GetNumServers(void);
+
 extern int OpenFile(char *name);
 
 extern int WriteBlock(int fd, char *buffer, int byteOffset, int blockSize);
 
+/*
+ * Reads up to blockSize bytes of fd from byteOffset into buffer.
+ * Returns the number of bytes read, fewer if the file ends first,
+ * or -1. Writes made through fd are seen straight away, whether
+ * they are staged or their commit is still in flight. Only one
+ * server is asked, whichever has been answering fastest, and
+ * blocks are cached until a commit writes over them.
+ */
+extern int ReadBlock(int fd, char *buffer, int byteOffset, int blockSize);
+
 extern int Commit(int fd);
 
+/*
+ * Asynchronous commits. CommitAsync starts committing everything
+ * written to fd so far and returns the commit's number without
+ * waiting for the servers; writes made afterwards go into the next
+ * commit. Up to MAX_COMMITS_IN_FLIGHT commits per file may be
+ * outstanding, after which CommitAsync blocks until the oldest one
+ * completes. If callback is non-NULL it is called with the commit's
+ * status once it completes, on the network thread, and must not call
+ * back into the library.
+ *
+ * PollCommits makes progress without blocking and returns the
+ * number of commits on fd still in flight. WaitCommits blocks until
+ * none are left. Both return -1 once a commit on fd has failed;
+ * the file then needs an Abort before it can be written again.
+ */
+typedef void (*CommitCallback)(int fd, int commitNum, int status);
+
+extern int CommitAsync(int fd, CommitCallback callback);
+
+extern int PollCommits(int fd);
+
+extern int WaitCommits(int fd);
+
 extern int Abort(int fd);
 
+/*
+ * How many servers a commit waits for. By default every server has
+ * to be ready and ack; with a quorum of n, or REPLFS_QUORUM_MAJORITY,
+ * a commit completes as soon as that many have, and the rest are
+ * brought up to date in the background. A server that falls too far
+ * behind is left out of later commits until it acks one again.
+ */
+#define REPLFS_QUORUM_ALL 0
+#define REPLFS_QUORUM_MAJORITY -1
+
+extern int SetCommitQuorum(int quorum);
+
+/*
+ * With compression enabled, the writes batched for each commit are
+ * sent compressed whenever that makes them smaller. It only takes
+ * effect while every server has said it understands compressed
+ * batches, and goes off by itself while one that doesn't is a member.
+ */
+extern int SetCompression(int enabled);
+
+/*
+ * Writes the library's counters and latency histograms into buffer
+ * as name=value lines: packets sent and received by type, drops,
+ * writes resent, and the time each commit phase takes in usecs.
+ * Works like snprintf, returning the length the whole text needs.
+ */
+extern int GetStats(char* buffer, int size);
+
+/*
+ * Writes the library's trace of recent writes and commits to path,
+ * for replFsTrace to lay alongside the servers' traces. Servers
+ * write theirs to .replfs_trace in their mount directory when sent
+ * SIGUSR2 and when they stop.
+ */
+extern int DumpTrace(const char* path);
+
 extern int CloseFile(int fd);
 
 #ifdef __cplusplus
@@ -0,0 +1,175 @@
+#include "crc32c.h"
+#include <string.h>
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+//reversed Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+//the hardware path runs three streams of this many bytes side by side
+#define LONG_STREAM 8192
+#define SHORT_STREAM 256
+
+//crcTables[k][b] is the CRC of byte b followed by k zero bytes
+static uint32_t crcTables[8][256];
+//shift a CRC over LONG_STREAM or SHORT_STREAM zero bytes, a byte at a time
+static uint32_t longShift[4][256];
+static uint32_t shortShift[4][256];
+
+/* Multiplies the 32x32 bit matrix mat, one column per word, by vec */
+static uint32_t matrixTimes(const uint32_t* mat, uint32_t vec){
+  uint32_t sum = 0;
+  while(vec){
+    if(vec & 1) sum ^= *mat;
+    vec >>= 1;
+    mat++;
+  }
+  return sum;
+}
+
+static void matrixSquare(uint32_t* square, const uint32_t* mat){
+  for(int n = 0; n < 32; n++) square[n] = matrixTimes(mat,mat[n]);
+}
+
+/*
+ * Builds the tables that move a CRC past length zero bytes, length
+ * being a power of two. The operator for one zero bit is squared up
+ * to the one for length bytes.
+ */
+static void buildShift(uint32_t shift[4][256], size_t length){
+  uint32_t odd[32];
+  uint32_t even[32];
+  odd[0] = CRC32C_POLY;
+  for(int n = 1; n < 32; n++) odd[n] = (uint32_t) 1 << (n - 1);
+  //two zero bits, then four
+  matrixSquare(even,odd);
+  matrixSquare(odd,even);
+  uint32_t* op = odd;
+  while(true){
+    matrixSquare(even,odd);
+    op = even;
+    length >>= 1;
+    if(length == 0) break;
+    matrixSquare(odd,even);
+    op = odd;
+    length >>= 1;
+    if(length == 0) break;
+  }
+  for(uint32_t n = 0; n < 256; n++){
+    shift[0][n] = matrixTimes(op,n);
+    shift[1][n] = matrixTimes(op,n << 8);
+    shift[2][n] = matrixTimes(op,n << 16);
+    shift[3][n] = matrixTimes(op,n << 24);
+  }
+}
+
+static bool buildTables(){
+  for(uint32_t i = 0; i < 256; i++){
+    uint32_t crc = i;
+    for(int bit = 0; bit < 8; bit++){
+      crc = crc & 1 ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+    }
+    crcTables[0][i] = crc;
+  }
+  for(uint32_t i = 0; i < 256; i++){
+    for(int k = 1; k < 8; k++){
+      uint32_t prev = crcTables[k - 1][i];
+      crcTables[k][i] = (prev >> 8) ^ crcTables[0][prev & 0xff];
+    }
+  }
+  buildShift(longShift,LONG_STREAM);
+  buildShift(shortShift,SHORT_STREAM);
+  return true;
+}
+
+//filled in before main, so threads never race to build them
+static bool haveTables = buildTables();
+
+static uint32_t shiftCrc(uint32_t shift[4][256], uint32_t crc){
+  return shift[0][crc & 0xff] ^ shift[1][(crc >> 8) & 0xff] ^
+         shift[2][(crc >> 16) & 0xff] ^ shift[3][crc >> 24];
+}
+
+/* Slicing by 8: eight table lookups for every eight bytes */
+static uint32_t crc32cPortable(uint32_t crc, const uint8_t* next, size_t length){
+  while(length >= 8){
+    uint32_t low = crc ^ (next[0] | next[1] << 8 | next[2] << 16 | (uint32_t) next[3] << 24);
+    crc = crcTables[7][low & 0xff] ^ crcTables[6][(low >> 8) & 0xff] ^
+          crcTables[5][(low >> 16) & 0xff] ^ crcTables[4][low >> 24] ^
+          crcTables[3][next[4]] ^ crcTables[2][next[5]] ^
+          crcTables[1][next[6]] ^ crcTables[0][next[7]];
+    next += 8;
+    length -= 8;
+  }
+  while(length-- > 0){
+    crc = crcTables[0][(crc ^ *next++) & 0xff] ^ (crc >> 8);
+  }
+  return crc;
+}
+
+#if defined(__x86_64__)
+/*
+ * The SSE4.2 crc32 instruction takes eight bytes at a time, but each
+ * one has to wait for the last. Three streams over neighbouring runs
+ * of the buffer keep it busy, and their CRCs are then put together by
+ * shifting each past the bytes that follow it.
+ */
+__attribute__((target("sse4.2")))
+static uint32_t crc32cHardware(uint32_t crc, const uint8_t* next, size_t length){
+  uint64_t crc0 = crc;
+  while(length > 0 && ((uintptr_t) next & 7) != 0){
+    crc0 = _mm_crc32_u8((uint32_t) crc0,*next++);
+    length--;
+  }
+  size_t streams[2] = {LONG_STREAM,SHORT_STREAM};
+  for(int s = 0; s < 2; s++){
+    size_t stream = streams[s];
+    while(length >= 3 * stream){
+      uint64_t crc1 = 0;
+      uint64_t crc2 = 0;
+      const uint8_t* end = next + stream;
+      do{
+        uint64_t word0, word1, word2;
+        memcpy(&word0,next,sizeof(word0));
+        memcpy(&word1,next + stream,sizeof(word1));
+        memcpy(&word2,next + 2 * stream,sizeof(word2));
+        crc0 = _mm_crc32_u64(crc0,word0);
+        crc1 = _mm_crc32_u64(crc1,word1);
+        crc2 = _mm_crc32_u64(crc2,word2);
+        next += 8;
+      }while(next < end);
+      uint32_t (*shift)[256] = stream == LONG_STREAM ? longShift : shortShift;
+      crc0 = shiftCrc(shift,(uint32_t) crc0) ^ crc1;
+      crc0 = shiftCrc(shift,(uint32_t) crc0) ^ crc2;
+      next += 2 * stream;
+      length -= 3 * stream;
+    }
+  }
+  while(length >= 8){
+    uint64_t word;
+    memcpy(&word,next,sizeof(word));
+    crc0 = _mm_crc32_u64(crc0,word);
+    next += 8;
+    length -= 8;
+  }
+  while(length-- > 0){
+    crc0 = _mm_crc32_u8((uint32_t) crc0,*next++);
+  }
+  return (uint32_t) crc0;
+}
+
+static bool haveHardware = __builtin_cpu_supports("sse4.2");
+#endif
+
+uint32_t crc32c(uint32_t crc, const void* data, size_t length){
+  const uint8_t* next = (const uint8_t*) data;
+#if defined(__x86_64__)
+  if(haveHardware) return ~crc32cHardware(~crc,next,length);
+#endif
+  return ~crc32cPortable(~crc,next,length);
+}
+
+uint32_t crc32cTables(uint32_t crc, const void* data, size_t length){
+  return ~crc32cPortable(~crc,(const uint8_t*) data,length);
+}
@@ -0,0 +1,21 @@
+#ifndef _crc32c_h
+#define _crc32c_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * CRC-32C (Castagnoli) of length bytes of data. Pass 0 to start a
+ * new checksum, or a previous result to carry one on over more data.
+ * Uses the SSE4.2 crc32 instruction where the processor has it, and
+ * tables eight bytes at a time elsewhere.
+ */
+uint32_t crc32c(uint32_t crc, const void* data, size_t length);
+
+/*
+ * The same checksum, always worked out with the tables, so that
+ * tests can check the hardware path against it.
+ */
+uint32_t crc32cTables(uint32_t crc, const void* data, size_t length);
+
+#endif
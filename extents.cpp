@@ -0,0 +1,100 @@
+#include "extents.h"
+#include "log.h"
+#include <stdio.h>
+#include <limits.h>
+#include <string.h>
+#include <sys/uio.h>
+
+void extentInsert(ExtentMap* map, uint64_t offset, uint32_t length, const uint8_t* data){
+  if(length == 0) return;
+  uint64_t end = offset + length;
+  ExtentMap::iterator it = map->lower_bound(offset);
+  //an extent starting before this one may run into or past it
+  if(it != map->begin()){
+    ExtentMap::iterator prev = it;
+    --prev;
+    uint64_t prevEnd = prev->first + prev->second.length;
+    if(prevEnd > offset){
+      if(prevEnd > end){
+        Extent tail;
+        tail.length = prevEnd - end;
+        tail.data = prev->second.data + (end - prev->first);
+        map->insert(it,std::make_pair(end,tail));
+      }
+      prev->second.length = offset - prev->first;
+    }
+  }
+  //extents starting inside this one are covered entirely or lose their front
+  while(it != map->end() && it->first < end){
+    uint64_t itEnd = it->first + it->second.length;
+    if(itEnd > end){
+      Extent tail;
+      tail.length = itEnd - end;
+      tail.data = it->second.data + (end - it->first);
+      map->erase(it++);
+      map->insert(it,std::make_pair(end,tail));
+      break;
+    }
+    map->erase(it++);
+  }
+  Extent extent;
+  extent.length = length;
+  extent.data = data;
+  (*map)[offset] = extent;
+}
+
+void extentsRead(const ExtentMap* map, uint64_t offset, uint32_t length, uint8_t* buffer){
+  uint64_t end = offset + length;
+  //the extent holding offset, if any, starts before it
+  ExtentMap::const_iterator it = map->upper_bound(offset);
+  if(it != map->begin()) --it;
+  for(; it != map->end() && it->first < end; ++it){
+    uint64_t from = it->first > offset ? it->first : offset;
+    uint64_t to = it->first + it->second.length;
+    if(to > end) to = end;
+    if(to > from) memcpy(buffer + (from - offset),it->second.data + (from - it->first),to - from);
+  }
+}
+
+uint64_t extentsEnd(const ExtentMap* map){
+  if(map->empty()) return 0;
+  ExtentMap::const_reverse_iterator last = map->rbegin();
+  return last->first + last->second.length;
+}
+
+/* Writes out one run of adjacent extents */
+static bool writeRun(int fd, ExtentMap::const_iterator first, ExtentMap::const_iterator last){
+  struct iovec iov[IOV_MAX];
+  while(first != last){
+    uint64_t offset = first->first;
+    ssize_t runSize = 0;
+    int numIov = 0;
+    for(; first != last && numIov < IOV_MAX; ++first, ++numIov){
+      iov[numIov].iov_base = (void*) first->second.data;
+      iov[numIov].iov_len = first->second.length;
+      runSize += first->second.length;
+    }
+    ssize_t written = pwritev(fd,iov,numIov,offset);
+    if(written != runSize){
+      LOG("Unable to write %zd bytes at offset %lu\n",runSize,(unsigned long) offset);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool extentsWrite(int fd, const ExtentMap* map){
+  bool ok = true;
+  ExtentMap::const_iterator runStart = map->begin();
+  while(runStart != map->end()){
+    ExtentMap::const_iterator runEnd = runStart;
+    uint64_t nextOffset;
+    do{
+      nextOffset = runEnd->first + runEnd->second.length;
+      ++runEnd;
+    }while(runEnd != map->end() && runEnd->first == nextOffset);
+    if(!writeRun(fd,runStart,runEnd)) ok = false;
+    runStart = runEnd;
+  }
+  return ok;
+}
@@ -0,0 +1,46 @@
+#ifndef _extents_h
+#define _extents_h
+
+#include <stdint.h>
+#include <map>
+
+/* A run of file bytes, pointing at data held elsewhere */
+struct Extent {
+  uint32_t length;
+  const uint8_t* data;
+};
+typedef struct Extent Extent;
+
+/*
+ * Non-overlapping extents keyed by their starting offset in the file.
+ * Walking the map gives them back in file order.
+ */
+typedef std::map<uint64_t,Extent> ExtentMap;
+
+/*
+ * Lays length bytes of data over the map at offset. Whatever the new
+ * extent overlaps is trimmed, split or dropped, so inserting writes in
+ * the order they were made leaves the last writer's bytes on top.
+ * The data is not copied and must outlive the map.
+ */
+void extentInsert(ExtentMap* map, uint64_t offset, uint32_t length, const uint8_t* data);
+
+/*
+ * Copies whatever the map holds between offset and offset + length
+ * over buffer, which stands for those bytes. Parts of the range no
+ * extent covers are left alone.
+ */
+void extentsRead(const ExtentMap* map, uint64_t offset, uint32_t length, uint8_t* buffer);
+
+/* Returns the offset just past the map's last extent, 0 if it is empty */
+uint64_t extentsEnd(const ExtentMap* map);
+
+/*
+ * Writes the map's extents to fd at their offsets. Each run of
+ * adjacent extents goes out in a single pwritev, split only where
+ * it has more than IOV_MAX pieces. Returns false if any of it
+ * couldn't be written.
+ */
+bool extentsWrite(int fd, const ExtentMap* map);
+
+#endif
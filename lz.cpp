@@ -0,0 +1,128 @@
+#include "lz.h"
+#include <string.h>
+
+#define MIN_MATCH 4
+//the format leaves the last bytes as literals, and no match starts
+//this close to the end
+#define LAST_LITERALS 5
+#define MATCH_SEARCH_END 12
+#define HASH_BITS 12
+
+static uint32_t read32(const uint8_t* p){
+  uint32_t value;
+  memcpy(&value,p,sizeof(value));
+  return value;
+}
+
+static uint32_t hashSequence(uint32_t sequence){
+  return (sequence * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/* Writes a length past the 15 its nibble holds as a run of bytes */
+static uint8_t* writeLength(uint8_t* op, size_t length){
+  length -= 15;
+  while(length >= 255){
+    *op++ = 255;
+    length -= 255;
+  }
+  *op++ = (uint8_t) length;
+  return op;
+}
+
+/*
+ * Writes one sequence: numLiterals bytes from literals, then, unless
+ * matchLength is 0, a back reference. Returns NULL if it won't fit.
+ */
+static uint8_t* writeSequence(uint8_t* op, uint8_t* end, const uint8_t* literals,
+                              size_t numLiterals, uint32_t offset, size_t matchLength){
+  size_t worst = 1 + numLiterals / 255 + 1 + numLiterals + 2 + matchLength / 255 + 1;
+  if((size_t) (end - op) < worst) return NULL;
+  uint8_t* token = op++;
+  *token = (numLiterals < 15 ? numLiterals : 15) << 4;
+  if(numLiterals >= 15) op = writeLength(op,numLiterals);
+  memcpy(op,literals,numLiterals);
+  op += numLiterals;
+  if(matchLength == 0) return op;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  size_t extra = matchLength - MIN_MATCH;
+  *token |= extra < 15 ? extra : 15;
+  if(extra >= 15) op = writeLength(op,extra);
+  return op;
+}
+
+size_t lzCompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity){
+  if(length > LZ_MAX_INPUT) return 0;
+  //positions plus one, so that 0 means empty
+  uint16_t table[1 << HASH_BITS];
+  memset(table,0,sizeof(table));
+  uint8_t* op = dst;
+  uint8_t* end = dst + capacity;
+  size_t anchor = 0;
+  size_t ip = 0;
+  while(ip + MATCH_SEARCH_END <= length){
+    uint32_t sequence = read32(src + ip);
+    uint32_t hash = hashSequence(sequence);
+    size_t candidate = table[hash];
+    table[hash] = ip + 1;
+    if(candidate == 0 || read32(src + candidate - 1) != sequence){
+      ip++;
+      continue;
+    }
+    size_t ref = candidate - 1;
+    size_t matchLength = MIN_MATCH;
+    while(ip + matchLength < length - LAST_LITERALS && src[ref + matchLength] == src[ip + matchLength]){
+      matchLength++;
+    }
+    op = writeSequence(op,end,src + anchor,ip - anchor,ip - ref,matchLength);
+    if(op == NULL) return 0;
+    ip += matchLength;
+    anchor = ip;
+  }
+  op = writeSequence(op,end,src + anchor,length - anchor,0,0);
+  if(op == NULL) return 0;
+  return op - dst;
+}
+
+/* Reads the rest of a length whose nibble was 15. Returns false if the input ends first */
+static bool readLength(const uint8_t* src, size_t length, size_t* ip, size_t* value){
+  uint8_t next;
+  do{
+    if(*ip >= length) return false;
+    next = src[(*ip)++];
+    *value += next;
+  }while(next == 255);
+  return true;
+}
+
+long lzDecompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity){
+  size_t ip = 0;
+  size_t op = 0;
+  while(ip < length){
+    uint8_t token = src[ip++];
+    size_t numLiterals = token >> 4;
+    if(numLiterals == 15 && !readLength(src,length,&ip,&numLiterals)) return -1;
+    if(numLiterals > length - ip || numLiterals > capacity - op) return -1;
+    memcpy(dst + op,src + ip,numLiterals);
+    ip += numLiterals;
+    op += numLiterals;
+    //the last sequence has no match
+    if(ip == length) break;
+    if(length - ip < 2) return -1;
+    size_t offset = src[ip] | src[ip + 1] << 8;
+    ip += 2;
+    if(offset == 0 || offset > op) return -1;
+    size_t matchLength = token & 0x0f;
+    if(matchLength == 15 && !readLength(src,length,&ip,&matchLength)) return -1;
+    matchLength += MIN_MATCH;
+    if(matchLength > capacity - op) return -1;
+    if(offset >= matchLength){
+      memcpy(dst + op,dst + op - offset,matchLength);
+      op += matchLength;
+    }else{
+      //the match overlaps what it copies, repeating the last offset bytes
+      for(size_t i = 0; i < matchLength; i++, op++) dst[op] = dst[op - offset];
+    }
+  }
+  return op;
+}
@@ -0,0 +1,25 @@
+#ifndef _lz_h
+#define _lz_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+//Largest input lzCompress takes, since matches are found within 64KB
+#define LZ_MAX_INPUT (64 * 1024 - 1)
+//Room that compressing length bytes may need, for data that doesn't shrink
+#define LZ_BOUND(length) ((length) + (length) / 255 + 16)
+
+/*
+ * A fast LZ77 codec in the LZ4 block format: sequences of literals
+ * and back references of at least four bytes, found greedily through
+ * a small hash table, so compressing costs little more than a copy.
+ *
+ * lzCompress returns the compressed length, or 0 if length is more
+ * than LZ_MAX_INPUT or the result won't fit in capacity bytes.
+ * lzDecompress returns the length expanded into dst, or -1 if the
+ * input is malformed or expands past capacity bytes.
+ */
+size_t lzCompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity);
+long lzDecompress(const uint8_t* src, size_t length, uint8_t* dst, size_t capacity);
+
+#endif
@@ -0,0 +1,193 @@
+#include "metrics.h"
+#include "packets.h"
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <pthread.h>
+#include <atomic>
+#include <set>
+
+/*
+ * One thread's counts. Only the owner writes them, with a relaxed
+ * load and store rather than an atomic add, and readers may see a
+ * count a moment out of date but never a torn one.
+ */
+struct MetricBlock {
+  std::atomic<uint64_t> counters[NUM_METRICS];
+  std::atomic<uint64_t> counts[NUM_HISTOGRAMS];
+  std::atomic<uint64_t> maxima[NUM_HISTOGRAMS];
+  std::atomic<uint64_t> buckets[NUM_HISTOGRAMS][HISTOGRAM_BUCKETS];
+};
+
+/* Hands a thread's block back when the thread exits */
+struct MetricOwner {
+  MetricBlock* block;
+  ~MetricOwner();
+};
+
+//the blocks of running threads, and what exited threads counted.
+//Taken only when a thread starts or stops counting, or to read.
+static pthread_mutex_t metricsLock = PTHREAD_MUTEX_INITIALIZER;
+static std::set<MetricBlock*> blocks;
+static MetricSnapshot retired;
+static thread_local MetricOwner owner = {NULL};
+
+static const char* packetNames[] = {
+  NULL, "roll_call", "roll_call_ack", "open_file", "open_file_ack", "write_block",
+  "commit_request", "ready_to_commit", "commit", "commit_ack", "write_resend_request",
+  "abort", "abort_ack", "write_batch", "read_request", "read_reply", "resync_request",
+  "resync_data", "membership", "join", "leave", "compressed_batch"
+};
+#define NUM_PACKET_NAMES (sizeof(packetNames) / sizeof(packetNames[0]))
+
+static const char* counterNames[NUM_METRICS - METRIC_DROPPED] = {
+  "dropped", "malformed", "bytes_sent", "bytes_received", "resend_requests",
+  "writes_resent", "writes_staged", "bytes_staged", "checksum_failures", "commits",
+  "commits_failed", "commits_applied"
+};
+
+static const char* histogramNames[NUM_HISTOGRAMS] = {
+  "commit_prepare", "commit_apply", "commit", "disk_apply", "wal_sync"
+};
+
+static MetricBlock* ownBlock(){
+  if(owner.block != NULL) return owner.block;
+  MetricBlock* block = new MetricBlock;
+  for(int i = 0; i < NUM_METRICS; i++) block->counters[i].store(0,std::memory_order_relaxed);
+  for(int h = 0; h < NUM_HISTOGRAMS; h++){
+    block->counts[h].store(0,std::memory_order_relaxed);
+    block->maxima[h].store(0,std::memory_order_relaxed);
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++) block->buckets[h][i].store(0,std::memory_order_relaxed);
+  }
+  pthread_mutex_lock(&metricsLock);
+  blocks.insert(block);
+  pthread_mutex_unlock(&metricsLock);
+  owner.block = block;
+  return block;
+}
+
+/* Adds block's counts into snapshot. The caller holds metricsLock. */
+static void addBlock(MetricBlock* block, MetricSnapshot* snapshot){
+  for(int i = 0; i < NUM_METRICS; i++){
+    snapshot->counters[i] += block->counters[i].load(std::memory_order_relaxed);
+  }
+  for(int h = 0; h < NUM_HISTOGRAMS; h++){
+    MetricHistogram* histogram = &snapshot->histograms[h];
+    histogram->count += block->counts[h].load(std::memory_order_relaxed);
+    uint64_t max = block->maxima[h].load(std::memory_order_relaxed);
+    if(max > histogram->max) histogram->max = max;
+    for(int i = 0; i < HISTOGRAM_BUCKETS; i++){
+      histogram->buckets[i] += block->buckets[h][i].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+MetricOwner::~MetricOwner(){
+  if(block == NULL) return;
+  pthread_mutex_lock(&metricsLock);
+  addBlock(block,&retired);
+  blocks.erase(block);
+  pthread_mutex_unlock(&metricsLock);
+  delete block;
+}
+
+static inline void bump(std::atomic<uint64_t>* value, uint64_t amount){
+  value->store(value->load(std::memory_order_relaxed) + amount,std::memory_order_relaxed);
+}
+
+void metricAdd(int metric, uint64_t amount){
+  bump(&ownBlock()->counters[metric],amount);
+}
+
+static int bucketIndex(uint64_t value){
+  if(value < HISTOGRAM_SUB_BUCKETS) return value;
+  int exponent = 63 - __builtin_clzll(value);
+  int shift = exponent - HISTOGRAM_SUB_BUCKET_BITS;
+  return (shift + 1) * HISTOGRAM_SUB_BUCKETS + ((value >> shift) & (HISTOGRAM_SUB_BUCKETS - 1));
+}
+
+/* The largest value that falls in a bucket */
+static uint64_t bucketLimit(int index){
+  if(index < HISTOGRAM_SUB_BUCKETS) return index;
+  int shift = index / HISTOGRAM_SUB_BUCKETS - 1;
+  uint64_t sub = HISTOGRAM_SUB_BUCKETS + index % HISTOGRAM_SUB_BUCKETS;
+  return ((sub + 1) << shift) - 1;
+}
+
+void metricRecord(int histogram, uint64_t usec){
+  MetricBlock* block = ownBlock();
+  bump(&block->counts[histogram],1);
+  bump(&block->buckets[histogram][bucketIndex(usec)],1);
+  if(usec > block->maxima[histogram].load(std::memory_order_relaxed)){
+    block->maxima[histogram].store(usec,std::memory_order_relaxed);
+  }
+}
+
+void metricsSnapshot(MetricSnapshot* snapshot){
+  pthread_mutex_lock(&metricsLock);
+  memcpy(snapshot,&retired,sizeof(*snapshot));
+  std::set<MetricBlock*>::iterator it;
+  for(it = blocks.begin(); it != blocks.end(); ++it) addBlock(*it,snapshot);
+  pthread_mutex_unlock(&metricsLock);
+}
+
+uint64_t metricPercentile(const MetricHistogram* histogram, double fraction){
+  if(histogram->count == 0) return 0;
+  //the rank of the sample wanted, counting from 1
+  uint64_t rank = (uint64_t) (fraction * histogram->count) + 1;
+  if(rank > histogram->count) rank = histogram->count;
+  uint64_t seen = 0;
+  for(int i = 0; i < HISTOGRAM_BUCKETS; i++){
+    seen += histogram->buckets[i];
+    if(seen < rank) continue;
+    uint64_t limit = bucketLimit(i);
+    return limit < histogram->max ? limit : histogram->max;
+  }
+  return histogram->max;
+}
+
+/* Appends to the text being formatted, keeping count of what didn't fit */
+struct FormatBuffer {
+  char* buffer;
+  size_t size;
+  size_t length;
+};
+
+static void append(FormatBuffer* out, const char* format, ...){
+  char* end = out->buffer;
+  size_t room = 0;
+  if(out->length < out->size){
+    end += out->length;
+    room = out->size - out->length;
+  }
+  va_list args;
+  va_start(args,format);
+  int written = vsnprintf(room ? end : NULL,room,format,args);
+  va_end(args);
+  if(written > 0) out->length += written;
+}
+
+int metricsFormat(const MetricSnapshot* snapshot, char* buffer, size_t size){
+  FormatBuffer out = {buffer, size, 0};
+  if(size > 0) buffer[0] = '\0';
+  for(int type = 1; type < (int) NUM_PACKET_NAMES; type++){
+    uint64_t sent = snapshot->counters[METRIC_SENT(type)];
+    uint64_t received = snapshot->counters[METRIC_RECEIVED(type)];
+    if(sent) append(&out,"sent_%s=%llu\n",packetNames[type],(unsigned long long) sent);
+    if(received) append(&out,"received_%s=%llu\n",packetNames[type],(unsigned long long) received);
+  }
+  for(int i = METRIC_DROPPED; i < NUM_METRICS; i++){
+    uint64_t value = snapshot->counters[i];
+    if(value) append(&out,"%s=%llu\n",counterNames[i - METRIC_DROPPED],(unsigned long long) value);
+  }
+  for(int h = 0; h < NUM_HISTOGRAMS; h++){
+    const MetricHistogram* histogram = &snapshot->histograms[h];
+    append(&out,"%s_count=%llu\n%s_p50_usec=%llu\n%s_p99_usec=%llu\n%s_p999_usec=%llu\n%s_max_usec=%llu\n",
+           histogramNames[h],(unsigned long long) histogram->count,
+           histogramNames[h],(unsigned long long) metricPercentile(histogram,0.5),
+           histogramNames[h],(unsigned long long) metricPercentile(histogram,0.99),
+           histogramNames[h],(unsigned long long) metricPercentile(histogram,0.999),
+           histogramNames[h],(unsigned long long) histogram->max);
+  }
+  return out.length;
+}
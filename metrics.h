@@ -0,0 +1,87 @@
+#ifndef _metrics_h
+#define _metrics_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Counters and latency histograms for the hot paths. Every thread
+ * counts into a block of its own, so recording is a plain add to
+ * memory no other thread writes, with no lock and no shared cache
+ * line. Readers sum the blocks of every thread, including those of
+ * threads that have exited.
+ */
+
+//packets sent and received are counted per type, in ranges of their own
+#define METRIC_SENT(type) (type)
+#define METRIC_RECEIVED(type) (256 + (type))
+#define METRIC_DROPPED 512
+#define METRIC_MALFORMED 513
+#define METRIC_BYTES_SENT 514
+#define METRIC_BYTES_RECEIVED 515
+//write resend requests sent by servers, and writes clients resent for them
+#define METRIC_RESEND_REQUESTS 516
+#define METRIC_WRITES_RESENT 517
+#define METRIC_WRITES_STAGED 518
+#define METRIC_BYTES_STAGED 519
+#define METRIC_CHECKSUM_FAILURES 520
+#define METRIC_COMMITS 521
+#define METRIC_COMMITS_FAILED 522
+#define METRIC_COMMITS_APPLIED 523
+#define NUM_METRICS 524
+
+//client: COMMIT_REQUEST to quorum ready, COMMIT to quorum acked, and the whole commit
+#define HISTOGRAM_COMMIT_PREPARE 0
+#define HISTOGRAM_COMMIT_APPLY 1
+#define HISTOGRAM_COMMIT 2
+//server: writing a commit to its file, and making the log durable
+#define HISTOGRAM_DISK_APPLY 3
+#define HISTOGRAM_WAL_SYNC 4
+#define NUM_HISTOGRAMS 5
+
+/*
+ * Histogram buckets are log-linear, HDR style: values below
+ * HISTOGRAM_SUB_BUCKETS each have a bucket, and every power of two
+ * above that is split into HISTOGRAM_SUB_BUCKETS equal buckets, so a
+ * value is known to within about 6% however large it is.
+ */
+#define HISTOGRAM_SUB_BUCKET_BITS 4
+#define HISTOGRAM_SUB_BUCKETS (1 << HISTOGRAM_SUB_BUCKET_BITS)
+#define HISTOGRAM_BUCKETS ((64 - HISTOGRAM_SUB_BUCKET_BITS + 1) * HISTOGRAM_SUB_BUCKETS)
+
+struct MetricHistogram {
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[HISTOGRAM_BUCKETS];
+};
+typedef struct MetricHistogram MetricHistogram;
+
+/* Every thread's counts added up */
+struct MetricSnapshot {
+  uint64_t counters[NUM_METRICS];
+  MetricHistogram histograms[NUM_HISTOGRAMS];
+};
+typedef struct MetricSnapshot MetricSnapshot;
+
+void metricAdd(int metric, uint64_t amount);
+
+/* Adds a latency in usecs to a histogram */
+void metricRecord(int histogram, uint64_t usec);
+
+void metricsSnapshot(MetricSnapshot* snapshot);
+
+/*
+ * The value below which fraction of a histogram's samples fall, to
+ * the bucket's precision. 0 if it is empty.
+ */
+uint64_t metricPercentile(const MetricHistogram* histogram, double fraction);
+
+/*
+ * Writes a snapshot as text, one name=value line per counter that
+ * isn't 0 and a count, percentiles and max per histogram. Behaves
+ * like snprintf: returns the length the whole text needs, writing as
+ * much as fits in size bytes, always terminated.
+ */
+int metricsFormat(const MetricSnapshot* snapshot, char* buffer, size_t size);
+
+#endif
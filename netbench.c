@@ -0,0 +1,106 @@
+#include "replfs_net.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#define DEFAULT_PORT 44019
+#define DEFAULT_PACKETS 200000
+//the receiver gives up once nothing has arrived for this long
+#define IDLE_MSEC 500
+
+/*
+ * Measures how many packets per second replfs_net moves over loopback
+ * multicast. A forked receiver drains WRITE_BLOCKs while the parent
+ * sends them, either batched through sendmmsg/recvmmsg or, with
+ * -single, one system call per packet as before batching existed.
+ *
+ * usage: netbench [-port p] [-packets n] [-size bytes] [-single]
+ */
+
+void receivePackets(unsigned short port, long expected, bool single);
+void sendPackets(unsigned short port, long count, int size, bool single);
+
+int main(const int argc, const char* argv[]){
+  unsigned short port = DEFAULT_PORT;
+  long count = DEFAULT_PACKETS;
+  int size = MAX_WRITE_SIZE;
+  bool single = false;
+  for(int i = 1; i < argc; i++){
+    if(strcmp(argv[i],"-port") == 0 && i + 1 < argc){
+      port = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-packets") == 0 && i + 1 < argc){
+      count = atol(argv[++i]);
+    }else if(strcmp(argv[i],"-size") == 0 && i + 1 < argc){
+      size = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-single") == 0){
+      single = true;
+    }else{
+      printf("usage: netbench [-port p] [-packets n] [-size bytes] [-single]\n");
+      return -1;
+    }
+  }
+  if(size < 0 || size > MAX_WRITE_SIZE) size = MAX_WRITE_SIZE;
+  pid_t receiver = fork();
+  if(receiver == 0){
+    receivePackets(port,count,single);
+    return 0;
+  }
+  //give the receiver time to join the group
+  usleep(200 * USEC_PER_MSEC);
+  sendPackets(port,count,size,single);
+  waitpid(receiver,NULL,0);
+  return 0;
+}
+
+void sendPackets(unsigned short port, long count, int size, bool single){
+  netInit(port,0);
+  WriteBlockPacket packet;
+  memset(&packet,0,sizeof(packet));
+  packet.blockSize = size;
+  uint64_t start = monotonicUsec();
+  for(long i = 0; i < count; i += SEND_BATCH){
+    if(!single) corkSends();
+    for(long j = i; j < count && j < i + SEND_BATCH; j++){
+      packet.writeNum = j + 1;
+      sendPacket(&packet,WRITE_BLOCK);
+    }
+    if(!single) uncorkSends();
+  }
+  double seconds = (monotonicUsec() - start) / (double) USEC_PER_SEC;
+  printf("send mode=%s packets=%ld size=%d seconds=%.3f pps=%.0f\n",
+         single ? "single" : "batch",count,size,seconds,count / seconds);
+}
+
+void receivePackets(unsigned short port, long expected, bool single){
+  netInit(port,0);
+  static ReplfsEvent events[RECEIVE_BATCH];
+  static ReplfsPacket packets[RECEIVE_BATCH];
+  for(int i = 0; i < RECEIVE_BATCH; i++) events[i].packet = &packets[i];
+  long received = 0;
+  long receivedAtTimer = 0;
+  uint64_t start = 0;
+  uint64_t last = 0;
+  TimerId idleTimer = setTimer(IDLE_MSEC * USEC_PER_MSEC);
+  while(received < expected){
+    int numEvents = single ? (nextEvent(&events[0]), 1) : nextEvents(events,RECEIVE_BATCH);
+    bool idle = false;
+    for(int i = 0; i < numEvents; i++){
+      if(events[i].type == PACKET_EVENT && packets[i].type == WRITE_BLOCK){
+        if(received == 0) start = monotonicUsec();
+        last = monotonicUsec();
+        received++;
+      }else if(events[i].type == TIMER_EVENT && events[i].timer == idleTimer){
+        idle = received > 0 && received == receivedAtTimer;
+        receivedAtTimer = received;
+        idleTimer = setTimer(IDLE_MSEC * USEC_PER_MSEC);
+      }
+    }
+    if(idle) break;
+  }
+  double seconds = (last - start) / (double) USEC_PER_SEC;
+  printf("receive mode=%s packets=%ld lost=%ld seconds=%.3f pps=%.0f\n",
+         single ? "single" : "batch",received,expected - received,seconds,
+         seconds > 0 ? received / seconds : 0);
+}
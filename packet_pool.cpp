@@ -0,0 +1,66 @@
+#include "packet_pool.h"
+#include <pthread.h>
+#include <vector>
+
+/* Hands a thread's spare buffers to the shared pool when the thread exits */
+struct SpareBuffers {
+  std::vector<PacketBuffer*> buffers;
+  ~SpareBuffers();
+};
+
+static pthread_mutex_t poolLock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<PacketBuffer*> sharedSpares;
+static thread_local SpareBuffers spares;
+
+/* Moves count of the calling thread's spares to the shared pool */
+static void shareSpares(size_t count){
+  std::vector<PacketBuffer*>& own = spares.buffers;
+  pthread_mutex_lock(&poolLock);
+  while(count > 0 && !own.empty()){
+    if(sharedSpares.size() < PACKET_POOL_MAX_SPARE){
+      sharedSpares.push_back(own.back());
+    }else{
+      delete own.back();
+    }
+    own.pop_back();
+    count--;
+  }
+  pthread_mutex_unlock(&poolLock);
+}
+
+SpareBuffers::~SpareBuffers(){
+  shareSpares(buffers.size());
+}
+
+PacketBuffer* packetPoolGet(){
+  std::vector<PacketBuffer*>& own = spares.buffers;
+  if(own.empty()){
+    pthread_mutex_lock(&poolLock);
+    for(int i = 0; i < PACKET_POOL_BATCH && !sharedSpares.empty(); i++){
+      own.push_back(sharedSpares.back());
+      sharedSpares.pop_back();
+    }
+    pthread_mutex_unlock(&poolLock);
+  }
+  PacketBuffer* buffer;
+  if(own.empty()){
+    buffer = new PacketBuffer;
+  }else{
+    buffer = own.back();
+    own.pop_back();
+  }
+  buffer->refs.store(1,std::memory_order_relaxed);
+  buffer->length = 0;
+  return buffer;
+}
+
+void packetPoolHold(PacketBuffer* buffer){
+  buffer->refs.fetch_add(1,std::memory_order_relaxed);
+}
+
+void packetPoolRelease(PacketBuffer* buffer){
+  //whoever lets go last must see everything the others did with it
+  if(buffer->refs.fetch_sub(1,std::memory_order_acq_rel) != 1) return;
+  spares.buffers.push_back(buffer);
+  if(spares.buffers.size() >= 2 * PACKET_POOL_BATCH) shareSpares(PACKET_POOL_BATCH);
+}
@@ -0,0 +1,39 @@
+#ifndef _packet_pool_h
+#define _packet_pool_h
+
+#include "packets.h"
+#include <atomic>
+
+//buffers moved between a thread's spares and the shared pool at once
+#define PACKET_POOL_BATCH 64
+//most spare buffers kept in the shared pool, the rest are freed
+#define PACKET_POOL_MAX_SPARE 4096
+
+/*
+ * A datagram received straight into a buffer of its own, so that it
+ * can be passed between threads and kept by whatever points into it
+ * without being copied. The buffer goes back to the pool once the
+ * last reference to it is released.
+ */
+struct PacketBuffer {
+  std::atomic<uint32_t> refs;
+  //bytes of packet received
+  uint32_t length;
+  ReplfsPacket packet;
+};
+typedef struct PacketBuffer PacketBuffer;
+
+/*
+ * Returns a buffer holding one reference, for the caller. Each thread
+ * keeps spare buffers of its own and trades them with a shared pool
+ * PACKET_POOL_BATCH at a time, so buffers can be taken on one thread
+ * and released on another without a lock each time.
+ */
+PacketBuffer* packetPoolGet();
+
+/* Adds a reference, to be released separately */
+void packetPoolHold(PacketBuffer* buffer);
+
+void packetPoolRelease(PacketBuffer* buffer);
+
+#endif
@@ -0,0 +1,30 @@
+#include "packet_queue.h"
+#include <stddef.h>
+
+void packetQueueInit(PacketQueue* queue){
+  queue->head.store(0);
+  queue->tail.store(0);
+}
+
+bool packetQueuePush(PacketQueue* queue, PacketBuffer* buffer){
+  uint32_t tail = queue->tail.load(std::memory_order_relaxed);
+  uint32_t head = queue->head.load(std::memory_order_acquire);
+  if(tail - head == PACKET_QUEUE_SLOTS) return false;
+  queue->slots[tail & (PACKET_QUEUE_SLOTS - 1)] = buffer;
+  //the buffer and what it holds must be visible before the consumer can see the new tail
+  queue->tail.store(tail + 1,std::memory_order_release);
+  return true;
+}
+
+PacketBuffer* packetQueueFront(PacketQueue* queue){
+  uint32_t head = queue->head.load(std::memory_order_relaxed);
+  uint32_t tail = queue->tail.load(std::memory_order_acquire);
+  if(head == tail) return NULL;
+  return queue->slots[head & (PACKET_QUEUE_SLOTS - 1)];
+}
+
+void packetQueuePop(PacketQueue* queue){
+  uint32_t head = queue->head.load(std::memory_order_relaxed);
+  //the slot may be refilled as soon as the producer sees this
+  queue->head.store(head + 1,std::memory_order_release);
+}
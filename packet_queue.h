@@ -0,0 +1,44 @@
+#ifndef _packet_queue_h
+#define _packet_queue_h
+
+#include "packet_pool.h"
+#include <atomic>
+
+//must be a power of two
+#define PACKET_QUEUE_SLOTS 1024
+#define CACHE_LINE_BYTES 64
+
+/*
+ * A lock-free queue of packets from exactly one producer thread to
+ * exactly one consumer thread. Each side only writes its own index,
+ * and the indices sit on separate cache lines so the two threads
+ * don't fight over them. Packets are passed by their buffers, along
+ * with the reference the producer held.
+ */
+struct PacketQueue {
+  //next slot the consumer will read, written only by the consumer
+  alignas(CACHE_LINE_BYTES) std::atomic<uint32_t> head;
+  //next slot the producer will fill, written only by the producer
+  alignas(CACHE_LINE_BYTES) std::atomic<uint32_t> tail;
+  alignas(CACHE_LINE_BYTES) PacketBuffer* slots[PACKET_QUEUE_SLOTS];
+};
+typedef struct PacketQueue PacketQueue;
+
+void packetQueueInit(PacketQueue* queue);
+
+/*
+ * Producer side. Adds buffer to the queue, returning false without
+ * waiting if the queue is full, in which case the producer keeps
+ * its reference.
+ */
+bool packetQueuePush(PacketQueue* queue, PacketBuffer* buffer);
+
+/*
+ * Consumer side. Returns the oldest buffer in the queue, or NULL if
+ * it is empty, and packetQueuePop takes it off. The consumer then has
+ * the buffer's reference.
+ */
+PacketBuffer* packetQueueFront(PacketQueue* queue);
+void packetQueuePop(PacketQueue* queue);
+
+#endif
@@ -17,13 +17,39 @@
 #define WRITE_RESEND_REQUEST 0x0A
 #define ABORT 0x0B
 #define ABORT_ACK 0x0C
+#define WRITE_BATCH 0x0D
+#define READ_REQUEST 0x0E
+#define READ_REPLY 0x0F
+#define RESYNC_REQUEST 0x10
+#define RESYNC_DATA 0x11
+#define MEMBERSHIP 0x12
+#define JOIN 0x13
+#define LEAVE 0x14
+#define COMPRESSED_BATCH 0x15
 
 #define MAX_FILENAME_SIZE 128
-#define MAX_WRITE_SIZE 512
-#define MAX_WRITES_PER_COMMIT 128
+//Most data one write packet carries. Larger writes are split
+//into pieces of this size, each with its own write number.
+#define MAX_WRITE_SIZE 1024
+#define MAX_WRITES_PER_COMMIT (1 << 20)
+//How many commits a client may have outstanding per file
+#define MAX_COMMITS_IN_FLIGHT 4
+//Reads are served and cached in blocks of this size, aligned to it
+#define READ_BLOCK_SIZE MAX_WRITE_SIZE
+//Largest datagram we send: an ethernet MTU less the IP and UDP headers.
+//Networks with jumbo frames can raise this to 8972.
+#define MAX_DATAGRAM_SIZE 1472
+//Every packet starts with its type and the sender's membership epoch
+#define PACKET_HEADER_SIZE (sizeof(uint8_t) + sizeof(uint32_t))
+//Most servers the client can count as members at once
+#define MAX_MEMBERS 64
+
+//Features a server announces when it answers a roll call or joins
+#define FEATURE_COMPRESSED_BATCH 0x1
 
 struct RollCallAckPacket {
   uint32_t proposedId;
+  uint32_t features;
 } __attribute__((packed));
 typedef struct RollCallAckPacket RollCallAckPacket;
 
@@ -42,17 +68,68 @@ typedef struct OpenFileAckPacket OpenFileAckPacket;
 struct WriteBlockPacket {
   uint32_t fileId;
   uint32_t commitNum;
-  uint8_t writeNum;
+  uint32_t writeNum;
   uint32_t byteOffset;
   uint32_t blockSize;
+  //CRC32C of the data, which is dropped if it doesn't match
+  uint32_t crc;
   uint8_t data[MAX_WRITE_SIZE];
 } __attribute__((packed));
 typedef struct WriteBlockPacket WriteBlockPacket;
 
+/*
+ * Several writes for the same commit packed into one datagram.
+ * writes holds numWrites BatchedWrites, each directly followed
+ * by its blockSize bytes of data. Only the used part is sent.
+ */
+struct BatchedWrite {
+  uint32_t writeNum;
+  uint32_t byteOffset;
+  uint32_t blockSize;
+  uint32_t crc;
+} __attribute__((packed));
+typedef struct BatchedWrite BatchedWrite;
+
+#define WRITE_BATCH_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(uint8_t))
+
+struct WriteBatchPacket {
+  uint32_t fileId;
+  uint32_t commitNum;
+  uint8_t numWrites;
+  uint8_t writes[MAX_DATAGRAM_SIZE - PACKET_HEADER_SIZE - WRITE_BATCH_HEADER_SIZE];
+} __attribute__((packed));
+typedef struct WriteBatchPacket WriteBatchPacket;
+
+//Most data a compressed batch expands to
+#define MAX_BATCH_DATA (16 * 1024)
+
+#define COMPRESSED_BATCH_HEADER_SIZE (2 * sizeof(uint32_t) + sizeof(uint8_t) + sizeof(uint16_t))
+
+/*
+ * A batch whose data is compressed, sent only to servers that announced
+ * FEATURE_COMPRESSED_BATCH. writes holds numWrites BatchedWrites, left
+ * uncompressed, followed by dataLength bytes of lzCompress output that
+ * expand to the data of each write in turn. Only the used part is sent.
+ */
+struct CompressedBatchPacket {
+  uint32_t fileId;
+  uint32_t commitNum;
+  uint8_t numWrites;
+  uint16_t dataLength;
+  uint8_t writes[MAX_DATAGRAM_SIZE - PACKET_HEADER_SIZE - COMPRESSED_BATCH_HEADER_SIZE];
+} __attribute__((packed));
+typedef struct CompressedBatchPacket CompressedBatchPacket;
+
+/*
+ * checksum is the commitChecksum of the commit's writes. A server
+ * that staged something else throws it away and asks for it again,
+ * and echoes the checksum it got in its ReadyToCommit.
+ */
 struct CommitRequestPacket {
   uint32_t fileId;
   uint32_t commitNum;
-  uint8_t finalWriteNum;
+  uint32_t finalWriteNum;
+  uint32_t checksum;
 } __attribute__((packed));
 typedef struct CommitRequestPacket CommitRequestPacket;
 
@@ -60,12 +137,20 @@ struct ReadyToCommitPacket {
   uint32_t serverId;
   uint32_t fileId;
   uint32_t commitNum;
+  uint32_t checksum;
 } __attribute__((packed));
 typedef struct ReadyToCommitPacket ReadyToCommitPacket;
 
+/*
+ * The final order to apply a commit. It carries the commit's write
+ * count and checksum so a server that wasn't ready can ask for what
+ * it is missing and apply the commit once it has caught up.
+ */
 struct CommitPacket {
   uint32_t fileId;
   uint32_t commitNum;
+  uint32_t finalWriteNum;
+  uint32_t checksum;
   uint8_t closeFlag;
 } __attribute__((packed));
 typedef struct CommitPacket CommitPacket;
@@ -77,11 +162,26 @@ struct CommitAckPacket {
 } __attribute__((packed));
 typedef struct CommitAckPacket CommitAckPacket;
 
+/* A run of count consecutive write numbers starting at first */
+struct WriteRange {
+  uint32_t first;
+  uint32_t count;
+} __attribute__((packed));
+typedef struct WriteRange WriteRange;
+
+#define MAX_RESEND_RANGES 128
+
+/*
+ * Lists the writes a server is missing as ranges of write numbers.
+ * Only the first numRanges ranges are sent. A server missing more
+ * than MAX_RESEND_RANGES runs asks for the rest next time around.
+ */
 struct WriteResendRequestPacket {
   uint32_t serverId;
   uint32_t fileId;
   uint32_t commitNum;
-  uint8_t requestedWrites[16];
+  uint16_t numRanges;
+  WriteRange ranges[MAX_RESEND_RANGES];
 } __attribute__((packed));
 typedef struct WriteResendRequestPacket WriteResendRequestPacket;
 
@@ -99,9 +199,122 @@ struct AbortAckPacket {
 } __attribute__((packed));
 typedef struct AbortAckPacket AbortAckPacket;
 
+/*
+ * Asks the server named by serverId for one block of a file. It is
+ * only answered once every commit before commitNum has been applied.
+ */
+struct ReadRequestPacket {
+  uint32_t fileId;
+  uint32_t serverId;
+  uint32_t requestId;
+  uint32_t commitNum;
+  uint32_t byteOffset;
+  uint32_t length;
+} __attribute__((packed));
+typedef struct ReadRequestPacket ReadRequestPacket;
+
+#define READ_OK 0
+#define READ_NOT_OPEN 1
+
+/*
+ * The bytes asked for, fewer if the file ends first. The data holds
+ * exactly the commits before commitNum. Only the data read is sent.
+ */
+struct ReadReplyPacket {
+  uint32_t serverId;
+  uint32_t fileId;
+  uint32_t requestId;
+  uint32_t commitNum;
+  uint32_t byteOffset;
+  uint32_t length;
+  uint8_t status;
+  uint8_t data[READ_BLOCK_SIZE];
+} __attribute__((packed));
+typedef struct ReadReplyPacket ReadReplyPacket;
+
+#define READ_REPLY_HEADER_SIZE (sizeof(ReadReplyPacket) - READ_BLOCK_SIZE)
+
+/*
+ * Sent by a server that has fallen behind on a file to the peer it is
+ * copying the file from. It starts a transfer, acknowledges every
+ * chunk before ackedSeq, and with retryFlag set asks for everything
+ * after that to be sent again. The copy is only finished once it
+ * holds every commit before minCommitNum.
+ */
+struct ResyncRequestPacket {
+  uint32_t fileId;
+  uint32_t sourceId;
+  uint32_t requesterId;
+  uint32_t sessionId;
+  uint32_t minCommitNum;
+  uint32_t ackedSeq;
+  uint8_t retryFlag;
+} __attribute__((packed));
+typedef struct ResyncRequestPacket ResyncRequestPacket;
+
+#define RESYNC_CHUNK_SIZE MAX_WRITE_SIZE
+
+#define RESYNC_OK 0
+#define RESYNC_NOT_OPEN 1
+#define RESYNC_DONE 2
+
+/*
+ * One chunk of a file being copied to a peer, numbered by seq and
+ * checked by crc over its data. Chunks may repeat bytes sent earlier
+ * that a commit has since changed, so they are applied in seq order.
+ * A retry starts a new generation, numbered on from the last chunk
+ * acknowledged; chunks from older generations are ignored.
+ * The RESYNC_DONE chunk carries the file's name in place of data and
+ * ends a copy holding exactly the commits before commitNum.
+ */
+struct ResyncDataPacket {
+  uint32_t fileId;
+  uint32_t requesterId;
+  uint32_t sessionId;
+  uint32_t generation;
+  uint32_t seq;
+  uint32_t commitNum;
+  uint32_t byteOffset;
+  uint32_t length;
+  uint32_t crc;
+  uint8_t status;
+  uint8_t data[RESYNC_CHUNK_SIZE];
+} __attribute__((packed));
+typedef struct ResyncDataPacket ResyncDataPacket;
+
+#define RESYNC_DATA_HEADER_SIZE (sizeof(ResyncDataPacket) - RESYNC_CHUNK_SIZE)
+
+/*
+ * The servers the client counts as members as of the epoch the packet
+ * carries. It is sent whenever they change, and as a probe when a
+ * member has gone quiet. Only the first numMembers ids are sent.
+ */
+struct MembershipPacket {
+  uint16_t numMembers;
+  uint32_t memberIds[MAX_MEMBERS];
+} __attribute__((packed));
+typedef struct MembershipPacket MembershipPacket;
+
+/*
+ * JOIN is sent by a server that isn't listed in the latest membership
+ * it knows of, asking to be let in, and by members answering a probe.
+ * A server that is shutting down sends LEAVE. Both carry the sender's
+ * features, which a LEAVE leaves at 0.
+ */
+struct MemberPacket {
+  uint32_t serverId;
+  uint32_t features;
+} __attribute__((packed));
+typedef struct MemberPacket MemberPacket;
+
+//Only the data actually written is sent for a WriteBlockPacket
+#define WRITE_BLOCK_HEADER_SIZE (sizeof(WriteBlockPacket) - MAX_WRITE_SIZE)
+
 struct ReplfsPacket {
   uint8_t type;
-  uint8_t body[sizeof(WriteBlockPacket)];
+  uint32_t epoch;
+  uint8_t body[sizeof(WriteBatchPacket) > sizeof(WriteBlockPacket) ?
+               sizeof(WriteBatchPacket) : sizeof(WriteBlockPacket)];
 } __attribute__((packed));
 typedef struct ReplfsPacket ReplfsPacket;
 
@@ -2,96 +2,627 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/time.h>
+#include <time.h>
 #include <unistd.h>
 #include <netdb.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <pthread.h>
+#include <errno.h>
 #include <arpa/inet.h>
 #include <stdbool.h>
 #include "packets.h"
+#include "simnet.h"
+#include "metrics.h"
 #include "log.h"
 #include <string>
+#include <string.h>
+#include <queue>
+#include <set>
+#include <map>
+#include <vector>
+#include <atomic>
 
-#define USEC_PER_SEC 1000000
-#define USEC_PER_MSEC 1000
-
-#define HEARTBEAT_USEC (HEARTBEAT_MSEC * (USEC_PER_MSEC))
+struct Timer {
+  uint64_t deadline;
+  TimerId id;
+  bool operator>(const Timer& other) const {
+    return deadline > other.deadline;
+  }
+};
 
 static int theSocket;
 Sockaddr address;
 static Sockaddr groupAddr;
 static int dropPercent;
+//packets of corruptType still to be sent corrupted
+static std::atomic<uint8_t> corruptType(0);
+static std::atomic<int> corruptLeft(0);
+
+/*
+ * What each endpoint of the network keeps to itself. A process on the
+ * real network is one node, shared by all of its threads. On the
+ * simulated network a process can run any number of nodes, each
+ * thread acting as the node it last made current.
+ */
+struct NetNode {
+  //stamped on every packet sent
+  std::atomic<uint32_t> epoch;
+  //pending timers, soonest first. Cancelled timers are left in
+  //the heap and skipped when they reach the top.
+  std::priority_queue<Timer,std::vector<Timer>,std::greater<Timer> > timers;
+  std::set<TimerId> activeTimers;
+  TimerId lastTimerId;
+  //datagrams taken off the network by the last receive, handed out in turn.
+  //A buffer handed over with its datagram is replaced before the next receive.
+  PacketBuffer* receiveBuffers[RECEIVE_BATCH];
+  Sockaddr receiveSources[RECEIVE_BATCH];
+  size_t receiveLengths[RECEIVE_BATCH];
+  int numReceived;
+  int nextReceived;
+  //smoothed round trip time and its variation, in usecs
+  bool haveRttSample;
+  uint64_t srtt;
+  uint64_t rttvar;
+  //its endpoint on the simulated network, and what netStep calls on its turn
+  int endpoint;
+  NodeHandler handler;
+  void* handlerContext;
+};
+
+static NetNode processNode;
+static thread_local NetNode* currentNode = &processNode;
+//the nodes on the simulated network, numbered as netAddNode returned them
+static std::vector<NetNode*> simNodes;
+
+/* A simulated node with a timer due at a given time */
+struct NodeTimer {
+  uint64_t deadline;
+  int node;
+  bool operator>(const NodeTimer& other) const {
+    if(deadline != other.deadline) return deadline > other.deadline;
+    return node > other.node;
+  }
+};
+
+//every simulated node's timers, soonest first, so netNextNode needn't
+//look at every node. Entries for timers that have fired or been
+//cancelled are skipped when they reach the top.
+static std::priority_queue<NodeTimer,std::vector<NodeTimer>,std::greater<NodeTimer> > simTimers;
+
+/*
+ * How datagrams get between nodes: UDP multicast to start with, or
+ * the simulated network once netSimulate is called.
+ */
+struct Transport {
+  //sends count datagrams queued by the calling thread
+  void (*send)(struct iovec* datagrams, int count);
+  //fills the current node's receive ring, first waiting up to waitUsec
+  //(forever if negative) for something to arrive
+  void (*receive)(int64_t waitUsec);
+};
+
+static void socketSend(struct iovec* datagrams, int count);
+static void socketReceive(int64_t waitUsec);
+static void simulatedSend(struct iovec* datagrams, int count);
+static void simulatedReceive(int64_t waitUsec);
+
+static const Transport socketTransport = {socketSend, socketReceive};
+static const Transport simulatedTransport = {simulatedSend, simulatedReceive};
+static const Transport* transport = &socketTransport;
+
+//timers and round trip estimates may be used from any thread
+static pthread_mutex_t netLock = PTHREAD_MUTEX_INITIALIZER;
+//set on threads that have waited for events
+static thread_local bool handlingEvents = false;
+//written to cut a wait short when another thread sets an earlier timer
+static int wakeupFd = -1;
+
+struct Watch {
+  FdCallback callback;
+  void* context;
+};
 
-static void convertIncoming(ReplfsPacket* packet);
-static void convertOutgoing(ReplfsPacket* packet);
-static size_t packetSize(uint8_t type);
+//the socket and every watched descriptor are registered with epoll
+static int epollFd = -1;
+//most ready descriptors taken from epoll at once
+#define MAX_READY_FDS 16
+//descriptors other than the socket, and what to do when they are readable
+static std::map<int,Watch> watchedFds;
 
-static void receivePacket(ReplfsPacket* packet, struct sockaddr* source);
-static void incrementTimeout(struct timeval* timeout);
-static void subtractTimevals(const struct timeval* one, const struct timeval* two, struct timeval* result);
+//recvmmsg's view of the process node's receive ring
+static struct iovec receiveIov[RECEIVE_BATCH];
+static struct mmsghdr receiveHeaders[RECEIVE_BATCH];
+
+//packets waiting for the next sendmmsg. Each thread sending
+//packets has its own queue, so threads can cork independently.
+static thread_local ReplfsPacket sendBuffers[SEND_BATCH];
+static thread_local struct iovec sendIov[SEND_BATCH];
+static thread_local struct mmsghdr sendHeaders[SEND_BATCH];
+static thread_local int numQueued = 0;
+static thread_local int corkDepth = 0;
+
+static bool convertIncoming(ReplfsPacket* packet, size_t length);
+static void convertOutgoing(ReplfsPacket* packet, size_t length);
+static size_t packetSize(uint8_t type, void* body);
+
+static bool getEvent(ReplfsEvent* event, bool block, bool handOver);
+static bool nextTimerDue(uint64_t now, TimerId* timer, uint64_t* waitUsec);
+static bool soonestTimer(NetNode* node, Timer* timer);
+static void Error(std::string errorString);
+static void receiveBatch();
+static bool takeReceived(ReplfsEvent* event, bool handOver);
+static void refillReceiveBuffers(NetNode* node);
+static void flushSends();
 static inline uint32_t ntohl_wrap(uint32_t in){ return ntohl(in);}
 static inline uint32_t htonl_wrap(uint32_t in){ return htonl(in);}
 
 /* Returns the next event*/
 void nextEvent(ReplfsEvent* event){
-  static bool nextTimeoutInitialized = false;
-  static struct timeval nextTimeout;
-  if(!nextTimeoutInitialized){
-    gettimeofday(&nextTimeout,NULL);
-    incrementTimeout(&nextTimeout);
-    nextTimeoutInitialized = true;
-  }
-  struct timeval currTime;
-  gettimeofday(&currTime,NULL);
-  struct timeval timeTillTimeout;
-  subtractTimevals(&nextTimeout,&currTime,&timeTillTimeout);
-  fd_set fdmask;
-  FD_ZERO(&fdmask);
-  FD_SET(theSocket,&fdmask);
-  if(select(theSocket+1,&fdmask,NULL,NULL,&timeTillTimeout) > 0){
-    receivePacket(event->packet,(struct sockaddr*)&(event->source));
-    convertIncoming(event->packet);
-    event->type = PACKET_EVENT;
+  getEvent(event,true,false);
+}
+
+static int getEvents(ReplfsEvent* events, int maxEvents, bool handOver){
+  if(maxEvents <= 0) return 0;
+  getEvent(&events[0],true,handOver);
+  int numEvents = 1;
+  while(numEvents < maxEvents && getEvent(&events[numEvents],false,handOver)) numEvents++;
+  return numEvents;
+}
+
+int nextEvents(ReplfsEvent* events, int maxEvents){
+  return getEvents(events,maxEvents,false);
+}
+
+int nextBufferedEvents(ReplfsEvent* events, int maxEvents){
+  return getEvents(events,maxEvents,true);
+}
+
+/* Returns the next event if one is already pending */
+bool pollEvent(ReplfsEvent* event){
+  return getEvent(event,false,false);
+}
+
+int pollBufferedEvents(ReplfsEvent* events, int maxEvents){
+  int numEvents = 0;
+  while(numEvents < maxEvents && getEvent(&events[numEvents],false,true)) numEvents++;
+  return numEvents;
+}
+
+static void createEpoll(){
+  if(epollFd != -1) return;
+  epollFd = epoll_create1(0);
+  if(epollFd < 0) Error("Can't create epoll instance");
+}
+
+void watchFd(int fd, FdCallback callback, void* context){
+  createEpoll();
+  Watch watch = {callback, context};
+  bool known = watchedFds.count(fd) != 0;
+  watchedFds[fd] = watch;
+  if(known) return;
+  struct epoll_event interest;
+  memset(&interest,0,sizeof(interest));
+  interest.events = EPOLLIN;
+  interest.data.fd = fd;
+  if(epoll_ctl(epollFd,EPOLL_CTL_ADD,fd,&interest) < 0) Error("Can't watch descriptor");
+}
+
+void unwatchFd(int fd){
+  if(watchedFds.erase(fd) == 0) return;
+  epoll_ctl(epollFd,EPOLL_CTL_DEL,fd,NULL);
+}
+
+/*
+ * Waits up to waitUsec (forever if negative) for the socket or a
+ * watched descriptor to become readable. Watched descriptors have
+ * their callbacks run, and a readable socket is drained into the
+ * receive ring.
+ */
+static void socketReceive(int64_t waitUsec){
+  struct epoll_event ready[MAX_READY_FDS];
+  struct timespec timeout;
+  timeout.tv_sec = waitUsec / USEC_PER_SEC;
+  timeout.tv_nsec = (waitUsec % USEC_PER_SEC) * 1000;
+  int numReady = epoll_pwait2(epollFd,ready,MAX_READY_FDS,waitUsec < 0 ? NULL : &timeout,NULL);
+  if(numReady < 0 && errno == ENOSYS){
+    //kernels before 5.11 only wait in whole milliseconds, so round up
+    int waitMsec = waitUsec < 0 ? -1 : (waitUsec + USEC_PER_MSEC - 1) / USEC_PER_MSEC;
+    numReady = epoll_wait(epollFd,ready,MAX_READY_FDS,waitMsec);
+  }
+  for(int i = 0; i < numReady; i++){
+    int fd = ready[i].data.fd;
+    if(fd == theSocket){
+      receiveBatch();
+      continue;
+    }
+    if(fd == wakeupFd){
+      uint64_t count;
+      if(read(wakeupFd,&count,sizeof(count)) < 0) LOG("Unable to clear wakeup\n");
+      continue;
+    }
+    //an earlier callback may have unwatched it
+    std::map<int,Watch>::iterator watch = watchedFds.find(fd);
+    if(watch != watchedFds.end()) watch->second.callback(fd,watch->second.context);
+  }
+}
+
+/*
+ * Due timers are handed out before waiting packets so that a
+ * steady stream of traffic can't hold up retransmissions.
+ */
+static bool getEvent(ReplfsEvent* event, bool block, bool handOver){
+  handlingEvents = true;
+  event->buffer = NULL;
+  while(true){
+    TimerId timer;
+    uint64_t waitUsec;
+    pthread_mutex_lock(&netLock);
+    bool haveTimer = nextTimerDue(monotonicUsec(),&timer,&waitUsec);
+    pthread_mutex_unlock(&netLock);
+    if(haveTimer && waitUsec == 0){
+      event->type = TIMER_EVENT;
+      event->timer = timer;
+      memset(&(event->source),0, sizeof(event->source));
+      return true;
+    }
+    if(takeReceived(event,handOver)) return true;
+    //nothing queued may be held back while the caller waits for replies
+    flushSends();
+    if(!block){
+      transport->receive(0);
+      if(currentNode->numReceived == currentNode->nextReceived) return false;
+    }else{
+      transport->receive(haveTimer ? (int64_t) waitUsec : -1);
+    }
+  }
+}
+
+/* Finds a node's soonest live timer, dropping cancelled ones on the way */
+static bool soonestTimer(NetNode* node, Timer* timer){
+  while(!node->timers.empty() && node->activeTimers.count(node->timers.top().id) == 0){
+    node->timers.pop();
+  }
+  if(node->timers.empty()) return false;
+  *timer = node->timers.top();
+  return true;
+}
+
+/*
+ * Finds the current node's soonest live timer. Returns false if there
+ * are none, otherwise fills in its id and how long until it is due.
+ */
+static bool nextTimerDue(uint64_t now, TimerId* timer, uint64_t* waitUsec){
+  Timer next;
+  if(!soonestTimer(currentNode,&next)) return false;
+  *timer = next.id;
+  if(next.deadline <= now){
+    currentNode->timers.pop();
+    currentNode->activeTimers.erase(next.id);
+    *waitUsec = 0;
   }else{
-    incrementTimeout(&nextTimeout);
-    event->type = HEARTBEAT_EVENT;
-    memset(&(event->source),0, sizeof(event->source));
-    memset(event->packet,0, sizeof(event->packet));
+    *waitUsec = next.deadline - now;
+  }
+  return true;
+}
+
+/* Gives the node a buffer in place of each one handed over */
+static void refillReceiveBuffers(NetNode* node){
+  for(int i = 0; i < RECEIVE_BATCH; i++){
+    if(node->receiveBuffers[i] == NULL) node->receiveBuffers[i] = packetPoolGet();
+  }
+}
+
+/* Takes as many datagrams as are waiting, up to RECEIVE_BATCH, off the socket */
+static void receiveBatch(){
+  refillReceiveBuffers(&processNode);
+  for(int i = 0; i < RECEIVE_BATCH; i++){
+    receiveIov[i].iov_base = &processNode.receiveBuffers[i]->packet;
+    receiveIov[i].iov_len = sizeof(ReplfsPacket);
+    receiveHeaders[i].msg_hdr.msg_name = &processNode.receiveSources[i];
+    receiveHeaders[i].msg_hdr.msg_namelen = sizeof(Sockaddr);
+    receiveHeaders[i].msg_hdr.msg_iov = &receiveIov[i];
+    receiveHeaders[i].msg_hdr.msg_iovlen = 1;
+    receiveHeaders[i].msg_hdr.msg_control = NULL;
+    receiveHeaders[i].msg_hdr.msg_controllen = 0;
+    receiveHeaders[i].msg_hdr.msg_flags = 0;
+  }
+  int received = recvmmsg(theSocket,receiveHeaders,RECEIVE_BATCH,MSG_DONTWAIT,NULL);
+  processNode.numReceived = received > 0 ? received : 0;
+  processNode.nextReceived = 0;
+  for(int i = 0; i < processNode.numReceived; i++){
+    processNode.receiveLengths[i] = receiveHeaders[i].msg_len;
+  }
+}
+
+/*
+ * Hands out the next well-formed datagram from the last batch
+ * received, either copied into the event's packet or, to hand it
+ * over, in the buffer it arrived in.
+ */
+static bool takeReceived(ReplfsEvent* event, bool handOver){
+  NetNode* node = currentNode;
+  while(node->nextReceived < node->numReceived){
+    int index = node->nextReceived++;
+    size_t length = node->receiveLengths[index];
+    if(length == 0) continue;
+    PacketBuffer* buffer = node->receiveBuffers[index];
+    if(handOver){
+      event->packet = &buffer->packet;
+    }else{
+      memcpy(event->packet,&buffer->packet,length);
+    }
+    if(convertIncoming(event->packet,length)){
+      memcpy(&(event->source),&node->receiveSources[index],sizeof(Sockaddr));
+      event->type = PACKET_EVENT;
+      if(handOver){
+        buffer->length = length;
+        event->buffer = buffer;
+        node->receiveBuffers[index] = NULL;
+      }
+      metricAdd(METRIC_RECEIVED(event->packet->type),1);
+      metricAdd(METRIC_BYTES_RECEIVED,length);
+      return true;
+    }
+    LOG("Discarding malformed packet\n");
+    metricAdd(METRIC_MALFORMED,1);
   }
-  return;
+  return false;
 }
 
-static void receivePacket(ReplfsPacket* packet, struct sockaddr* source){
-  socklen_t fromLen = sizeof(struct sockaddr);
-  recvfrom(theSocket,packet,sizeof(ReplfsPacket),0,source,&fromLen);
+uint64_t monotonicUsec(){
+  if(simulating()) return simClock();
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (uint64_t) now.tv_sec * USEC_PER_SEC + now.tv_nsec / 1000;
 }
 
-static void incrementTimeout(struct timeval* timeout){
-  timeout->tv_usec += HEARTBEAT_USEC;
-  if(timeout->tv_usec >= USEC_PER_SEC){
-    timeout->tv_sec += timeout->tv_usec / USEC_PER_SEC;
-    timeout->tv_usec %= USEC_PER_SEC;
+/*
+ * The thread waiting for events only looks at the timers before it
+ * starts waiting, so a timer set elsewhere that is due sooner than
+ * the rest has to wake it up.
+ */
+TimerId setTimer(uint64_t delayUsec){
+  NetNode* node = currentNode;
+  Timer timer;
+  timer.deadline = monotonicUsec() + delayUsec;
+  pthread_mutex_lock(&netLock);
+  timer.id = ++node->lastTimerId;
+  node->timers.push(timer);
+  node->activeTimers.insert(timer.id);
+  bool soonest = node->timers.top().id == timer.id;
+  if(node != &processNode){
+    NodeTimer nodeTimer = {timer.deadline, node->endpoint};
+    simTimers.push(nodeTimer);
+  }
+  pthread_mutex_unlock(&netLock);
+  if(soonest && !handlingEvents && wakeupFd >= 0){
+    uint64_t count = 1;
+    if(write(wakeupFd,&count,sizeof(count)) < 0) LOG("Unable to wake event loop\n");
   }
+  return timer.id;
 }
 
-static void subtractTimevals(const struct timeval* one, const struct timeval* two, struct timeval* result){
-  long usecs = (one->tv_sec - two->tv_sec) * USEC_PER_SEC;
-  usecs += (one->tv_usec - two->tv_usec);
-  result->tv_usec = usecs % USEC_PER_SEC;
-  result->tv_sec = usecs / USEC_PER_SEC;
+void cancelTimer(TimerId timer){
+  pthread_mutex_lock(&netLock);
+  currentNode->activeTimers.erase(timer);
+  pthread_mutex_unlock(&netLock);
+}
+
+/* Updates the estimates the way TCP does (RFC 6298) */
+void rttSample(uint64_t usec){
+  NetNode* node = currentNode;
+  pthread_mutex_lock(&netLock);
+  if(!node->haveRttSample){
+    node->srtt = usec;
+    node->rttvar = usec / 2;
+    node->haveRttSample = true;
+  }else{
+    uint64_t delta = node->srtt > usec ? node->srtt - usec : usec - node->srtt;
+    node->rttvar = (3 * node->rttvar + delta) / 4;
+    node->srtt = (7 * node->srtt + usec) / 8;
+  }
+  pthread_mutex_unlock(&netLock);
+}
+
+uint64_t retransmitTimeout(){
+  pthread_mutex_lock(&netLock);
+  bool haveSample = currentNode->haveRttSample;
+  uint64_t rto = currentNode->srtt + 4 * currentNode->rttvar;
+  pthread_mutex_unlock(&netLock);
+  if(!haveSample) return INITIAL_RTO_MSEC * USEC_PER_MSEC;
+  if(rto < MIN_RTO_USEC) rto = MIN_RTO_USEC;
+  if(rto > MAX_RTO_USEC) rto = MAX_RTO_USEC;
+  return rto;
 }
 
 int sendPacket(void* packet, uint8_t type){
   if((rand() % 100) < dropPercent){
     LOG("Dropping packet of type 0x%x\n",type);
+    metricAdd(METRIC_DROPPED,1);
     return-1;
   }
-  ReplfsPacket outerPacket;
-  outerPacket.type = type;
-  if(packet){
-    memcpy(&(outerPacket.body),packet,packetSize(type));
-    convertOutgoing(&outerPacket);
+  ReplfsPacket* outerPacket = &sendBuffers[numQueued];
+  outerPacket->type = type;
+  outerPacket->epoch = currentNode->epoch;
+  size_t size = packetSize(type,packet);
+  if(packet) memcpy(&(outerPacket->body),packet,size - PACKET_HEADER_SIZE);
+  if(type == corruptType && corruptLeft > 0 && corruptLeft-- > 0){
+    LOG("Corrupting packet of type 0x%x\n",type);
+    ((uint8_t*) outerPacket)[size - 1] ^= 1;
   }
-  return sendto(theSocket,&outerPacket,packetSize(type),0,(const struct sockaddr*) &groupAddr,sizeof(Sockaddr));
+  convertOutgoing(outerPacket,size);
+  sendIov[numQueued].iov_base = outerPacket;
+  sendIov[numQueued].iov_len = size;
+  numQueued++;
+  metricAdd(METRIC_SENT(type),1);
+  metricAdd(METRIC_BYTES_SENT,size);
+  if(corkDepth == 0 || numQueued == SEND_BATCH) flushSends();
+  return size;
+}
+
+void corruptSends(uint8_t type, int count){
+  corruptType = type;
+  corruptLeft = count;
+}
+
+void setEpoch(uint32_t epoch){
+  currentNode->epoch = epoch;
+}
+
+void corkSends(){
+  corkDepth++;
+}
+
+void uncorkSends(){
+  if(corkDepth > 0) corkDepth--;
+  if(corkDepth == 0) flushSends();
+}
+
+/* Sends every packet the calling thread has queued */
+static void flushSends(){
+  if(numQueued > 0) transport->send(sendIov,numQueued);
+  numQueued = 0;
+}
+
+/* Sends datagrams to the multicast group, in as few sendmmsg calls as it takes */
+static void socketSend(struct iovec* datagrams, int count){
+  for(int i = 0; i < count; i++){
+    sendHeaders[i].msg_hdr.msg_name = &groupAddr;
+    sendHeaders[i].msg_hdr.msg_namelen = sizeof(Sockaddr);
+    sendHeaders[i].msg_hdr.msg_iov = &datagrams[i];
+    sendHeaders[i].msg_hdr.msg_iovlen = 1;
+    sendHeaders[i].msg_hdr.msg_control = NULL;
+    sendHeaders[i].msg_hdr.msg_controllen = 0;
+    sendHeaders[i].msg_hdr.msg_flags = 0;
+  }
+  int sent = 0;
+  while(sent < count){
+    int result = sendmmsg(theSocket,&sendHeaders[sent],count - sent,0);
+    if(result <= 0){
+      LOG("Unable to send %d packets\n",count - sent);
+      break;
+    }
+    sent += result;
+  }
+}
+
+static void simulatedSend(struct iovec* datagrams, int count){
+  for(int i = 0; i < count; i++){
+    simSend(currentNode->endpoint,datagrams[i].iov_base,datagrams[i].iov_len);
+  }
+}
+
+/*
+ * Waiting on the simulated network moves virtual time on to whichever
+ * comes first, the end of the wait or the next arrival. Nothing else
+ * can happen meanwhile, so a node that would wait forever is a bug.
+ */
+static void simulatedReceive(int64_t waitUsec){
+  NetNode* node = currentNode;
+  if(waitUsec != 0){
+    uint64_t arrival;
+    bool arriving = simNextArrival(node->endpoint,&arrival);
+    if(!arriving && waitUsec < 0) Error("Simulated node is waiting with nothing to wait for");
+    uint64_t until = waitUsec < 0 ? arrival : simClock() + waitUsec;
+    if(arriving && arrival < until) until = arrival;
+    simAdvance(until);
+  }
+  node->numReceived = 0;
+  node->nextReceived = 0;
+  refillReceiveBuffers(node);
+  while(node->numReceived < RECEIVE_BATCH){
+    int index = node->numReceived;
+    size_t length = simReceive(node->endpoint,&node->receiveBuffers[index]->packet,
+                               sizeof(ReplfsPacket),&node->receiveSources[index]);
+    if(length == 0) break;
+    node->receiveLengths[index] = length;
+    node->numReceived++;
+  }
+}
+
+void netSimulate(const SimConfig* config){
+  for(size_t i = 0; i < simNodes.size(); i++){
+    for(int j = 0; j < RECEIVE_BATCH; j++){
+      if(simNodes[i]->receiveBuffers[j] != NULL) packetPoolRelease(simNodes[i]->receiveBuffers[j]);
+    }
+    delete simNodes[i];
+  }
+  simNodes.clear();
+  while(!simTimers.empty()) simTimers.pop();
+  simInit(config);
+  transport = &simulatedTransport;
+  dropPercent = 0;
+  currentNode = &processNode;
+}
+
+/* A node's number is also its endpoint in simnet.h */
+int netAddNode(unsigned short port){
+  NetNode* node = new NetNode();
+  node->endpoint = simAttach(port);
+  simNodes.push_back(node);
+  currentNode = node;
+  return simNodes.size() - 1;
+}
+
+void netUseNode(int node){
+  currentNode = simNodes[node];
+}
+
+int netCurrentNode(){
+  return currentNode == &processNode ? -1 : currentNode->endpoint;
+}
+
+/*
+ * Finds the node with the soonest timer or arrival, ties going to the
+ * lowest numbered, so that the same seed always runs the same way.
+ * A node that hasn't handled everything it received goes first.
+ */
+int netNextNode(){
+  if(currentNode != &processNode && currentNode->nextReceived < currentNode->numReceived){
+    return currentNode->endpoint;
+  }
+  int next = -1;
+  uint64_t soonest = 0;
+  pthread_mutex_lock(&netLock);
+  while(!simTimers.empty()){
+    NodeTimer top = simTimers.top();
+    Timer timer;
+    if(soonestTimer(simNodes[top.node],&timer) && timer.deadline <= top.deadline){
+      next = top.node;
+      soonest = top.deadline;
+      break;
+    }
+    simTimers.pop();
+  }
+  pthread_mutex_unlock(&netLock);
+  int endpoint;
+  uint64_t arrival;
+  if(simSoonestArrival(&endpoint,&arrival) &&
+     (next == -1 || arrival < soonest || (arrival == soonest && endpoint < next))){
+    next = endpoint;
+    soonest = arrival;
+  }
+  if(next == -1) return -1;
+  simAdvance(soonest);
+  currentNode = simNodes[next];
+  return next;
+}
+
+void netSetHandler(int node, NodeHandler handler, void* context){
+  simNodes[node]->handler = handler;
+  simNodes[node]->handlerContext = context;
+}
+
+int netStep(){
+  flushSends();
+  int next = netNextNode();
+  if(next < 0) return -1;
+  NetNode* node = simNodes[next];
+  if(node->handler != NULL) node->handler(node->handlerContext);
+  flushSends();
+  return next;
 }
 
 static void Error(std::string errorString){
@@ -127,6 +658,13 @@ void netInit(unsigned short replfsPort, int packetLoss){
 		Error("setsockopt failed (SO_REUSEPORT)");
 	}
 #endif
+  //large commits arrive in bursts, give the kernel room to queue them.
+  //the kernel caps these at its own limits, so failure isn't fatal
+  int bufferSize = SOCKET_BUFFER_BYTES;
+  if (setsockopt(theSocket, SOL_SOCKET, SO_RCVBUF, &bufferSize, sizeof(bufferSize)) < 0 ||
+      setsockopt(theSocket, SOL_SOCKET, SO_SNDBUF, &bufferSize, sizeof(bufferSize)) < 0) {
+    LOG("Unable to enlarge socket buffers\n");
+  }
   //bind the socket to address nullAddr
 	Sockaddr nullAddr;
 	nullAddr.sin_family = AF_INET;
@@ -150,6 +688,20 @@ void netInit(unsigned short replfsPort, int packetLoss){
   //Get the multi-cast address ready to use
   memcpy(&groupAddr, &nullAddr, sizeof(Sockaddr));
   groupAddr.sin_addr.s_addr = htonl(GROUP);
+  createEpoll();
+  struct epoll_event interest;
+  memset(&interest,0,sizeof(interest));
+  interest.events = EPOLLIN;
+  interest.data.fd = theSocket;
+  if(epoll_ctl(epollFd,EPOLL_CTL_ADD,theSocket,&interest) < 0){
+    Error("Can't watch socket");
+  }
+  wakeupFd = eventfd(0,EFD_NONBLOCK);
+  if(wakeupFd < 0) Error("Can't create wakeup descriptor");
+  interest.data.fd = wakeupFd;
+  if(epoll_ctl(epollFd,EPOLL_CTL_ADD,wakeupFd,&interest) < 0){
+    Error("Can't watch wakeup descriptor");
+  }
 }
 
 static Sockaddr* resolveHost(register char* name){
@@ -177,6 +729,7 @@ static uint32_t convertLong(uint32_t toConvert,bool incoming){
 
 static void convertRollCallAck(RollCallAckPacket* packet, bool incoming){
   packet->proposedId = convertLong(packet->proposedId,incoming);
+  packet->features = convertLong(packet->features,incoming);
 }
 
 static void convertOpenFile(OpenFilePacket* packet,bool incoming){
@@ -191,27 +744,167 @@ static void convertOpenFileAck(OpenFileAckPacket* packet, bool incoming){
 static void convertWriteBlock(WriteBlockPacket* packet, bool incoming){
   packet->fileId = convertLong(packet->fileId,incoming);
   packet->commitNum = convertLong(packet->commitNum,incoming);
+  packet->writeNum = convertLong(packet->writeNum,incoming);
   packet->byteOffset = convertLong(packet->byteOffset,incoming);
   packet->blockSize = convertLong(packet->blockSize,incoming);
+  packet->crc = convertLong(packet->crc,incoming);
+}
+
+/*
+ * Walks the writes in a batch, converting each one's header.
+ * Returns false if the batch doesn't fit in bodyLength bytes.
+ */
+static bool convertWriteBatch(WriteBatchPacket* packet, bool incoming, size_t bodyLength){
+  packet->fileId = convertLong(packet->fileId,incoming);
+  packet->commitNum = convertLong(packet->commitNum,incoming);
+  size_t offset = 0;
+  size_t available = bodyLength - WRITE_BATCH_HEADER_SIZE;
+  for(int i = 0; i < packet->numWrites; i++){
+    if(offset + sizeof(BatchedWrite) > available) return false;
+    BatchedWrite* write = (BatchedWrite*) (packet->writes + offset);
+    write->writeNum = convertLong(write->writeNum,incoming);
+    write->byteOffset = convertLong(write->byteOffset,incoming);
+    write->crc = convertLong(write->crc,incoming);
+    uint32_t blockSize = incoming ? ntohl(write->blockSize) : write->blockSize;
+    write->blockSize = convertLong(write->blockSize,incoming);
+    if(blockSize > MAX_WRITE_SIZE) return false;
+    offset += sizeof(BatchedWrite) + blockSize;
+    if(offset > available) return false;
+  }
+  return true;
+}
+
+/*
+ * Converts the write headers ahead of a compressed batch's data.
+ * Returns false if they and the data don't fit in bodyLength bytes,
+ * or the data would expand past MAX_BATCH_DATA.
+ */
+static bool convertCompressedBatch(CompressedBatchPacket* packet, bool incoming, size_t bodyLength){
+  packet->fileId = convertLong(packet->fileId,incoming);
+  packet->commitNum = convertLong(packet->commitNum,incoming);
+  uint16_t dataLength = incoming ? ntohs(packet->dataLength) : packet->dataLength;
+  packet->dataLength = incoming ? ntohs(packet->dataLength) : htons(packet->dataLength);
+  size_t headersSize = packet->numWrites * sizeof(BatchedWrite);
+  if(headersSize + dataLength > bodyLength - COMPRESSED_BATCH_HEADER_SIZE) return false;
+  size_t expanded = 0;
+  for(int i = 0; i < packet->numWrites; i++){
+    BatchedWrite* write = (BatchedWrite*) (packet->writes + i * sizeof(BatchedWrite));
+    write->writeNum = convertLong(write->writeNum,incoming);
+    write->byteOffset = convertLong(write->byteOffset,incoming);
+    write->crc = convertLong(write->crc,incoming);
+    uint32_t blockSize = incoming ? ntohl(write->blockSize) : write->blockSize;
+    write->blockSize = convertLong(write->blockSize,incoming);
+    if(blockSize > MAX_WRITE_SIZE) return false;
+    expanded += blockSize;
+  }
+  return expanded <= MAX_BATCH_DATA;
 }
 
 static void convertCommitRequest(CommitRequestPacket* packet, bool incoming){
   packet->commitNum = convertLong(packet->commitNum,incoming);
   packet->fileId = convertLong(packet->fileId,incoming);
+  packet->finalWriteNum = convertLong(packet->finalWriteNum,incoming);
+  packet->checksum = convertLong(packet->checksum,incoming);
+}
+
+/* Returns false if the packet claims more ranges than it can hold */
+static bool convertWriteResendRequest(WriteResendRequestPacket* packet, bool incoming){
+  packet->serverId = convertLong(packet->serverId,incoming);
+  packet->fileId = convertLong(packet->fileId,incoming);
+  packet->commitNum = convertLong(packet->commitNum,incoming);
+  uint16_t numRanges = incoming ? ntohs(packet->numRanges) : packet->numRanges;
+  packet->numRanges = incoming ? ntohs(packet->numRanges) : htons(packet->numRanges);
+  if(numRanges > MAX_RESEND_RANGES) return false;
+  for(int i = 0; i < numRanges; i++){
+    packet->ranges[i].first = convertLong(packet->ranges[i].first,incoming);
+    packet->ranges[i].count = convertLong(packet->ranges[i].count,incoming);
+  }
+  return true;
 }
 
 static void convertReadyToCommit(ReadyToCommitPacket* packet,bool incoming){
   packet->serverId = convertLong(packet->serverId,incoming);
   packet->fileId = convertLong(packet->fileId,incoming);
   packet->commitNum = convertLong(packet->commitNum,incoming);
+  packet->checksum = convertLong(packet->checksum,incoming);
+}
+
+static void convertCommitAck(CommitAckPacket* packet,bool incoming){
+  packet->serverId = convertLong(packet->serverId,incoming);
+  packet->fileId = convertLong(packet->fileId,incoming);
+  packet->commitNum = convertLong(packet->commitNum,incoming);
 }
 
 static void convertCommit(CommitPacket* packet, bool incoming){
   packet->fileId = convertLong(packet->fileId,incoming);
   packet->commitNum = convertLong(packet->commitNum,incoming);
+  packet->finalWriteNum = convertLong(packet->finalWriteNum,incoming);
+  packet->checksum = convertLong(packet->checksum,incoming);
+}
+
+static void convertAbort(AbortPacket* packet, bool incoming){
+  packet->fileId = convertLong(packet->fileId,incoming);
+  packet->commitNum = convertLong(packet->commitNum,incoming);
+}
+
+static void convertReadRequest(ReadRequestPacket* packet, bool incoming){
+  packet->fileId = convertLong(packet->fileId,incoming);
+  packet->serverId = convertLong(packet->serverId,incoming);
+  packet->requestId = convertLong(packet->requestId,incoming);
+  packet->commitNum = convertLong(packet->commitNum,incoming);
+  packet->byteOffset = convertLong(packet->byteOffset,incoming);
+  packet->length = convertLong(packet->length,incoming);
 }
 
-static void convertPacket(ReplfsPacket* packet, bool incoming){
+static void convertReadReply(ReadReplyPacket* packet, bool incoming){
+  packet->serverId = convertLong(packet->serverId,incoming);
+  packet->fileId = convertLong(packet->fileId,incoming);
+  packet->requestId = convertLong(packet->requestId,incoming);
+  packet->commitNum = convertLong(packet->commitNum,incoming);
+  packet->byteOffset = convertLong(packet->byteOffset,incoming);
+  packet->length = convertLong(packet->length,incoming);
+}
+
+static void convertResyncRequest(ResyncRequestPacket* packet, bool incoming){
+  packet->fileId = convertLong(packet->fileId,incoming);
+  packet->sourceId = convertLong(packet->sourceId,incoming);
+  packet->requesterId = convertLong(packet->requesterId,incoming);
+  packet->sessionId = convertLong(packet->sessionId,incoming);
+  packet->minCommitNum = convertLong(packet->minCommitNum,incoming);
+  packet->ackedSeq = convertLong(packet->ackedSeq,incoming);
+}
+
+static void convertResyncData(ResyncDataPacket* packet, bool incoming){
+  packet->fileId = convertLong(packet->fileId,incoming);
+  packet->requesterId = convertLong(packet->requesterId,incoming);
+  packet->sessionId = convertLong(packet->sessionId,incoming);
+  packet->generation = convertLong(packet->generation,incoming);
+  packet->seq = convertLong(packet->seq,incoming);
+  packet->commitNum = convertLong(packet->commitNum,incoming);
+  packet->byteOffset = convertLong(packet->byteOffset,incoming);
+  packet->length = convertLong(packet->length,incoming);
+  packet->crc = convertLong(packet->crc,incoming);
+}
+
+/* Returns false if the list is longer than any we send */
+static bool convertMembership(MembershipPacket* packet, bool incoming){
+  uint16_t numMembers = incoming ? ntohs(packet->numMembers) : packet->numMembers;
+  packet->numMembers = incoming ? ntohs(packet->numMembers) : htons(packet->numMembers);
+  if(numMembers > MAX_MEMBERS) return false;
+  for(int i = 0; i < numMembers; i++){
+    packet->memberIds[i] = convertLong(packet->memberIds[i],incoming);
+  }
+  return true;
+}
+
+static void convertMember(MemberPacket* packet, bool incoming){
+  packet->serverId = convertLong(packet->serverId,incoming);
+  packet->features = convertLong(packet->features,incoming);
+}
+
+static bool convertPacket(ReplfsPacket* packet, bool incoming, size_t length){
+  size_t bodyLength = length - PACKET_HEADER_SIZE;
+  packet->epoch = convertLong(packet->epoch,incoming);
   switch(packet->type){
     case ROLL_CALL: break;
     case ROLL_CALL_ACK:
@@ -225,48 +918,132 @@ static void convertPacket(ReplfsPacket* packet, bool incoming){
       break;
     case WRITE_BLOCK:
       convertWriteBlock((WriteBlockPacket*)packet->body,incoming);
+      if(((WriteBlockPacket*)packet->body)->blockSize > MAX_WRITE_SIZE) return false;
       break;
+    case WRITE_BATCH:
+      if(bodyLength < WRITE_BATCH_HEADER_SIZE) return false;
+      return convertWriteBatch((WriteBatchPacket*)packet->body,incoming,bodyLength);
+    case COMPRESSED_BATCH:
+      if(bodyLength < COMPRESSED_BATCH_HEADER_SIZE) return false;
+      return convertCompressedBatch((CompressedBatchPacket*)packet->body,incoming,bodyLength);
     case COMMIT_REQUEST:
       convertCommitRequest((CommitRequestPacket*)packet->body,incoming);
       break;
+    case WRITE_RESEND_REQUEST:
+      return convertWriteResendRequest((WriteResendRequestPacket*)packet->body,incoming);
     case READY_TO_COMMIT:
+      convertReadyToCommit((ReadyToCommitPacket*)packet->body,incoming);
+      break;
     case COMMIT_ACK:
-    case WRITE_RESEND_REQUEST:
     case ABORT_ACK:
-      convertReadyToCommit((ReadyToCommitPacket*)packet->body,incoming);
+      convertCommitAck((CommitAckPacket*)packet->body,incoming);
       break;
     case COMMIT:
-    case ABORT:
       convertCommit((CommitPacket*)packet->body,incoming);
       break;
+    case ABORT:
+      convertAbort((AbortPacket*)packet->body,incoming);
+      break;
+    case READ_REQUEST:
+      convertReadRequest((ReadRequestPacket*)packet->body,incoming);
+      break;
+    case READ_REPLY:
+      convertReadReply((ReadReplyPacket*)packet->body,incoming);
+      if(((ReadReplyPacket*)packet->body)->length > READ_BLOCK_SIZE) return false;
+      break;
+    case RESYNC_REQUEST:
+      convertResyncRequest((ResyncRequestPacket*)packet->body,incoming);
+      break;
+    case RESYNC_DATA:
+      convertResyncData((ResyncDataPacket*)packet->body,incoming);
+      if(((ResyncDataPacket*)packet->body)->length > RESYNC_CHUNK_SIZE) return false;
+      break;
+    case MEMBERSHIP:
+      return convertMembership((MembershipPacket*)packet->body,incoming);
+    case JOIN:
+    case LEAVE:
+      convertMember((MemberPacket*)packet->body,incoming);
+      break;
   }
+  return true;
 }
 
-static void convertIncoming(ReplfsPacket* packet){
-  convertPacket(packet,true);
+/*
+ * Converts a received packet to host order. Returns false
+ * if it is shorter than its type says it should be.
+ */
+static bool convertIncoming(ReplfsPacket* packet, size_t length){
+  if(length < packetSize(packet->type,NULL)) return false;
+  if(!convertPacket(packet,true,length)) return false;
+  return length >= packetSize(packet->type,packet->body);
 }
 
-static void convertOutgoing(ReplfsPacket* packet){
-  convertPacket(packet,false);
+static void convertOutgoing(ReplfsPacket* packet, size_t length){
+  convertPacket(packet,false,length);
 }
 
-static size_t packetSize(uint8_t type){
-  size_t result = sizeof(type);
+/*
+ * The number of bytes a packet takes on the wire. Writes only
+ * carry the data they use, so their size depends on the body,
+ * which must be in host order. With no body, returns the
+ * smallest size a packet of this type can have.
+ */
+static size_t packetSize(uint8_t type, void* body){
+  size_t result = PACKET_HEADER_SIZE;
   switch(type){
     case ROLL_CALL: break;
     case ROLL_CALL_ACK: result += sizeof(RollCallAckPacket); break;
     case OPEN_FILE: result += sizeof(OpenFilePacket); break;
     case OPEN_FILE_ACK: result += sizeof(OpenFileAckPacket); break;
-    case WRITE_BLOCK: result += sizeof(WriteBlockPacket); break;
+    case WRITE_BLOCK:
+      result += WRITE_BLOCK_HEADER_SIZE;
+      if(body) result += ((WriteBlockPacket*)body)->blockSize;
+      break;
+    case WRITE_BATCH:
+      result += WRITE_BATCH_HEADER_SIZE;
+      if(body){
+        WriteBatchPacket* batch = (WriteBatchPacket*) body;
+        size_t offset = 0;
+        for(int i = 0; i < batch->numWrites; i++){
+          BatchedWrite* write = (BatchedWrite*) (batch->writes + offset);
+          offset += sizeof(BatchedWrite) + write->blockSize;
+        }
+        result += offset;
+      }
+      break;
+    case COMPRESSED_BATCH:
+      result += COMPRESSED_BATCH_HEADER_SIZE;
+      if(body){
+        CompressedBatchPacket* batch = (CompressedBatchPacket*) body;
+        result += batch->numWrites * sizeof(BatchedWrite) + batch->dataLength;
+      }
+      break;
     case COMMIT_REQUEST: result += sizeof(CommitRequestPacket); break;
     case READY_TO_COMMIT: result += sizeof(ReadyToCommitPacket); break;
     case COMMIT_ACK: result += sizeof(CommitAckPacket); break;
-    case WRITE_RESEND_REQUEST: result += sizeof(WriteResendRequestPacket); break;
-    case ABORT: result += sizeof(AbortPacket);
-    case COMMIT: result += sizeof(CommitPacket);
-    case ABORT_ACK: result += sizeof(AbortAckPacket);
+    case WRITE_RESEND_REQUEST:
+      result += sizeof(WriteResendRequestPacket) - sizeof(WriteRange) * MAX_RESEND_RANGES;
+      if(body) result += sizeof(WriteRange) * ((WriteResendRequestPacket*)body)->numRanges;
+      break;
+    case ABORT: result += sizeof(AbortPacket); break;
+    case COMMIT: result += sizeof(CommitPacket); break;
+    case ABORT_ACK: result += sizeof(AbortAckPacket); break;
+    case READ_REQUEST: result += sizeof(ReadRequestPacket); break;
+    case READ_REPLY:
+      result += READ_REPLY_HEADER_SIZE;
+      if(body) result += ((ReadReplyPacket*)body)->length;
+      break;
+    case RESYNC_REQUEST: result += sizeof(ResyncRequestPacket); break;
+    case RESYNC_DATA:
+      result += RESYNC_DATA_HEADER_SIZE;
+      if(body) result += ((ResyncDataPacket*)body)->length;
+      break;
+    case MEMBERSHIP:
+      result += sizeof(MembershipPacket) - sizeof(uint32_t) * MAX_MEMBERS;
+      if(body) result += sizeof(uint32_t) * ((MembershipPacket*)body)->numMembers;
+      break;
+    case JOIN:
+    case LEAVE: result += sizeof(MemberPacket); break;
   }
   return result;
 }
-
-
@@ -1,27 +1,50 @@
 #ifndef _replfs_net_h
-#define _replfs_het_h
+#define _replfs_net_h
 
 #include "packets.h"
+#include "simnet.h"
+#include "packet_pool.h"
 #include <netdb.h>
 
 #define PACKET_EVENT 0x01
-#define HEARTBEAT_EVENT 0x02
+#define TIMER_EVENT 0x02
 
-#define HEARTBEAT_MSEC 200
+//retransmission timeout to use before any round trips are measured
+#define INITIAL_RTO_MSEC 200
+//bounds on the adaptive retransmission timeout
+#define MIN_RTO_USEC 2000
+#define MAX_RTO_USEC 1000000
+
+#define USEC_PER_SEC 1000000
+#define USEC_PER_MSEC 1000
 
 #define GROUP 0xe0010101
 
+#define SOCKET_BUFFER_BYTES (4 * 1024 * 1024)
+
+//most datagrams taken off or put on the socket in one system call
+#define RECEIVE_BATCH 32
+#define SEND_BATCH 32
+
 /* Give a network address a shorter name */
 typedef struct sockaddr_in Sockaddr;
 
+typedef uint32_t TimerId;
+
 /* Holds information about an event in the system */
 struct ReplfsEvent {
   short type;
   Sockaddr source;
   ReplfsPacket* packet;
+  //the timer that fired, for TIMER_EVENTs
+  TimerId timer;
+  //the buffer packet is in, for events from nextBufferedEvents
+  PacketBuffer* buffer;
 };
 typedef struct ReplfsEvent ReplfsEvent;
 
+typedef void (*FdCallback)(int fd, void* context);
+
 /*
  * Connects to the network and performs housekeeping
  * to get the system ready to send and receive packets.
@@ -30,16 +53,137 @@ typedef struct ReplfsEvent ReplfsEvent;
 void netInit(unsigned short replfsPort, int dropPercent);
 
 /*
- * Sends the supplied packet out via UDP Multicast.
+ * Sends the supplied packet out via UDP Multicast. Any thread may
+ * send, set and cancel timers, and use the round trip estimates;
+ * everything else here belongs to the thread handling events.
  * packet should be a pointer to one of the types in
  * packets.h, *not* a ReplfsPacket
  */
 int sendPacket(void* packet, uint8_t type);
 
+/*
+ * The next count packets of the given type that are sent go out with
+ * a bit of their last byte flipped: the end of the data for writes,
+ * the checksum for commit requests. For tests that check receivers
+ * notice.
+ */
+void corruptSends(uint8_t type, int count);
+
+/*
+ * Every packet sent carries the sender's membership epoch, which
+ * starts at 0. Received packets have the epoch they were sent with.
+ */
+void setEpoch(uint32_t epoch);
+
+/*
+ * While corked, sendPacket queues packets instead of sending them.
+ * They go out together, a single sendmmsg for up to SEND_BATCH of
+ * them, once uncorked, once the queue fills, or before the caller
+ * next waits for an event. Corks nest.
+ */
+void corkSends();
+void uncorkSends();
+
 /*
  * Returns the next event in the system.
  * Will block until that event occurs.
  */
 void nextEvent(ReplfsEvent* event);
 
+/*
+ * Waits for at least one event, then returns as many as are ready,
+ * up to maxEvents: due timers and datagrams already received, without
+ * going back to the kernel for each. Every event's packet must point
+ * at a ReplfsPacket of the caller's. Returns the number of events.
+ */
+int nextEvents(ReplfsEvent* events, int maxEvents);
+
+/*
+ * Like nextEvents, but hands over the buffers datagrams were received
+ * into instead of copying them. Each PACKET_EVENT's packet points into
+ * its buffer, which holds a reference for the caller to release.
+ *
+ * Every header in the datagram has been converted to host order in
+ * place by then: the packet's own, the fields of its body, and within
+ * the body each write header of a WRITE_BATCH or COMPRESSED_BATCH,
+ * the ranges of a WRITE_RESEND_REQUEST and the ids in a MEMBERSHIP.
+ * Only payloads are as they arrived: the data of writes, read replies
+ * and resync chunks, and the compressed data of a COMPRESSED_BATCH.
+ */
+int nextBufferedEvents(ReplfsEvent* events, int maxEvents);
+
+/*
+ * Like nextEvent, but never blocks. Returns false
+ * if no packet is waiting and no timer is due.
+ */
+bool pollEvent(ReplfsEvent* event);
+
+/* Like nextBufferedEvents, but never blocks. Returns 0 if nothing is ready */
+int pollBufferedEvents(ReplfsEvent* events, int maxEvents);
+
+/*
+ * Registers fd with the event loop, which calls callback with fd and
+ * context whenever it is readable while waiting for the next event.
+ * The callback must read from fd, or it will be called again straight
+ * away. Any number of descriptors may be watched; unwatch one before
+ * closing it.
+ */
+void watchFd(int fd, FdCallback callback, void* context);
+void unwatchFd(int fd);
+
+/*
+ * Microseconds on a clock that only moves forward,
+ * unaffected by changes to the time of day.
+ */
+uint64_t monotonicUsec();
+
+/*
+ * Arranges for a TIMER_EVENT carrying the returned id to be
+ * delivered once delayUsec microseconds have passed.
+ * Timers fire once; cancelling a fired timer is harmless.
+ */
+TimerId setTimer(uint64_t delayUsec);
+void cancelTimer(TimerId timer);
+
+/*
+ * Round trip time estimation. Feed in measured round trips
+ * (never ones that involved a retransmission) and get back
+ * a retransmission timeout based on their smoothed mean and
+ * variance.
+ */
+void rttSample(uint64_t usec);
+uint64_t retransmitTimeout();
+
+/*
+ * Simulation. netSimulate switches from UDP multicast to the simulated
+ * network of simnet.h, with time virtual from then on, and is called
+ * in place of netInit. netAddNode adds an endpoint listening on port,
+ * with its own timers, epoch and round trip estimates, and makes it
+ * the calling thread's current node; netUseNode switches to another,
+ * and netCurrentNode returns its number, or -1 if there is none.
+ * Everything above acts as the current node.
+ *
+ * A simulation runs on one thread: netNextNode moves virtual time on
+ * to the soonest timer or arrival of any node, makes that node current
+ * and returns its number, or -1 if nothing is left to happen. The
+ * caller then handles that node's events with pollEvent. Watched
+ * descriptors are not polled while simulating.
+ *
+ * Nodes that run the client or a server are given a handler, which
+ * handles whatever the node has waiting. netStep takes one turn: it
+ * finds the next node as netNextNode does and calls its handler with
+ * its context, returning the node or -1. Anything queued with
+ * corkSends goes out before the turn and after it, as the node that
+ * queued it.
+ */
+typedef void (*NodeHandler)(void* context);
+
+void netSimulate(const SimConfig* config);
+int netAddNode(unsigned short port);
+void netUseNode(int node);
+int netCurrentNode();
+int netNextNode();
+void netSetHandler(int node, NodeHandler handler, void* context);
+int netStep();
+
 #endif
@@ -1,96 +1,574 @@
 #include "packets.h"
 #include "replfs_net.h"
+#include "staging.h"
+#include "extents.h"
+#include "wal.h"
+#include "crc32c.h"
+#include "lz.h"
+#include "metrics.h"
+#include "trace.h"
 #include "stdio.h"
 #include <stdbool.h>
 #include <map>
 #include <set>
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <stdlib.h>
 #include <time.h>
 #include "log.h"
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <sys/time.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <errno.h>
 #include <limits.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <deque>
+#include <atomic>
+#include <sys/eventfd.h>
+#include <sys/signalfd.h>
+#include <signal.h>
+#include "packet_queue.h"
+#include "server.h"
 
 #define DEFAULT_PORT 44018
+#define MAX_SHARDS 64
 
-#define WORD_SIZE_BYTES ((int) sizeof(unsigned int))
-#define WORD_SIZE_BITS (WORD_SIZE_BYTES * CHAR_BIT)
+//how often a server that isn't a member asks to be let in
+#define JOIN_EVERY_MSEC 500
+//nothing acks a LEAVE, so it is sent a few times
+#define LEAVE_REPEATS 3
+//what this server can take, announced in roll call acks and joins
+#define SERVER_FEATURES FEATURE_COMPRESSED_BATCH
 
-static std::string mountPath;
-static uint32_t serverId;
+//commits that can be staged at once: the next one and those in flight behind it
+#define COMMIT_SLOTS (MAX_COMMITS_IN_FLIGHT + 1)
 
-static std::set<uint32_t> closedFileIds;
-static std::set<uint32_t> openFileIds;
-static std::map<uint32_t,std::string> filenames;
-static std::map<uint32_t,std::vector<WriteBlockPacket*> > stagedWrites;
-static std::map<uint32_t,uint32_t> commitNums;
-static std::set<uint32_t> readyToCommit;
+//how often the receive thread ticks the shards, which time out and pace copies
+#define SHARD_TICK_MSEC 20
+//never sent, a tick the receive thread queues for each shard
+#define SHARD_TICK 0xFF
+//a server behind its peers on a file that gets no further for this
+//long copies the file from the peer furthest ahead
+#define RESYNC_AFTER_MSEC 2000
+//chunks a copy may have unacknowledged, and how often they are acknowledged
+#define RESYNC_WINDOW 64
+#define RESYNC_ACK_EVERY 16
+#define RESYNC_RETRY_MSEC 200
+#define RESYNC_GIVEUP_MSEC 5000
+//bandwidth the copies a server sends may take, shared between its shards
+#define RESYNC_BYTES_PER_SEC (16 * 1024 * 1024)
+
+/*
+ * The writes staged for one commit. They sit in slots indexed by
+ * write number, with a bitmap of which slots are filled, so a write
+ * is placed or recognised as a duplicate in O(1). Every write before
+ * firstMissing is staged, which lets resend requests skip them.
+ */
+struct ServerCommit {
+  StagedCommit staged;
+  std::vector<uint64_t> present;
+  uint32_t numStaged;
+  uint32_t firstMissing;
+  //set by the final Commit, after which the commit is applied as soon
+  //as its writes are all staged and the commits before it have gone
+  bool decided;
+  bool closeFlag;
+  uint32_t finalWriteNum;
+  //the commitChecksum the client gave with the final Commit
+  uint32_t checksum;
+  //the receive buffers its staged writes point into, one reference each
+  std::vector<PacketBuffer*> buffers;
+};
+typedef struct ServerCommit ServerCommit;
+
+struct ServerFile {
+  std::string filename;
+  //opened by the writer on the first commit, kept until the file is closed
+  int fd;
+  //the next commit to be handed to the writer
+  uint32_t commitNum;
+  //the next commit not yet on disk
+  uint32_t durableCommitNum;
+  //commits handed to the writer that haven't come back
+  uint32_t pendingJobs;
+  //closed by the client, waiting for the writer to finish with it
+  bool closing;
+  //commits being staged, by commit number modulo COMMIT_SLOTS
+  ServerCommit* commits[COMMIT_SLOTS];
+  //set while the file is being copied from a peer
+  struct ResyncTarget* resync;
+};
+typedef struct ServerFile ServerFile;
+
+//disjoint ranges of bytes, from the start of each to its end
+typedef std::map<uint32_t,uint32_t> RangeSet;
+
+/* Adds [start,end) to a set of ranges, merging it with any it meets */
+static void rangeAdd(RangeSet* ranges, uint32_t start, uint32_t end){
+  if(start >= end) return;
+  RangeSet::iterator it = ranges->upper_bound(start);
+  if(it != ranges->begin()){
+    RangeSet::iterator before = it;
+    --before;
+    if(before->second >= start){
+      start = before->first;
+      if(before->second > end) end = before->second;
+      ranges->erase(before);
+    }
+  }
+  while(it != ranges->end() && it->first <= end){
+    if(it->second > end) end = it->second;
+    ranges->erase(it++);
+  }
+  (*ranges)[start] = end;
+}
+
+/* How far the peer furthest ahead has got with a file */
+struct PeerProgress {
+  uint32_t serverId;
+  //the next commit the peer hasn't acknowledged
+  uint32_t commitNum;
+  //where this server was with the file at stalledSince
+  uint32_t localCommitNum;
+  uint64_t stalledSince;
+};
+typedef struct PeerProgress PeerProgress;
+
+/*
+ * A copy of a file this server is receiving from a peer. It streams
+ * into a file of its own, which replaces the real one once complete.
+ */
+struct ResyncTarget {
+  uint32_t sourceId;
+  uint32_t sessionId;
+  uint32_t generation;
+  uint32_t expectedSeq;
+  int fd;
+  //chunks taken since the last acknowledgement
+  uint32_t sinceAck;
+  uint64_t progressAt;
+  uint64_t requestedAt;
+};
+typedef struct ResyncTarget ResyncTarget;
+
+/* The bytes a chunk covers, kept until it is acknowledged */
+struct ResyncChunk {
+  uint32_t byteOffset;
+  uint32_t length;
+};
+typedef struct ResyncChunk ResyncChunk;
+
+/*
+ * A copy of a file this server is sending to a peer. The file is
+ * read in order up to cursor while commits keep landing, so the
+ * bytes commits change behind the cursor are marked dirty and sent
+ * again. The copy ends once it has reached the end of the file and
+ * nothing is dirty, at which point it holds every commit so far.
+ */
+struct ResyncSource {
+  uint32_t fileId;
+  uint32_t requesterId;
+  uint32_t sessionId;
+  uint32_t generation;
+  uint32_t minCommitNum;
+  uint32_t nextSeq;
+  uint32_t ackedSeq;
+  std::map<uint32_t,ResyncChunk> unacked;
+  RangeSet dirty;
+  uint32_t cursor;
+  //the furthest any commit has written since the copy began
+  uint32_t maxEnd;
+  //a read came back short, so the file ended before the cursor
+  bool sawEnd;
+  bool doneQueued;
+  uint32_t doneSeq;
+  uint64_t requestedAt;
+};
+typedef struct ResyncSource ResyncSource;
+
+#define JOB_OPEN 0x01
+#define JOB_COMMIT 0x02
+#define JOB_ABORT 0x03
+#define JOB_READ 0x04
+#define JOB_RESYNC_READ 0x05
+#define JOB_RESYNC 0x06
+
+/*
+ * Work handed to the writer thread, which logs it and, for commits,
+ * applies it to the file. A commit has already left the staging
+ * window, so nothing else touches it until the job comes back.
+ */
+struct WriterJob {
+  uint8_t type;
+  uint32_t fileId;
+  ServerFile* file;
+  uint32_t commitNum;
+  ServerCommit* commit;
+  bool closeFlag;
+  //filled in by the writer for reads, sent back by the shard
+  ReadReplyPacket* reply;
+  //likewise for chunks of a copy, and the copy's generation when read
+  ResyncDataPacket* chunk;
+  uint32_t generation;
+  //the shard the file belongs to, which the job goes back to
+  struct Shard* shard;
+};
+typedef struct WriterJob WriterJob;
+
+/*
+ * A worker thread and the files hashed to it. Its files are only
+ * ever touched by its own thread, so none of this needs locking,
+ * except finishedJobs which the writer hands jobs back through.
+ */
+struct Shard {
+  pthread_t thread;
+  //packets for the shard's files, from the receive thread
+  PacketQueue* packets;
+  //the receive thread and the writer bump this to wake the shard
+  int wakeupFd;
+  std::map<uint32_t,ServerFile*> openFiles;
+  std::set<uint32_t> closedFileIds;
+  //guarded by writerLock
+  std::deque<WriterJob> finishedJobs;
+  //how far peers have got with the shard's files, from their acks
+  std::map<uint32_t,PeerProgress> peers;
+  //files being copied from a peer
+  std::set<uint32_t> resyncing;
+  //copies being sent to peers, by file and requester
+  std::map<std::pair<uint32_t,uint32_t>,ResyncSource*> resyncSources;
+  //bytes of copies the shard may send, topped up each tick
+  int64_t resyncTokens;
+  uint64_t refilledAt;
+};
+typedef struct Shard Shard;
+
+/*
+ * Everything one server has. A replFsServer process is one server,
+ * whose receive thread, shards and writer all share processServer.
+ * On the simulated network a process can run any number of them,
+ * each thread acting as the server it last made current.
+ */
+struct ServerNode {
+  std::string mountPath;
+  //chosen at startup, read by every shard
+  std::atomic<uint32_t> serverId;
+  //membership as the receive thread knows it: the epoch of the latest
+  //list of members seen, whether this server was on it, and the newest
+  //epoch the client has been seen sending with
+  uint32_t memberEpoch;
+  bool isMember;
+  uint32_t clientEpoch;
+  uint64_t joinSentAt;
+  int numShards;
+  Shard* shards;
+  TimerId tickTimer;
+  //jobs waiting for the writer
+  pthread_mutex_t writerLock;
+  pthread_cond_t writerWakeup;
+  std::deque<WriterJob> writerJobs;
+  //the writer's: its log, and the files written since the last checkpoint
+  Wal wal;
+  std::set<ServerFile*> unsynced;
+};
+typedef struct ServerNode ServerNode;
+
+static ServerNode processServer;
+static thread_local ServerNode* server = &processServer;
+//the shard whose thread is running
+static thread_local Shard* shard;
 
 extern Sockaddr address;
 
 void listen();
 
-void handlePacket(void* packet, uint8_t type);
+void handlePacket(PacketBuffer* buffer);
+void generateServerId();
 void handleRollCall();
+void handleMembership(MembershipPacket* packet, uint32_t epoch);
+void checkMembership();
+void watchSignals(sigset_t* signals);
 void handleOpenFile(OpenFilePacket* packet);
-void handleWriteBlock(WriteBlockPacket* packet);
+void handleWriteBlock(WriteBlockPacket* packet, PacketBuffer* buffer);
+void handleWriteBatch(WriteBatchPacket* packet, PacketBuffer* buffer);
+void handleCompressedBatch(CompressedBatchPacket* packet);
 void handleCommitRequest(CommitRequestPacket* packet);
 void handleCommit(CommitPacket* packet);
 void handleAbort(AbortPacket* packet);
+void handleReadRequest(ReadRequestPacket* packet);
+void handlePeerAck(CommitAckPacket* packet);
+void handleResyncRequest(ResyncRequestPacket* packet);
+void handleResyncData(ResyncDataPacket* packet);
+void handleShardTick();
+void createShards();
+void startShards();
+int recoverFiles();
+void startWriter();
+void handleFinishedJobs();
+
+/* Sets up a server with nothing started, on one shard unless told otherwise */
+static void initServer(ServerNode* node){
+  node->serverId = 0;
+  node->memberEpoch = 0;
+  node->isMember = false;
+  node->clientEpoch = 0;
+  node->joinSentAt = 0;
+  node->numShards = 1;
+  node->shards = NULL;
+  node->tickTimer = 0;
+  pthread_mutex_init(&node->writerLock,NULL);
+  pthread_cond_init(&node->writerWakeup,NULL);
+}
 
-int main(const int argc, char* argv[]){
+int serverMain(const int argc, char* argv[]){
+  initServer(&processServer);
   unsigned short portNum;
   int dropPercent;
+  //blocked before any thread starts, so only the receive thread sees them
+  sigset_t signals;
+  sigemptyset(&signals);
+  sigaddset(&signals,SIGINT);
+  sigaddset(&signals,SIGTERM);
+  sigaddset(&signals,SIGUSR1);
+  sigaddset(&signals,SIGUSR2);
+  pthread_sigmask(SIG_BLOCK,&signals,NULL);
   if(argc == 1){
     portNum = DEFAULT_PORT;
     dropPercent = 10;
-    mountPath = "./";
-  }else if(argc == 7){
+    server->mountPath = "./";
+  }else if(argc == 7 || (argc == 9 && strcmp(argv[7],"-shards") == 0)){
     portNum = atoi(argv[2]);
     dropPercent = atoi(argv[6]);
-    mountPath = argv[4];
-    if(mountPath[mountPath.length()-1] != '/'){
-      mountPath +='/';
+    server->mountPath = argv[4];
+    if(server->mountPath[server->mountPath.length()-1] != '/'){
+      server->mountPath +='/';
     }
-    int ret = mkdir(mountPath.c_str(),0777);
-    if(ret == -1){
+    int ret = mkdir(server->mountPath.c_str(),0777);
+    //a directory holding a log was left by a server that stopped, and can be recovered
+    std::string walPath = server->mountPath + WAL_FILENAME;
+    if(ret == -1 && (errno != EEXIST || access(walPath.c_str(),F_OK) != 0)){
       printf("machine already in use\n");
       return -1;
     }
+    if(argc == 9) server->numShards = atoi(argv[8]);
+    if(server->numShards < 1) server->numShards = 1;
+    if(server->numShards > MAX_SHARDS) server->numShards = MAX_SHARDS;
+  }else{
+    printf("usage: replFsServer [-port p -mount path -drop pct [-shards n]]\n");
+    return -1;
+  }
+  LOG("Starting server with %d shards...\n",server->numShards);
+  createShards();
+  if(recoverFiles() != 0){
+    printf("unable to open log in %s\n",server->mountPath.c_str());
+    return -1;
   }
-  LOG("Starting server...\n");
   netInit(portNum,dropPercent);
-  LOG("Server started, waiting for roll call\n");
+  generateServerId();
+  watchSignals(&signals);
+  startWriter();
+  startShards();
+  LOG("Server %u started, waiting for roll call\n",server->serverId.load());
   listen();
+  return 0;
 }
 
-void listen(){
-  ReplfsEvent event;
-  ReplfsPacket packet;
-  event.packet = &packet;
-  while(true){
-    nextEvent(&event);
-    if(event.type == HEARTBEAT_EVENT){
-    }else{
-      handlePacket(&(packet.body),packet.type);
-    }
-  }
+/* Wakes a shard's thread if it is waiting */
+static void wakeShard(Shard* target){
+  uint64_t one = 1;
+  if(write(target->wakeupFd,&one,sizeof(one)) != sizeof(one)) LOG("Unable to wake shard\n");
 }
 
-void handlePacket(void* packet, uint8_t type){
+/* Whether packets of this type come from the client rather than another server */
+static bool sentByClient(uint8_t type){
   switch(type){
+    case ROLL_CALL:
+    case OPEN_FILE:
+    case WRITE_BLOCK:
+    case WRITE_BATCH:
+    case COMPRESSED_BATCH:
+    case COMMIT_REQUEST:
+    case COMMIT:
+    case ABORT:
+    case READ_REQUEST:
+    case MEMBERSHIP:
+      return true;
+  }
+  return false;
+}
+
+/*
+ * Returns the shard a packet is for, the one its fileId hashes to, so
+ * that every packet for a file goes to the same shard. Membership is
+ * the receive thread's own business; those packets are handled here
+ * and -1 returned. So is -1 for anything no shard handles, such as
+ * the replies other servers send the client.
+ */
+static int routePacket(ReplfsPacket* packet){
+  if(sentByClient(packet->type) && packet->epoch > server->clientEpoch){
+    server->clientEpoch = packet->epoch;
+  }
+  size_t fileIdAt = 0;
+  switch(packet->type){
     case ROLL_CALL:
       handleRollCall();
+      return -1;
+    case MEMBERSHIP:
+      handleMembership((MembershipPacket*) packet->body,packet->epoch);
+      return -1;
+    case OPEN_FILE:
+    case WRITE_BLOCK:
+    case WRITE_BATCH:
+    case COMPRESSED_BATCH:
+    case COMMIT_REQUEST:
+    case COMMIT:
+    case ABORT:
+    case READ_REQUEST:
+    case RESYNC_REQUEST:
+    case RESYNC_DATA:
+      break;
+    //other servers' acks start with their id, then the fileId
+    case COMMIT_ACK:
+    case ABORT_ACK:
+      fileIdAt = sizeof(uint32_t);
       break;
+    default:
+      return -1;
+  }
+  uint32_t fileId;
+  memcpy(&fileId,packet->body + fileIdAt,sizeof(fileId));
+  return fileId % server->numShards;
+}
+
+/*
+ * Routes a batch of events the receive thread took: each packet goes,
+ * in the buffer it arrived in, to its shard's queue, and a tick goes
+ * to every shard each SHARD_TICK_MSEC. woken is set for the shards
+ * given something, which are left for the caller to wake.
+ */
+static void routeEvents(ReplfsEvent* events, int numEvents, bool* woken){
+  for(int i = 0; i < numEvents; i++){
+    if(events[i].type == TIMER_EVENT && events[i].timer == server->tickTimer){
+      for(int j = 0; j < server->numShards; j++){
+        PacketBuffer* tick = packetPoolGet();
+        tick->packet.type = SHARD_TICK;
+        if(packetQueuePush(server->shards[j].packets,tick)){
+          woken[j] = true;
+        }else{
+          packetPoolRelease(tick);
+        }
+      }
+      server->tickTimer = setTimer(SHARD_TICK_MSEC * USEC_PER_MSEC);
+      checkMembership();
+      continue;
+    }
+    if(events[i].type != PACKET_EVENT) continue;
+    PacketBuffer* buffer = events[i].buffer;
+    int target = routePacket(&buffer->packet);
+    if(target < 0){
+      packetPoolRelease(buffer);
+      continue;
+    }
+    if(!packetQueuePush(server->shards[target].packets,buffer)){
+      LOG("Shard %d is full, dropping packet\n",target);
+      packetPoolRelease(buffer);
+      continue;
+    }
+    woken[target] = true;
+  }
+}
+
+/*
+ * The receive thread. Packets are taken off the socket in batches and
+ * routed to their shards, and a shard is woken once per batch however
+ * many packets it was given.
+ */
+void listen(){
+  static ReplfsEvent events[RECEIVE_BATCH];
+  bool woken[MAX_SHARDS];
+  server->tickTimer = setTimer(SHARD_TICK_MSEC * USEC_PER_MSEC);
+  while(true){
+    int numEvents = nextBufferedEvents(events,RECEIVE_BATCH);
+    memset(woken,0,sizeof(woken));
+    routeEvents(events,numEvents,woken);
+    for(int i = 0; i < server->numShards; i++){
+      if(woken[i]) wakeShard(&server->shards[i]);
+    }
+  }
+}
+
+/* Handles whatever the current shard's queue holds and whatever the writer has finished */
+static void runShard(){
+  corkSends();
+  PacketBuffer* buffer;
+  while((buffer = packetQueueFront(shard->packets)) != NULL){
+    packetQueuePop(shard->packets);
+    handlePacket(buffer);
+    //staged writes keep references of their own
+    packetPoolRelease(buffer);
+  }
+  handleFinishedJobs();
+  uncorkSends();
+}
+
+/*
+ * A shard's thread. It runs the shard, then sleeps until it is woken
+ * again. A wakeup that comes while it is busy stays counted in the
+ * eventfd, so none are missed.
+ */
+static void* shardThread(void* arg){
+  shard = (Shard*) arg;
+  while(true){
+    runShard();
+    uint64_t wakeups;
+    if(read(shard->wakeupFd,&wakeups,sizeof(wakeups)) != sizeof(wakeups)) LOG("Shard wakeup failed\n");
+  }
+  return NULL;
+}
+
+void createShards(){
+  server->shards = new Shard[server->numShards];
+  for(int i = 0; i < server->numShards; i++){
+    server->shards[i].packets = new PacketQueue;
+    packetQueueInit(server->shards[i].packets);
+    server->shards[i].resyncTokens = 0;
+    server->shards[i].refilledAt = monotonicUsec();
+    //only shards with threads of their own need waking
+    server->shards[i].wakeupFd = simulating() ? -1 : eventfd(0,0);
+    if(server->shards[i].wakeupFd == -1 && !simulating()){
+      perror("eventfd");
+      exit(-1);
+    }
+  }
+}
+
+void startShards(){
+  for(int i = 0; i < server->numShards; i++){
+    if(pthread_create(&server->shards[i].thread,NULL,shardThread,&server->shards[i]) != 0){
+      perror("pthread_create");
+      exit(-1);
+    }
+  }
+}
+
+void handlePacket(PacketBuffer* buffer){
+  void* packet = buffer->packet.body;
+  switch(buffer->packet.type){
     case OPEN_FILE:
       handleOpenFile((OpenFilePacket*)packet);
       break;
     case WRITE_BLOCK:
-      handleWriteBlock((WriteBlockPacket*)packet);
+      handleWriteBlock((WriteBlockPacket*)packet,buffer);
+      break;
+    case WRITE_BATCH:
+      handleWriteBatch((WriteBatchPacket*)packet,buffer);
+      break;
+    case COMPRESSED_BATCH:
+      handleCompressedBatch((CompressedBatchPacket*)packet);
       break;
     case COMMIT_REQUEST:
       handleCommitRequest((CommitRequestPacket*)packet);
@@ -101,20 +579,41 @@ void handlePacket(void* packet, uint8_t type){
     case ABORT:
       handleAbort((AbortPacket*)packet);
       break;
+    case READ_REQUEST:
+      handleReadRequest((ReadRequestPacket*)packet);
+      break;
+    case COMMIT_ACK:
+    case ABORT_ACK:
+      handlePeerAck((CommitAckPacket*)packet);
+      break;
+    case RESYNC_REQUEST:
+      handleResyncRequest((ResyncRequestPacket*)packet);
+      break;
+    case RESYNC_DATA:
+      handleResyncData((ResyncDataPacket*)packet);
+      break;
+    case SHARD_TICK:
+      handleShardTick();
+      break;
   }
 }
 
 /*
- * Responds to a RollCall packet sent out by the client by generating 
- * a new server id and sending it out via a RollCallAck packet.
+ * Generates the id the server goes by from startup on.
  * ServerId is a 32 bit unsigned int which maxes out at 2^32 -1, 
  * but RAND_MAX is 2^31 -1. This means that rand cannot generate 
  * random numbers large enough to fill up a 32 bit unsigned int. 
  * To compensate for this, we call rand twice and add the results together.
  * Because 2*RAND_MAX = 2^32 -2, which is only 1 away from UINT_MAX,
- * the randomness of rand() isn't affected by much.
+ * the randomness of rand() isn't affected by much. On the simulated
+ * network the id comes from the simulation's generator instead, so
+ * that a seed always gives the same ids.
  */
-void handleRollCall(){
+void generateServerId(){
+  if(simulating()){
+    server->serverId = simRandom((uint64_t) UINT32_MAX + 1);
+    return;
+  }
   //re-seed the random number generator
   unsigned int randSeed = (unsigned int) address.sin_addr.s_addr;
   randSeed ^= (unsigned int) getpid();
@@ -122,26 +621,165 @@ void handleRollCall(){
   gettimeofday(&curtime,NULL);
   randSeed ^= (unsigned int) curtime.tv_usec;
   srand(randSeed);
-  serverId = rand();
-  serverId += rand();
+  server->serverId = rand();
+  server->serverId += rand();
+}
+
+/*
+ * Responds to a RollCall packet sent out by the client with the
+ * server's id. A roll call comes from a client starting out, whose
+ * epochs begin again, so whatever membership was known is forgotten.
+ */
+void handleRollCall(){
   RollCallAckPacket packet;
-  packet.proposedId = serverId;
+  packet.proposedId = server->serverId;
+  packet.features = SERVER_FEATURES;
   sendPacket(&packet,ROLL_CALL_ACK);
-  LOG("RollCall packet received\n");
-  LOG("New proposed ID generated: %u\n",serverId);
+  server->memberEpoch = 0;
+  server->isMember = false;
+  server->clientEpoch = 0;
+  setEpoch(0);
+  LOG("RollCall packet received, answered as %u\n",server->serverId.load());
+}
+
+/*
+ * Takes in the client's latest list of members. A member answers with
+ * a JOIN to show it is alive, and a server left off it asks to join.
+ */
+void handleMembership(MembershipPacket* packet, uint32_t epoch){
+  if(epoch < server->memberEpoch) return;
+  server->memberEpoch = epoch;
+  if(epoch > server->clientEpoch) server->clientEpoch = epoch;
+  setEpoch(epoch);
+  server->isMember = false;
+  for(int i = 0; i < packet->numMembers; i++){
+    if(packet->memberIds[i] == server->serverId) server->isMember = true;
+  }
+  MemberPacket join;
+  join.serverId = server->serverId;
+  join.features = SERVER_FEATURES;
+  sendPacket(&join,JOIN);
+  server->joinSentAt = monotonicUsec();
+  LOG("Membership epoch %u, %s\n",epoch,server->isMember ? "a member" : "not a member");
+}
+
+/*
+ * Called every tick. A server that hasn't been let in, or that has
+ * seen the client move to an epoch whose members it wasn't told,
+ * asks to join every JOIN_EVERY_MSEC. The client answers a member
+ * with the current list rather than letting it in again.
+ */
+void checkMembership(){
+  if(server->isMember && server->memberEpoch >= server->clientEpoch) return;
+  uint64_t now = monotonicUsec();
+  if(now - server->joinSentAt < JOIN_EVERY_MSEC * USEC_PER_MSEC) return;
+  MemberPacket join;
+  join.serverId = server->serverId;
+  join.features = SERVER_FEATURES;
+  sendPacket(&join,JOIN);
+  server->joinSentAt = now;
+}
+
+/* Prints the counters and latency histograms to stderr */
+static void dumpStats(){
+  MetricSnapshot* snapshot = new MetricSnapshot;
+  metricsSnapshot(snapshot);
+  int length = metricsFormat(snapshot,NULL,0);
+  std::vector<char> text(length + 1);
+  metricsFormat(snapshot,&text[0],text.size());
+  fprintf(stderr,"server=%u\n%s",(uint32_t) server->serverId,&text[0]);
+  fflush(stderr);
+  delete snapshot;
 }
 
+/* Writes the trace rings to TRACE_FILENAME in the mount directory */
+static void dumpTrace(){
+  std::string tracePath = server->mountPath + TRACE_FILENAME;
+  if(traceDump(tracePath.c_str(),server->serverId) != 0) perror("trace");
+}
+
+/*
+ * SIGUSR1 dumps the stats and SIGUSR2 the trace. Stopping with SIGINT
+ * or SIGTERM dumps the trace and sends a LEAVE first, so the client
+ * stops waiting for this server straight away rather than once it has
+ * gone quiet. Every acknowledged commit is already in the log.
+ */
+static void handleSignal(int fd, void* context){
+  struct signalfd_siginfo info;
+  if(read(fd,&info,sizeof(info)) != sizeof(info)) return;
+  if(info.ssi_signo == SIGUSR1){
+    dumpStats();
+    return;
+  }
+  if(info.ssi_signo == SIGUSR2){
+    dumpTrace();
+    return;
+  }
+  LOG("Stopping on signal %u\n",info.ssi_signo);
+  MemberPacket leave;
+  leave.serverId = server->serverId;
+  leave.features = 0;
+  for(int i = 0; i < LEAVE_REPEATS; i++) sendPacket(&leave,LEAVE);
+  dumpTrace();
+  fflush(stdout);
+  _exit(0);
+}
+
+void watchSignals(sigset_t* signals){
+  int fd = signalfd(-1,signals,0);
+  if(fd == -1){
+    perror("signalfd");
+    exit(-1);
+  }
+  watchFd(fd,handleSignal,NULL);
+}
+
+static ServerFile* newServerFile(const std::string& filename, uint32_t commitNum){
+  ServerFile* file = new ServerFile;
+  file->filename = filename;
+  file->commitNum = commitNum;
+  file->durableCommitNum = commitNum;
+  file->pendingJobs = 0;
+  file->closing = false;
+  file->fd = -1;
+  for(int i = 0; i < COMMIT_SLOTS; i++) file->commits[i] = NULL;
+  file->resync = NULL;
+  return file;
+}
+
+/*
+ * Opens the log, which first brings the files up to date with
+ * commits a previous run made durable, and picks up where that
+ * run left each file.
+ */
+int recoverFiles(){
+  std::map<uint32_t,WalFile> recovered;
+  std::set<uint32_t> closed;
+  if(walOpen(&server->wal,server->mountPath,&recovered,&closed) != 0) return -1;
+  std::map<uint32_t,WalFile>::iterator it;
+  for(it = recovered.begin(); it != recovered.end(); ++it){
+    Shard* owner = &server->shards[it->first % server->numShards];
+    owner->openFiles[it->first] = newServerFile(it->second.filename,it->second.commitNum);
+    LOG("Recovered file %u at commit %u\n",it->first,it->second.commitNum);
+  }
+  std::set<uint32_t>::iterator closedId;
+  for(closedId = closed.begin(); closedId != closed.end(); ++closedId){
+    server->shards[*closedId % server->numShards].closedFileIds.insert(*closedId);
+  }
+  return 0;
+}
+
+void submitJob(uint8_t type, uint32_t fileId, ServerFile* file, uint32_t commitNum, bool closeFlag);
+
 void handleOpenFile(OpenFilePacket* packet){
   LOG("OpenFile packet received for filename %s\n",packet->fileName);
   OpenFileAckPacket outgoing;
-  outgoing.serverId = serverId;
+  outgoing.serverId = server->serverId;
   outgoing.fileId = packet->fileId;
-  if(openFileIds.count(packet->fileId) == 0){
-    openFileIds.insert(packet->fileId);
-    std::string filename = (char*) packet->fileName;
-    filenames[packet->fileId] = filename;
-    commitNums[packet->fileId] = 1;
-    stagedWrites[packet->fileId] = std::vector<WriteBlockPacket*>();
+  if(shard->openFiles.count(packet->fileId) == 0){
+    ServerFile* file = newServerFile((char*) packet->fileName,1);
+    shard->openFiles[packet->fileId] = file;
+    submitJob(JOB_OPEN,packet->fileId,file,0,false);
     LOG("New fileId stored.\n");
   }else{
     LOG("Already had file %u open\n",packet->fileId);
@@ -149,142 +787,1242 @@ void handleOpenFile(OpenFilePacket* packet){
   sendPacket(&outgoing,OPEN_FILE_ACK);
 }
 
-void handleWriteBlock(WriteBlockPacket* packet){
+/* Returns the state of an open file, or NULL if it isn't open */
+static ServerFile* findFile(uint32_t fileId){
+  std::map<uint32_t,ServerFile*>::iterator it = shard->openFiles.find(fileId);
+  return it == shard->openFiles.end() ? NULL : it->second;
+}
+
+/*
+ * Clients may stage writes for later commits while earlier ones
+ * are still in flight, so any commit within MAX_COMMITS_IN_FLIGHT
+ * of the next one to be applied is accepted.
+ */
+static bool commitInWindow(ServerFile* file, uint32_t commitNum){
+  if(file == NULL || file->closing) return false;
+  return commitNum >= file->commitNum && commitNum <= file->commitNum + MAX_COMMITS_IN_FLIGHT;
+}
+
+/*
+ * Returns the staging for a commit in the window, starting it if
+ * need be. Commits only leave the window from the bottom, and every
+ * commit in it has a slot of its own, so a slot never holds a stale
+ * commit.
+ */
+static ServerCommit* getCommit(ServerFile* file, uint32_t commitNum){
+  ServerCommit*& commit = file->commits[commitNum % COMMIT_SLOTS];
+  if(commit == NULL){
+    commit = new ServerCommit;
+    arenaInit(&commit->staged.arena);
+    commit->numStaged = 0;
+    commit->firstMissing = 1;
+    commit->decided = false;
+  }
+  return commit;
+}
+
+/* Lets go of everything a commit's staged writes point at */
+static void releaseStaged(ServerCommit* commit){
+  arenaRelease(&commit->staged.arena);
+  for(size_t i = 0; i < commit->buffers.size(); i++) packetPoolRelease(commit->buffers[i]);
+  commit->buffers.clear();
+}
+
+static void freeServerCommit(ServerCommit* commit){
+  if(commit == NULL) return;
+  releaseStaged(commit);
+  delete commit;
+}
+
+static void freeCommit(ServerFile* file, uint32_t commitNum){
+  ServerCommit*& commit = file->commits[commitNum % COMMIT_SLOTS];
+  freeServerCommit(commit);
+  commit = NULL;
+}
+
+/* Drops the staging of every commit in the file's window */
+static void freeCommits(ServerFile* file){
+  for(uint32_t commitNum = file->commitNum; commitNum < file->commitNum + COMMIT_SLOTS; commitNum++){
+    freeCommit(file,commitNum);
+  }
+}
+
+static bool writePresent(ServerCommit* commit, uint32_t writeNum){
+  uint32_t index = writeNum - 1;
+  if(index >= commit->staged.writes.size()) return false;
+  return (commit->present[index / 64] >> (index % 64)) & 1;
+}
+
+/*
+ * Returns the first write number from writeNum up to limit that is
+ * (or, if present is false, isn't) staged, or limit if there is none.
+ * Whole words of the bitmap are skipped at a time.
+ */
+static uint32_t scanWrites(ServerCommit* commit, uint32_t writeNum, uint32_t limit, bool present){
+  uint32_t numSlots = commit->staged.writes.size();
+  while(writeNum < limit){
+    uint32_t index = writeNum - 1;
+    if(index >= numSlots) return present ? limit : writeNum;
+    uint64_t word = commit->present[index / 64];
+    if(!present) word = ~word;
+    word >>= index % 64;
+    if(word != 0){
+      uint32_t found = writeNum + __builtin_ctzll(word);
+      return found < limit ? found : limit;
+    }
+    writeNum += 64 - index % 64;
+  }
+  return limit;
+}
+
+void stageWrite(uint32_t fileId, ServerFile* file, uint32_t commitNum, uint32_t writeNum,
+                uint32_t byteOffset, uint32_t blockSize, uint32_t crc, uint8_t* data,
+                PacketBuffer* buffer);
+static void applyDecidedCommits(uint32_t fileId, ServerFile* file);
+
+/*
+ * A file being copied from a peer has nothing to apply its commits
+ * to, so rather than hold up at the bottom of the window it moves the
+ * window along with the commits it sees go by. The copy will hold
+ * whatever falls out of the bottom.
+ */
+static void followCommits(ServerFile* file, uint32_t commitNum){
+  if(file == NULL || file->resync == NULL) return;
+  if(commitNum <= file->commitNum + MAX_COMMITS_IN_FLIGHT) return;
+  uint32_t bottom = commitNum - MAX_COMMITS_IN_FLIGHT;
+  if(bottom - file->commitNum >= COMMIT_SLOTS){
+    freeCommits(file);
+  }else{
+    for(uint32_t dropped = file->commitNum; dropped < bottom; dropped++) freeCommit(file,dropped);
+  }
+  file->commitNum = bottom;
+}
+
+void handleWriteBlock(WriteBlockPacket* packet, PacketBuffer* buffer){
   LOG("Received write block packet\n");
-  if(packet->commitNum != commitNums[packet->fileId]){
+  ServerFile* file = findFile(packet->fileId);
+  followCommits(file,packet->commitNum);
+  if(!commitInWindow(file,packet->commitNum)){
     LOG("Received write block for non-open commit. Discarding...\n");
     return;
   }
-  WriteBlockPacket* write =(WriteBlockPacket*) malloc(sizeof(WriteBlockPacket));
-  if(write == NULL){
-    LOG("Error allocating space for write block packet. crashing\n");
+  if(crc32c(0,packet->data,packet->blockSize) != packet->crc){
+    LOG("Write %u failed its checksum. Discarding...\n",packet->writeNum);
+    metricAdd(METRIC_CHECKSUM_FAILURES,1);
+    trace(TRACE_CHECKSUM_FAILED,packet->fileId,packet->commitNum,packet->writeNum);
     return;
   }
-  memcpy(write,packet,sizeof(WriteBlockPacket));
-  std::vector<WriteBlockPacket*>::iterator it;
-  for(it = stagedWrites[packet->fileId].begin(); it != stagedWrites[packet->fileId].end(); ++it){
-    if((*it)->writeNum == packet->writeNum){
-      LOG("Received duplicate write\n");
-      free(write);
+  stageWrite(packet->fileId,file,packet->commitNum,packet->writeNum,
+             packet->byteOffset,packet->blockSize,packet->crc,packet->data,buffer);
+  applyDecidedCommits(packet->fileId,file);
+}
+
+void handleWriteBatch(WriteBatchPacket* packet, PacketBuffer* buffer){
+  LOG("Received batch of %u writes\n",packet->numWrites);
+  ServerFile* file = findFile(packet->fileId);
+  followCommits(file,packet->commitNum);
+  if(!commitInWindow(file,packet->commitNum)){
+    LOG("Received write batch for non-open commit. Discarding...\n");
+    return;
+  }
+  uint8_t* next = packet->writes;
+  for(int i = 0; i < packet->numWrites; i++){
+    BatchedWrite* write = (BatchedWrite*) next;
+    uint8_t* data = next + sizeof(BatchedWrite);
+    next = data + write->blockSize;
+    //a corrupted write is left missing, to be asked for again
+    if(crc32c(0,data,write->blockSize) != write->crc){
+      LOG("Write %u failed its checksum. Discarding...\n",write->writeNum);
+      metricAdd(METRIC_CHECKSUM_FAILURES,1);
+      trace(TRACE_CHECKSUM_FAILED,packet->fileId,packet->commitNum,write->writeNum);
+      continue;
+    }
+    stageWrite(packet->fileId,file,packet->commitNum,write->writeNum,
+               write->byteOffset,write->blockSize,write->crc,data,buffer);
+  }
+  applyDecidedCommits(packet->fileId,file);
+}
+
+/*
+ * Expands a compressed batch and stages its writes as for a plain one.
+ * Each write is still checked against its own CRC, so a batch that
+ * expands to the wrong bytes only loses the writes it got wrong.
+ */
+void handleCompressedBatch(CompressedBatchPacket* packet){
+  LOG("Received compressed batch of %u writes\n",packet->numWrites);
+  ServerFile* file = findFile(packet->fileId);
+  followCommits(file,packet->commitNum);
+  if(!commitInWindow(file,packet->commitNum)){
+    LOG("Received compressed batch for non-open commit. Discarding...\n");
+    return;
+  }
+  static thread_local uint8_t expanded[MAX_BATCH_DATA];
+  BatchedWrite* writes = (BatchedWrite*) packet->writes;
+  uint8_t* compressed = packet->writes + packet->numWrites * sizeof(BatchedWrite);
+  long length = lzDecompress(compressed,packet->dataLength,expanded,sizeof(expanded));
+  if(length < 0){
+    LOG("Compressed batch is malformed. Discarding...\n");
+    return;
+  }
+  uint32_t offset = 0;
+  for(int i = 0; i < packet->numWrites; i++){
+    BatchedWrite* write = &writes[i];
+    if(offset + write->blockSize > (uint32_t) length){
+      LOG("Compressed batch expanded short. Discarding the rest...\n");
+      break;
+    }
+    uint8_t* data = expanded + offset;
+    offset += write->blockSize;
+    if(crc32c(0,data,write->blockSize) != write->crc){
+      LOG("Write %u failed its checksum. Discarding...\n",write->writeNum);
+      metricAdd(METRIC_CHECKSUM_FAILURES,1);
+      trace(TRACE_CHECKSUM_FAILED,packet->fileId,packet->commitNum,write->writeNum);
+      continue;
+    }
+    //expanded into a buffer that is reused, so the writes are copied
+    stageWrite(packet->fileId,file,packet->commitNum,write->writeNum,
+               write->byteOffset,write->blockSize,write->crc,data,NULL);
+  }
+  applyDecidedCommits(packet->fileId,file);
+}
+
+/*
+ * A write received in buffer is staged where it lies, the commit
+ * taking a reference on the buffer until it is freed, so its bytes
+ * aren't copied again before they go to disk. Without a buffer, the
+ * write is copied into the commit's arena.
+ */
+void stageWrite(uint32_t fileId, ServerFile* file, uint32_t commitNum, uint32_t writeNum,
+                uint32_t byteOffset, uint32_t blockSize, uint32_t crc, uint8_t* data,
+                PacketBuffer* buffer){
+  if(writeNum == 0 || writeNum > MAX_WRITES_PER_COMMIT){
+    LOG("Received out of range write %u. Discarding...\n",writeNum);
+    return;
+  }
+  ServerCommit* commit = getCommit(file,commitNum);
+  if(writePresent(commit,writeNum)){
+    LOG("Received duplicate write\n");
+    return;
+  }
+  std::vector<StagedWrite>& writes = commit->staged.writes;
+  uint32_t index = writeNum - 1;
+  if(index >= writes.size()){
+    writes.resize(index + 1);
+    commit->present.resize(index / 64 + 1,0);
+  }
+  StagedWrite& write = writes[index];
+  if(buffer != NULL){
+    write.data = data;
+    //a batch's writes are staged one after another, and share a reference
+    if(commit->buffers.empty() || commit->buffers.back() != buffer){
+      packetPoolHold(buffer);
+      commit->buffers.push_back(buffer);
+    }
+  }else{
+    write.data = (uint8_t*) arenaAlloc(&commit->staged.arena,blockSize);
+    if(write.data == NULL){
+      LOG("Error allocating space for staged write. crashing\n");
       return;
-    }else if((*it)->writeNum > packet->writeNum) break;
+    }
+    memcpy(write.data,data,blockSize);
   }
-  stagedWrites[packet->fileId].insert(it, write);
-  LOG("Staged writes: %zu\n",stagedWrites[packet->fileId].size());
-  LOG("Write %u staged for file:%u, commit:%u\n",packet->writeNum,packet->fileId,packet->commitNum);
+  write.writeNum = writeNum;
+  write.byteOffset = byteOffset;
+  write.blockSize = blockSize;
+  write.crc = crc;
+  commit->present[index / 64] |= (uint64_t) 1 << (index % 64);
+  commit->numStaged++;
+  //each write is stepped over at most once
+  while(writePresent(commit,commit->firstMissing)) commit->firstMissing++;
+  metricAdd(METRIC_WRITES_STAGED,1);
+  metricAdd(METRIC_BYTES_STAGED,blockSize);
+  trace(TRACE_WRITE_STAGED,fileId,commitNum,writeNum);
 }
 
-void sendWriteResendRequest(uint32_t fileId, uint32_t commitNum, uint8_t numWrites);
+void sendWriteResendRequest(uint32_t fileId, uint32_t commitNum, ServerCommit* commit, uint32_t numWrites);
+
+/*
+ * Checks a commit whose writes are all staged against the checksum
+ * the client gave for them. If they don't match, every write is
+ * thrown away and asked for again. Returns false if that happened.
+ */
+static bool checkStaged(uint32_t fileId, uint32_t commitNum, ServerCommit* commit,
+                        uint32_t finalWriteNum, uint32_t checksum){
+  if(commitChecksum(&commit->staged,finalWriteNum) == checksum) return true;
+  LOG("Commit %u of file %u doesn't match its checksum, staging it again\n",commitNum,fileId);
+  releaseStaged(commit);
+  commit->staged.writes.clear();
+  commit->present.clear();
+  commit->numStaged = 0;
+  commit->firstMissing = 1;
+  sendWriteResendRequest(fileId,commitNum,commit,finalWriteNum);
+  return false;
+}
 
 void handleCommitRequest(CommitRequestPacket* packet){
   LOG("Received Commit request for file %u, commit %u with %u expected writes\n",
       packet->fileId,packet->commitNum,packet->finalWriteNum);
-  //if the file is open and the commit num is correct
-  if(openFileIds.count(packet->fileId) != 0 &&
-     commitNums[packet->fileId] == packet->commitNum){
-    if(stagedWrites[packet->fileId].size() != packet->finalWriteNum){
-      LOG("Commit requested, but %zu of %d writes present. Requesting resends...\n",
-          stagedWrites[packet->fileId].size(),packet->finalWriteNum);
-      sendWriteResendRequest(packet->fileId,packet->commitNum,packet->finalWriteNum);
-    }else{
+  ServerFile* file = findFile(packet->fileId);
+  followCommits(file,packet->commitNum);
+  //if the file is open and the commit is one we're staging. A file
+  //being copied can't apply commits yet, so it doesn't claim to be ready.
+  if(commitInWindow(file,packet->commitNum) && file->resync == NULL){
+    ServerCommit* commit = getCommit(file,packet->commitNum);
+    if(commit->firstMissing <= packet->finalWriteNum){
+      LOG("Commit requested, but %u of %d writes present. Requesting resends...\n",
+          commit->numStaged,packet->finalWriteNum);
+      sendWriteResendRequest(packet->fileId,packet->commitNum,commit,packet->finalWriteNum);
+    }else if(checkStaged(packet->fileId,packet->commitNum,commit,packet->finalWriteNum,packet->checksum)){
       LOG("All writes present, ready to commit!\n");
       ReadyToCommitPacket outgoing;
-      outgoing.serverId = serverId;
+      outgoing.serverId = server->serverId;
       outgoing.fileId = packet->fileId;
       outgoing.commitNum = packet->commitNum;
+      outgoing.checksum = packet->checksum;
       sendPacket(&outgoing,READY_TO_COMMIT);
+      trace(TRACE_READY_SENT,packet->fileId,packet->commitNum,0);
     }
   }
 }
 
-void sendWriteResendRequest(uint32_t fileId, uint32_t commitNum, uint8_t numWrites){
-  std::vector<WriteBlockPacket*>::iterator it;
-  uint8_t writeArray[16];
-  memset(writeArray,0xff,16);
-  for(it = stagedWrites[fileId].begin(); it != stagedWrites[fileId].end(); ++it){
-    int writeNum = (*it)->writeNum;
-    void* address = ((unsigned int*) writeArray) + (writeNum/WORD_SIZE_BITS);
-    *(unsigned int*)address &= ~(1 << (writeNum % WORD_SIZE_BITS));
-  }
+/*
+ * Asks for the gaps in writes 1 through numWrites. Everything before
+ * firstMissing is known to be staged, so the search for gaps starts
+ * there and hops between them using the bitmap.
+ */
+void sendWriteResendRequest(uint32_t fileId, uint32_t commitNum, ServerCommit* commit, uint32_t numWrites){
   WriteResendRequestPacket request;
-  request.serverId = serverId;
+  request.serverId = server->serverId;
   request.fileId = fileId;
   request.commitNum = commitNum;
-  memcpy(request.requestedWrites,writeArray,16);
+  request.numRanges = 0;
+  uint32_t limit = numWrites + 1;
+  uint32_t missing = commit->firstMissing;
+  while(missing < limit && request.numRanges < MAX_RESEND_RANGES){
+    uint32_t staged = scanWrites(commit,missing,limit,true);
+    WriteRange* range = &request.ranges[request.numRanges++];
+    range->first = missing;
+    range->count = staged - missing;
+    missing = scanWrites(commit,staged,limit,false);
+  }
+  LOG("Requesting %u ranges of writes\n",request.numRanges);
   sendPacket(&request,WRITE_RESEND_REQUEST);
+  metricAdd(METRIC_RESEND_REQUESTS,1);
+  trace(TRACE_RESEND_REQUESTED,fileId,commitNum,commit->firstMissing);
 }
 
-void writeCommitToDisk(uint32_t fileId, uint32_t commitNum){
-  std::string filePath = mountPath + filenames[fileId];
-  int fd = open(filePath.c_str(),O_WRONLY | O_CREAT, 0777);
-  if(fd == -1){
-    LOG("Error opening file %s\n",filePath.c_str());
-    return;
+/*
+ * Lays a commit's writes over each other in write order, so that
+ * overlapping bytes come from the last writer.
+ */
+static void buildExtents(ServerCommit* commit, ExtentMap* extents){
+  std::vector<StagedWrite>& writes = commit->staged.writes;
+  std::vector<StagedWrite>::iterator it;
+  for(it = writes.begin(); it != writes.end(); ++it){
+    if(it->data == NULL) continue;
+    extentInsert(extents,it->byteOffset,it->blockSize,it->data);
   }
-  std::vector<WriteBlockPacket*>::iterator it;
-  for(it = stagedWrites[fileId].begin(); it != stagedWrites[fileId].end(); ++it){
-    WriteBlockPacket* packet = *it;
-    lseek(fd,packet->byteOffset,SEEK_SET);
-    int writeSize = write(fd,packet->data,packet->blockSize);
-    if(writeSize == -1 || writeSize != (int) packet->blockSize){
-      LOG("Unable to perform write %u \n",packet->writeNum);
+}
+
+/*
+ * Opens the file the first time it is needed. It is only created
+ * for writing; a file nothing was committed to reads as empty.
+ * Returns -1 if it can't be opened.
+ */
+static int openServerFile(ServerFile* file, bool create){
+  if(file->fd != -1) return file->fd;
+  std::string filePath = server->mountPath + file->filename;
+  file->fd = open(filePath.c_str(),O_RDWR | (create ? O_CREAT : 0), 0777);
+  if(file->fd == -1 && (create || errno != ENOENT)) LOG("Error opening file %s\n",filePath.c_str());
+  return file->fd;
+}
+
+/*
+ * Applies a commit to disk, each run of adjacent bytes going out as
+ * a single pwritev. The file stays open until the client closes it.
+ */
+void writeCommitToDisk(ServerFile* file, uint32_t commitNum, const ExtentMap* extents){
+  if(openServerFile(file,true) == -1) return;
+  uint64_t start = monotonicUsec();
+  extentsWrite(file->fd,extents);
+  metricRecord(HISTOGRAM_DISK_APPLY,monotonicUsec() - start);
+  metricAdd(METRIC_COMMITS_APPLIED,1);
+  LOG("Commit writing finished. File:%s Commit:%u\n",file->filename.c_str(),commitNum);
+}
+
+/* Fills in reply with the bytes it asks for, as far as the file goes */
+static void readFromDisk(ServerFile* file, ReadReplyPacket* reply){
+  uint32_t wanted = reply->length;
+  reply->length = 0;
+  if(openServerFile(file,false) == -1) return;
+  ssize_t numRead = pread(file->fd,reply->data,wanted,reply->byteOffset);
+  reply->length = numRead > 0 ? numRead : 0;
+}
+
+/* Reads a chunk of a file being copied to a peer, and checksums it */
+static void readChunk(ServerFile* file, ResyncDataPacket* chunk){
+  if(chunk->status == RESYNC_OK){
+    uint32_t wanted = chunk->length;
+    chunk->length = 0;
+    if(openServerFile(file,false) != -1){
+      ssize_t numRead = pread(file->fd,chunk->data,wanted,chunk->byteOffset);
+      chunk->length = numRead > 0 ? numRead : 0;
+    }
+  }
+  chunk->crc = crc32c(0,chunk->data,chunk->length);
+}
+
+/* Where a copy of a file from a peer is put together */
+static std::string resyncPath(uint32_t fileId){
+  char name[32];
+  snprintf(name,sizeof(name),".replfs_resync_%u",fileId);
+  return server->mountPath + name;
+}
+
+/* Syncs every file written since the last checkpoint, then checkpoints the log */
+static void checkpointLog(std::set<ServerFile*>* unsynced){
+  std::set<ServerFile*>::iterator it;
+  for(it = unsynced->begin(); it != unsynced->end(); ++it){
+    if(fdatasync((*it)->fd) != 0) LOG("Error syncing %s\n",(*it)->filename.c_str());
+  }
+  unsynced->clear();
+  if(walCheckpoint(&server->wal) != 0){
+    perror("checkpoint");
+    exit(-1);
+  }
+}
+
+/*
+ * Puts a copy received from a peer in place of its file. The log is
+ * checkpointed first so none of the file's older commits can be
+ * replayed over the copy, then the copy is renamed over the file and
+ * logged as holding every commit before the job's.
+ */
+static void installResync(WriterJob* job, std::set<ServerFile*>* unsynced){
+  ServerFile* file = job->file;
+  if(file->fd != -1){
+    close(file->fd);
+    file->fd = -1;
+  }
+  unsynced->erase(file);
+  checkpointLog(unsynced);
+  std::string tempPath = resyncPath(job->fileId);
+  std::string filePath = server->mountPath + file->filename;
+  int fd = open(tempPath.c_str(),O_RDONLY);
+  if(fd == -1 || fdatasync(fd) != 0 || rename(tempPath.c_str(),filePath.c_str()) != 0){
+    perror("resync");
+    exit(-1);
+  }
+  close(fd);
+  int dirFd = open(server->mountPath.c_str(),O_RDONLY);
+  if(dirFd != -1){
+    fsync(dirFd);
+    close(dirFd);
+  }
+  walLogResync(&server->wal,job->fileId,file->filename,job->commitNum);
+  if(walSync(&server->wal) != 0){
+    perror("write-ahead log");
+    exit(-1);
+  }
+  LOG("Installed copy of %s at commit %u\n",file->filename.c_str(),job->commitNum);
+}
+
+/*
+ * Takes the jobs waiting for the writer, with writerLock held. A copy
+ * from a peer ends a batch, so that it goes in after the commits
+ * before it are applied and before any that follow are logged.
+ */
+static void takeWriterJobs(std::deque<WriterJob>* jobs){
+  jobs->swap(server->writerJobs);
+  for(size_t i = 0; i + 1 < jobs->size(); i++){
+    if((*jobs)[i].type != JOB_RESYNC) continue;
+    server->writerJobs.insert(server->writerJobs.begin(),jobs->begin() + i + 1,jobs->end());
+    jobs->erase(jobs->begin() + i + 1,jobs->end());
+    break;
+  }
+}
+
+/*
+ * The whole batch is appended to the log and made durable with one
+ * fdatasync, however many files and commits it covers; only then are
+ * the commits applied to their files, which are left for the page
+ * cache to write back. Files are synced only when the log is
+ * checkpointed or they are closed.
+ */
+static void writeJobs(std::deque<WriterJob>* jobs){
+  std::vector<ExtentMap> extents(jobs->size());
+  for(size_t i = 0; i < jobs->size(); i++){
+    WriterJob& job = (*jobs)[i];
+    if(job.type == JOB_OPEN){
+      walLogOpen(&server->wal,job.fileId,job.file->filename);
+    }else if(job.type == JOB_COMMIT){
+      buildExtents(job.commit,&extents[i]);
+      walLogCommit(&server->wal,job.fileId,job.commitNum,job.closeFlag,&extents[i]);
+    }else if(job.type == JOB_ABORT){
+      walLogAbort(&server->wal,job.fileId,job.commitNum,job.closeFlag);
+    }
+  }
+  uint64_t syncStart = monotonicUsec();
+  if(walSync(&server->wal) != 0){
+    perror("write-ahead log");
+    exit(-1);
+  }
+  metricRecord(HISTOGRAM_WAL_SYNC,monotonicUsec() - syncStart);
+  for(size_t i = 0; i < jobs->size(); i++){
+    WriterJob& job = (*jobs)[i];
+    if(job.type == JOB_COMMIT){
+      trace(TRACE_COMMIT_LOGGED,job.fileId,job.commitNum,0);
+      writeCommitToDisk(job.file,job.commitNum,&extents[i]);
+      trace(TRACE_COMMIT_APPLIED,job.fileId,job.commitNum,0);
+      server->unsynced.insert(job.file);
+    }else if(job.type == JOB_READ){
+      readFromDisk(job.file,job.reply);
+    }else if(job.type == JOB_RESYNC_READ){
+      readChunk(job.file,job.chunk);
+    }else if(job.type == JOB_RESYNC){
+      installResync(&job,&server->unsynced);
+    }
+    if(job.closeFlag && job.file->fd != -1){
+      if(fdatasync(job.file->fd) != 0) LOG("Error syncing %s\n",job.file->filename.c_str());
+      close(job.file->fd);
+      job.file->fd = -1;
+      server->unsynced.erase(job.file);
+    }
+  }
+  if(walWantsCheckpoint(&server->wal)) checkpointLog(&server->unsynced);
+}
+
+/*
+ * The writer thread. Everything waiting is taken at once, written,
+ * and handed back to the shards it came from.
+ */
+static void* writerThread(void* arg){
+  std::deque<WriterJob> jobs;
+  while(true){
+    pthread_mutex_lock(&server->writerLock);
+    while(server->writerJobs.empty()) pthread_cond_wait(&server->writerWakeup,&server->writerLock);
+    takeWriterJobs(&jobs);
+    pthread_mutex_unlock(&server->writerLock);
+
+    writeJobs(&jobs);
+
+    std::set<Shard*> finished;
+    pthread_mutex_lock(&server->writerLock);
+    std::deque<WriterJob>::iterator it;
+    for(it = jobs.begin(); it != jobs.end(); ++it){
+      it->shard->finishedJobs.push_back(*it);
+      finished.insert(it->shard);
     }
+    pthread_mutex_unlock(&server->writerLock);
+    jobs.clear();
+    std::set<Shard*>::iterator owner;
+    for(owner = finished.begin(); owner != finished.end(); ++owner) wakeShard(*owner);
+  }
+  return NULL;
+}
+
+void startWriter(){
+  pthread_t writer;
+  if(pthread_create(&writer,NULL,writerThread,NULL) != 0){
+    perror("pthread_create");
+    exit(-1);
   }
-  LOG("Commit writing finished. File:%u Commit:%u\n",fileId,commitNum);
-  if(close(fd) != 0) LOG("Error closing file %s\n",filePath.c_str());
+  pthread_detach(writer);
 }
 
-void cleanupAfterCommit(uint32_t fileId, uint32_t commitNum){
-  LOG("Cleaning up after commit. File:%u commit:%u\n",fileId,commitNum);
-  std::vector<WriteBlockPacket*>::iterator it;
-  for(it = stagedWrites[fileId].begin(); it != stagedWrites[fileId].end(); ++it){
-    free(*it);
+/*
+ * Queues work for the writer. A commit is taken out of the staging
+ * window as it goes, and the window moves on straight away so later
+ * commits can follow it before it reaches the disk.
+ */
+static void queueJob(WriterJob* job);
+static void markResyncDirty(uint32_t fileId, ServerCommit* commit);
+
+void submitJob(uint8_t type, uint32_t fileId, ServerFile* file, uint32_t commitNum, bool closeFlag){
+  WriterJob job;
+  job.type = type;
+  job.fileId = fileId;
+  job.file = file;
+  job.commitNum = commitNum;
+  job.commit = NULL;
+  job.closeFlag = closeFlag;
+  job.reply = NULL;
+  job.chunk = NULL;
+  job.generation = 0;
+  job.shard = shard;
+  if(type == JOB_COMMIT){
+    job.commit = getCommit(file,commitNum);
+    file->commits[commitNum % COMMIT_SLOTS] = NULL;
+    file->commitNum++;
+    markResyncDirty(fileId,job.commit);
   }
-  stagedWrites[fileId].clear();
-  readyToCommit.erase(fileId);
-  commitNums[fileId]++;
+  if(closeFlag) file->closing = true;
+  queueJob(&job);
 }
 
-void closeFile(int fd){
-  LOG("Closing file %u.\n",fd);
-  openFileIds.erase(fd);
-  filenames.erase(fd);
-  stagedWrites.erase(fd);
-  commitNums.erase(fd);
-  closedFileIds.insert(fd);
+static void queueJob(WriterJob* job){
+  job->file->pendingJobs++;
+  pthread_mutex_lock(&server->writerLock);
+  server->writerJobs.push_back(*job);
+  pthread_cond_signal(&server->writerWakeup);
+  pthread_mutex_unlock(&server->writerLock);
 }
 
+void closeFile(uint32_t fileId, ServerFile* file);
+static void sendChunk(ResyncDataPacket* chunk, uint32_t generation);
+
+/* Acknowledges the commits the writer has made durable */
+void handleFinishedJobs(){
+  std::deque<WriterJob> jobs;
+  pthread_mutex_lock(&server->writerLock);
+  jobs.swap(shard->finishedJobs);
+  pthread_mutex_unlock(&server->writerLock);
+  std::deque<WriterJob>::iterator it;
+  for(it = jobs.begin(); it != jobs.end(); ++it){
+    ServerFile* file = it->file;
+    file->pendingJobs--;
+    if(it->type == JOB_COMMIT){
+      freeServerCommit(it->commit);
+      file->durableCommitNum = it->commitNum + 1;
+      CommitAckPacket outgoing;
+      outgoing.serverId = server->serverId;
+      outgoing.fileId = it->fileId;
+      outgoing.commitNum = it->commitNum;
+      sendPacket(&outgoing,COMMIT_ACK);
+      trace(TRACE_ACK_SENT,it->fileId,it->commitNum,0);
+    }else if(it->type == JOB_READ){
+      sendPacket(it->reply,READ_REPLY);
+      delete it->reply;
+    }else if(it->type == JOB_RESYNC_READ){
+      sendChunk(it->chunk,it->generation);
+    }else if(it->type == JOB_RESYNC){
+      file->durableCommitNum = it->commitNum;
+    }
+    if(file->closing && file->pendingJobs == 0) closeFile(it->fileId,file);
+  }
+}
+
+static void endResyncSources(uint32_t fileId);
+
+void closeFile(uint32_t fileId, ServerFile* file){
+  LOG("Closing file %u.\n",fileId);
+  endResyncSources(fileId);
+  shard->peers.erase(fileId);
+  freeCommits(file);
+  if(file->fd != -1 && close(file->fd) != 0) LOG("Error closing file %s\n",file->filename.c_str());
+  delete file;
+  shard->openFiles.erase(fileId);
+  shard->closedFileIds.insert(fileId);
+}
+
+/*
+ * Hands the writer every commit at the bottom of the window that the
+ * client has decided on and that has all its writes, in order. A
+ * server the client didn't wait for catches up this way as the
+ * writes it asked for arrive.
+ */
+static void applyDecidedCommits(uint32_t fileId, ServerFile* file){
+  while(!file->closing && file->resync == NULL){
+    ServerCommit* commit = file->commits[file->commitNum % COMMIT_SLOTS];
+    if(commit == NULL || !commit->decided || commit->firstMissing <= commit->finalWriteNum) return;
+    if(!checkStaged(fileId,file->commitNum,commit,commit->finalWriteNum,commit->checksum)) return;
+    trace(TRACE_COMMIT_QUEUED,fileId,file->commitNum,0);
+    submitJob(JOB_COMMIT,fileId,file,file->commitNum,commit->closeFlag);
+  }
+}
+
+/*
+ * The acknowledgement for a new commit is sent once the writer has
+ * it on disk. Repeats are acknowledged here if it already is. The
+ * client may have decided on a commit without waiting for this
+ * server to be ready, so any writes still missing are asked for.
+ */
 void handleCommit(CommitPacket* packet){
-  LOG("Received final Commit order\n");
-  if(packet->commitNum == commitNums[packet->fileId]){
-    LOG("Have not already performed commit. Writing to disk...\n");
-    writeCommitToDisk(packet->fileId,packet->commitNum);
-    cleanupAfterCommit(packet->fileId,packet->commitNum);
-    if(packet->closeFlag) closeFile(packet->fileId);
-  }
-  if(packet->commitNum <= commitNums[packet->fileId] || closedFileIds.count(packet->fileId) != 0){
+  trace(TRACE_COMMIT_RECEIVED,packet->fileId,packet->commitNum,0);
+  ServerFile* file = findFile(packet->fileId);
+  if(file == NULL && shard->closedFileIds.count(packet->fileId) == 0) return;
+  followCommits(file,packet->commitNum);
+  if(commitInWindow(file,packet->commitNum)){
+    ServerCommit* commit = getCommit(file,packet->commitNum);
+    commit->decided = true;
+    commit->closeFlag = packet->closeFlag;
+    commit->finalWriteNum = packet->finalWriteNum;
+    commit->checksum = packet->checksum;
+    if(commit->firstMissing <= commit->finalWriteNum){
+      LOG("Commit %u decided without all its writes. Requesting resends...\n",packet->commitNum);
+      sendWriteResendRequest(packet->fileId,packet->commitNum,commit,commit->finalWriteNum);
+    }
+    applyDecidedCommits(packet->fileId,file);
+    return;
+  }
+  if(file == NULL || packet->commitNum < file->durableCommitNum){
     CommitAckPacket outgoing;
-    outgoing.serverId = serverId;
+    outgoing.serverId = server->serverId;
     outgoing.fileId = packet->fileId;
     outgoing.commitNum = packet->commitNum;
     LOG("Commit already performed. Acknowledging...\n");
     sendPacket(&outgoing,COMMIT_ACK);
+    trace(TRACE_ACK_SENT,packet->fileId,packet->commitNum,0);
   }
 }
 
+void abandonResync(uint32_t fileId, ServerFile* file);
+
 void handleAbort(AbortPacket* packet){
   LOG("Received abort packet for file %u\n",packet->fileId);
-  if(openFileIds.count(packet->fileId) != 0 && commitNums[packet->fileId] == packet->commitNum){
-    LOG("Performing abort operation\n");
-    cleanupAfterCommit(packet->fileId,packet->commitNum);
-    if(packet->closeFlag) closeFile(packet->fileId);
+  ServerFile* file = findFile(packet->fileId);
+  if(file == NULL && shard->closedFileIds.count(packet->fileId) == 0) return;
+  if(file != NULL && file->resync != NULL && file->commitNum == packet->commitNum){
+    if(packet->closeFlag){
+      //a file closed while it was being copied is left as it was
+      abandonResync(packet->fileId,file);
+      file = findFile(packet->fileId);
+      if(file == NULL) shard->closedFileIds.insert(packet->fileId);
+    }else{
+      //the copy will show whether the commits were dropped, nothing need be logged
+      freeCommits(file);
+      file->commitNum++;
+    }
+  }
+  if(file != NULL && file->commitNum == packet->commitNum){
+    trace(TRACE_ABORTED,packet->fileId,packet->commitNum,0);
+    //later commits staged behind this one are dropped too
+    freeCommits(file);
+    file->commitNum++;
+    //the file is closed once the writer has logged the abort
+    submitJob(JOB_ABORT,packet->fileId,file,packet->commitNum,packet->closeFlag);
   }
-  if(commitNums[packet->fileId] >= packet->commitNum || closedFileIds.count(packet->fileId) != 0){
+  if(file == NULL || file->commitNum > packet->commitNum){
     LOG("Sending abort confirmation\n");
     AbortAckPacket outgoing;
-    outgoing.serverId = serverId;
+    outgoing.serverId = server->serverId;
     outgoing.commitNum = packet->commitNum;
     outgoing.fileId = packet->fileId;
     sendPacket(&outgoing,ABORT_ACK);
   }
 }
+
+/*
+ * Serves a read addressed to this server once it has every commit the
+ * client asked for. With nothing in the writer's hands the file is
+ * read straight away; otherwise the read queues behind the commits
+ * already handed over, so it sees all of them and none that follow.
+ */
+void handleReadRequest(ReadRequestPacket* packet){
+  if(packet->serverId != server->serverId) return;
+  ServerFile* file = findFile(packet->fileId);
+  if(file != NULL && (file->resync != NULL || file->commitNum < packet->commitNum)){
+    LOG("Not caught up to commit %u of file %u, ignoring read\n",packet->commitNum,packet->fileId);
+    return;
+  }
+  ReadReplyPacket* reply = new ReadReplyPacket;
+  reply->serverId = server->serverId;
+  reply->fileId = packet->fileId;
+  reply->requestId = packet->requestId;
+  reply->byteOffset = packet->byteOffset;
+  reply->length = packet->length < READ_BLOCK_SIZE ? packet->length : READ_BLOCK_SIZE;
+  if(file == NULL || file->closing){
+    reply->status = READ_NOT_OPEN;
+    reply->commitNum = 0;
+    reply->length = 0;
+  }else{
+    reply->status = READ_OK;
+    reply->commitNum = file->commitNum;
+    if(file->pendingJobs > 0){
+      WriterJob job;
+      job.type = JOB_READ;
+      job.fileId = packet->fileId;
+      job.file = file;
+      job.commitNum = file->commitNum;
+      job.commit = NULL;
+      job.closeFlag = false;
+      job.reply = reply;
+      job.chunk = NULL;
+      job.generation = 0;
+      job.shard = shard;
+      queueJob(&job);
+      return;
+    }
+    readFromDisk(file,reply);
+  }
+  sendPacket(reply,READ_REPLY);
+  delete reply;
+}
+
+/*
+ * Notes how far another server has got with a file, which is how a
+ * server finds out it has fallen behind.
+ */
+void handlePeerAck(CommitAckPacket* packet){
+  if(packet->serverId == server->serverId) return;
+  if(shard->closedFileIds.count(packet->fileId) != 0) return;
+  std::map<uint32_t,PeerProgress>::iterator it = shard->peers.find(packet->fileId);
+  if(it == shard->peers.end()){
+    ServerFile* file = findFile(packet->fileId);
+    PeerProgress progress;
+    progress.serverId = packet->serverId;
+    progress.commitNum = 0;
+    progress.localCommitNum = file == NULL ? 0 : file->commitNum;
+    progress.stalledSince = monotonicUsec();
+    it = shard->peers.insert(std::make_pair((uint32_t) packet->fileId,progress)).first;
+  }
+  if(packet->commitNum + 1 > it->second.commitNum){
+    it->second.commitNum = packet->commitNum + 1;
+    it->second.serverId = packet->serverId;
+  }
+}
+
+static void sendResyncRequest(uint32_t fileId, ServerFile* file, bool retry){
+  ResyncTarget* target = file->resync;
+  ResyncRequestPacket request;
+  request.fileId = fileId;
+  request.sourceId = target->sourceId;
+  request.requesterId = server->serverId;
+  request.sessionId = target->sessionId;
+  request.minCommitNum = file->commitNum;
+  request.ackedSeq = target->expectedSeq;
+  request.retryFlag = retry;
+  sendPacket(&request,RESYNC_REQUEST);
+  target->sinceAck = 0;
+  target->requestedAt = monotonicUsec();
+}
+
+/*
+ * Starts copying a file from a peer. A file this server never saw
+ * opened, say because it was started afresh, is given a placeholder
+ * that takes its name from the copy.
+ */
+static void startResync(uint32_t fileId, ServerFile* file, PeerProgress* peer){
+  int fd = open(resyncPath(fileId).c_str(),O_RDWR | O_CREAT | O_TRUNC, 0777);
+  if(fd == -1){
+    LOG("Unable to start copying file %u\n",fileId);
+    return;
+  }
+  if(file == NULL){
+    file = newServerFile("",peer->commitNum);
+    shard->openFiles[fileId] = file;
+  }
+  LOG("Behind on file %u at commit %u, copying it from server %u at commit %u\n",
+      fileId,file->commitNum,peer->serverId,peer->commitNum);
+  ResyncTarget* target = new ResyncTarget;
+  target->sourceId = peer->serverId;
+  target->sessionId = (uint32_t) monotonicUsec() ^ server->serverId;
+  target->generation = 0;
+  target->expectedSeq = 0;
+  target->fd = fd;
+  target->progressAt = monotonicUsec();
+  file->resync = target;
+  shard->resyncing.insert(fileId);
+  sendResyncRequest(fileId,file,false);
+}
+
+/* Gives up on a copy. A placeholder goes with it */
+void abandonResync(uint32_t fileId, ServerFile* file){
+  LOG("Abandoning copy of file %u\n",fileId);
+  close(file->resync->fd);
+  unlink(resyncPath(fileId).c_str());
+  delete file->resync;
+  file->resync = NULL;
+  shard->resyncing.erase(fileId);
+  if(file->filename.empty() && file->pendingJobs == 0){
+    freeCommits(file);
+    delete file;
+    shard->openFiles.erase(fileId);
+  }
+}
+
+/*
+ * A finished copy takes the file straight to the commit it holds.
+ * Commits staged below that are dropped, those above are kept and
+ * applied once the writer has put the copy in place.
+ */
+static void finishResync(uint32_t fileId, ServerFile* file, ResyncDataPacket* packet){
+  if(packet->commitNum < file->commitNum || packet->length == 0 || packet->length > MAX_FILENAME_SIZE){
+    //the window moved past the copy after it was asked for; the next one will do
+    abandonResync(fileId,file);
+    return;
+  }
+  sendResyncRequest(fileId,file,false);
+  close(file->resync->fd);
+  delete file->resync;
+  file->resync = NULL;
+  shard->resyncing.erase(fileId);
+  if(file->filename.empty()) file->filename.assign((char*) packet->data,packet->length);
+  if(packet->commitNum - file->commitNum >= COMMIT_SLOTS){
+    freeCommits(file);
+  }else{
+    for(uint32_t dropped = file->commitNum; dropped < packet->commitNum; dropped++) freeCommit(file,dropped);
+  }
+  file->commitNum = packet->commitNum;
+  LOG("Copy of file %u complete at commit %u\n",fileId,file->commitNum);
+  submitJob(JOB_RESYNC,fileId,file,file->commitNum,false);
+  applyDecidedCommits(fileId,file);
+}
+
+/*
+ * Takes the next chunk of a copy, if it is the one expected and
+ * arrived intact. Chunks are written straight to the copy's file
+ * rather than held, and acknowledged every RESYNC_ACK_EVERY.
+ */
+void handleResyncData(ResyncDataPacket* packet){
+  if(packet->requesterId != server->serverId) return;
+  ServerFile* file = findFile(packet->fileId);
+  if(file == NULL || file->resync == NULL || file->resync->sessionId != packet->sessionId) return;
+  ResyncTarget* target = file->resync;
+  if(packet->status == RESYNC_NOT_OPEN){
+    LOG("Server %u doesn't have file %u open\n",target->sourceId,packet->fileId);
+    shard->peers.erase(packet->fileId);
+    abandonResync(packet->fileId,file);
+    return;
+  }
+  if(packet->generation < target->generation || packet->seq != target->expectedSeq) return;
+  if(crc32c(0,packet->data,packet->length) != packet->crc){
+    LOG("Chunk %u of file %u failed its checksum\n",packet->seq,packet->fileId);
+    return;
+  }
+  target->generation = packet->generation;
+  target->expectedSeq++;
+  target->progressAt = monotonicUsec();
+  if(packet->status == RESYNC_DONE){
+    finishResync(packet->fileId,file,packet);
+    return;
+  }
+  if(pwrite(target->fd,packet->data,packet->length,packet->byteOffset) != (ssize_t) packet->length){
+    LOG("Unable to write copy of file %u\n",packet->fileId);
+    abandonResync(packet->fileId,file);
+    return;
+  }
+  if(++target->sinceAck >= RESYNC_ACK_EVERY) sendResyncRequest(packet->fileId,file,false);
+}
+
+/* Tells a peer that asked for a copy that this server can't give one */
+static void refuseResync(ResyncRequestPacket* packet){
+  ResyncDataPacket reply;
+  memset(&reply,0,RESYNC_DATA_HEADER_SIZE);
+  reply.fileId = packet->fileId;
+  reply.requesterId = packet->requesterId;
+  reply.sessionId = packet->sessionId;
+  reply.status = RESYNC_NOT_OPEN;
+  sendPacket(&reply,RESYNC_DATA);
+}
+
+static void endResync(ResyncSource* source){
+  shard->resyncSources.erase(std::make_pair(source->fileId,source->requesterId));
+  delete source;
+}
+
+static void endResyncSources(uint32_t fileId){
+  std::map<std::pair<uint32_t,uint32_t>,ResyncSource*>::iterator it;
+  it = shard->resyncSources.lower_bound(std::make_pair(fileId,(uint32_t) 0));
+  while(it != shard->resyncSources.end() && it->first.first == fileId){
+    delete it->second;
+    shard->resyncSources.erase(it++);
+  }
+}
+
+/*
+ * Once the bytes a commit writes reach the writer, copies that have
+ * already read past them have to send them again. Anything past a
+ * copy's cursor will be read in order anyway.
+ */
+static void markResyncDirty(uint32_t fileId, ServerCommit* commit){
+  std::map<std::pair<uint32_t,uint32_t>,ResyncSource*>::iterator it;
+  it = shard->resyncSources.lower_bound(std::make_pair(fileId,(uint32_t) 0));
+  for(; it != shard->resyncSources.end() && it->first.first == fileId; ++it){
+    ResyncSource* source = it->second;
+    std::vector<StagedWrite>& writes = commit->staged.writes;
+    std::vector<StagedWrite>::iterator write;
+    for(write = writes.begin(); write != writes.end(); ++write){
+      if(write->data == NULL) continue;
+      uint32_t start = write->byteOffset;
+      uint32_t end = start + write->blockSize;
+      uint32_t below = end < source->cursor ? end : source->cursor;
+      if(start < below) rangeAdd(&source->dirty,start,below);
+      if(end > source->maxEnd) source->maxEnd = end;
+    }
+  }
+}
+
+/*
+ * Sends a chunk read for a copy, unless the copy has since ended or
+ * gone back to resend from an earlier chunk. A read that comes back
+ * short shows where the file ended.
+ */
+static void sendChunk(ResyncDataPacket* chunk, uint32_t generation){
+  std::map<std::pair<uint32_t,uint32_t>,ResyncSource*>::iterator it;
+  it = shard->resyncSources.find(std::make_pair((uint32_t) chunk->fileId,(uint32_t) chunk->requesterId));
+  if(it != shard->resyncSources.end() && it->second->sessionId == chunk->sessionId &&
+     it->second->generation == generation){
+    ResyncSource* source = it->second;
+    std::map<uint32_t,ResyncChunk>::iterator sent = source->unacked.find(chunk->seq);
+    if(sent != source->unacked.end() && chunk->length < sent->second.length) source->sawEnd = true;
+    sendPacket(chunk,RESYNC_DATA);
+  }
+  delete chunk;
+}
+
+/*
+ * Reads the next chunk of a copy and sends it. Like a read, it waits
+ * behind any commits the writer has been handed, so it sees them.
+ */
+static void queueChunk(ServerFile* file, ResyncSource* source, uint32_t byteOffset,
+                       uint32_t length, uint8_t status){
+  ResyncDataPacket* chunk = new ResyncDataPacket;
+  chunk->fileId = source->fileId;
+  chunk->requesterId = source->requesterId;
+  chunk->sessionId = source->sessionId;
+  chunk->generation = source->generation;
+  chunk->seq = source->nextSeq++;
+  chunk->commitNum = file->commitNum;
+  chunk->byteOffset = byteOffset;
+  chunk->length = length;
+  chunk->status = status;
+  if(status == RESYNC_DONE){
+    chunk->length = file->filename.length();
+    memcpy(chunk->data,file->filename.data(),chunk->length);
+  }else{
+    ResyncChunk sent = {byteOffset, length};
+    source->unacked[chunk->seq] = sent;
+  }
+  if(file->pendingJobs > 0){
+    WriterJob job;
+    job.type = JOB_RESYNC_READ;
+    job.fileId = source->fileId;
+    job.file = file;
+    job.commitNum = file->commitNum;
+    job.commit = NULL;
+    job.closeFlag = false;
+    job.reply = NULL;
+    job.chunk = chunk;
+    job.generation = source->generation;
+    job.shard = shard;
+    queueJob(&job);
+    return;
+  }
+  readChunk(file,chunk);
+  sendChunk(chunk,source->generation);
+}
+
+/*
+ * Sends as much of a copy as its window and the shard's share of the
+ * bandwidth allow: bytes that commits have changed since they were
+ * sent, then the rest of the file in order. When neither is left and
+ * the file has reached the commit the peer needs, the copy ends.
+ */
+static void pumpResync(ServerFile* file, ResyncSource* source){
+  while(!source->doneQueued && source->nextSeq - source->ackedSeq < RESYNC_WINDOW &&
+        shard->resyncTokens >= RESYNC_CHUNK_SIZE){
+    uint32_t byteOffset;
+    uint32_t length;
+    if(!source->dirty.empty()){
+      RangeSet::iterator first = source->dirty.begin();
+      byteOffset = first->first;
+      uint32_t end = first->second;
+      length = end - byteOffset < RESYNC_CHUNK_SIZE ? end - byteOffset : RESYNC_CHUNK_SIZE;
+      source->dirty.erase(first);
+      if(byteOffset + length < end) source->dirty[byteOffset + length] = end;
+    }else if(!source->sawEnd || source->cursor < source->maxEnd){
+      byteOffset = source->cursor;
+      length = RESYNC_CHUNK_SIZE;
+      source->cursor += RESYNC_CHUNK_SIZE;
+    }else{
+      if(file->commitNum < source->minCommitNum) return;
+      source->doneQueued = true;
+      source->doneSeq = source->nextSeq;
+      queueChunk(file,source,0,0,RESYNC_DONE);
+      return;
+    }
+    shard->resyncTokens -= length;
+    queueChunk(file,source,byteOffset,length,RESYNC_OK);
+  }
+}
+
+/*
+ * Resends everything the peer hasn't acknowledged. Rather than read
+ * it again as it was, its bytes are marked dirty, and a new
+ * generation keeps chunks already on their way from being mistaken
+ * for the ones that replace them.
+ */
+static void rewindResync(ResyncSource* source){
+  std::map<uint32_t,ResyncChunk>::iterator it;
+  for(it = source->unacked.begin(); it != source->unacked.end(); ++it){
+    rangeAdd(&source->dirty,it->second.byteOffset,it->second.byteOffset + it->second.length);
+  }
+  source->unacked.clear();
+  source->nextSeq = source->ackedSeq;
+  source->generation++;
+  source->doneQueued = false;
+}
+
+/*
+ * A peer asking for a copy of a file, acknowledging chunks of one or
+ * asking for them again. A file that is itself being copied, or is
+ * closing, isn't given out.
+ */
+void handleResyncRequest(ResyncRequestPacket* packet){
+  if(packet->sourceId != server->serverId) return;
+  ServerFile* file = findFile(packet->fileId);
+  std::pair<uint32_t,uint32_t> key((uint32_t) packet->fileId,(uint32_t) packet->requesterId);
+  std::map<std::pair<uint32_t,uint32_t>,ResyncSource*>::iterator it = shard->resyncSources.find(key);
+  ResyncSource* source = it == shard->resyncSources.end() ? NULL : it->second;
+  if(file == NULL || file->closing || file->resync != NULL){
+    if(source != NULL) endResync(source);
+    refuseResync(packet);
+    return;
+  }
+  if(source != NULL && source->sessionId != packet->sessionId){
+    endResync(source);
+    source = NULL;
+  }
+  if(source == NULL){
+    LOG("Copying file %u to server %u\n",packet->fileId,packet->requesterId);
+    source = new ResyncSource;
+    source->fileId = packet->fileId;
+    source->requesterId = packet->requesterId;
+    source->sessionId = packet->sessionId;
+    source->generation = 0;
+    source->nextSeq = packet->ackedSeq;
+    source->ackedSeq = packet->ackedSeq;
+    source->cursor = 0;
+    source->maxEnd = 0;
+    source->sawEnd = false;
+    source->doneQueued = false;
+    source->doneSeq = 0;
+    shard->resyncSources[key] = source;
+  }
+  source->requestedAt = monotonicUsec();
+  source->minCommitNum = packet->minCommitNum;
+  if(packet->ackedSeq > source->ackedSeq && packet->ackedSeq <= source->nextSeq){
+    source->ackedSeq = packet->ackedSeq;
+    source->unacked.erase(source->unacked.begin(),source->unacked.lower_bound(source->ackedSeq));
+  }
+  if(source->doneQueued && source->ackedSeq > source->doneSeq){
+    LOG("Finished copying file %u to server %u\n",packet->fileId,packet->requesterId);
+    endResync(source);
+    return;
+  }
+  if(packet->retryFlag) rewindResync(source);
+  pumpResync(file,source);
+}
+
+/*
+ * Looks for files this server has fallen behind its peers on and
+ * not caught up with for RESYNC_AFTER_MSEC, and starts copying them.
+ */
+static void checkLagging(uint64_t now){
+  std::map<uint32_t,PeerProgress>::iterator it = shard->peers.begin();
+  while(it != shard->peers.end()){
+    uint32_t fileId = it->first;
+    PeerProgress& peer = it->second;
+    ++it;
+    if(shard->closedFileIds.count(fileId) != 0){
+      shard->peers.erase(fileId);
+      continue;
+    }
+    ServerFile* file = findFile(fileId);
+    if(file != NULL && (file->resync != NULL || file->closing)) continue;
+    uint32_t local = file == NULL ? 0 : file->commitNum;
+    if(local >= peer.commitNum || local != peer.localCommitNum){
+      peer.localCommitNum = local;
+      peer.stalledSince = now;
+    }else if(now - peer.stalledSince >= RESYNC_AFTER_MSEC * USEC_PER_MSEC){
+      peer.stalledSince = now;
+      startResync(fileId,file,&peer);
+    }
+  }
+}
+
+/*
+ * Tops up the shard's share of the copy bandwidth, then moves every
+ * copy along: those being received are retried or given up on if
+ * they have stalled, and those being sent carry on, or are dropped if
+ * their peer has gone quiet. Last of all, new copies are started.
+ */
+void handleShardTick(){
+  uint64_t now = monotonicUsec();
+  int64_t perShard = RESYNC_BYTES_PER_SEC / server->numShards;
+  shard->resyncTokens += perShard * (int64_t) (now - shard->refilledAt) / USEC_PER_SEC;
+  //at most two ticks' worth builds up
+  int64_t burst = perShard * SHARD_TICK_MSEC * 2 / 1000;
+  if(shard->resyncTokens > burst) shard->resyncTokens = burst;
+  shard->refilledAt = now;
+  std::set<uint32_t>::iterator copying = shard->resyncing.begin();
+  while(copying != shard->resyncing.end()){
+    uint32_t fileId = *copying++;
+    ServerFile* file = findFile(fileId);
+    ResyncTarget* target = file->resync;
+    if(now - target->progressAt >= RESYNC_GIVEUP_MSEC * USEC_PER_MSEC){
+      abandonResync(fileId,file);
+    }else if(now - target->progressAt >= RESYNC_RETRY_MSEC * USEC_PER_MSEC &&
+             now - target->requestedAt >= RESYNC_RETRY_MSEC * USEC_PER_MSEC){
+      sendResyncRequest(fileId,file,true);
+    }
+  }
+  std::map<std::pair<uint32_t,uint32_t>,ResyncSource*>::iterator sending = shard->resyncSources.begin();
+  while(sending != shard->resyncSources.end()){
+    ResyncSource* source = (sending++)->second;
+    ServerFile* file = findFile(source->fileId);
+    if(file == NULL || now - source->requestedAt >= RESYNC_GIVEUP_MSEC * USEC_PER_MSEC){
+      endResync(source);
+    }else{
+      pumpResync(file,source);
+    }
+  }
+  checkLagging(now);
+}
+
+/*
+ * A server's turn on the simulated network, which stands in for all
+ * of its threads: the events that are due are routed as the receive
+ * thread routes them, each shard given something is run, and the
+ * writer's jobs are written and handed back, until nothing is left.
+ */
+static void stepServer(void* context){
+  static ReplfsEvent events[RECEIVE_BATCH];
+  bool woken[MAX_SHARDS];
+  server = (ServerNode*) context;
+  int numEvents;
+  while((numEvents = pollBufferedEvents(events,RECEIVE_BATCH)) > 0){
+    memset(woken,0,sizeof(woken));
+    routeEvents(events,numEvents,woken);
+    for(int i = 0; i < server->numShards; i++){
+      if(!woken[i]) continue;
+      shard = &server->shards[i];
+      runShard();
+    }
+    std::deque<WriterJob> jobs;
+    while(!server->writerJobs.empty()){
+      pthread_mutex_lock(&server->writerLock);
+      takeWriterJobs(&jobs);
+      pthread_mutex_unlock(&server->writerLock);
+      writeJobs(&jobs);
+      pthread_mutex_lock(&server->writerLock);
+      std::deque<WriterJob>::iterator it;
+      for(it = jobs.begin(); it != jobs.end(); ++it) it->shard->finishedJobs.push_back(*it);
+      pthread_mutex_unlock(&server->writerLock);
+      jobs.clear();
+      for(int i = 0; i < server->numShards; i++){
+        shard = &server->shards[i];
+        runShard();
+      }
+    }
+  }
+}
+
+int addSimServer(unsigned short port, const char* mountPath, int numShards){
+  ServerNode* node = new ServerNode;
+  initServer(node);
+  node->mountPath = mountPath;
+  if(node->mountPath[node->mountPath.length()-1] != '/') node->mountPath += '/';
+  if(mkdir(node->mountPath.c_str(),0777) != 0 && errno != EEXIST) return -1;
+  node->numShards = numShards < 1 ? 1 : numShards > MAX_SHARDS ? MAX_SHARDS : numShards;
+  server = node;
+  int number = netAddNode(port);
+  createShards();
+  if(recoverFiles() != 0) return -1;
+  generateServerId();
+  node->tickTimer = setTimer(SHARD_TICK_MSEC * USEC_PER_MSEC);
+  netSetHandler(number,stepServer,node);
+  LOG("Simulated server %u started on node %d\n",node->serverId.load(),number);
+  return number;
+}
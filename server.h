@@ -0,0 +1,20 @@
+#ifndef _server_h
+#define _server_h
+
+/*
+ * Runs a server with replFsServer's command line, returning only if
+ * it couldn't start.
+ */
+int serverMain(const int argc, char* argv[]);
+
+/*
+ * Adds a server to the simulated network (see netSimulate in
+ * replfs_net.h) as a node on port, keeping its files and log in
+ * mountPath, which is made if need be. It starts no threads: netStep
+ * gives it its turn, in which its shards and writer do their work
+ * there and then. Any number can share a process. Returns the node's
+ * number, or -1 if the log couldn't be opened.
+ */
+int addSimServer(unsigned short port, const char* mountPath, int numShards);
+
+#endif
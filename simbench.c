@@ -0,0 +1,327 @@
+#include "client.h"
+#include "server.h"
+#include "replfs_net.h"
+#include "metrics.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <ftw.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <vector>
+#include <algorithm>
+
+#define BASE_PORT 45000
+#define DEFAULT_GROUPS 20
+#define DEFAULT_SERVERS 3
+#define DEFAULT_COMMITS 100
+#define DEFAULT_WRITES 4
+#define DEFAULT_SIZE 512
+//writes wrap around within this much of each file
+#define MAX_FILE_BYTES (1024 * 1024)
+
+/*
+ * Commit latency and retransmission under loss, duplication,
+ * reordering and partitions, with the real client and servers run as
+ * nodes of the simulated network (see netSimulate in replfs_net.h),
+ * all in this process and in virtual time.
+ *
+ * Each of -groups groups is a client and -servers servers on a port
+ * of their own, the servers with -shards shards and a mount directory
+ * under -dir, emptied first. Every client commits -commits times to a
+ * file, -writes writes of -size bytes each time, starting each commit
+ * as soon as the last completes. A commit that fails is aborted and
+ * counted, and the next one started. -quorum is given to every client.
+ *
+ * Every -flap usecs one server, picked at random, is cut off from its
+ * group for -cutoff usecs.
+ *
+ * The result is one line of key=value pairs: commit latency in
+ * virtual usecs, as the bench saw it and as the clients timed their
+ * prepare and apply phases; how many commit requests, commits and
+ * writes were sent again; what the network did with the datagrams;
+ * and how much faster than real time the run went. The same seed
+ * always gives the same result, wall time aside.
+ *
+ * usage: replFsSim [-groups n] [-servers n] [-shards n] [-commits n]
+ *                  [-writes n] [-size bytes] [-quorum n] [-seed s]
+ *                  [-loss pct] [-dup pct] [-latency usec] [-jitter usec]
+ *                  [-tail pct] [-tailusec usec] [-flap usec] [-cutoff usec]
+ *                  [-dir path]
+ */
+
+struct SimGroup {
+  int client;
+  int fd;
+  std::vector<int> servers;
+  int offset;
+  long started;
+  uint64_t startedAt;
+  int status;
+};
+
+static int numGroups = DEFAULT_GROUPS;
+static int numServers = DEFAULT_SERVERS;
+static int numShards = 1;
+static long numCommits = DEFAULT_COMMITS;
+static int writesPerCommit = DEFAULT_WRITES;
+static int writeSize = DEFAULT_SIZE;
+static int quorum = REPLFS_QUORUM_ALL;
+static uint64_t flapUsec = 0;
+static uint64_t cutoffUsec = 0;
+static const char* dir = "/tmp/replfs_simbench";
+static std::vector<SimGroup> groups;
+//the group each node belongs to, or -1
+static std::vector<int> groupOfNode;
+//groups whose commit has completed, in the order they did
+static std::vector<int> finished;
+static std::vector<uint64_t> latencies;
+static std::vector<char> buffer;
+static long failures = 0;
+static int groupsDone = 0;
+static TimerId chaosTimer;
+static int cutOff = -1;
+
+static uint64_t wallUsec(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (uint64_t) now.tv_sec * USEC_PER_SEC + now.tv_nsec / 1000;
+}
+
+static void usage(){
+  printf("usage: replFsSim [-groups n] [-servers n] [-shards n] [-commits n]\n"
+         "                 [-writes n] [-size bytes] [-quorum n] [-seed s]\n"
+         "                 [-loss pct] [-dup pct] [-latency usec] [-jitter usec]\n"
+         "                 [-tail pct] [-tailusec usec] [-flap usec] [-cutoff usec]\n"
+         "                 [-dir path]\n");
+}
+
+static int removeEntry(const char* path, const struct stat* info, int flag, struct FTW* ftw){
+  return remove(path);
+}
+
+static void addToGroup(int node, int group){
+  if(groupOfNode.size() <= (size_t) node) groupOfNode.resize(node + 1,-1);
+  groupOfNode[node] = group;
+}
+
+/* Called on the client's turn, which makes its node the current one */
+static void commitDone(int fd, int commitNum, int status){
+  int group = groupOfNode[netCurrentNode()];
+  groups[group].status = status;
+  finished.push_back(group);
+}
+
+/* Starts a group's next commit, if it has one left */
+static void startCommit(int index){
+  SimGroup* group = &groups[index];
+  if(group->started == numCommits){
+    groupsDone++;
+    return;
+  }
+  group->started++;
+  UseSimClient(group->client);
+  int startOffset = group->offset;
+  bool failed = false;
+  for(int i = 0; i < writesPerCommit && !failed; i++){
+    if(group->offset + writeSize > MAX_FILE_BYTES) group->offset = 0;
+    buffer[i % writeSize] ^= 1;
+    failed = WriteBlock(group->fd,&buffer[0],group->offset,writeSize) != writeSize;
+    group->offset += writeSize;
+  }
+  group->startedAt = simClock();
+  if(!failed) failed = CommitAsync(group->fd,commitDone) < 0;
+  if(failed){
+    group->status = -1;
+    group->offset = startOffset;
+    finished.push_back(index);
+  }
+}
+
+/* Records the commits that have completed and starts the next ones */
+static void finishCommits(){
+  //an Abort runs the simulation, so more may finish meanwhile
+  for(size_t i = 0; i < finished.size(); i++){
+    SimGroup* group = &groups[finished[i]];
+    if(group->status == 0){
+      latencies.push_back(simClock() - group->startedAt);
+    }else{
+      failures++;
+      UseSimClient(group->client);
+      Abort(group->fd);
+    }
+    startCommit(finished[i]);
+  }
+  finished.clear();
+}
+
+/* Cuts a random server off every flapUsec, letting it back cutoffUsec later */
+static void stepChaos(void* context){
+  ReplfsPacket packet;
+  ReplfsEvent event;
+  event.packet = &packet;
+  while(pollEvent(&event)){
+    if(event.type != TIMER_EVENT || event.timer != chaosTimer) continue;
+    if(cutOff >= 0){
+      simPartition(cutOff,0);
+      cutOff = -1;
+      chaosTimer = setTimer(flapUsec - cutoffUsec);
+      continue;
+    }
+    SimGroup& group = groups[simRandom(groups.size())];
+    cutOff = group.servers[simRandom(group.servers.size())];
+    simPartition(cutOff,1);
+    chaosTimer = setTimer(cutoffUsec);
+  }
+}
+
+static uint64_t percentile(const std::vector<uint64_t>& sorted, double fraction){
+  if(sorted.size() == 0) return 0;
+  size_t index = (size_t) (fraction * sorted.size());
+  if(index >= sorted.size()) index = sorted.size() - 1;
+  return sorted[index];
+}
+
+static bool parseArgs(const int argc, const char* argv[], SimConfig* config){
+  memset(config,0,sizeof(*config));
+  config->seed = 1;
+  config->latencyUsec = 100;
+  config->jitterUsec = 50;
+  for(int i = 1; i < argc; i++){
+    if(i + 1 == argc) return false;
+    if(strcmp(argv[i],"-groups") == 0){
+      numGroups = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-servers") == 0){
+      numServers = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-shards") == 0){
+      numShards = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-commits") == 0){
+      numCommits = atol(argv[++i]);
+    }else if(strcmp(argv[i],"-writes") == 0){
+      writesPerCommit = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-size") == 0){
+      writeSize = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-quorum") == 0){
+      quorum = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-seed") == 0){
+      config->seed = strtoull(argv[++i],NULL,10);
+    }else if(strcmp(argv[i],"-loss") == 0){
+      config->lossPercent = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-dup") == 0){
+      config->duplicatePercent = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-latency") == 0){
+      config->latencyUsec = strtoull(argv[++i],NULL,10);
+    }else if(strcmp(argv[i],"-jitter") == 0){
+      config->jitterUsec = strtoull(argv[++i],NULL,10);
+    }else if(strcmp(argv[i],"-tail") == 0){
+      config->tailPercent = atoi(argv[++i]);
+    }else if(strcmp(argv[i],"-tailusec") == 0){
+      config->tailUsec = strtoull(argv[++i],NULL,10);
+    }else if(strcmp(argv[i],"-flap") == 0){
+      flapUsec = strtoull(argv[++i],NULL,10);
+    }else if(strcmp(argv[i],"-cutoff") == 0){
+      cutoffUsec = strtoull(argv[++i],NULL,10);
+    }else if(strcmp(argv[i],"-dir") == 0){
+      dir = argv[++i];
+    }else{
+      return false;
+    }
+  }
+  if(numGroups < 1 || numServers < 1 || numCommits < 1) return false;
+  if(writesPerCommit < 1 || writeSize < 1 || writeSize > MAX_FILE_BYTES) return false;
+  return flapUsec == 0 || cutoffUsec < flapUsec;
+}
+
+int main(const int argc, const char* argv[]){
+  SimConfig config;
+  if(!parseArgs(argc,argv,&config)){
+    usage();
+    return -1;
+  }
+  if(mkdir(dir,0777) != 0 && errno != EEXIST){
+    perror("mkdir");
+    return -1;
+  }
+  netSimulate(&config);
+  groups.resize(numGroups);
+  for(int g = 0; g < numGroups; g++){
+    unsigned short port = BASE_PORT + g;
+    for(int i = 0; i < numServers; i++){
+      char mount[PATH_MAX];
+      snprintf(mount,sizeof(mount),"%s/group%d.server%d",dir,g,i);
+      nftw(mount,removeEntry,16,FTW_DEPTH | FTW_PHYS);
+      int server = addSimServer(port,mount,numShards);
+      if(server < 0){
+        printf("simbench error=server group=%d server=%d\n",g,i);
+        return -1;
+      }
+      groups[g].servers.push_back(server);
+      addToGroup(server,g);
+    }
+    groups[g].client = InitSimReplFs(port,numServers);
+    if(groups[g].client < 0){
+      printf("simbench error=init group=%d servers=%d\n",g,numServers);
+      return -1;
+    }
+    addToGroup(netCurrentNode(),g);
+    SetCommitQuorum(quorum);
+    groups[g].fd = OpenFile((char*) "simbench");
+    if(groups[g].fd < 0){
+      printf("simbench error=open group=%d\n",g);
+      return -1;
+    }
+    groups[g].offset = 0;
+    groups[g].started = 0;
+  }
+  if(flapUsec > 0){
+    //on a port of its own, it only ever sees its timers
+    int chaos = netAddNode(BASE_PORT + numGroups);
+    netSetHandler(chaos,stepChaos,NULL);
+    chaosTimer = setTimer(flapUsec - cutoffUsec);
+  }
+  buffer.resize(writeSize);
+  for(int i = 0; i < writeSize; i++) buffer[i] = 'a' + i % 26;
+  MetricSnapshot before;
+  metricsSnapshot(&before);
+  uint64_t virtualStart = simClock();
+  uint64_t wallStart = wallUsec();
+  for(int g = 0; g < numGroups; g++) startCommit(g);
+  finishCommits();
+  while(groupsDone < numGroups && netStep() >= 0) finishCommits();
+  double wallSeconds = (wallUsec() - wallStart) / (double) USEC_PER_SEC;
+  double virtualSeconds = (simClock() - virtualStart) / (double) USEC_PER_SEC;
+  MetricSnapshot after;
+  metricsSnapshot(&after);
+  std::sort(latencies.begin(),latencies.end());
+  SimStats stats = simStats();
+  printf("simbench groups=%d servers=%d shards=%d commits=%ld writes=%d size=%d quorum=%d "
+         "seed=%llu loss=%d dup=%d latency_usec=%llu jitter_usec=%llu tail_pct=%d tail_usec=%llu "
+         "flap_usec=%llu cutoff_usec=%llu committed=%zu failed=%ld p50_usec=%llu p99_usec=%llu "
+         "p999_usec=%llu max_usec=%llu prepare_p99_usec=%llu apply_p99_usec=%llu "
+         "commit_requests_sent=%llu commits_sent=%llu resend_requests=%llu writes_resent=%llu "
+         "sent=%llu delivered=%llu lost=%llu duplicated=%llu partitioned=%llu "
+         "virtual_sec=%.3f wall_sec=%.3f speedup=%.1f\n",
+         numGroups,numServers,numShards,numCommits,writesPerCommit,writeSize,quorum,
+         (unsigned long long) config.seed,config.lossPercent,config.duplicatePercent,
+         (unsigned long long) config.latencyUsec,(unsigned long long) config.jitterUsec,
+         config.tailPercent,(unsigned long long) config.tailUsec,(unsigned long long) flapUsec,
+         (unsigned long long) cutoffUsec,latencies.size(),failures,
+         (unsigned long long) percentile(latencies,0.5),
+         (unsigned long long) percentile(latencies,0.99),
+         (unsigned long long) percentile(latencies,0.999),
+         (unsigned long long) (latencies.size() ? latencies.back() : 0),
+         (unsigned long long) metricPercentile(&after.histograms[HISTOGRAM_COMMIT_PREPARE],0.99),
+         (unsigned long long) metricPercentile(&after.histograms[HISTOGRAM_COMMIT_APPLY],0.99),
+         (unsigned long long) (after.counters[METRIC_SENT(COMMIT_REQUEST)] -
+                               before.counters[METRIC_SENT(COMMIT_REQUEST)]),
+         (unsigned long long) (after.counters[METRIC_SENT(COMMIT)] - before.counters[METRIC_SENT(COMMIT)]),
+         (unsigned long long) (after.counters[METRIC_RESEND_REQUESTS] - before.counters[METRIC_RESEND_REQUESTS]),
+         (unsigned long long) (after.counters[METRIC_WRITES_RESENT] - before.counters[METRIC_WRITES_RESENT]),
+         (unsigned long long) stats.sent,(unsigned long long) stats.delivered,
+         (unsigned long long) stats.lost,(unsigned long long) stats.duplicated,
+         (unsigned long long) stats.partitioned,virtualSeconds,wallSeconds,
+         wallSeconds > 0 ? virtualSeconds / wallSeconds : 0);
+  return groupsDone == numGroups ? 0 : -1;
+}
@@ -0,0 +1,216 @@
+#include "simnet.h"
+#include <math.h>
+#include <string.h>
+#include <arpa/inet.h>
+#include <queue>
+#include <vector>
+#include <map>
+
+/* A datagram on its way to one endpoint */
+struct Delivery {
+  uint64_t arrival;
+  //the order it was sent in, so that ties arrive in a fixed order
+  uint64_t seq;
+  int source;
+  std::vector<uint8_t>* datagram;
+  bool operator>(const Delivery& other) const {
+    if(arrival != other.arrival) return arrival > other.arrival;
+    return seq > other.seq;
+  }
+};
+
+/* An endpoint that has something arriving at a given time */
+struct Arrival {
+  uint64_t arrival;
+  int endpoint;
+  bool operator>(const Arrival& other) const {
+    if(arrival != other.arrival) return arrival > other.arrival;
+    return endpoint > other.endpoint;
+  }
+};
+
+struct Endpoint {
+  unsigned short port;
+  int side;
+  std::priority_queue<Delivery,std::vector<Delivery>,std::greater<Delivery> > inbox;
+};
+
+static bool active = false;
+static SimConfig config;
+static uint64_t virtualClock = 0;
+static uint64_t nextSeq = 0;
+static uint64_t randomState;
+static std::vector<Endpoint*> endpoints;
+//the endpoints listening on each port
+static std::map<unsigned short,std::vector<int> > listeners;
+//every delivery on its way, soonest first, so the next one anywhere is
+//found without looking at every endpoint. Entries for deliveries that
+//have been received are skipped when they reach the top.
+static std::priority_queue<Arrival,std::vector<Arrival>,std::greater<Arrival> > arrivals;
+static SimStats stats;
+
+/* xorshift64*, quick and good enough to pick delays and losses with */
+static uint64_t nextRandom(){
+  randomState ^= randomState >> 12;
+  randomState ^= randomState << 25;
+  randomState ^= randomState >> 27;
+  return randomState * 2685821657736338717ULL;
+}
+
+uint64_t simRandom(uint64_t bound){
+  if(bound == 0) return 0;
+  return nextRandom() % bound;
+}
+
+static bool chance(int percent){
+  return percent > 0 && (int) simRandom(100) < percent;
+}
+
+/* Draws how long one delivery takes from the latency model */
+static uint64_t deliveryDelay(){
+  uint64_t delay = config.latencyUsec + simRandom(config.jitterUsec + 1);
+  if(chance(config.tailPercent)){
+    //53 random bits make a uniform double in (0,1]
+    double uniform = ((nextRandom() >> 11) + 1) / 9007199254740992.0;
+    delay += (uint64_t) (-log(uniform) * config.tailUsec);
+  }
+  return delay;
+}
+
+static void freeEndpoints(){
+  for(size_t i = 0; i < endpoints.size(); i++){
+    std::priority_queue<Delivery,std::vector<Delivery>,std::greater<Delivery> >& inbox = endpoints[i]->inbox;
+    while(!inbox.empty()){
+      delete inbox.top().datagram;
+      inbox.pop();
+    }
+    delete endpoints[i];
+  }
+  endpoints.clear();
+  listeners.clear();
+  while(!arrivals.empty()) arrivals.pop();
+}
+
+void simInit(const SimConfig* simConfig){
+  freeEndpoints();
+  config = *simConfig;
+  virtualClock = 0;
+  nextSeq = 0;
+  //xorshift can't start from 0
+  randomState = config.seed ? config.seed : 0x9e3779b97f4a7c15ULL;
+  memset(&stats,0,sizeof(stats));
+  active = true;
+}
+
+bool simulating(){
+  return active;
+}
+
+uint64_t simClock(){
+  return virtualClock;
+}
+
+void simAdvance(uint64_t usec){
+  if(usec > virtualClock) virtualClock = usec;
+}
+
+int simAttach(unsigned short port){
+  Endpoint* endpoint = new Endpoint;
+  endpoint->port = port;
+  endpoint->side = 0;
+  endpoints.push_back(endpoint);
+  listeners[port].push_back(endpoints.size() - 1);
+  return endpoints.size() - 1;
+}
+
+void simAddress(int endpoint, struct sockaddr_in* address){
+  memset(address,0,sizeof(*address));
+  address->sin_family = AF_INET;
+  //10.x.y.z, numbered from 10.0.0.1
+  address->sin_addr.s_addr = htonl((10 << 24) + endpoint + 1);
+  address->sin_port = endpoints[endpoint]->port;
+}
+
+static void deliver(int endpoint, int from, const void* datagram, size_t length){
+  Endpoint* to = endpoints[endpoint];
+  Delivery delivery;
+  delivery.arrival = virtualClock + deliveryDelay();
+  delivery.seq = nextSeq++;
+  delivery.source = from;
+  const uint8_t* bytes = (const uint8_t*) datagram;
+  delivery.datagram = new std::vector<uint8_t>(bytes,bytes + length);
+  to->inbox.push(delivery);
+  Arrival arrival = {delivery.arrival, endpoint};
+  arrivals.push(arrival);
+}
+
+void simSend(int endpoint, const void* datagram, size_t length){
+  Endpoint* from = endpoints[endpoint];
+  stats.sent++;
+  std::vector<int>& group = listeners[from->port];
+  for(size_t i = 0; i < group.size(); i++){
+    Endpoint* to = endpoints[group[i]];
+    if(to->side != from->side){
+      stats.partitioned++;
+      continue;
+    }
+    if(chance(config.lossPercent)){
+      stats.lost++;
+      continue;
+    }
+    deliver(group[i],endpoint,datagram,length);
+    if(chance(config.duplicatePercent)){
+      stats.duplicated++;
+      deliver(group[i],endpoint,datagram,length);
+    }
+  }
+}
+
+bool simNextArrival(int endpoint, uint64_t* usec){
+  Endpoint* to = endpoints[endpoint];
+  if(to->inbox.empty()) return false;
+  *usec = to->inbox.top().arrival;
+  return true;
+}
+
+bool simSoonestArrival(int* endpoint, uint64_t* usec){
+  while(!arrivals.empty()){
+    Arrival next = arrivals.top();
+    Endpoint* to = endpoints[next.endpoint];
+    //an earlier delivery to it would have its own entry above this one
+    if(!to->inbox.empty() && to->inbox.top().arrival == next.arrival){
+      *endpoint = next.endpoint;
+      *usec = next.arrival;
+      return true;
+    }
+    arrivals.pop();
+  }
+  return false;
+}
+
+size_t simReceive(int endpoint, void* buffer, size_t capacity, struct sockaddr_in* source){
+  Endpoint* to = endpoints[endpoint];
+  if(to->inbox.empty() || to->inbox.top().arrival > virtualClock) return 0;
+  Delivery delivery = to->inbox.top();
+  to->inbox.pop();
+  size_t length = delivery.datagram->size();
+  //truncated like a datagram too big for the buffer
+  if(length > capacity) length = capacity;
+  memcpy(buffer,&(*delivery.datagram)[0],length);
+  delete delivery.datagram;
+  simAddress(delivery.source,source);
+  stats.delivered++;
+  return length;
+}
+
+void simPartition(int endpoint, int side){
+  endpoints[endpoint]->side = side;
+}
+
+void simHeal(){
+  for(size_t i = 0; i < endpoints.size(); i++) endpoints[i]->side = 0;
+}
+
+SimStats simStats(){
+  return stats;
+}
@@ -0,0 +1,93 @@
+#ifndef _simnet_h
+#define _simnet_h
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+/*
+ * A simulated network for replfs_net to run over in place of UDP
+ * multicast, so that any number of endpoints can share one process.
+ * Every datagram sent reaches each endpoint on the same port, the
+ * sender included, after a delay drawn from the latency model, and
+ * may be lost or duplicated on the way. Time is virtual: it only
+ * moves when simAdvance moves it, so nothing waits for real.
+ *
+ * Every random choice comes from one generator seeded from the
+ * config, and ties are broken by the order things were sent, so the
+ * same seed and the same sequence of calls give the same run.
+ */
+struct SimConfig {
+  uint64_t seed;
+  int lossPercent;
+  int duplicatePercent;
+  //each delivery takes latencyUsec plus up to jitterUsec more, picked
+  //uniformly, so datagrams sent close together may arrive reordered
+  uint64_t latencyUsec;
+  uint64_t jitterUsec;
+  //tailPercent of deliveries are held up a further time drawn from an
+  //exponential distribution with mean tailUsec, for the long tail
+  int tailPercent;
+  uint64_t tailUsec;
+};
+typedef struct SimConfig SimConfig;
+
+/* What happened to the datagrams sent so far, counted per receiver */
+struct SimStats {
+  uint64_t sent;
+  uint64_t delivered;
+  uint64_t lost;
+  uint64_t duplicated;
+  uint64_t partitioned;
+};
+typedef struct SimStats SimStats;
+
+/* Starts the simulation with virtual time at 0, forgetting any earlier one */
+void simInit(const SimConfig* config);
+bool simulating();
+
+/* The virtual time in usecs, and moving it forward to usec */
+uint64_t simClock();
+void simAdvance(uint64_t usec);
+
+/* Adds an endpoint listening on port, returning its number */
+int simAttach(unsigned short port);
+
+/* The address datagrams from an endpoint appear to come from */
+void simAddress(int endpoint, struct sockaddr_in* address);
+
+void simSend(int endpoint, const void* datagram, size_t length);
+
+/*
+ * When the next datagram for endpoint arrives. Returns false if none
+ * are on their way.
+ */
+bool simNextArrival(int endpoint, uint64_t* usec);
+
+/*
+ * The endpoint with the soonest arrival of all, and when. Returns
+ * false if nothing is on its way anywhere.
+ */
+bool simSoonestArrival(int* endpoint, uint64_t* usec);
+
+/*
+ * Takes the first datagram to have arrived at endpoint by now into
+ * buffer, which holds capacity bytes. Returns its length, or 0 if
+ * nothing has arrived.
+ */
+size_t simReceive(int endpoint, void* buffer, size_t capacity, struct sockaddr_in* source);
+
+/*
+ * Partitions. Endpoints only hear from others on the same side, and
+ * all start on side 0. simHeal puts every endpoint back on side 0.
+ * Datagrams already on their way still arrive.
+ */
+void simPartition(int endpoint, int side);
+void simHeal();
+
+/* A random number below bound, from the simulation's generator */
+uint64_t simRandom(uint64_t bound);
+
+SimStats simStats();
+
+#endif
@@ -0,0 +1,296 @@
+#include "client.h"
+#include "server.h"
+#include "replfs_net.h"
+#include "simnet.h"
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <ftw.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+//runs the real client and servers as nodes of the simulated network
+//(see netSimulate in replfs_net.h), all on this thread and in virtual time
+
+#define SIM_PORT 44030
+#define SIM_DIR "/tmp/replfs_sim"
+#define SIM_SEED 20261017
+#define SIM_SERVERS 3
+#define SIM_SHARDS 2
+#define LOSS_PERCENT 5
+#define DUPLICATE_PERCENT 5
+//jitter several times the gap between sends, so datagrams arrive reordered
+#define LATENCY_USEC 200
+#define JITTER_USEC 800
+#define TAIL_PERCENT 1
+#define TAIL_USEC 5000
+
+#define SIM_FILE_NAME "simfile"
+#define SIM_FILE_BYTES (16 * 1024)
+#define MAX_SIM_WRITE 2000
+#define MAX_WRITES_PER_SIM_COMMIT 8
+#define COMMITS_BEFORE_PARTITION 20
+#define PARTITION_COMMITS 20
+//longer than MEMBER_TIMEOUT, so the cut off server is dropped and
+//has to join again once healed
+#define PARTITION_USEC (7 * 1000 * 1000)
+//time for the healed server to join, before the commits that show
+//it is behind on the file
+#define JOIN_USEC (2 * 1000 * 1000)
+#define COMMITS_AFTER_HEAL 20
+//time for the healed server to copy the file from the others
+#define CATCHUP_USEC (30 * 1000 * 1000)
+#define MAX_SIM_COMMITS (COMMITS_BEFORE_PARTITION + PARTITION_COMMITS + COMMITS_AFTER_HEAL)
+
+//a group is a client and its servers on a port of their own
+#define NUM_GROUPS 100
+#define GROUP_SERVERS 3
+#define GROUP_COMMITS 4
+#define GROUP_WRITE 512
+//a roll call needs every server's ack in the same round, and each of
+//the groups has to get through one, so they lose less
+#define GROUP_LOSS_PERCENT 1
+
+/* What a run did, for comparing two runs of the same seed */
+struct SimRun {
+  int numCommits;
+  int statuses[MAX_SIM_COMMITS];
+  int partitionedServers;
+  int numServers;
+  uint32_t fileChecksums[SIM_SERVERS];
+  bool serversHold;
+  uint64_t finishUsec;
+  SimStats stats;
+};
+
+static int numChecks = 0;
+static int numFailed = 0;
+
+void check(bool ok, const char* what);
+void partitionRun(uint64_t seed, struct SimRun* run);
+void partitionTest();
+void groupTest();
+
+int main(const int argc, const char* argv[]){
+  if(mkdir(SIM_DIR,0777) != 0 && errno != EEXIST){
+    perror(SIM_DIR);
+    return -1;
+  }
+  partitionTest();
+  groupTest();
+  printf("%d checks, %d failed\n",numChecks,numFailed);
+  return numFailed == 0 ? 0 : -1;
+}
+
+/* Counts a check, printing what it was if it failed */
+void check(bool ok, const char* what){
+  numChecks++;
+  if(ok) return;
+  numFailed++;
+  printf("FAILED: %s\n",what);
+  fflush(stdout);
+}
+
+static int removeEntry(const char* path, const struct stat* info, int flag, struct FTW* ftw){
+  return remove(path);
+}
+
+static void simConfig(uint64_t seed, SimConfig* config){
+  memset(config,0,sizeof(*config));
+  config->seed = seed;
+  config->lossPercent = LOSS_PERCENT;
+  config->duplicatePercent = DUPLICATE_PERCENT;
+  config->latencyUsec = LATENCY_USEC;
+  config->jitterUsec = JITTER_USEC;
+  config->tailPercent = TAIL_PERCENT;
+  config->tailUsec = TAIL_USEC;
+}
+
+/* Adds a server on an emptied mount directory named after group and index */
+static int addServer(unsigned short port, int group, int index){
+  char mount[PATH_MAX];
+  snprintf(mount,sizeof(mount),"%s/group%d.server%d",SIM_DIR,group,index);
+  nftw(mount,removeEntry,16,FTW_DEPTH | FTW_PHYS);
+  return addSimServer(port,mount,SIM_SHARDS);
+}
+
+/*
+ * Reads a server's copy of a file into data, which holds length
+ * bytes. Returns the copy's length, up to length + 1 so a longer
+ * copy shows.
+ */
+static int readServerFile(int group, int index, const char* name, char* data, int length){
+  char path[PATH_MAX];
+  snprintf(path,sizeof(path),"%s/group%d.server%d/%s",SIM_DIR,group,index,name);
+  FILE* in = fopen(path,"r");
+  if(in == NULL) return 0;
+  int copyLength = fread(data,1,length + 1,in);
+  fclose(in);
+  return copyLength;
+}
+
+/* Runs the simulation until virtual time reaches usec */
+static void runUntil(uint64_t usec){
+  while(simClock() < usec && netStep() >= 0);
+}
+
+/* A generator of the run's writes, kept apart from the network's */
+static uint32_t nextRandom(uint64_t* state){
+  *state = *state * 6364136223846793005ULL + 1442695040888963407ULL;
+  return (uint32_t) (*state >> 33);
+}
+
+/* Writes a few random blocks to fd and commits them, applying them to expected if it succeeds */
+static int commitRandom(int fd, uint64_t* state, char* expected, int* length){
+  char block[MAX_SIM_WRITE];
+  char staged[SIM_FILE_BYTES];
+  int stagedLength = *length;
+  memcpy(staged,expected,*length);
+  int numWrites = 1 + nextRandom(state) % MAX_WRITES_PER_SIM_COMMIT;
+  for(int i = 0; i < numWrites; i++){
+    int size = 1 + nextRandom(state) % MAX_SIM_WRITE;
+    int offset = nextRandom(state) % (SIM_FILE_BYTES - size + 1);
+    for(int j = 0; j < size; j++) block[j] = 'a' + nextRandom(state) % 26;
+    if(WriteBlock(fd,block,offset,size) != size) return -1;
+    memcpy(staged + offset,block,size);
+    if(offset + size > stagedLength) stagedLength = offset + size;
+  }
+  int status = Commit(fd);
+  if(status == 0){
+    memcpy(expected,staged,stagedLength);
+    *length = stagedLength;
+  }else{
+    Abort(fd);
+  }
+  return status;
+}
+
+static uint32_t checksum(const char* data, int length){
+  uint32_t sum = 2166136261u;
+  for(int i = 0; i < length; i++) sum = (sum ^ (uint8_t) data[i]) * 16777619u;
+  return sum;
+}
+
+/*
+ * Commits through SIM_SERVERS servers while one of them is cut off
+ * for longer than it takes to be dropped, then heals the partition
+ * and commits more, so the server has to join again and copy the
+ * file. A majority quorum lets commits go on while it is away.
+ */
+void partitionRun(uint64_t seed, struct SimRun* run){
+  memset(run,0,sizeof(*run));
+  SimConfig config;
+  simConfig(seed,&config);
+  netSimulate(&config);
+  int servers[SIM_SERVERS];
+  for(int i = 0; i < SIM_SERVERS; i++) servers[i] = addServer(SIM_PORT,0,i);
+  if(InitSimReplFs(SIM_PORT,SIM_SERVERS) < 0) return;
+  SetCommitQuorum(REPLFS_QUORUM_MAJORITY);
+  int fd = OpenFile((char*) SIM_FILE_NAME);
+  if(fd < 0) return;
+  uint64_t state = seed;
+  static char expected[SIM_FILE_BYTES];
+  int length = 0;
+  for(int i = 0; i < COMMITS_BEFORE_PARTITION; i++){
+    run->statuses[run->numCommits++] = commitRandom(fd,&state,expected,&length);
+  }
+  simPartition(servers[SIM_SERVERS - 1],1);
+  uint64_t healAt = simClock() + PARTITION_USEC;
+  for(int i = 0; i < PARTITION_COMMITS; i++){
+    run->statuses[run->numCommits++] = commitRandom(fd,&state,expected,&length);
+  }
+  runUntil(healAt);
+  run->partitionedServers = GetNumServers();
+  simHeal();
+  runUntil(simClock() + JOIN_USEC);
+  for(int i = 0; i < COMMITS_AFTER_HEAL; i++){
+    run->statuses[run->numCommits++] = commitRandom(fd,&state,expected,&length);
+  }
+  runUntil(simClock() + CATCHUP_USEC);
+  run->numServers = GetNumServers();
+  run->serversHold = true;
+  static char copy[SIM_FILE_BYTES + 1];
+  for(int i = 0; i < SIM_SERVERS; i++){
+    int copyLength = readServerFile(0,i,SIM_FILE_NAME,copy,SIM_FILE_BYTES);
+    run->fileChecksums[i] = checksum(copy,copyLength);
+    if(copyLength != length || memcmp(copy,expected,length) != 0) run->serversHold = false;
+  }
+  CloseFile(fd);
+  run->finishUsec = simClock();
+  run->stats = simStats();
+}
+
+void partitionTest(){
+  struct SimRun first;
+  struct SimRun second;
+  partitionRun(SIM_SEED,&first);
+  bool committed = first.numCommits == MAX_SIM_COMMITS;
+  for(int i = 0; i < first.numCommits; i++) committed = committed && first.statuses[i] == 0;
+  check(committed,"partition: every commit succeeds while a server is cut off");
+  check(first.partitionedServers == SIM_SERVERS - 1,"partition: the cut off server is dropped");
+  check(first.numServers == SIM_SERVERS,"partition: the healed server joins again");
+  check(first.serversHold,"partition: every server holds what was committed");
+  check(first.stats.lost > 0 && first.stats.duplicated > 0 && first.stats.partitioned > 0,
+        "partition: datagrams were lost, duplicated and partitioned");
+  partitionRun(SIM_SEED,&second);
+  check(memcmp(&first,&second,sizeof(first)) == 0,"partition: a second run of the same seed does the same");
+}
+
+/*
+ * Runs NUM_GROUPS clients with GROUP_SERVERS servers each, hundreds
+ * of nodes in all, committing to every group at once.
+ */
+void groupTest(){
+  SimConfig config;
+  simConfig(SIM_SEED + 1,&config);
+  config.lossPercent = GROUP_LOSS_PERCENT;
+  netSimulate(&config);
+  int clients[NUM_GROUPS];
+  bool started = true;
+  for(int group = 0; group < NUM_GROUPS; group++){
+    for(int i = 0; i < GROUP_SERVERS; i++){
+      if(addServer(SIM_PORT + 1 + group,group + 1,i) < 0) started = false;
+    }
+    clients[group] = InitSimReplFs(SIM_PORT + 1 + group,GROUP_SERVERS);
+    if(clients[group] < 0) started = false;
+  }
+  check(started,"groups: every group's servers start and answer the roll call");
+  if(!started) return;
+  int fds[NUM_GROUPS];
+  char block[GROUP_WRITE];
+  for(int group = 0; group < NUM_GROUPS; group++){
+    UseSimClient(clients[group]);
+    fds[group] = OpenFile((char*) SIM_FILE_NAME);
+  }
+  for(int commit = 0; commit < GROUP_COMMITS; commit++){
+    for(int group = 0; group < NUM_GROUPS; group++){
+      UseSimClient(clients[group]);
+      memset(block,'a' + (group + commit) % 26,sizeof(block));
+      WriteBlock(fds[group],block,commit * GROUP_WRITE,GROUP_WRITE);
+      CommitAsync(fds[group],NULL);
+    }
+  }
+  bool committed = true;
+  for(int group = 0; group < NUM_GROUPS; group++){
+    UseSimClient(clients[group]);
+    if(WaitCommits(fds[group]) != 0) committed = false;
+  }
+  check(committed,"groups: every group's commits succeed");
+  static char expected[GROUP_COMMITS * GROUP_WRITE];
+  static char copy[GROUP_COMMITS * GROUP_WRITE + 1];
+  bool held = true;
+  runUntil(simClock() + CATCHUP_USEC);
+  for(int group = 0; group < NUM_GROUPS; group++){
+    for(int commit = 0; commit < GROUP_COMMITS; commit++){
+      memset(expected + commit * GROUP_WRITE,'a' + (group + commit) % 26,GROUP_WRITE);
+    }
+    for(int i = 0; i < GROUP_SERVERS; i++){
+      int copyLength = readServerFile(group + 1,i,SIM_FILE_NAME,copy,sizeof(expected));
+      if(copyLength != (int) sizeof(expected) || memcmp(copy,expected,sizeof(expected)) != 0) held = false;
+    }
+    UseSimClient(clients[group]);
+    CloseFile(fds[group]);
+  }
+  check(held,"groups: every server holds its group's file");
+}
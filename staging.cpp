@@ -0,0 +1,15 @@
+#include "staging.h"
+#include "crc32c.h"
+#include <arpa/inet.h>
+
+uint32_t commitChecksum(const StagedCommit* staged, uint32_t numWrites){
+  uint32_t checksum = 0;
+  for(uint32_t i = 0; i < numWrites && i < staged->writes.size(); i++){
+    const StagedWrite& write = staged->writes[i];
+    //in network order, so replicas of either byte order agree
+    uint32_t fields[4] = {htonl(write.writeNum),htonl(write.byteOffset),
+                          htonl(write.blockSize),htonl(write.crc)};
+    checksum = crc32c(checksum,fields,sizeof(fields));
+  }
+  return checksum;
+}
@@ -0,0 +1,37 @@
+#ifndef _staging_h
+#define _staging_h
+
+#include "arena.h"
+#include <stdint.h>
+#include <vector>
+
+/* A write waiting for its commit. Its data lives in an arena. */
+struct StagedWrite {
+  uint32_t writeNum;
+  uint32_t byteOffset;
+  uint32_t blockSize;
+  //CRC32C of the data
+  uint32_t crc;
+  uint8_t* data;
+};
+typedef struct StagedWrite StagedWrite;
+
+/*
+ * Everything staged for one commit. The data of all its writes
+ * shares one arena, so the whole commit is let go of at once.
+ */
+struct StagedCommit {
+  Arena arena;
+  std::vector<StagedWrite> writes;
+};
+typedef struct StagedCommit StagedCommit;
+
+/*
+ * A checksum rolled over writes 1 through numWrites of a commit, made
+ * from each one's number, place and data CRC, so the data itself isn't
+ * read again. Replicas that staged the same writes get the same value.
+ * Every one of those writes must be staged.
+ */
+uint32_t commitChecksum(const StagedCommit* staged, uint32_t numWrites);
+
+#endif
@@ -1,35 +1,502 @@
 #include "client.h"
+#include "wal.h"
+#include "crc32c.h"
+#include "replfs_net.h"
+#include "trace.h"
 #include <time.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <ftw.h>
+#include <errno.h>
+#include <limits.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #define DEFAULT_PORT 44018
+#define PACKET_LOSS 10
+//the roll call needs every server's ack in the same round, so servers drop less
+#define SERVER_PACKET_LOSS 2
+//servers spread their files over this many shards
+#define SERVER_SHARDS 4
 
 #define MAX_COMMITS 500
 
 #define MAX_WRITES_PER_COMMIT 127
-#define NUM_SERVERS 1
+#define NUM_SERVERS 3
+//room for servers that join while the tests run
+#define MAX_TEST_SERVERS (NUM_SERVERS + 1)
+
+#define SERVER_PATH "./replFsServer"
+#define TEST_DIR "/tmp/replfs_test"
+#define TRACE_PATH TEST_DIR "/client.trace"
+//time for servers to start before the roll call, or before they join
+#define SERVER_START_MSEC 200
+//servers apply commits after acking them, and stragglers catch up in
+//the background, so their copies are read again until these have passed
+#define APPLY_WAIT_MSEC 3000
+#define CATCHUP_WAIT_MSEC 30000
+#define POLL_MSEC 100
+
+//files the checked tests write stay within this size
+#define TEST_FILE_BYTES (64 * 1024)
+//big enough to be split into several writes by WriteBlock
+#define MAX_TEST_WRITE 3000
+#define ASYNC_COMMITS 12
+//small enough that dozens of writes share a datagram
+#define SMALL_WRITE 64
+//WriteBlock splits writes into pieces of MAX_WRITE_SIZE, and a commit
+//holds at most MAX_WRITES_PER_COMMIT of them (see packets.h)
+#define WRITE_PIECE_BYTES 1024
+#define MAX_COMMIT_PIECES (1 << 20)
+//enough pieces that a server misses more runs of them than one resend
+//request can list
+#define LARGE_WRITE_BYTES (2 * 1024 * 1024)
+//enough writes over a small enough region that under loss some of
+//each byte's writes arrive after later ones
+#define OVERLAP_WRITES 300
+#define OVERLAP_BYTES 4096
+//writes of more pieces than go out in one sendmmsg, to several files at once
+#define BURST_WRITE_BYTES (48 * 1024)
+#define BURST_FILES 4
+#define BURST_COMMITS 8
+//files open at once, enough for every shard to hold some
+#define SHARD_FILES (2 * SERVER_SHARDS)
+#define SHARD_COMMITS 10
+#define NUM_TEST_THREADS 4
+#define THREAD_COMMITS 40
+#define READ_COMMITS 20
+//the hardware CRC runs three streams of 8192 bytes, then of 256
+#define CRC_LONG_STREAM 8192
+#define CRC_SHORT_STREAM 256
+#define CRC_TEST_BYTES (6 * CRC_LONG_STREAM + 1024)
+#define CORRUPT_WRITES 5
+//a stopped server is dropped after MEMBER_TIMEOUT, so it is woken well before
+#define QUORUM_COMMITS 8
+#define QUORUM_COMMIT_MSEC 1000
+//a server that stops says it is leaving, rather than timing out
+#define LEAVE_WAIT_MSEC 2000
+#define STATS_BYTES (64 * 1024)
+//commits to another file while one file's writes are staged, enough
+//datagrams that servers reuse every free receive buffer many times
+#define ZERO_COPY_COMMITS 20
+
+/*
+ * The tests start NUM_SERVERS servers of their own on this machine,
+ * each with a mount directory under TEST_DIR, so that servers can be
+ * stopped, killed, restarted and added while the client runs, and
+ * the files each one holds can be read back and checked. Tests that
+ * check anything print what failed, and the exit status is non-zero
+ * if anything did.
+ */
+
+/*
+ * A file written by a checked test, with what it should hold. Both
+ * copies are zero past their length.
+ */
+struct TestFile {
+  int fd;
+  char name[32];
+  //what the servers hold once every commit so far is applied
+  char committed[TEST_FILE_BYTES];
+  int committedLength;
+  //what reads through fd see: committed, then what is in flight or staged
+  char written[TEST_FILE_BYTES];
+  int writtenLength;
+};
 
 int descriptors[5];
+pid_t serverPids[MAX_TEST_SERVERS];
+int numChecks = 0;
+int numFailed = 0;
+
+//what commit callbacks have been told, in the order they were told
+pthread_mutex_t callbackLock = PTHREAD_MUTEX_INITIALIZER;
+int numCallbacks = 0;
+int callbackFds[ASYNC_COMMITS];
+int callbackCommits[ASYNC_COMMITS];
+int callbackStatuses[ASYNC_COMMITS];
 
 void RandomWrite(int fd);
 char* generateRandomString(int size);
 void randomNumberWrite(int fd);
 
+void check(bool ok, const char* what);
+void startServer(int index, bool fresh);
+void stopServer(int index, int sig);
+void stopServers();
+struct TestFile* openTestFile(const char* name);
+bool writeRandom(struct TestFile* file, int numWrites);
+void commitWritten(struct TestFile* file);
+void abortWritten(struct TestFile* file);
+bool serverHolds(int index, struct TestFile* file, int maxMsec);
+bool serverHoldsBytes(int index, const char* name, const char* data, int length, int maxMsec);
+bool serversHold(struct TestFile* file, int maxMsec);
+bool readMatches(struct TestFile* file, int offset, int size);
+void closeTestFile(struct TestFile* file);
+void resetCallbacks();
+void recordCallback(int fd, int commitNum, int status);
+long long nowMsec();
+bool waitForServers(int numServers, int maxMsec);
+long long statValue(const char* name);
+
+void crcTest();
 void randomMultiFileTest();
 void writeNumbersTest();
 void sequentialWriteTest();
 void openAbortTest();
 void openCommitTest();
 void dontTrucateTest();
+void asyncCommitTest();
+void asyncFailureTest();
+void batchTest();
+void largeWriteTest();
+void overlapTest();
+void burstTest();
+void corruptionTest();
+void shardTest();
+void concurrentFilesTest();
+void readBlockTest();
+void readYourWritesTest();
+void quorumTest();
+void resyncTest();
+void membershipTest();
+void compressionTest();
+void statsTest();
+void traceTest();
+void zeroCopyTest();
+void walTest();
 
 int main(const int argc, const char* argv[]){
-  InitReplFs(DEFAULT_PORT,10,NUM_SERVERS);
+  if(mkdir(TEST_DIR,0777) != 0 && errno != EEXIST){
+    perror(TEST_DIR);
+    return -1;
+  }
+  for(int i = 0; i < NUM_SERVERS; i++) startServer(i,true);
+  usleep(SERVER_START_MSEC * 1000);
+  if(InitReplFs(DEFAULT_PORT,PACKET_LOSS,NUM_SERVERS) != 0){
+    printf("FAILED: roll call of %d servers\n",NUM_SERVERS);
+    stopServers();
+    return -1;
+  }
+  crcTest();
   writeNumbersTest();
   randomMultiFileTest();
   sequentialWriteTest();
   openAbortTest();
   openCommitTest();
   dontTrucateTest();
+  asyncCommitTest();
+  asyncFailureTest();
+  batchTest();
+  largeWriteTest();
+  overlapTest();
+  burstTest();
+  corruptionTest();
+  shardTest();
+  concurrentFilesTest();
+  readBlockTest();
+  readYourWritesTest();
+  quorumTest();
+  resyncTest();
+  membershipTest();
+  compressionTest();
+  statsTest();
+  traceTest();
+  zeroCopyTest();
+  walTest();
+  stopServers();
+  printf("%d checks, %d failed\n",numChecks,numFailed);
+  return numFailed == 0 ? 0 : -1;
+}
+
+/* Counts a check, printing what it was if it failed */
+void check(bool ok, const char* what){
+  numChecks++;
+  if(ok) return;
+  numFailed++;
+  printf("FAILED: %s\n",what);
+  fflush(stdout);
+}
+
+static void serverMount(int index, char* mount, size_t size){
+  snprintf(mount,size,"%s/server%d",TEST_DIR,index);
+}
+
+static int removeEntry(const char* path, const struct stat* info, int flag, struct FTW* ftw){
+  return remove(path);
+}
+
+/* Starts server index on its mount directory, emptied first if fresh is set */
+void startServer(int index, bool fresh){
+  char mount[PATH_MAX];
+  serverMount(index,mount,sizeof(mount));
+  if(fresh) nftw(mount,removeEntry,16,FTW_DEPTH | FTW_PHYS);
+  char port[16];
+  char drop[16];
+  char numShards[16];
+  snprintf(port,sizeof(port),"%u",DEFAULT_PORT);
+  snprintf(drop,sizeof(drop),"%d",SERVER_PACKET_LOSS);
+  snprintf(numShards,sizeof(numShards),"%d",SERVER_SHARDS);
+  pid_t pid = fork();
+  if(pid == 0){
+    if(freopen("/dev/null","w",stdout) == NULL) _exit(-1);
+    execl(SERVER_PATH,SERVER_PATH,"-port",port,"-mount",mount,"-drop",drop,"-shards",numShards,(char*) NULL);
+    perror("exec");
+    _exit(-1);
+  }
+  serverPids[index] = pid;
+}
+
+/* Sends server index sig and waits for it to exit */
+void stopServer(int index, int sig){
+  if(serverPids[index] <= 0) return;
+  kill(serverPids[index],sig);
+  waitpid(serverPids[index],NULL,0);
+  serverPids[index] = 0;
+}
+
+/* Appends a record header to server index's log promising more than follows it */
+static void tearLog(int index){
+  char mount[PATH_MAX];
+  char path[PATH_MAX + 32];
+  serverMount(index,mount,sizeof(mount));
+  snprintf(path,sizeof(path),"%s/%s",mount,WAL_FILENAME);
+  //crc, length and type, then part of the body
+  char torn[9 + 16];
+  uint32_t crc = 0x12345678;
+  uint32_t length = 4096;
+  memcpy(torn,&crc,sizeof(crc));
+  memcpy(torn + 4,&length,sizeof(length));
+  torn[8] = 2;
+  memset(torn + 9,'x',sizeof(torn) - 9);
+  FILE* log = fopen(path,"ab");
+  check(log != NULL && fwrite(torn,sizeof(torn),1,log) == 1,"wal: tear the log");
+  if(log != NULL) fclose(log);
+}
+
+void stopServers(){
+  for(int i = 0; i < MAX_TEST_SERVERS; i++) stopServer(i,SIGTERM);
+}
+
+struct TestFile* openTestFile(const char* name){
+  struct TestFile* file = (struct TestFile*) calloc(1,sizeof(struct TestFile));
+  snprintf(file->name,sizeof(file->name),"%s",name);
+  file->fd = OpenFile(file->name);
+  check(file->fd >= 0,name);
+  return file;
+}
+
+/* Makes numWrites writes of random letters at random offsets, returning false if any failed */
+bool writeRandom(struct TestFile* file, int numWrites){
+  char data[MAX_TEST_WRITE];
+  bool ok = true;
+  for(int i = 0; i < numWrites; i++){
+    int size = rand() % MAX_TEST_WRITE;
+    int offset = rand() % (TEST_FILE_BYTES - size);
+    for(int j = 0; j < size; j++) data[j] = 'a' + rand() % 26;
+    if(WriteBlock(file->fd,data,offset,size) != size) ok = false;
+    memcpy(file->written + offset,data,size);
+    if(offset + size > file->writtenLength) file->writtenLength = offset + size;
+  }
+  return ok;
+}
+
+/* Notes that everything written so far has been committed */
+void commitWritten(struct TestFile* file){
+  memcpy(file->committed,file->written,sizeof(file->committed));
+  file->committedLength = file->writtenLength;
+}
+
+/* Notes that everything written since the last commit was aborted */
+void abortWritten(struct TestFile* file){
+  memcpy(file->written,file->committed,sizeof(file->written));
+  file->writtenLength = file->committedLength;
+}
+
+/* Whether server index's copy of file holds what was committed, once it has had maxMsec to */
+bool serverHolds(int index, struct TestFile* file, int maxMsec){
+  return serverHoldsBytes(index,file->name,file->committed,file->committedLength,maxMsec);
+}
+
+/* Whether server index's copy of the file name is exactly length bytes of data, once it has had maxMsec to */
+bool serverHoldsBytes(int index, const char* name, const char* data, int length, int maxMsec){
+  char mount[PATH_MAX];
+  char path[PATH_MAX + 32];
+  serverMount(index,mount,sizeof(mount));
+  snprintf(path,sizeof(path),"%s/%s",mount,name);
+  char* copy = (char*) malloc(length + 1);
+  bool held = false;
+  for(int waited = 0; ; waited += POLL_MSEC){
+    int copyLength = 0;
+    FILE* in = fopen(path,"r");
+    if(in != NULL){
+      copyLength = fread(copy,1,length + 1,in);
+      fclose(in);
+    }
+    held = copyLength == length && memcmp(copy,data,length) == 0;
+    if(held || waited >= maxMsec) break;
+    usleep(POLL_MSEC * 1000);
+  }
+  free(copy);
+  return held;
+}
+
+/* Whether every running server holds what was committed to file */
+bool serversHold(struct TestFile* file, int maxMsec){
+  bool ok = true;
+  for(int i = 0; i < MAX_TEST_SERVERS; i++){
+    if(serverPids[i] > 0 && !serverHolds(i,file,maxMsec)) ok = false;
+  }
+  return ok;
+}
+
+/* Whether reading size bytes of file from offset gives what was written there */
+bool readMatches(struct TestFile* file, int offset, int size){
+  static char buffer[2 * TEST_FILE_BYTES];
+  int expected = file->writtenLength - offset;
+  if(expected > size) expected = size;
+  if(expected < 0) expected = 0;
+  int length = ReadBlock(file->fd,buffer,offset,size);
+  return length == expected && memcmp(buffer,file->written + offset,expected) == 0;
+}
+
+void closeTestFile(struct TestFile* file){
+  if(file->fd >= 0) CloseFile(file->fd);
+  free(file);
+}
+
+void resetCallbacks(){
+  pthread_mutex_lock(&callbackLock);
+  numCallbacks = 0;
+  pthread_mutex_unlock(&callbackLock);
+}
+
+/* Called on the library's network thread, so it only takes note */
+void recordCallback(int fd, int commitNum, int status){
+  pthread_mutex_lock(&callbackLock);
+  if(numCallbacks < ASYNC_COMMITS){
+    callbackFds[numCallbacks] = fd;
+    callbackCommits[numCallbacks] = commitNum;
+    callbackStatuses[numCallbacks] = status;
+  }
+  numCallbacks++;
+  pthread_mutex_unlock(&callbackLock);
+}
+
+/* CRC-32C a bit at a time, to check the fast ways against */
+static uint32_t crcBitwise(const uint8_t* data, size_t length){
+  uint32_t crc = ~0u;
+  for(size_t i = 0; i < length; i++){
+    crc ^= data[i];
+    for(int bit = 0; bit < 8; bit++) crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+  }
+  return ~crc;
+}
+
+/*
+ * Checks crc32c, which uses the SSE4.2 instruction where there is one,
+ * and the slicing-by-8 tables against known answers, then against a
+ * bitwise CRC at lengths either side of where the hardware path joins
+ * its three streams, starting at every alignment.
+ */
+void crcTest(){
+  const char* digits = "123456789";
+  check(crc32c(0,digits,9) == 0xe3069283,"crc: hardware path on 123456789");
+  check(crc32cTables(0,digits,9) == 0xe3069283,"crc: tables on 123456789");
+  uint8_t known[32];
+  for(int i = 0; i < 32; i++) known[i] = i;
+  check(crc32c(0,known,32) == 0x46dd794e && crc32cTables(0,known,32) == 0x46dd794e,"crc: ascending bytes");
+  memset(known,0xff,sizeof(known));
+  check(crc32c(0,known,32) == 0x62a8ab43 && crc32cTables(0,known,32) == 0x62a8ab43,"crc: all ones");
+  static uint8_t data[CRC_TEST_BYTES + 8];
+  for(size_t i = 0; i < sizeof(data); i++) data[i] = rand();
+  size_t lengths[] = {0,1,7,8,9,
+                      3 * CRC_SHORT_STREAM - 1,3 * CRC_SHORT_STREAM,3 * CRC_SHORT_STREAM + 13,
+                      3 * CRC_LONG_STREAM - 1,3 * CRC_LONG_STREAM,3 * CRC_LONG_STREAM + 3 * CRC_SHORT_STREAM + 5,
+                      CRC_TEST_BYTES};
+  bool hardware = true;
+  bool tables = true;
+  for(int offset = 0; offset < 8; offset++){
+    for(size_t i = 0; i < sizeof(lengths) / sizeof(lengths[0]); i++){
+      uint32_t expected = crcBitwise(data + offset,lengths[i]);
+      if(crc32c(0,data + offset,lengths[i]) != expected) hardware = false;
+      if(crc32cTables(0,data + offset,lengths[i]) != expected) tables = false;
+    }
+  }
+  check(hardware,"crc: hardware path at unaligned lengths");
+  check(tables,"crc: tables at unaligned lengths");
+  uint32_t first = crc32c(0,data + 1,3 * CRC_SHORT_STREAM + 3);
+  check(crc32c(first,data + 3 * CRC_SHORT_STREAM + 4,CRC_TEST_BYTES - 3 * CRC_SHORT_STREAM - 3) ==
+        crc32c(0,data + 1,CRC_TEST_BYTES),"crc: carried on over more data");
+}
+
+/*
+ * Starts more commits than may be in flight at once, so CommitAsync
+ * has to wait for some, and checks they complete in the order they
+ * were started, each telling its callback it succeeded.
+ */
+void asyncCommitTest(){
+  struct TestFile* file = openTestFile("async.txt");
+  resetCallbacks();
+  int commitNums[ASYNC_COMMITS];
+  bool written = true;
+  bool increasing = true;
+  for(int i = 0; i < ASYNC_COMMITS; i++){
+    if(!writeRandom(file,8)) written = false;
+    commitNums[i] = CommitAsync(file->fd,recordCallback);
+    if(commitNums[i] <= 0 || (i > 0 && commitNums[i] <= commitNums[i - 1])) increasing = false;
+    commitWritten(file);
+  }
+  check(written,"async: writes made while commits are in flight");
+  check(increasing,"async: CommitAsync returns increasing commit numbers");
+  check(PollCommits(file->fd) >= 0,"async: PollCommits while commits are in flight");
+  check(WaitCommits(file->fd) == 0,"async: WaitCommits once every commit succeeded");
+  check(PollCommits(file->fd) == 0,"async: nothing in flight after WaitCommits");
+  pthread_mutex_lock(&callbackLock);
+  bool inOrder = numCallbacks == ASYNC_COMMITS;
+  for(int i = 0; i < ASYNC_COMMITS && inOrder; i++){
+    inOrder = callbackFds[i] == file->fd && callbackCommits[i] == commitNums[i] &&
+              callbackStatuses[i] == 0;
+  }
+  pthread_mutex_unlock(&callbackLock);
+  check(inOrder,"async: one successful callback per commit, in order");
+  check(serversHold(file,APPLY_WAIT_MSEC),"async: servers hold every async commit");
+  closeTestFile(file);
+}
+
+/*
+ * Stops a server so that an async commit fails, and checks that the
+ * file then refuses writes and commits until it is aborted, after
+ * which it can be committed to again.
+ */
+void asyncFailureTest(){
+  struct TestFile* file = openTestFile("async_failure.txt");
+  check(writeRandom(file,4) && Commit(file->fd) == 0,"async failure: commit before the failure");
+  commitWritten(file);
+  resetCallbacks();
+  kill(serverPids[NUM_SERVERS - 1],SIGSTOP);
+  writeRandom(file,4);
+  int commitNum = CommitAsync(file->fd,recordCallback);
+  check(commitNum > 0,"async failure: CommitAsync with a server stopped");
+  check(WaitCommits(file->fd) == -1,"async failure: WaitCommits reports the failed commit");
+  kill(serverPids[NUM_SERVERS - 1],SIGCONT);
+  check(PollCommits(file->fd) == -1,"async failure: PollCommits reports the failed commit");
+  char byte = 'x';
+  check(WriteBlock(file->fd,&byte,0,1) == -1,"async failure: WriteBlock refused before Abort");
+  check(CommitAsync(file->fd,NULL) == -1,"async failure: CommitAsync refused before Abort");
+  pthread_mutex_lock(&callbackLock);
+  check(numCallbacks == 1 && callbackCommits[0] == commitNum && callbackStatuses[0] == -1,
+        "async failure: the callback is told the commit failed");
+  pthread_mutex_unlock(&callbackLock);
+  check(Abort(file->fd) == 0,"async failure: Abort after the failed commit");
+  abortWritten(file);
+  check(writeRandom(file,4) && Commit(file->fd) == 0,"async failure: commit after Abort");
+  commitWritten(file);
+  check(serversHold(file,APPLY_WAIT_MSEC),"async failure: servers hold the commits around the failed one");
+  closeTestFile(file);
 }
 
 void dontTrucateTest(){
@@ -136,3 +603,547 @@ char* generateRandomString(int size){
   }
   return str;
 }
+
+/*
+ * Fills commits with small writes, so that many go out in each
+ * datagram, and checks that what was batched is what the servers end
+ * up with.
+ */
+void batchTest(){
+  struct TestFile* file = openTestFile("batch.txt");
+  char data[SMALL_WRITE];
+  bool ok = true;
+  for(int i = 0; i < 3; i++){
+    for(int j = 0; j < MAX_WRITES_PER_COMMIT; j++){
+      int size = rand() % SMALL_WRITE;
+      int offset = rand() % (TEST_FILE_BYTES - size);
+      for(int k = 0; k < size; k++) data[k] = 'a' + rand() % 26;
+      if(WriteBlock(file->fd,data,offset,size) != size) ok = false;
+      memcpy(file->written + offset,data,size);
+      if(offset + size > file->writtenLength) file->writtenLength = offset + size;
+    }
+    if(Commit(file->fd) != 0) ok = false;
+    commitWritten(file);
+  }
+  check(ok,"batch: commits full of small writes");
+  check(serversHold(file,APPLY_WAIT_MSEC),"batch: servers hold the batched writes");
+  closeTestFile(file);
+}
+
+/*
+ * One write spread over thousands of datagrams, so servers ask for
+ * the pieces they missed a resend request at a time, and writes that
+ * end on and just past a piece's boundary. A write that would take
+ * the commit past MAX_COMMIT_PIECES is refused, before any of it is
+ * read, without spoiling the rest of the commit.
+ */
+void largeWriteTest(){
+  int fd = OpenFile((char*) "large.txt");
+  check(fd >= 0,"large: open");
+  char* data = (char*) malloc(LARGE_WRITE_BYTES);
+  char* expected = (char*) malloc(LARGE_WRITE_BYTES);
+  for(int i = 0; i < LARGE_WRITE_BYTES; i++) data[i] = 'a' + rand() % 26;
+  memcpy(expected,data,LARGE_WRITE_BYTES);
+  check(WriteBlock(fd,data,0,LARGE_WRITE_BYTES) == LARGE_WRITE_BYTES,"large: a write of many pieces");
+  for(int i = 0; i < 3; i++){
+    int size = WRITE_PIECE_BYTES * (i + 1) + (i == 1);
+    int offset = rand() % (LARGE_WRITE_BYTES - size);
+    memset(data,'0' + i,size);
+    check(WriteBlock(fd,data,offset,size) == size,"large: a write on a piece boundary");
+    memcpy(expected + offset,data,size);
+  }
+  check(WriteBlock(fd,data,0,MAX_COMMIT_PIECES * WRITE_PIECE_BYTES) == -1,"large: a commit of too many pieces refused");
+  check(Commit(fd) == 0,"large: commit");
+  bool held = true;
+  for(int i = 0; i < NUM_SERVERS; i++){
+    if(!serverHoldsBytes(i,"large.txt",expected,LARGE_WRITE_BYTES,APPLY_WAIT_MSEC)) held = false;
+  }
+  check(held,"large: servers hold the write, piece for piece");
+  CloseFile(fd);
+  free(data);
+  free(expected);
+}
+
+/*
+ * Writes over the same few kilobytes again and again in each commit,
+ * so that under loss servers stage them with holes, fill the holes
+ * from resends that arrive after later writes, and are sent some of
+ * them more than once. Every byte has to come out as the last write
+ * to it left it.
+ */
+void overlapTest(){
+  struct TestFile* file = openTestFile("overlap.txt");
+  char data[WRITE_PIECE_BYTES];
+  bool ok = true;
+  for(int i = 0; i < 3; i++){
+    for(int j = 0; j < OVERLAP_WRITES; j++){
+      int size = 1 + rand() % WRITE_PIECE_BYTES;
+      int offset = rand() % OVERLAP_BYTES;
+      memset(data,'a' + j % 26,size);
+      if(WriteBlock(file->fd,data,offset,size) != size) ok = false;
+      memcpy(file->written + offset,data,size);
+      if(offset + size > file->writtenLength) file->writtenLength = offset + size;
+    }
+    if(Commit(file->fd) != 0) ok = false;
+    commitWritten(file);
+  }
+  check(ok,"overlap: commits of overlapping writes");
+  check(serversHold(file,APPLY_WAIT_MSEC),"overlap: servers apply the writes in order");
+  closeTestFile(file);
+}
+
+/*
+ * Keeps commits to several files in flight at once, each carrying a
+ * write of more pieces than go out in one sendmmsg, so the servers
+ * take datagrams off the socket many at a time while some are lost.
+ * Every file has to come out whole.
+ */
+void burstTest(){
+  struct TestFile* files[BURST_FILES];
+  for(int i = 0; i < BURST_FILES; i++){
+    char name[32];
+    snprintf(name,sizeof(name),"burst%d.txt",i);
+    files[i] = openTestFile(name);
+  }
+  static char data[BURST_WRITE_BYTES];
+  bool ok = true;
+  for(int i = 0; i < BURST_COMMITS; i++){
+    for(int j = 0; j < BURST_FILES; j++){
+      struct TestFile* file = files[j];
+      int offset = rand() % (TEST_FILE_BYTES - BURST_WRITE_BYTES);
+      for(int k = 0; k < BURST_WRITE_BYTES; k++) data[k] = 'a' + rand() % 26;
+      if(WriteBlock(file->fd,data,offset,BURST_WRITE_BYTES) != BURST_WRITE_BYTES) ok = false;
+      memcpy(file->written + offset,data,BURST_WRITE_BYTES);
+      if(offset + BURST_WRITE_BYTES > file->writtenLength) file->writtenLength = offset + BURST_WRITE_BYTES;
+      if(!writeRandom(file,4) || CommitAsync(file->fd,NULL) <= 0) ok = false;
+      commitWritten(file);
+    }
+  }
+  for(int i = 0; i < BURST_FILES; i++){
+    if(WaitCommits(files[i]->fd) != 0) ok = false;
+  }
+  check(ok,"burst: commits to several files at once");
+  bool held = true;
+  for(int i = 0; i < BURST_FILES; i++){
+    if(!serversHold(files[i],APPLY_WAIT_MSEC)) held = false;
+    closeTestFile(files[i]);
+  }
+  check(held,"burst: servers hold every file");
+}
+
+/*
+ * Sends a batch of writes with a flipped bit in its data, then a
+ * commit request with a wrong checksum. Servers have to throw away
+ * what doesn't match and ask for it again, or the commits would fail
+ * or leave the wrong bytes behind.
+ */
+void corruptionTest(){
+  struct TestFile* file = openTestFile("corrupt.txt");
+  corruptSends(WRITE_BATCH,1);
+  check(writeRandom(file,CORRUPT_WRITES) && Commit(file->fd) == 0,"corruption: commit after a corrupted write");
+  commitWritten(file);
+  check(serversHold(file,APPLY_WAIT_MSEC),"corruption: servers hold the resent write");
+  corruptSends(COMMIT_REQUEST,1);
+  check(writeRandom(file,CORRUPT_WRITES) && Commit(file->fd) == 0,"corruption: commit after a wrong checksum");
+  commitWritten(file);
+  check(serversHold(file,APPLY_WAIT_MSEC),"corruption: servers hold the restaged commit");
+  closeTestFile(file);
+}
+
+/*
+ * Files are given to shards by fileId, so files opened one after
+ * another land on different shards. Commits to all of them are kept
+ * in flight together, so the writer logs commits from every shard in
+ * the same batches.
+ */
+void shardTest(){
+  struct TestFile* files[SHARD_FILES];
+  bool onShard[SERVER_SHARDS];
+  memset(onShard,0,sizeof(onShard));
+  for(int i = 0; i < SHARD_FILES; i++){
+    char name[32];
+    snprintf(name,sizeof(name),"shard%d.txt",i);
+    files[i] = openTestFile(name);
+    if(files[i]->fd >= 0) onShard[files[i]->fd % SERVER_SHARDS] = true;
+  }
+  bool spread = true;
+  for(int i = 0; i < SERVER_SHARDS; i++) spread = spread && onShard[i];
+  check(spread,"shards: files on every shard");
+  bool ok = true;
+  for(int i = 0; i < SHARD_COMMITS; i++){
+    for(int j = 0; j < SHARD_FILES; j++){
+      if(!writeRandom(files[j],3) || CommitAsync(files[j]->fd,NULL) <= 0) ok = false;
+      commitWritten(files[j]);
+    }
+  }
+  for(int i = 0; i < SHARD_FILES; i++){
+    if(WaitCommits(files[i]->fd) != 0) ok = false;
+  }
+  check(ok,"shards: commits to files on every shard at once");
+  bool held = true;
+  for(int i = 0; i < SHARD_FILES; i++){
+    if(!serversHold(files[i],APPLY_WAIT_MSEC)) held = false;
+    closeTestFile(files[i]);
+  }
+  check(held,"shards: servers hold every file");
+}
+
+/*
+ * Writes to its own file, committing, committing asynchronously or
+ * aborting after each run of writes. Returns NULL if anything failed.
+ */
+void* fileThread(void* arg){
+  struct TestFile* file = (struct TestFile*) arg;
+  bool ok = true;
+  for(int i = 0; i < THREAD_COMMITS && ok; i++){
+    ok = writeRandom(file,rand() % 10);
+    int choice = rand() % 4;
+    if(choice == 0){
+      //waits for the commits in flight, which stay committed
+      ok = ok && Abort(file->fd) == 0;
+      abortWritten(file);
+    }else if(choice == 1){
+      ok = ok && CommitAsync(file->fd,NULL) > 0;
+      commitWritten(file);
+    }else{
+      ok = ok && Commit(file->fd) == 0;
+      commitWritten(file);
+    }
+  }
+  ok = ok && WaitCommits(file->fd) == 0;
+  return ok ? file : NULL;
+}
+
+/* Drives a file from each of several threads at once */
+void concurrentFilesTest(){
+  struct TestFile* files[NUM_TEST_THREADS];
+  pthread_t threads[NUM_TEST_THREADS];
+  for(int i = 0; i < NUM_TEST_THREADS; i++){
+    char name[32];
+    snprintf(name,sizeof(name),"thread%d.txt",i);
+    files[i] = openTestFile(name);
+  }
+  for(int i = 0; i < NUM_TEST_THREADS; i++){
+    pthread_create(&threads[i],NULL,fileThread,files[i]);
+  }
+  bool ok = true;
+  for(int i = 0; i < NUM_TEST_THREADS; i++){
+    void* result;
+    pthread_join(threads[i],&result);
+    if(result == NULL) ok = false;
+  }
+  check(ok,"concurrent: every thread's writes and commits succeeded");
+  bool held = true;
+  for(int i = 0; i < NUM_TEST_THREADS; i++){
+    if(!serversHold(files[i],APPLY_WAIT_MSEC)) held = false;
+    closeTestFile(files[i]);
+  }
+  check(held,"concurrent: servers hold each thread's file");
+}
+
+/*
+ * Reads committed data back after every commit, the whole file and
+ * pieces of it, each piece twice so the second read comes from the
+ * cache. A commit writing over cached blocks has to be seen.
+ */
+void readBlockTest(){
+  struct TestFile* file = openTestFile("read.txt");
+  char buffer[16];
+  check(ReadBlock(file->fd,buffer,0,sizeof(buffer)) == 0,"read: an empty file reads nothing");
+  check(ReadBlock(file->fd,buffer,0,0) == 0,"read: an empty read");
+  check(ReadBlock(file->fd,buffer,-1,1) == -1 && ReadBlock(file->fd,NULL,0,1) == -1 &&
+        ReadBlock(-1,buffer,0,1) == -1,"read: bad arguments refused");
+  bool ok = true;
+  for(int i = 0; i < READ_COMMITS; i++){
+    if(!writeRandom(file,5) || Commit(file->fd) != 0) ok = false;
+    commitWritten(file);
+    if(!readMatches(file,0,TEST_FILE_BYTES)) ok = false;
+    for(int j = 0; j < 4; j++){
+      int offset = rand() % TEST_FILE_BYTES;
+      int size = rand() % (TEST_FILE_BYTES / 4);
+      if(!readMatches(file,offset,size) || !readMatches(file,offset,size)) ok = false;
+    }
+  }
+  check(ok,"read: reads after each commit give what was committed");
+  check(readMatches(file,file->writtenLength - 10,100),"read: a read past the end is cut short");
+  check(readMatches(file,file->writtenLength + 10,100),"read: a read after the end reads nothing");
+  closeTestFile(file);
+}
+
+/*
+ * Reads through the client see the file's own writes whether they
+ * are still staged, in a commit that is in flight or committed, and
+ * an Abort takes the staged ones back out again.
+ */
+void readYourWritesTest(){
+  struct TestFile* file = openTestFile("yours.txt");
+  const char* first = "staged";
+  int offset = TEST_FILE_BYTES / 2;
+  check(WriteBlock(file->fd,(char*) first,offset,strlen(first)) == (int) strlen(first),"yours: first write");
+  memcpy(file->written + offset,first,strlen(first));
+  file->writtenLength = offset + strlen(first);
+  check(readMatches(file,0,TEST_FILE_BYTES),"yours: the gap before a staged write reads as zeros");
+  check(writeRandom(file,5) && readMatches(file,0,TEST_FILE_BYTES),"yours: staged writes read back");
+  bool ok = true;
+  for(int i = 0; i < ASYNC_COMMITS; i++){
+    if(CommitAsync(file->fd,NULL) <= 0) ok = false;
+    commitWritten(file);
+    if(!readMatches(file,0,TEST_FILE_BYTES)) ok = false;
+    if(!writeRandom(file,3) || !readMatches(file,0,TEST_FILE_BYTES)) ok = false;
+  }
+  check(ok,"yours: in flight and staged writes read back");
+  check(Abort(file->fd) == 0,"yours: abort behind commits in flight");
+  abortWritten(file);
+  check(readMatches(file,0,TEST_FILE_BYTES),"yours: abort leaves what was committed");
+  check(WaitCommits(file->fd) == 0 && readMatches(file,0,TEST_FILE_BYTES),"yours: committed writes read back");
+  check(serversHold(file,APPLY_WAIT_MSEC),"yours: servers hold the commits");
+  closeTestFile(file);
+}
+
+long long nowMsec(){
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  return (long long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+/*
+ * With a majority quorum, commits go on at full speed while one
+ * server is stopped, and the server catches up once it runs again.
+ */
+void quorumTest(){
+  struct TestFile* file = openTestFile("quorum.txt");
+  check(SetCommitQuorum(REPLFS_QUORUM_MAJORITY) == 0,"quorum: majority");
+  check(writeRandom(file,5) && Commit(file->fd) == 0,"quorum: commit before a server stops");
+  commitWritten(file);
+  kill(serverPids[NUM_SERVERS - 1],SIGSTOP);
+  bool ok = true;
+  long long slowest = 0;
+  for(int i = 0; i < QUORUM_COMMITS; i++){
+    long long start = nowMsec();
+    if(!writeRandom(file,3) || Commit(file->fd) != 0) ok = false;
+    commitWritten(file);
+    if(nowMsec() - start > slowest) slowest = nowMsec() - start;
+  }
+  check(ok,"quorum: commits with a server stopped");
+  check(slowest < QUORUM_COMMIT_MSEC,"quorum: commits do not wait for the stopped server");
+  bool majorityHolds = true;
+  for(int i = 0; i < NUM_SERVERS - 1; i++) majorityHolds = majorityHolds && serverHolds(i,file,APPLY_WAIT_MSEC);
+  kill(serverPids[NUM_SERVERS - 1],SIGCONT);
+  check(majorityHolds,"quorum: running servers hold the commits");
+  check(serverHolds(NUM_SERVERS - 1,file,CATCHUP_WAIT_MSEC),"quorum: stopped server catches up");
+  check(SetCommitQuorum(REPLFS_QUORUM_ALL) == 0,"quorum: back to all");
+  check(writeRandom(file,3) && Commit(file->fd) == 0,"quorum: commit to all servers again");
+  commitWritten(file);
+  check(serversHold(file,APPLY_WAIT_MSEC),"quorum: servers hold the last commit");
+  closeTestFile(file);
+}
+
+/* Whether GetNumServers comes to numServers within maxMsec */
+bool waitForServers(int numServers, int maxMsec){
+  for(int waited = 0; ; waited += POLL_MSEC){
+    if(GetNumServers() == numServers) return true;
+    if(waited >= maxMsec) return false;
+    usleep(POLL_MSEC * 1000);
+  }
+}
+
+/*
+ * A server killed while a file is open and started again on an empty
+ * mount directory is copied the file by the others, then kept up to
+ * date by later commits.
+ */
+void resyncTest(){
+  struct TestFile* file = openTestFile("resync.txt");
+  check(SetCommitQuorum(REPLFS_QUORUM_MAJORITY) == 0,"resync: majority");
+  check(writeRandom(file,5) && Commit(file->fd) == 0,"resync: commit before a server dies");
+  commitWritten(file);
+  stopServer(NUM_SERVERS - 1,SIGKILL);
+  bool ok = true;
+  for(int i = 0; i < 3; i++){
+    if(!writeRandom(file,3) || Commit(file->fd) != 0) ok = false;
+    commitWritten(file);
+  }
+  check(ok,"resync: commits with a server dead");
+  startServer(NUM_SERVERS - 1,true);
+  check(serverHolds(NUM_SERVERS - 1,file,CATCHUP_WAIT_MSEC),"resync: restarted server is copied the file");
+  check(waitForServers(NUM_SERVERS,CATCHUP_WAIT_MSEC),"resync: restarted server is a member");
+  check(SetCommitQuorum(REPLFS_QUORUM_ALL) == 0,"resync: back to all");
+  check(writeRandom(file,3) && Commit(file->fd) == 0,"resync: commit to all servers again");
+  commitWritten(file);
+  check(serversHold(file,APPLY_WAIT_MSEC),"resync: servers hold the last commit");
+  closeTestFile(file);
+}
+
+/*
+ * A server started while the client runs joins: files opened after
+ * that go to it, and a file already open is copied to it once the
+ * other servers' acks for the file's next commit show it is behind.
+ * Once it stops it leaves, and commits go on without it.
+ */
+void membershipTest(){
+  struct TestFile* before = openTestFile("before.txt");
+  check(writeRandom(before,5) && Commit(before->fd) == 0,"membership: commit before a server joins");
+  commitWritten(before);
+  startServer(NUM_SERVERS,true);
+  check(waitForServers(NUM_SERVERS + 1,CATCHUP_WAIT_MSEC),"membership: new server joins");
+  struct TestFile* after = openTestFile("after.txt");
+  check(writeRandom(after,5) && Commit(after->fd) == 0,"membership: commit after a server joins");
+  commitWritten(after);
+  check(serversHold(after,APPLY_WAIT_MSEC),"membership: all servers hold a file opened after the join");
+  check(writeRandom(before,5) && Commit(before->fd) == 0,"membership: commit to an open file after the join");
+  commitWritten(before);
+  check(serverHolds(NUM_SERVERS,before,CATCHUP_WAIT_MSEC),"membership: new server is copied an open file");
+  check(serversHold(before,APPLY_WAIT_MSEC),"membership: all servers hold the open file");
+  stopServer(NUM_SERVERS,SIGTERM);
+  check(waitForServers(NUM_SERVERS,LEAVE_WAIT_MSEC),"membership: stopped server leaves");
+  check(writeRandom(after,5) && Commit(after->fd) == 0,"membership: commit after a server leaves");
+  commitWritten(after);
+  check(serversHold(after,APPLY_WAIT_MSEC),"membership: remaining servers hold the file");
+  closeTestFile(before);
+  closeTestFile(after);
+}
+
+/* The value of the counter name in GetStats, 0 if it isn't listed */
+long long statValue(const char* name){
+  static char stats[STATS_BYTES];
+  GetStats(stats,sizeof(stats));
+  int nameLength = strlen(name);
+  for(char* line = stats; *line != '\0'; line = strchr(line,'\n') + 1){
+    if(strncmp(line,name,nameLength) == 0 && line[nameLength] == '=') return atoll(line + nameLength + 1);
+    if(strchr(line,'\n') == NULL) break;
+  }
+  return 0;
+}
+
+/*
+ * The same writes of easily compressed data go to one file with
+ * compression on and to another with it off, and both files come
+ * out the same on every server.
+ */
+void compressionTest(){
+  struct TestFile* compressed = openTestFile("compressed.txt");
+  struct TestFile* plain = openTestFile("plain.txt");
+  char data[MAX_TEST_WRITE];
+  bool ok = true;
+  long long sentBefore = statValue("sent_compressed_batch");
+  for(int i = 0; i < 10; i++){
+    int size = MAX_TEST_WRITE - rand() % 100;
+    int offset = rand() % (TEST_FILE_BYTES - size);
+    for(int j = 0; j < size; j++) data[j] = 'a' + (i + j / 64) % 4;
+    struct TestFile* files[2] = {compressed,plain};
+    for(int k = 0; k < 2; k++){
+      SetCompression(k == 0);
+      if(WriteBlock(files[k]->fd,data,offset,size) != size || Commit(files[k]->fd) != 0) ok = false;
+      memcpy(files[k]->written + offset,data,size);
+      if(offset + size > files[k]->writtenLength) files[k]->writtenLength = offset + size;
+      commitWritten(files[k]);
+    }
+  }
+  check(ok,"compression: commits with and without compression");
+  check(statValue("sent_compressed_batch") > sentBefore,"compression: batches sent compressed");
+  check(serversHold(compressed,APPLY_WAIT_MSEC) && serversHold(plain,APPLY_WAIT_MSEC),
+        "compression: files written both ways come out the same");
+  closeTestFile(compressed);
+  closeTestFile(plain);
+}
+
+/*
+ * GetStats works like snprintf: it returns the length of the whole
+ * text whatever room it is given, and cuts it short to fit.
+ */
+void statsTest(){
+  static char stats[STATS_BYTES];
+  char small[16];
+  int length = GetStats(stats,sizeof(stats));
+  check(length > 0 && length == (int) strlen(stats),"stats: returns the length of the text");
+  check(strstr(stats,"commits=") != NULL && strstr(stats,"sent_commit=") != NULL,"stats: counts commits");
+  memset(small,'x',sizeof(small));
+  int smallLength = GetStats(small,sizeof(small));
+  //counters may move between calls, so only the start of the text is compared
+  check(smallLength >= length && strlen(small) == sizeof(small) - 1 &&
+        strncmp(small,stats,strlen("sent_")) == 0,"stats: cut short to fit");
+  check(GetStats(NULL,0) >= length,"stats: length with no room");
+  check(GetStats(stats,-1) == -1,"stats: negative size refused");
+}
+
+/*
+ * DumpTrace writes a header saying it came from a client, then the
+ * client's records, which by now include completed commits.
+ */
+void traceTest(){
+  check(DumpTrace(TRACE_PATH) == 0,"trace: dump");
+  FILE* dump = fopen(TRACE_PATH,"rb");
+  TraceHeader header;
+  bool headerOk = dump != NULL && fread(&header,sizeof(header),1,dump) == 1 &&
+    memcmp(header.magic,TRACE_MAGIC,sizeof(header.magic)) == 0 && header.version == TRACE_VERSION &&
+    header.recordSize == sizeof(TraceRecord) && header.serverId == 0 && header.pid == (uint32_t) getpid();
+  check(headerOk,"trace: header");
+  bool sawCommit = false;
+  TraceRecord record;
+  while(headerOk && fread(&record,sizeof(record),1,dump) == 1){
+    if(record.event == TRACE_COMMIT_DONE) sawCommit = true;
+  }
+  check(sawCommit,"trace: completed commits recorded");
+  if(dump != NULL) fclose(dump);
+  unlink(TRACE_PATH);
+  check(DumpTrace(NULL) == -1,"trace: no path refused");
+  check(DumpTrace(TEST_DIR "/missing/client.trace") == -1,"trace: unwritable path refused");
+}
+
+/*
+ * Servers stage a received write in the buffer it arrived in. Writes
+ * to one file are left staged while many commits to another go through
+ * the same servers, then committed, and have to come out unchanged.
+ */
+void zeroCopyTest(){
+  struct TestFile* held = openTestFile("held.txt");
+  struct TestFile* busy = openTestFile("busy.txt");
+  check(writeRandom(held,5),"zero copy: stage writes");
+  static char data[BURST_WRITE_BYTES];
+  bool ok = true;
+  for(int i = 0; i < ZERO_COPY_COMMITS; i++){
+    int offset = rand() % (TEST_FILE_BYTES - BURST_WRITE_BYTES);
+    for(int j = 0; j < BURST_WRITE_BYTES; j++) data[j] = 'a' + rand() % 26;
+    if(WriteBlock(busy->fd,data,offset,BURST_WRITE_BYTES) != BURST_WRITE_BYTES || Commit(busy->fd) != 0) ok = false;
+    memcpy(busy->written + offset,data,BURST_WRITE_BYTES);
+    if(offset + BURST_WRITE_BYTES > busy->writtenLength) busy->writtenLength = offset + BURST_WRITE_BYTES;
+    commitWritten(busy);
+  }
+  check(ok,"zero copy: commits to another file");
+  check(Commit(held->fd) == 0,"zero copy: commit the staged writes");
+  commitWritten(held);
+  check(serversHold(held,APPLY_WAIT_MSEC),"zero copy: staged writes survive other traffic");
+  check(serversHold(busy,APPLY_WAIT_MSEC),"zero copy: servers hold the other file");
+  closeTestFile(held);
+  closeTestFile(busy);
+}
+
+/*
+ * A server killed with commits in its log, and left with a torn
+ * record at the end of it, replays what it logged when started
+ * again on the same mount directory, then catches up with commits
+ * made after it came back.
+ */
+void walTest(){
+  struct TestFile* file = openTestFile("wal.txt");
+  bool ok = true;
+  for(int i = 0; i < 5; i++){
+    if(!writeRandom(file,5) || Commit(file->fd) != 0) ok = false;
+    commitWritten(file);
+  }
+  check(ok,"wal: commits before a server dies");
+  stopServer(NUM_SERVERS - 1,SIGKILL);
+  tearLog(NUM_SERVERS - 1);
+  startServer(NUM_SERVERS - 1,false);
+  usleep(SERVER_START_MSEC * 1000);
+  check(waitpid(serverPids[NUM_SERVERS - 1],NULL,WNOHANG) == 0,"wal: server starts on a torn log");
+  check(serverHolds(NUM_SERVERS - 1,file,APPLY_WAIT_MSEC),"wal: restarted server holds what it logged");
+  //the server comes back under a new id, so the old one is not waited for
+  check(SetCommitQuorum(REPLFS_QUORUM_MAJORITY) == 0,"wal: majority");
+  check(writeRandom(file,5) && Commit(file->fd) == 0,"wal: commit after the restart");
+  commitWritten(file);
+  check(serversHold(file,CATCHUP_WAIT_MSEC),"wal: restarted server catches up");
+  check(waitForServers(NUM_SERVERS,CATCHUP_WAIT_MSEC),"wal: restarted server is a member");
+  check(SetCommitQuorum(REPLFS_QUORUM_ALL) == 0,"wal: back to all");
+  closeTestFile(file);
+}
@@ -0,0 +1,134 @@
+#include "trace.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <atomic>
+#include <vector>
+
+/*
+ * One thread's events. Only the owner writes records, publishing each
+ * by moving head on; a reader copies what is behind head and then
+ * checks head again to see which records the owner may have been
+ * writing over meanwhile.
+ */
+struct TraceRing {
+  std::atomic<uint64_t> head;
+  uint16_t thread;
+  bool owned;
+  TraceRecord records[TRACE_RING_RECORDS];
+};
+
+/* Gives a thread's ring up when the thread exits, for the next one to carry on */
+struct TraceOwner {
+  TraceRing* ring;
+  ~TraceOwner();
+};
+
+//every ring there has been. A ring outlives its thread, so the
+//events leading up to a thread exiting can still be dumped.
+static pthread_mutex_t traceLock = PTHREAD_MUTEX_INITIALIZER;
+static std::vector<TraceRing*> rings;
+static thread_local TraceOwner owner = {NULL};
+
+static const char* eventNames[NUM_TRACE_EVENTS] = {
+  NULL, "write", "commit_requested", "server_ready", "commit_ready", "commit_sent",
+  "server_acked", "commit_done", "commit_failed", "write_resent",
+  NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL, NULL,
+  "write_staged", "checksum_failed", "resend_requested", "ready_sent", "commit_received",
+  "commit_queued", "commit_logged", "commit_applied", "ack_sent", "aborted"
+};
+
+const char* traceEventName(uint16_t event){
+  if(event >= NUM_TRACE_EVENTS || eventNames[event] == NULL) return "unknown";
+  return eventNames[event];
+}
+
+static TraceRing* ownRing(){
+  if(owner.ring != NULL) return owner.ring;
+  TraceRing* ring = NULL;
+  pthread_mutex_lock(&traceLock);
+  for(size_t i = 0; i < rings.size() && ring == NULL; i++){
+    if(!rings[i]->owned) ring = rings[i];
+  }
+  if(ring == NULL){
+    ring = new TraceRing;
+    ring->head.store(0,std::memory_order_relaxed);
+    ring->thread = rings.size();
+    rings.push_back(ring);
+  }
+  ring->owned = true;
+  pthread_mutex_unlock(&traceLock);
+  owner.ring = ring;
+  return ring;
+}
+
+TraceOwner::~TraceOwner(){
+  if(ring == NULL) return;
+  pthread_mutex_lock(&traceLock);
+  ring->owned = false;
+  pthread_mutex_unlock(&traceLock);
+}
+
+void trace(uint16_t event, uint32_t fileId, uint32_t commitNum, uint32_t writeNum){
+  TraceRing* ring = ownRing();
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC,&now);
+  uint64_t head = ring->head.load(std::memory_order_relaxed);
+  TraceRecord* record = &ring->records[head & (TRACE_RING_RECORDS - 1)];
+  record->nsec = (uint64_t) now.tv_sec * 1000000000 + now.tv_nsec;
+  record->event = event;
+  record->thread = ring->thread;
+  record->fileId = fileId;
+  record->commitNum = commitNum;
+  record->writeNum = writeNum;
+  ring->head.store(head + 1,std::memory_order_release);
+}
+
+/*
+ * Copies the records in a ring into copy, returning how many. The
+ * owner writes record i + TRACE_RING_RECORDS over record i just
+ * before moving head past it, so once the copy is made every record
+ * that may have been overwritten is dropped from its front.
+ */
+static size_t copyRing(TraceRing* ring, std::vector<TraceRecord>* copy){
+  uint64_t end = ring->head.load(std::memory_order_acquire);
+  uint64_t start = end > TRACE_RING_RECORDS ? end - TRACE_RING_RECORDS : 0;
+  copy->resize(end - start);
+  for(uint64_t i = start; i < end; i++){
+    (*copy)[i - start] = ring->records[i & (TRACE_RING_RECORDS - 1)];
+  }
+  std::atomic_thread_fence(std::memory_order_acquire);
+  uint64_t now = ring->head.load(std::memory_order_relaxed);
+  uint64_t firstIntact = now >= TRACE_RING_RECORDS ? now - TRACE_RING_RECORDS + 1 : 0;
+  if(firstIntact <= start) return copy->size();
+  size_t dropped = firstIntact - start;
+  if(dropped > copy->size()) dropped = copy->size();
+  copy->erase(copy->begin(),copy->begin() + dropped);
+  return copy->size();
+}
+
+int traceDump(const char* path, uint32_t serverId){
+  FILE* out = fopen(path,"w");
+  if(out == NULL) return -1;
+  TraceHeader header;
+  memset(&header,0,sizeof(header));
+  memcpy(header.magic,TRACE_MAGIC,sizeof(header.magic));
+  header.version = TRACE_VERSION;
+  header.recordSize = sizeof(TraceRecord);
+  header.serverId = serverId;
+  header.pid = getpid();
+  bool ok = fwrite(&header,sizeof(header),1,out) == 1;
+  pthread_mutex_lock(&traceLock);
+  std::vector<TraceRing*> all(rings);
+  pthread_mutex_unlock(&traceLock);
+  std::vector<TraceRecord> copy;
+  for(size_t i = 0; i < all.size() && ok; i++){
+    size_t count = copyRing(all[i],&copy);
+    if(count > 0) ok = fwrite(&copy[0],sizeof(TraceRecord),count,out) == count;
+  }
+  if(fclose(out) != 0) ok = false;
+  return ok ? 0 : -1;
+}
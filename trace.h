@@ -0,0 +1,89 @@
+#ifndef _trace_h
+#define _trace_h
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * An always-on binary trace of the commit protocol. Each thread
+ * records fixed-size events into a ring of its own, overwriting the
+ * oldest once it is full, so tracing costs a clock read and a few
+ * stores and never takes a lock. A dump writes out what the rings
+ * hold, for replFsTrace to merge with the dumps of the other nodes
+ * into per-commit timelines.
+ */
+
+//client events
+#define TRACE_WRITE 1
+#define TRACE_COMMIT_REQUESTED 2
+#define TRACE_SERVER_READY 3
+#define TRACE_COMMIT_READY 4
+#define TRACE_COMMIT_SENT 5
+#define TRACE_SERVER_ACKED 6
+#define TRACE_COMMIT_DONE 7
+#define TRACE_COMMIT_FAILED 8
+#define TRACE_WRITE_RESENT 9
+//server events
+#define TRACE_WRITE_STAGED 32
+#define TRACE_CHECKSUM_FAILED 33
+#define TRACE_RESEND_REQUESTED 34
+#define TRACE_READY_SENT 35
+#define TRACE_COMMIT_RECEIVED 36
+#define TRACE_COMMIT_QUEUED 37
+#define TRACE_COMMIT_LOGGED 38
+#define TRACE_COMMIT_APPLIED 39
+#define TRACE_ACK_SENT 40
+#define TRACE_ABORTED 41
+#define NUM_TRACE_EVENTS 42
+
+//must be a power of two
+#define TRACE_RING_RECORDS 16384
+
+//where a server dumps its trace, in its mount directory
+#define TRACE_FILENAME ".replfs_trace"
+#define TRACE_MAGIC "RFSTRACE"
+#define TRACE_VERSION 1
+
+/*
+ * One event. writeNum is the write the event is about, if any; for
+ * TRACE_SERVER_READY and TRACE_SERVER_ACKED it is the server's id
+ * instead, and for TRACE_RESEND_REQUESTED the first write missing.
+ */
+struct TraceRecord {
+  uint64_t nsec;
+  uint16_t event;
+  //the ring it was recorded in, one per thread
+  uint16_t thread;
+  uint32_t fileId;
+  uint32_t commitNum;
+  uint32_t writeNum;
+};
+typedef struct TraceRecord TraceRecord;
+
+/*
+ * A dump is this header followed by records up to the end of the
+ * file, in the byte order of the machine that wrote it. serverId is
+ * 0 in a client's dump.
+ */
+struct TraceHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t recordSize;
+  uint32_t serverId;
+  uint32_t pid;
+};
+typedef struct TraceHeader TraceHeader;
+
+void trace(uint16_t event, uint32_t fileId, uint32_t commitNum, uint32_t writeNum);
+
+/*
+ * Writes every thread's ring to path, oldest records first within
+ * each ring. Records made while it runs may be left out. Returns -1
+ * if the file can't be written.
+ */
+int traceDump(const char* path, uint32_t serverId);
+
+/* The name of an event, for printing */
+const char* traceEventName(uint16_t event);
+
+#endif
@@ -0,0 +1,186 @@
+#include "trace.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+#include <map>
+#include <string>
+#include <utility>
+#include <algorithm>
+
+/*
+ * Reads the trace dumps of a client and its servers and lays their
+ * events out commit by commit, so that where the time went in a slow
+ * commit can be seen across every node. Timestamps come from each
+ * machine's monotonic clock, so dumps only line up with each other
+ * when they were made on the same machine.
+ *
+ * Each commit is printed with its span, from its first event on any
+ * node to its last, and each event's time from the start of it. The
+ * events for individual writes are folded into one line per node and
+ * event, giving how many there were and when the first and last
+ * happened, unless -writes is given.
+ *
+ * -slow shows only commits that took at least that many usecs, and
+ * -file and -commit pick out a file or a single commit of it.
+ *
+ * usage: replFsTrace [-slow usec] [-file id] [-commit n] [-writes] dump...
+ */
+
+struct TraceEvent {
+  TraceRecord record;
+  //the dump it came from
+  int node;
+  bool operator<(const TraceEvent& other) const {
+    if(record.nsec != other.record.nsec) return record.nsec < other.record.nsec;
+    return node < other.node;
+  }
+};
+
+typedef std::pair<uint32_t,uint32_t> CommitKey;
+
+static std::vector<std::string> nodeNames;
+
+static void usage(){
+  printf("usage: replFsTrace [-slow usec] [-file id] [-commit n] [-writes] dump...\n");
+}
+
+/* Adds the events in one dump, returning false if it isn't a trace dump */
+static bool readDump(const char* path, std::vector<TraceEvent>* events){
+  FILE* in = fopen(path,"r");
+  if(in == NULL){
+    perror(path);
+    return false;
+  }
+  TraceHeader header;
+  if(fread(&header,sizeof(header),1,in) != 1 ||
+     memcmp(header.magic,TRACE_MAGIC,sizeof(header.magic)) != 0 ||
+     header.version != TRACE_VERSION || header.recordSize != sizeof(TraceRecord)){
+    fprintf(stderr,"%s: not a trace dump\n",path);
+    fclose(in);
+    return false;
+  }
+  char name[32];
+  if(header.serverId == 0){
+    snprintf(name,sizeof(name),"client:%u",header.pid);
+  }else{
+    snprintf(name,sizeof(name),"server:%u",header.serverId);
+  }
+  int node = nodeNames.size();
+  nodeNames.push_back(name);
+  TraceEvent event;
+  event.node = node;
+  while(fread(&event.record,sizeof(TraceRecord),1,in) == 1) events->push_back(event);
+  fclose(in);
+  return true;
+}
+
+static bool isWriteEvent(uint16_t event){
+  return event == TRACE_WRITE || event == TRACE_WRITE_RESENT || event == TRACE_WRITE_STAGED ||
+         event == TRACE_CHECKSUM_FAILED;
+}
+
+static double usecSince(uint64_t start, uint64_t nsec){
+  return (nsec - start) / 1000.0;
+}
+
+static void printEvent(uint64_t start, const TraceEvent& event){
+  const TraceRecord& record = event.record;
+  char detail[32] = "";
+  if(record.event == TRACE_SERVER_READY || record.event == TRACE_SERVER_ACKED){
+    snprintf(detail,sizeof(detail)," server %u",record.writeNum);
+  }else if(record.event == TRACE_RESEND_REQUESTED){
+    snprintf(detail,sizeof(detail)," from write %u",record.writeNum);
+  }else if(record.writeNum != 0){
+    snprintf(detail,sizeof(detail)," write %u",record.writeNum);
+  }
+  printf("  %+12.1f us  %-18s t%-3u %-18s%s\n",usecSince(start,record.nsec),
+         nodeNames[event.node].c_str(),record.thread,traceEventName(record.event),detail);
+}
+
+/*
+ * Prints a commit's events in time order. Runs of write events are
+ * gathered up by node and event and printed where the first of them
+ * happened.
+ */
+static void printCommit(CommitKey key, const std::vector<TraceEvent>& events, bool writes){
+  uint64_t start = events.front().record.nsec;
+  uint64_t end = events.back().record.nsec;
+  printf("file %u commit %u: %.1f us, %zu events\n",key.first,key.second,
+         usecSince(start,end),events.size());
+  //node and event of each write event folded, to how many and the last time
+  std::map<std::pair<int,uint16_t>,std::pair<size_t,uint64_t> > folded;
+  if(!writes){
+    for(size_t i = 0; i < events.size(); i++){
+      if(!isWriteEvent(events[i].record.event)) continue;
+      std::pair<size_t,uint64_t>& fold = folded[std::make_pair(events[i].node,events[i].record.event)];
+      fold.first++;
+      fold.second = events[i].record.nsec;
+    }
+  }
+  std::map<std::pair<int,uint16_t>,bool> printed;
+  for(size_t i = 0; i < events.size(); i++){
+    const TraceEvent& event = events[i];
+    if(writes || !isWriteEvent(event.record.event)){
+      printEvent(start,event);
+      continue;
+    }
+    std::pair<int,uint16_t> foldKey(event.node,event.record.event);
+    if(printed[foldKey]) continue;
+    printed[foldKey] = true;
+    std::pair<size_t,uint64_t>& fold = folded[foldKey];
+    printf("  %+12.1f us  %-18s t%-3u %-18s x%zu until %+.1f us\n",
+           usecSince(start,event.record.nsec),nodeNames[event.node].c_str(),
+           event.record.thread,traceEventName(event.record.event),fold.first,
+           usecSince(start,fold.second));
+  }
+}
+
+int main(const int argc, const char* argv[]){
+  double slowUsec = 0;
+  long fileId = -1;
+  long commitNum = -1;
+  bool writes = false;
+  std::vector<TraceEvent> events;
+  int numDumps = 0;
+  for(int i = 1; i < argc; i++){
+    bool hasValue = i + 1 < argc;
+    if(strcmp(argv[i],"-slow") == 0 && hasValue){
+      slowUsec = atof(argv[++i]);
+    }else if(strcmp(argv[i],"-file") == 0 && hasValue){
+      fileId = atol(argv[++i]);
+    }else if(strcmp(argv[i],"-commit") == 0 && hasValue){
+      commitNum = atol(argv[++i]);
+    }else if(strcmp(argv[i],"-writes") == 0){
+      writes = true;
+    }else if(argv[i][0] == '-'){
+      usage();
+      return -1;
+    }else{
+      if(!readDump(argv[i],&events)) return -1;
+      numDumps++;
+    }
+  }
+  if(numDumps == 0){
+    usage();
+    return -1;
+  }
+  std::stable_sort(events.begin(),events.end());
+  std::map<CommitKey,std::vector<TraceEvent> > commits;
+  for(size_t i = 0; i < events.size(); i++){
+    const TraceRecord& record = events[i].record;
+    if(fileId >= 0 && record.fileId != (uint32_t) fileId) continue;
+    if(commitNum >= 0 && record.commitNum != (uint32_t) commitNum) continue;
+    commits[CommitKey(record.fileId,record.commitNum)].push_back(events[i]);
+  }
+  size_t shown = 0;
+  std::map<CommitKey,std::vector<TraceEvent> >::iterator it;
+  for(it = commits.begin(); it != commits.end(); ++it){
+    std::vector<TraceEvent>& commit = it->second;
+    if(usecSince(commit.front().record.nsec,commit.back().record.nsec) < slowUsec) continue;
+    printCommit(it->first,commit,writes);
+    shown++;
+  }
+  printf("dumps=%d events=%zu commits=%zu shown=%zu\n",numDumps,events.size(),commits.size(),shown);
+  return 0;
+}
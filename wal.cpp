@@ -0,0 +1,354 @@
+#include "wal.h"
+#include "crc32c.h"
+#include "log.h"
+#include <stdio.h>
+#include <string.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <vector>
+
+#define WAL_OPEN 0x01
+#define WAL_COMMIT 0x02
+#define WAL_ABORT 0x03
+#define WAL_CLOSED 0x04
+
+/*
+ * Starts every record. The checksum covers the record's body and
+ * then the rest of the header, so a record torn by a crash fails it.
+ */
+struct WalHeader {
+  uint32_t crc;
+  uint32_t length;
+  uint8_t type;
+} __attribute__((packed));
+typedef struct WalHeader WalHeader;
+
+//followed by nameLength bytes of filename
+struct WalOpenRecord {
+  uint32_t fileId;
+  uint32_t commitNum;
+  uint16_t nameLength;
+} __attribute__((packed));
+typedef struct WalOpenRecord WalOpenRecord;
+
+//followed by numExtents WalExtentRecords
+struct WalCommitRecord {
+  uint32_t fileId;
+  uint32_t commitNum;
+  uint8_t closeFlag;
+  uint32_t numExtents;
+} __attribute__((packed));
+typedef struct WalCommitRecord WalCommitRecord;
+
+//followed by length bytes of data
+struct WalExtentRecord {
+  uint64_t offset;
+  uint32_t length;
+} __attribute__((packed));
+typedef struct WalExtentRecord WalExtentRecord;
+
+struct WalAbortRecord {
+  uint32_t fileId;
+  uint32_t commitNum;
+  uint8_t closeFlag;
+} __attribute__((packed));
+typedef struct WalAbortRecord WalAbortRecord;
+
+struct WalClosedRecord {
+  uint32_t fileId;
+} __attribute__((packed));
+typedef struct WalClosedRecord WalClosedRecord;
+
+static void noteOutcome(Wal* wal, uint32_t fileId, uint32_t commitNum, bool closeFlag);
+static bool replay(Wal* wal, const uint8_t* log, size_t size);
+
+static void queueBytes(Wal* wal, const void* bytes, size_t length){
+  size_t offset = wal->queuedBytes.size();
+  wal->queuedBytes.insert(wal->queuedBytes.end(),(const uint8_t*) bytes,(const uint8_t*) bytes + length);
+  if(!wal->queuedPieces.empty() && wal->queuedPieces.back().data == NULL){
+    wal->queuedPieces.back().length += length;
+  }else{
+    WalPiece piece = {NULL, offset, length};
+    wal->queuedPieces.push_back(piece);
+  }
+}
+
+/* Adds length bytes of the record's body */
+static void queueBody(Wal* wal, const void* bytes, size_t length){
+  queueBytes(wal,bytes,length);
+  wal->recordLength += length;
+  wal->recordCrc = crc32c(wal->recordCrc,bytes,length);
+}
+
+/* Like queueBody, but leaves the bytes where they are until written */
+static void queueData(Wal* wal, const uint8_t* data, size_t length){
+  WalPiece piece = {data, 0, length};
+  wal->queuedPieces.push_back(piece);
+  wal->recordLength += length;
+  wal->recordCrc = crc32c(wal->recordCrc,data,length);
+}
+
+static void beginRecord(Wal* wal, uint8_t type){
+  WalHeader header;
+  memset(&header,0,sizeof(header));
+  header.type = type;
+  wal->recordHeader = wal->queuedBytes.size();
+  queueBytes(wal,&header,sizeof(header));
+  wal->recordLength = 0;
+  wal->recordCrc = 0;
+}
+
+static void endRecord(Wal* wal){
+  WalHeader* header = (WalHeader*) &wal->queuedBytes[wal->recordHeader];
+  header->length = wal->recordLength;
+  header->crc = crc32c(wal->recordCrc,&header->length,sizeof(WalHeader) - sizeof(header->crc));
+}
+
+/* Writes the queued records to fd at offset. Returns the bytes written, or -1 */
+static int64_t writeQueued(Wal* wal, int fd, uint64_t offset){
+  struct iovec iov[IOV_MAX];
+  uint64_t start = offset;
+  size_t next = 0;
+  while(next < wal->queuedPieces.size()){
+    int numIov = 0;
+    ssize_t expected = 0;
+    for(; next < wal->queuedPieces.size() && numIov < IOV_MAX; next++, numIov++){
+      WalPiece& piece = wal->queuedPieces[next];
+      iov[numIov].iov_base = (void*) (piece.data != NULL ? piece.data : &wal->queuedBytes[piece.offset]);
+      iov[numIov].iov_len = piece.length;
+      expected += piece.length;
+    }
+    if(pwritev(fd,iov,numIov,offset) != expected) return -1;
+    offset += expected;
+  }
+  wal->queuedBytes.clear();
+  wal->queuedPieces.clear();
+  return offset - start;
+}
+
+/* A file opened at commitNum, the same record a checkpoint leaves */
+static void logOpenAt(Wal* wal, uint32_t fileId, const std::string& filename, uint32_t commitNum){
+  WalOpenRecord record;
+  record.fileId = fileId;
+  record.commitNum = commitNum;
+  record.nameLength = filename.length();
+  beginRecord(wal,WAL_OPEN);
+  queueBody(wal,&record,sizeof(record));
+  queueBody(wal,filename.data(),filename.length());
+  endRecord(wal);
+  WalFile& file = wal->files[fileId];
+  file.filename = filename;
+  file.commitNum = commitNum;
+}
+
+void walLogOpen(Wal* wal, uint32_t fileId, const std::string& filename){
+  logOpenAt(wal,fileId,filename,1);
+}
+
+void walLogResync(Wal* wal, uint32_t fileId, const std::string& filename, uint32_t commitNum){
+  logOpenAt(wal,fileId,filename,commitNum);
+}
+
+void walLogCommit(Wal* wal, uint32_t fileId, uint32_t commitNum, bool closeFlag, const ExtentMap* extents){
+  WalCommitRecord record;
+  record.fileId = fileId;
+  record.commitNum = commitNum;
+  record.closeFlag = closeFlag;
+  record.numExtents = extents->size();
+  beginRecord(wal,WAL_COMMIT);
+  queueBody(wal,&record,sizeof(record));
+  ExtentMap::const_iterator it;
+  for(it = extents->begin(); it != extents->end(); ++it){
+    WalExtentRecord extent;
+    extent.offset = it->first;
+    extent.length = it->second.length;
+    queueBody(wal,&extent,sizeof(extent));
+    queueData(wal,it->second.data,it->second.length);
+  }
+  endRecord(wal);
+  noteOutcome(wal,fileId,commitNum,closeFlag);
+}
+
+void walLogAbort(Wal* wal, uint32_t fileId, uint32_t commitNum, bool closeFlag){
+  WalAbortRecord record;
+  record.fileId = fileId;
+  record.commitNum = commitNum;
+  record.closeFlag = closeFlag;
+  beginRecord(wal,WAL_ABORT);
+  queueBody(wal,&record,sizeof(record));
+  endRecord(wal);
+  noteOutcome(wal,fileId,commitNum,closeFlag);
+}
+
+/* Moves a file past a commit that was applied or aborted */
+static void noteOutcome(Wal* wal, uint32_t fileId, uint32_t commitNum, bool closeFlag){
+  std::map<uint32_t,WalFile>::iterator file = wal->files.find(fileId);
+  if(file == wal->files.end()) return;
+  file->second.commitNum = commitNum + 1;
+  if(closeFlag){
+    wal->files.erase(file);
+    wal->closed.insert(fileId);
+  }
+}
+
+int walSync(Wal* wal){
+  if(wal->queuedPieces.empty()) return 0;
+  int64_t written = writeQueued(wal,wal->fd,wal->size);
+  if(written == -1) return -1;
+  wal->size += written;
+  return fdatasync(wal->fd);
+}
+
+bool walWantsCheckpoint(Wal* wal){
+  return wal->size > WAL_CHECKPOINT_BYTES;
+}
+
+/*
+ * The replacement log is written alongside the old one and renamed
+ * over it, so a crash part way through leaves one or the other.
+ */
+int walCheckpoint(Wal* wal){
+  std::string tempPath = wal->path + ".tmp";
+  int fd = open(tempPath.c_str(),O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if(fd == -1) return -1;
+  std::map<uint32_t,WalFile>::iterator file;
+  for(file = wal->files.begin(); file != wal->files.end(); ++file){
+    WalOpenRecord record;
+    record.fileId = file->first;
+    record.commitNum = file->second.commitNum;
+    record.nameLength = file->second.filename.length();
+    beginRecord(wal,WAL_OPEN);
+    queueBody(wal,&record,sizeof(record));
+    queueBody(wal,file->second.filename.data(),file->second.filename.length());
+    endRecord(wal);
+  }
+  std::set<uint32_t>::iterator closed;
+  for(closed = wal->closed.begin(); closed != wal->closed.end(); ++closed){
+    WalClosedRecord record;
+    record.fileId = *closed;
+    beginRecord(wal,WAL_CLOSED);
+    queueBody(wal,&record,sizeof(record));
+    endRecord(wal);
+  }
+  int64_t written = writeQueued(wal,fd,0);
+  if(written == -1 || fdatasync(fd) != 0 || rename(tempPath.c_str(),wal->path.c_str()) != 0){
+    close(fd);
+    return -1;
+  }
+  int dirFd = open(wal->dir.c_str(),O_RDONLY);
+  if(dirFd != -1){
+    fsync(dirFd);
+    close(dirFd);
+  }
+  if(wal->fd != -1) close(wal->fd);
+  wal->fd = fd;
+  wal->size = written;
+  LOG("Checkpointed log down to %ld bytes\n",(long) written);
+  return 0;
+}
+
+int walOpen(Wal* wal, const std::string& dir, std::map<uint32_t,WalFile>* openFiles,
+                std::set<uint32_t>* closedFiles){
+  wal->dir = dir;
+  wal->path = dir + WAL_FILENAME;
+  wal->fd = -1;
+  wal->size = 0;
+  int fd = open(wal->path.c_str(),O_RDONLY | O_CREAT, 0666);
+  if(fd == -1) return -1;
+  struct stat info;
+  if(fstat(fd,&info) != 0){
+    close(fd);
+    return -1;
+  }
+  std::vector<uint8_t> log(info.st_size);
+  size_t haveRead = 0;
+  while(haveRead < log.size()){
+    ssize_t got = read(fd,&log[haveRead],log.size() - haveRead);
+    if(got <= 0) break;
+    haveRead += got;
+  }
+  close(fd);
+  if(!replay(wal,log.data(),haveRead)) return -1;
+  //the replayed commits are on disk, so the log can start afresh
+  if(walCheckpoint(wal) != 0) return -1;
+  *openFiles = wal->files;
+  *closedFiles = wal->closed;
+  return 0;
+}
+
+/*
+ * Applies the logged commits to their files in order, stopping at
+ * the first record that is cut short or fails its checksum.
+ */
+static bool replay(Wal* wal, const uint8_t* log, size_t size){
+  std::map<uint32_t,int> fds;
+  size_t offset = 0;
+  size_t numRecords = 0;
+  while(size - offset >= sizeof(WalHeader)){
+    const WalHeader* header = (const WalHeader*) (log + offset);
+    const uint8_t* body = log + offset + sizeof(WalHeader);
+    if(header->length > size - offset - sizeof(WalHeader)) break;
+    uint32_t crc = crc32c(crc32c(0,body,header->length),&header->length,
+                          sizeof(WalHeader) - sizeof(header->crc));
+    if(crc != header->crc) break;
+    const uint8_t* end = body + header->length;
+    bool valid = true;
+    if(header->type == WAL_OPEN && header->length >= sizeof(WalOpenRecord)){
+      const WalOpenRecord* record = (const WalOpenRecord*) body;
+      if(sizeof(WalOpenRecord) + record->nameLength > header->length) break;
+      WalFile& file = wal->files[record->fileId];
+      file.filename.assign((const char*) body + sizeof(WalOpenRecord),record->nameLength);
+      file.commitNum = record->commitNum;
+    }else if(header->type == WAL_COMMIT && header->length >= sizeof(WalCommitRecord)){
+      const WalCommitRecord* record = (const WalCommitRecord*) body;
+      std::map<uint32_t,WalFile>::iterator file = wal->files.find(record->fileId);
+      int fileFd = -1;
+      if(file != wal->files.end()){
+        if(fds.count(record->fileId) == 0){
+          std::string filePath = wal->dir + file->second.filename;
+          fds[record->fileId] = open(filePath.c_str(),O_WRONLY | O_CREAT, 0777);
+        }
+        fileFd = fds[record->fileId];
+      }
+      const uint8_t* next = body + sizeof(WalCommitRecord);
+      for(uint32_t i = 0; i < record->numExtents && valid; i++){
+        const WalExtentRecord* extent = (const WalExtentRecord*) next;
+        if(end - next < (ssize_t) sizeof(WalExtentRecord) ||
+           end - next - sizeof(WalExtentRecord) < extent->length){
+          valid = false;
+          break;
+        }
+        next += sizeof(WalExtentRecord);
+        if(fileFd != -1 && pwrite(fileFd,next,extent->length,extent->offset) != (ssize_t) extent->length){
+          LOG("Unable to replay write to file %u\n",record->fileId);
+        }
+        next += extent->length;
+      }
+      if(valid) noteOutcome(wal,record->fileId,record->commitNum,record->closeFlag);
+    }else if(header->type == WAL_ABORT && header->length >= sizeof(WalAbortRecord)){
+      const WalAbortRecord* record = (const WalAbortRecord*) body;
+      noteOutcome(wal,record->fileId,record->commitNum,record->closeFlag);
+    }else if(header->type == WAL_CLOSED && header->length >= sizeof(WalClosedRecord)){
+      const WalClosedRecord* record = (const WalClosedRecord*) body;
+      wal->closed.insert(record->fileId);
+    }else{
+      valid = false;
+    }
+    if(!valid) break;
+    offset = end - log;
+    numRecords++;
+  }
+  if(offset != size) LOG("Discarding %zu bytes of torn log\n",size - offset);
+  bool ok = true;
+  std::map<uint32_t,int>::iterator fd;
+  for(fd = fds.begin(); fd != fds.end(); ++fd){
+    if(fd->second == -1) continue;
+    if(fsync(fd->second) != 0) ok = false;
+    close(fd->second);
+  }
+  LOG("Replayed %zu log records\n",numRecords);
+  return ok;
+}
@@ -0,0 +1,98 @@
+#ifndef _wal_h
+#define _wal_h
+
+#include "extents.h"
+#include <stdint.h>
+#include <map>
+#include <set>
+#include <string>
+#include <vector>
+
+//name of the log inside the mount directory
+#define WAL_FILENAME ".replfs_wal"
+//size the log may reach before it is checkpointed
+#define WAL_CHECKPOINT_BYTES (64 * 1024 * 1024)
+
+/* A file the log shows as open */
+struct WalFile {
+  std::string filename;
+  //the next commit the file expects
+  uint32_t commitNum;
+};
+typedef struct WalFile WalFile;
+
+/*
+ * Part of the records queued for the next write. Pieces either point
+ * at commit data held by the caller or, when data is NULL, at bytes
+ * of queuedBytes starting from offset.
+ */
+struct WalPiece {
+  const uint8_t* data;
+  size_t offset;
+  size_t length;
+};
+typedef struct WalPiece WalPiece;
+
+/*
+ * A server's log and the records queued for it. Everything below
+ * takes the log to act on; a log belongs to the thread writing it.
+ */
+struct Wal {
+  std::string dir;
+  std::string path;
+  int fd;
+  uint64_t size;
+  //what the log says about each file, kept up to date as records are logged
+  std::map<uint32_t,WalFile> files;
+  std::set<uint32_t> closed;
+  std::vector<uint8_t> queuedBytes;
+  std::vector<WalPiece> queuedPieces;
+  //the record being queued
+  size_t recordHeader;
+  uint32_t recordLength;
+  uint32_t recordCrc;
+};
+typedef struct Wal Wal;
+
+/*
+ * Opens the write-ahead log in dir, creating it if need be. Commits
+ * an earlier run logged are first replayed onto their files; a record
+ * torn by a crash, and anything after it, is discarded. The files the
+ * log shows as open and closed are handed back so the server can
+ * carry on from where it stopped. Returns -1 on failure.
+ */
+int walOpen(Wal* wal, const std::string& dir, std::map<uint32_t,WalFile>* openFiles,
+                std::set<uint32_t>* closedFiles);
+
+/*
+ * Queue records for the log. Nothing is written until walSync, and
+ * the extents given to walLogCommit must stay valid until then.
+ */
+void walLogOpen(Wal* wal, uint32_t fileId, const std::string& filename);
+void walLogCommit(Wal* wal, uint32_t fileId, uint32_t commitNum, bool closeFlag, const ExtentMap* extents);
+void walLogAbort(Wal* wal, uint32_t fileId, uint32_t commitNum, bool closeFlag);
+
+/*
+ * Records that a file was replaced by a copy from another replica
+ * holding every commit before commitNum. The log must have been
+ * checkpointed since the file's last logged commit, so that nothing
+ * older is replayed over the copy.
+ */
+void walLogResync(Wal* wal, uint32_t fileId, const std::string& filename, uint32_t commitNum);
+
+/*
+ * Appends every queued record to the log and waits for them to reach
+ * the disk, with a single fdatasync however many there are.
+ * Returns -1 on failure.
+ */
+int walSync(Wal* wal);
+
+/*
+ * The log is checkpointed by replacing it with a short record of which
+ * files are open. Every logged commit must be applied and synced to
+ * its file beforehand. Returns -1 on failure.
+ */
+bool walWantsCheckpoint(Wal* wal);
+int walCheckpoint(Wal* wal);
+
+#endif